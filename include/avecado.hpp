@@ -5,12 +5,15 @@
 #include "post_processor.hpp"
 
 #include <memory>
+#include <chrono>
 #include <boost/optional.hpp>
 #include <mapnik/map.hpp>
 #include <mapnik/image_scaling.hpp>
 
 namespace avecado {
 
+struct fetcher;
+
 /**
  * make_vector_tile adds geometry from a mapnik query to a vector
  * tile object.
@@ -70,6 +73,11 @@ namespace avecado {
  *     An optional `post_processor` object to handle geometry
  *     operations ("izers") before the tile is serialised.
  *
+ *   post_process_time
+ *     If not null, the time spent in the `post_processor` is added
+ *     to this, so that it can be told apart from the time spent
+ *     querying the data.
+ *
  * Returns true if the renderer painted, which means that it added
  * some geometry to the vector tile. Returns false if no geometry
  * was added. This can be used to detect empty tiles, which can be
@@ -90,7 +98,8 @@ bool make_vector_tile(tile &tile,
                       const std::string &image_format,
                       mapnik::scaling_method_e scaling_method,
                       double scale_denominator,
-                      boost::optional<const post_processor &> post_processor);
+                      boost::optional<const post_processor &> post_processor,
+                      std::chrono::steady_clock::duration *post_process_time = nullptr);
 
 /* Render a vector tile to a raster image.
  *
@@ -132,6 +141,90 @@ bool render_vector_tile(mapnik::image_rgba8 &image,
                         double scale_factor,
                         unsigned int buffer_size);
 
+/* Render a vector tile to a block of raster images.
+ *
+ * This renders the whole of the map's extent in a single pass, as
+ * with `render_vector_tile`, and then slices the result into
+ * `metatile` x `metatile` equally sized images. Because there is
+ * only one pass, labels are placed once for the whole block and are
+ * not cut or duplicated at the edges between images.
+ *
+ * Arguments:
+ *
+ *   images:
+ *     Output images, in row-major order so that the image at
+ *     column i and row j is at index (j * metatile + i). Any
+ *     existing content is replaced.
+ *
+ *   tile:
+ *     Vector tile object, which should cover the whole of the map
+ *     extent. For a block of tiles at zoom z, this could be the tile
+ *     at zoom z - log2(metatile), or the tiles of the block at zoom z
+ *     merged together.
+ *
+ *   map:
+ *     As above, except that the size and extent of the map should
+ *     be those of the whole block. The width and height must both
+ *     be divisible by `metatile`.
+ *
+ *   metatile:
+ *     Number of images along each side of the block.
+ *
+ *   scale_factor & buffer_size:
+ *     As above.
+ */
+bool render_vector_metatile(std::vector<mapnik::image_rgba8> &images,
+                            tile &tile,
+                            mapnik::Map const &map,
+                            unsigned int metatile,
+                            double scale_factor,
+                            unsigned int buffer_size);
+
+/* Render a large extent, covering many vector tiles, to a raster
+ * image using several threads.
+ *
+ * All the vector tiles at zoom `z` which cover the map's extent are
+ * fetched concurrently. The image is then split into pieces, each
+ * of which is rendered on a pool of `num_threads` threads from the
+ * tiles underneath it and copied into place.
+ *
+ * Each piece is rendered padded on every side by `buffer_size`
+ * pixels, or 128 pixels times the scale factor if that's more, and
+ * then cropped, so that the labels and symbols crossing its edges are
+ * placed the same way as in its neighbours. The buffer size should be
+ * raised if the style has labels or symbols wider than that.
+ *
+ * Arguments:
+ *
+ *   image:
+ *     The raster image to render into, which must be the same size
+ *     as the map.
+ *
+ *   source:
+ *     Fetcher to get the vector tiles from. Tiles which are not
+ *     found are treated as empty, any other error is thrown.
+ *
+ *   map:
+ *     The Mapnik style, with its size and extent set to those of
+ *     the whole image. It must be in spherical mercator.
+ *
+ *   z:
+ *     Zoom of the vector tiles to use.
+ *
+ *   scale_factor & buffer_size:
+ *     As for `render_vector_tile`.
+ *
+ *   num_threads:
+ *     Number of threads to render with.
+ */
+bool render_vector_extent(mapnik::image_rgba8 &image,
+                          fetcher &source,
+                          mapnik::Map const &map,
+                          unsigned int z,
+                          double scale_factor,
+                          unsigned int buffer_size,
+                          unsigned int num_threads);
+
 } // namespace avecado
 
 #endif /* AVECADO_HPP */
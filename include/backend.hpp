@@ -13,6 +13,8 @@
 // boost
 #include <boost/optional.hpp>
 
+#include <chrono>
+
 namespace avecado {
 
 class post_processor;
@@ -22,7 +24,8 @@ public:
   backend(vector_tile::Tile & tile,
           unsigned path_multiplier,
           mapnik::Map const& map,
-          boost::optional<const post_processor &> pp);
+          boost::optional<const post_processor &> pp,
+          std::chrono::steady_clock::duration *post_process_time = nullptr);
 
   void start_tile_layer(std::string const& name);
 
@@ -59,6 +62,8 @@ private:
   mapnik::Map const& m_map;
   unsigned int m_tolerance;
   boost::optional<const post_processor &> m_post_processor;
+  // if not null, time spent post-processing is added to this.
+  std::chrono::steady_clock::duration *m_post_process_time;
   std::string m_current_layer_name;
   std::vector<mapnik::feature_ptr> m_current_layer_features;
   mapnik::feature_ptr m_current_feature;
@@ -0,0 +1,32 @@
+#ifndef FETCHER_COMPOSITE_HPP
+#define FETCHER_COMPOSITE_HPP
+
+#include "fetcher.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace avecado { namespace fetch {
+
+/* Fetcher which requests the same tile from several sources at once
+ * and merges the layers of all of them into a single tile.
+ *
+ * The layers are merged in the order that the sources were given,
+ * without being re-encoded. A source which doesn't have the tile
+ * simply contributes no layers, and the tile is only not found if
+ * none of the sources have it. Any other non-content status from a
+ * source is returned instead of a tile.
+ */
+struct composite : public fetcher {
+  explicit composite(std::vector<std::unique_ptr<fetcher> > &&sources);
+  virtual ~composite();
+
+  std::future<fetch_response> operator()(const request &);
+
+private:
+  std::vector<std::unique_ptr<fetcher> > m_sources;
+};
+
+} } // namespace avecado::fetch
+
+#endif /* FETCHER_COMPOSITE_HPP */
@@ -0,0 +1,64 @@
+#ifndef FETCHER_HOST_QUEUES_HPP
+#define FETCHER_HOST_QUEUES_HPP
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+namespace avecado { namespace fetch {
+
+/* Queues of items, such as requests waiting to be started, kept
+ * separately for each host in the order they were pushed.
+ *
+ * Items are popped from each host in turn. A cursor remembers which
+ * host is next, so that when only a few items can be started at a
+ * time, they go round all the hosts rather than always to whichever
+ * host sorts first.
+ */
+template <typename T>
+class host_queues {
+public:
+  void push(const std::string &host, T item) {
+    m_queues[host].push_back(std::move(item));
+  }
+
+  bool empty() const {
+    return m_queues.empty();
+  }
+
+  // pops the front item of the next host in turn for which
+  // `can_start(host)` is true, returning false if there isn't one.
+  template <typename Predicate>
+  bool pop(Predicate can_start, T &item) {
+    auto itr = m_queues.lower_bound(m_next_host);
+    for (std::size_t i = 0; i < m_queues.size(); ++i, ++itr) {
+      if (itr == m_queues.end()) {
+        itr = m_queues.begin();
+      }
+      if (!can_start(itr->first)) {
+        continue;
+      }
+
+      item = std::move(itr->second.front());
+      itr->second.pop_front();
+      if (itr->second.empty()) {
+        itr = m_queues.erase(itr);
+      } else {
+        ++itr;
+      }
+      m_next_host = (itr == m_queues.end()) ? std::string() : itr->first;
+      return true;
+    }
+    return false;
+  }
+
+private:
+  std::map<std::string, std::list<T> > m_queues;
+  // the host to start looking from on the next pop.
+  std::string m_next_host;
+};
+
+} } // namespace avecado::fetch
+
+#endif /* FETCHER_HOST_QUEUES_HPP */
@@ -6,7 +6,11 @@
 #include <memory>
 #include <string>
 
-namespace avecado { namespace fetch {
+namespace avecado {
+
+class fetch_metrics;
+
+namespace fetch {
 
 /* Fetcher which fetches tiles from URLs.
  */
@@ -29,6 +33,18 @@ struct http : public fetcher {
   // server.
   void disable_cache();
 
+  // report statuses, latencies, bytes transferred and queue lengths
+  // into `metrics`. as with the cache, this should be set before
+  // any requests are made.
+  void set_metrics(std::shared_ptr<fetch_metrics> metrics);
+
+  // limit the number of transfers which can be running at once, in
+  // total and to any single host. requests over the limit are queued
+  // and started in priority order as earlier transfers finish. a
+  // limit of zero means unlimited. by default, at most 64 transfers
+  // run at once, with no separate per-host limit.
+  void limit_concurrency(std::size_t max_in_flight, std::size_t max_per_host);
+
 private:
   struct impl;
   std::unique_ptr<impl> m_impl;
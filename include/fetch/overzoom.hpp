@@ -4,12 +4,22 @@
 #include "fetcher.hpp"
 
 #include <memory>
+#include <chrono>
 
-namespace avecado { namespace fetch {
+namespace avecado {
+
+class fetch_metrics;
+
+namespace fetch {
 
 /* Fetcher which supports 'overzoom', that is using tiles from
  * a lower zoom level when tiles at the desired zoom level are
  * missing.
+ *
+ * When a mask zoom is set, tiles which the source says are not
+ * found are remembered for a while, so that requests for them, or
+ * for any of their children, can go straight to the mask zoom
+ * rather than making a request which is known to fail first.
  */
 struct overzoom : public fetcher {
   overzoom(std::unique_ptr<fetcher> &&source, int max_zoom, boost::optional<int> mask_zoom);
@@ -17,10 +27,21 @@ struct overzoom : public fetcher {
 
   std::future<fetch_response> operator()(const request &);
 
+  // count overzoomed requests and mask zoom fallbacks in `metrics`.
+  void set_metrics(std::shared_ptr<fetch_metrics> metrics);
+
+  // how long to remember that a tile was not found. the default is
+  // five minutes, and zero turns off remembering entirely.
+  void set_missing_ttl(std::chrono::seconds ttl);
+
 private:
+  struct missing_tiles;
+
   std::unique_ptr<fetcher> m_source;
   int m_max_zoom;
   boost::optional<int> m_mask_zoom;
+  std::shared_ptr<fetch_metrics> m_metrics;
+  std::unique_ptr<missing_tiles> m_missing;
 };
 
 } } // namespace avecado::fetch
@@ -0,0 +1,124 @@
+#ifndef FETCH_METRICS_HPP
+#define FETCH_METRICS_HPP
+
+#include "fetcher.hpp"
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <boost/noncopyable.hpp>
+
+namespace avecado {
+
+/* Histogram of latencies with fixed, roughly logarithmic, bucket
+ * boundaries. Recording is lock-free, so it's fine to share a
+ * histogram between many threads.
+ */
+struct latency_histogram : public boost::noncopyable {
+  // upper bounds of each bucket, in milliseconds. there is one more
+  // bucket than bounds, which catches everything slower than the
+  // last bound.
+  static const std::size_t num_bounds = 13;
+  static const unsigned int bounds_ms[num_bounds];
+
+  latency_histogram();
+
+  void record(std::chrono::steady_clock::duration d);
+
+  // total number of samples and their total duration.
+  std::uint64_t count() const;
+  double sum_ms() const;
+
+  // number of samples in bucket `i`, where `i` may be up to and
+  // including `num_bounds`.
+  std::uint64_t bucket(std::size_t i) const;
+
+private:
+  std::array<std::atomic<std::uint64_t>, num_bounds + 1> m_buckets;
+  std::atomic<std::uint64_t> m_count;
+  std::atomic<std::uint64_t> m_sum_us;
+};
+
+/* Telemetry which fetchers, and the decorators wrapping them, report
+ * into.
+ *
+ * A single instance can be shared between several fetchers, for
+ * example the `fetch::http` and `fetch::overzoom` built by
+ * `make_tilejson_fetcher`. Each fetcher only reports the things it
+ * is responsible for, so that nothing is double counted: the origin
+ * fetcher reports statuses, latencies, bytes and queue lengths, and
+ * decorators report how often they had to step in.
+ */
+class fetch_metrics : public boost::noncopyable {
+public:
+  // where a tile came from, which tends to determine how long it
+  // took to get.
+  enum class latency_kind {
+    // served from the local cache without going to the origin.
+    cache_hit,
+    // fetched from the origin.
+    cache_miss,
+    // the origin said the tile was not modified.
+    revalidated
+  };
+
+  fetch_metrics();
+
+  // count the outcome of a single fetch, either a tile (counted as
+  // "ok") or one of the non-content statuses.
+  void record_response(const fetch_response &response);
+  void record_status(fetch_status status);
+  void record_ok();
+
+  void record_latency(latency_kind kind, std::chrono::steady_clock::duration d);
+
+  // bytes transferred from the origin.
+  void add_bytes(std::uint64_t bytes);
+
+  // requests waiting to be started and requests currently being
+  // transferred. these are gauges, so each increment should be
+  // matched by a decrement.
+  void add_queued(std::int64_t delta);
+  void add_in_flight(std::int64_t delta);
+
+  // a request was for a zoom above the source's maximum and was
+  // served from a lower zoom.
+  void record_overzoom();
+  // a tile was missing and the request was retried at the mask zoom.
+  void record_mask_fallback();
+  // a fetched tile couldn't be written to the local cache. the tile
+  // is still returned.
+  void record_cache_write_error();
+
+  std::uint64_t ok() const;
+  std::uint64_t status(fetch_status s) const;
+  const latency_histogram &latency(latency_kind kind) const;
+  std::uint64_t bytes() const;
+  std::int64_t queued() const;
+  std::int64_t in_flight() const;
+  std::uint64_t overzooms() const;
+  std::uint64_t mask_fallbacks() const;
+  std::uint64_t cache_write_errors() const;
+
+private:
+  std::atomic<std::uint64_t> m_ok;
+  std::atomic<std::uint64_t> m_not_modified, m_bad_request, m_not_found,
+    m_server_error, m_not_implemented;
+  latency_histogram m_cache_hit, m_cache_miss, m_revalidated;
+  std::atomic<std::uint64_t> m_bytes;
+  std::atomic<std::int64_t> m_queued, m_in_flight;
+  std::atomic<std::uint64_t> m_overzooms, m_mask_fallbacks, m_cache_write_errors;
+
+  std::atomic<std::uint64_t> &status_counter(fetch_status s);
+};
+
+// dumps all the metrics, one "name value" pair per line. the latency
+// histograms are dumped cumulatively, with each "_le_" line counting
+// the samples at or under its bound.
+std::ostream &operator<<(std::ostream &out, const fetch_metrics &metrics);
+
+} // namespace avecado
+
+#endif /* FETCH_METRICS_HPP */
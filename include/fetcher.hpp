@@ -44,6 +44,16 @@ struct fetch_result {
 
 typedef either<std::unique_ptr<tile>, fetch_result> fetch_response;
 
+/* How urgently a tile is needed. Fetchers which have to queue
+ * requests will start interactive requests before any background
+ * ones, so that bulk jobs such as seeding or prefetching don't hold
+ * up tiles which someone is waiting to see.
+ */
+enum class request_priority {
+  interactive,
+  background
+};
+
 /* Request objects collect together the parameters needed
  * to specify a tile request, such as its (z, x, y)
  * location.
@@ -70,6 +80,9 @@ struct request {
   // value here only has granularity to the second, and so may
   // miss updates.
   boost::optional<boost::posix_time::ptime> if_modified_since;
+
+  // Priority of the request, which defaults to interactive.
+  request_priority priority;
 };
 
 /* Interface for objects which fetch tiles from sources.
@@ -0,0 +1,93 @@
+#ifndef HTTP_SERVER3_BODY_STREAM_HPP
+#define HTTP_SERVER3_BODY_STREAM_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <functional>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace http {
+namespace server3 {
+
+/// The body of a reply which is made a piece at a time, possibly on
+/// several threads, and sent as it's made rather than all at once.
+///
+/// The handler puts one of these in the reply and arranges for the
+/// pieces to be written to it, and the connection sends them to the
+/// client, with chunked transfer encoding where the client supports it.
+class body_stream
+  : private boost::noncopyable
+{
+public:
+  enum state_type
+  {
+    /// More of the body is still to come.
+    open,
+    /// The whole body has been written.
+    closed,
+    /// The body couldn't be finished, so the client must be told that
+    /// it's incomplete by closing the connection without ending it.
+    aborted
+  };
+
+  typedef std::function<void ()> callback;
+
+  /// Writers are asked to wait once more than high_water bytes are
+  /// waiting to be sent, or never if it's zero.
+  explicit body_stream(std::size_t high_water = 0);
+
+  /// Append a piece of the body. Does nothing once the stream has been
+  /// closed or aborted.
+  void write(const std::string &data);
+
+  /// Mark the body as complete.
+  void close();
+
+  /// Mark the body as failed, unless it's already complete.
+  void abort();
+
+  /// Whether there's no point writing any more of the body, because it
+  /// has been aborted or the client has gone away.
+  bool stopped() const;
+
+  /// Returns true if there's room to write more of the body. Otherwise
+  /// the writer should stop, and resume is called once the connection
+  /// has taken what's waiting, or is dropped if the stream finishes or
+  /// the client goes away first. This keeps a slow client from making
+  /// the server hold the whole body in memory.
+  bool wait_for_room(callback resume);
+
+  /// Called by the connection. Swaps whatever has been written since the
+  /// last read into data, and returns the state of the stream. If there
+  /// was nothing to read and the stream is still open, ready is called,
+  /// on whichever thread next writes to, closes or aborts it.
+  state_type read(std::string &data, callback ready);
+
+  /// Called by the connection when it can't send any more of the body.
+  void cancel();
+
+private:
+  mutable boost::mutex mutex_;
+  std::string data_;
+  const std::size_t high_water_;
+  state_type state_;
+  bool cancelled_;
+
+  /// The connection's callback for when there's more to read, if it's
+  /// waiting.
+  callback ready_;
+
+  /// The writers' callbacks for when there's room to write again.
+  std::vector<callback> waiting_;
+
+  /// Change the state and wake the connection, unless the stream is
+  /// already finished.
+  void finish(state_type state);
+};
+
+} // namespace server3
+} // namespace http
+
+#endif // HTTP_SERVER3_BODY_STREAM_HPP
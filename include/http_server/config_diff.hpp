@@ -0,0 +1,31 @@
+#ifndef CONFIG_DIFF_HPP
+#define CONFIG_DIFF_HPP
+
+#include <bitset>
+#include <string>
+#include <boost/property_tree/ptree.hpp>
+
+namespace http { namespace server3 {
+
+// the largest zoom which the server will make tiles for.
+const int CONFIG_MAX_ZOOM = 30;
+
+// a set of zoom levels, with bit z set for zoom z.
+typedef std::bitset<CONFIG_MAX_ZOOM + 1> zoom_set;
+
+// returns the zooms at which tiles made with the old Mapnik XML style
+// might differ from those made with the new one. layers and the styles
+// they use are compared one by one, so that a change to a layer only
+// affects the zooms at which its scale denominators let it be seen.
+// a change to anything else about the map, or XML which can't be
+// parsed, affects every zoom.
+zoom_set changed_zooms_for_map(const std::string &old_xml, const std::string &new_xml);
+
+// returns the zooms at which the post-processor configurations differ,
+// comparing the izers for each layer and zoom range.
+zoom_set changed_zooms_for_izers(const boost::property_tree::ptree &old_config,
+                                 const boost::property_tree::ptree &new_config);
+
+} } // namespace http::server3
+
+#endif /* CONFIG_DIFF_HPP */
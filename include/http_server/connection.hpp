@@ -20,6 +20,8 @@
 #include "http_server/request.hpp"
 #include "http_server/request_handler.hpp"
 #include "http_server/request_parser.hpp"
+#include "http_server/render_pool.hpp"
+#include "http_server/server_metrics.hpp"
 
 namespace http {
 namespace server3 {
@@ -30,9 +32,18 @@ class connection
     private boost::noncopyable
 {
 public:
-  /// Construct a connection with the given io_service.
-  explicit connection(boost::asio::io_service& io_service,
-                      boost::thread_specific_ptr<request_handler> &handler_ptr);
+  /// Construct a connection with the given io_service. The connection is
+  /// kept open between requests for up to keepalive_timeout seconds of
+  /// idleness, or closed after each reply if keepalive_timeout is zero.
+  /// Requests are handled on the render pool's threads or, if it's null,
+  /// inline by the io_service thread's own handler. If metrics isn't null,
+  /// the time taken to write each reply is recorded there, along with the
+  /// requests which are rejected before reaching a handler.
+  connection(boost::asio::io_service& io_service,
+             boost::thread_specific_ptr<request_handler> &handler_ptr,
+             unsigned int keepalive_timeout,
+             render_pool *pool,
+             server_metrics *metrics = NULL);
 
   /// Get the socket associated with the connection.
   boost::asio::ip::tcp::socket& socket();
@@ -41,6 +52,25 @@ public:
   void start();
 
 private:
+  /// Read more data from the socket, timing out if the connection is idle.
+  void start_read();
+
+  /// Parse any buffered data, and either reply or read more.
+  void process_buffer();
+
+  /// Hand the parsed request to a handler, replying once it's done.
+  void handle_request();
+
+  /// Fill in reply_ using the given handler. Called on a render pool thread.
+  void render(request_handler &handler);
+
+  /// Send reply_ to the client.
+  void start_write();
+
+  /// Send whatever has been written to reply_'s body stream since the
+  /// last time, or wait until there's more.
+  void write_stream();
+
   /// Handle completion of a read operation.
   void handle_read(const boost::system::error_code& e,
       std::size_t bytes_transferred);
@@ -48,6 +78,9 @@ private:
   /// Handle completion of a write operation.
   void handle_write(const boost::system::error_code& e);
 
+  /// Handle expiry of the idle timer.
+  void handle_timeout(const boost::system::error_code& e);
+
   /// Strand to ensure the connection's handlers are not called concurrently.
   boost::asio::io_service::strand strand_;
 
@@ -57,9 +90,33 @@ private:
   /// The handler used to process the incoming request.
   boost::thread_specific_ptr<request_handler>& request_handler_ptr_;
 
+  /// The pool of threads to handle requests on, or null to handle them
+  /// inline.
+  render_pool *render_pool_;
+
+  /// Where to record telemetry, or null.
+  server_metrics *metrics_;
+
+  /// Timer used to close idle connections.
+  boost::asio::deadline_timer timer_;
+
+  /// Seconds an idle connection is kept open for, zero to disable keep-alive.
+  unsigned int keepalive_timeout_;
+
   /// Buffer for incoming data.
   boost::array<char, 8192> buffer_;
 
+  /// Range of data in buffer_ which has been read, but not yet parsed. This
+  /// is non-empty when a client pipelines requests.
+  std::size_t buffer_begin_, buffer_end_;
+
+  /// Bytes of the current request's body which are still to be read and
+  /// thrown away before the next request starts.
+  std::size_t body_remaining_;
+
+  /// Whether the connection should be kept open after the current reply.
+  bool keep_alive_;
+
   /// The incoming request.
   request request_;
 
@@ -68,6 +125,20 @@ private:
 
   /// The reply to be sent back to the client.
   reply reply_;
+
+  /// Whether reply_'s body stream is sent in chunks, rather than as-is
+  /// up to the end of the connection.
+  bool chunked_;
+
+  /// Whether the whole of reply_'s body stream has been sent.
+  bool stream_done_;
+
+  /// The piece of reply_'s body stream being sent, and the chunk size
+  /// line which goes before it.
+  std::string stream_data_, chunk_head_;
+
+  /// When writing the current reply started.
+  server_metrics::clock::time_point write_start_;
 };
 
 typedef boost::shared_ptr<connection> connection_ptr;
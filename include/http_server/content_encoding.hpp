@@ -0,0 +1,29 @@
+#ifndef HTTP_SERVER3_CONTENT_ENCODING_HPP
+#define HTTP_SERVER3_CONTENT_ENCODING_HPP
+
+#include <string>
+
+namespace http {
+namespace server3 {
+
+/// Return true if the value of an Accept-Encoding header allows the
+/// response to be gzipped. Codings with a q-value of zero are refused,
+/// and "*" stands for any coding not otherwise mentioned.
+bool accepts_gzip(const std::string &accept_encoding);
+
+/// Return true if the data starts with the gzip magic number. Neither
+/// vector tiles nor JSON can start with those bytes, so this tells
+/// apart tiles which were stored compressed from those which weren't.
+bool is_gzipped(const std::string &data);
+
+/// Gzip the data at the given zlib compression level, where -1 is the
+/// default level.
+std::string gzip_compress(const std::string &data, int compression_level);
+
+/// Inflate gzipped data, throwing if it's corrupt.
+std::string gzip_decompress(const std::string &data);
+
+} // namespace server3
+} // namespace http
+
+#endif // HTTP_SERVER3_CONTENT_ENCODING_HPP
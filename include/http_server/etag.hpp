@@ -0,0 +1,23 @@
+#ifndef HTTP_SERVER3_ETAG_HPP
+#define HTTP_SERVER3_ETAG_HPP
+
+#include <string>
+
+namespace http {
+namespace server3 {
+
+/// Make a strong entity tag for a response body, including the
+/// surrounding double quotes. This is a 128-bit non-cryptographic hash
+/// of the body, which is fast to compute and, for the number of tiles
+/// any one server will ever see, won't collide.
+std::string make_etag(const std::string &body);
+
+/// Return true if the value of an If-None-Match header matches the
+/// entity tag, i.e: if the client already has the current body. Uses
+/// the weak comparison, as RFC 7232 says to for If-None-Match.
+bool etag_matches(const std::string &if_none_match, const std::string &etag);
+
+} // namespace server3
+} // namespace http
+
+#endif // HTTP_SERVER3_ETAG_HPP
@@ -0,0 +1,23 @@
+#ifndef HTTP_SERVER3_HTTP_DATE_HPP
+#define HTTP_SERVER3_HTTP_DATE_HPP
+
+#include <ctime>
+#include <string>
+
+namespace http {
+namespace server3 {
+
+/// Format a time as an HTTP date, e.g: "Sun, 06 Nov 1994 08:49:37 GMT".
+/// Unlike strftime, this doesn't depend on the locale, so it doesn't
+/// need setlocale, which isn't thread-safe.
+std::string format_http_date(std::time_t t);
+
+/// The current time as an HTTP date, for the Date header. This is only
+/// formatted once a second by each thread, and the reference is valid
+/// until the thread's next call.
+const std::string &http_date();
+
+} // namespace server3
+} // namespace http
+
+#endif // HTTP_SERVER3_HTTP_DATE_HPP
@@ -0,0 +1,159 @@
+#ifndef MAP_RELOADER_HPP
+#define MAP_RELOADER_HPP
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <mapnik/map.hpp>
+
+#include "post_processor.hpp"
+#include "thread_pool.hpp"
+#include "http_server/config_diff.hpp"
+#include "http_server/shared_tilejson.hpp"
+#include "http_server/tile_cache.hpp"
+#include "http_server/tile_store.hpp"
+
+namespace http { namespace server3 {
+
+/* Holds the Mapnik maps and post-processor which tiles are made with,
+ * and loads them again from their files when asked to, so that a new
+ * style or izer configuration can be deployed without restarting the
+ * server.
+ *
+ * The reload is done RCU-style: the new configuration is loaded on a
+ * background thread and published, and the request handlers pick it
+ * up between requests, each making its own copy of the maps. Once no
+ * handler is still in the middle of a request with the old
+ * configuration, the cached tiles which the change affects are
+ * dropped, as are any affected tiles which were written back to the
+ * store. Layers and izers are compared one by one, so that only the
+ * zooms they apply to are dropped.
+ */
+class map_reloader : public boost::noncopyable {
+public:
+  // everything which is loaded from the configuration files. this is
+  // never changed once it's been published.
+  struct config {
+    unsigned int generation;
+    mapnik::Map map;
+    // null if PNG tiles aren't being served.
+    std::unique_ptr<mapnik::Map> raster_map;
+    // null if there's no izer configuration.
+    std::shared_ptr<avecado::post_processor> post_processor;
+    // the TileJSON for the map, made when it's first asked for. this is
+    // the only part which changes after publication, and is safe to.
+    std::shared_ptr<shared_tilejson> tilejson;
+
+    // the sources of the above, kept to compare against the next load.
+    std::string map_xml, raster_map_xml;
+    boost::property_tree::ptree izer_config;
+  };
+  typedef std::shared_ptr<const config> config_ptr;
+
+  // a request handler's marker of which configuration it's using, so
+  // that the reloader can tell when the old one is no longer in use.
+  class reader : public boost::noncopyable {
+  public:
+    reader();
+  private:
+    friend class map_reloader;
+    // generation being used for the current request, or zero between
+    // requests.
+    std::atomic<unsigned int> active;
+  };
+
+  // loads the configuration, throwing if it can't be. the raster map
+  // file and the izer configuration file may be empty. PNG tiles
+  // rendered from the server's own vector tiles are dropped along with
+  // the vector tiles they came from.
+  // if tiles are written back to the store, store_writer must be the
+  // single-threaded pool which writes them, and each must be passed to
+  // `written_back` once it's written.
+  map_reloader(const std::string &map_file, const std::string &raster_map_file,
+               const std::string &config_file, std::shared_ptr<tile_cache> cache,
+               bool raster_from_own_tiles,
+               std::shared_ptr<tile_store> store = std::shared_ptr<tile_store>(),
+               std::shared_ptr<avecado::thread_pool> store_writer = std::shared_ptr<avecado::thread_pool>());
+  ~map_reloader();
+
+  // the latest configuration.
+  config_ptr current() const;
+
+  // load the configuration again and, if it loads, swap it in and drop
+  // the affected tiles from the cache. waits for requests still using
+  // the old configuration. returns false, leaving the old configuration
+  // in place, if it doesn't load.
+  bool reload();
+
+  // start a reload in the background, unless one is already waiting
+  // to start.
+  void reload_async();
+
+  // record that a vector tile made with the current configuration has
+  // been written back to the store. called on the store writer's thread.
+  void written_back(int z, int x, int y);
+
+  // register a handler's reader, which is kept until it's destroyed.
+  std::shared_ptr<reader> make_reader();
+
+  // mark the start of a request by the reader's handler, returning the
+  // generation it must use at least. if it's behind, it should switch
+  // to `current()`. every `enter` must be followed by an `exit` once the
+  // request is done.
+  unsigned int enter(reader &r) const;
+  void exit(reader &r) const;
+
+private:
+  // load the configuration from the files.
+  config_ptr load(unsigned int generation) const;
+
+  // wait until no reader is using a configuration older than the
+  // given generation.
+  void wait_for_readers(unsigned int generation);
+
+  // drop the cached and written back tiles which differ between the
+  // configurations.
+  void invalidate(const config &old_config, const config &new_config);
+
+  // erase the tiles which were written back to the store at the given
+  // zooms, once any writes queued before now are done. at zooms where
+  // too many were written back to remember, everything is erased.
+  void erase_written_back(const zoom_set &zooms);
+
+  const std::string map_file_, raster_map_file_, config_file_;
+  std::shared_ptr<tile_cache> cache_;
+  const bool raster_from_own_tiles_;
+  std::shared_ptr<tile_store> store_;
+  std::shared_ptr<avecado::thread_pool> store_writer_;
+
+  // the tiles which have been written back to the store at one zoom,
+  // as x, y. once there are too many to keep track of, they're
+  // forgotten and the whole zoom is erased from the store instead.
+  struct written_zoom {
+    std::set<std::pair<int, int> > tiles;
+    bool overflowed = false;
+  };
+  std::mutex written_mutex_;
+  std::array<written_zoom, CONFIG_MAX_ZOOM + 1> written_;
+
+  mutable std::mutex mutex_;
+  config_ptr current_;
+  std::atomic<unsigned int> generation_;
+  std::vector<std::weak_ptr<reader> > readers_;
+
+  // only one reload runs at a time.
+  std::mutex reload_mutex_;
+  std::atomic<bool> reload_queued_;
+  avecado::thread_pool background_;
+};
+
+} } // namespace http::server3
+
+#endif /* MAP_RELOADER_HPP */
@@ -12,18 +12,25 @@
 #define HTTP_SERVER3_MAPNIK_REQUEST_HANDLER_HPP
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <functional>
 #include <boost/noncopyable.hpp>
 #include <boost/optional.hpp>
 #include <boost/thread/tss.hpp>
 
 #include "http_server/mapnik_server_options.hpp"
+#include "http_server/tile_batch.hpp"
 #include <mapnik/map.hpp>
 
+namespace avecado { class tile; }
+
 namespace http {
 namespace server3 {
 
 struct reply;
 struct request;
+class render_pool;
 
 /// The handler for mapnik vector tile creation & tilejson
 class mapnik_request_handler
@@ -36,11 +43,20 @@ public:
   /// Handle a request and produce a reply.
   void handle_request(const request& req, reply& rep);
 
+  /// Make a tile and put it in the cache, if it isn't already there,
+  /// without making the rest of its metatile. Does nothing if there's no
+  /// cache.
+  void prefetch(int z, int x, int y, const std::string &encoding);
+
 private:
   /// pointer to thread-local copy of the mapnik Map object used to
   /// do the rendering.
   mapnik::Map map_;
 
+  /// thread-local copy of the mapnik Map object used to render PNG
+  /// tiles, or null if the server isn't serving PNG tiles.
+  std::unique_ptr<mapnik::Map> raster_map_;
+
   /// options, mostly passed to mapnik for making the vector tile
   mapnik_server_options options_;
 
@@ -51,17 +67,136 @@ private:
   /// max-age header directive to use. pre-rendered to a string.
   std::string max_age_value_;
 
+  /// header lines which are the same on every reply for a tile,
+  /// pre-rendered so that replying from the cache is quick: those
+  /// common to all tile replies, including 304s, and those for 200s
+  /// for vector and PNG tiles.
+  std::string common_headers_, pbf_headers_, png_headers_;
+
+  /// TileJSON for the map, made on the first request for it to any
+  /// handler after the map is loaded, and shared with the others.
+  std::shared_ptr<shared_tilejson> tilejson_;
+
+  /// this handler's marker for the reloader, or null if the configuration
+  /// can't be reloaded.
+  std::shared_ptr<map_reloader::reader> reader_;
+
+  /// generation of the reloader's configuration which map_ and
+  /// raster_map_ are copies of.
+  unsigned int config_generation_;
+
+  /// zoom of the tile being requested, or -1 if the current request
+  /// isn't for a tile.
+  int request_zoom_;
+
   /// Implementation detail of handling a request and producing a reply.
   void handle_request_impl(const request& req, reply& rep);
 
   /// Handle request for TileJSON.
   void handle_request_json(const request &req, reply &rep);
 
-  /// Handle request for a tile.
+  /// Handle request for the server's metrics.
+  void handle_request_metrics(const request &req, reply &rep);
+
+  /// Handle request for a batch of vector tiles, given the query string.
+  void handle_request_batch(const request &req, reply &rep, const std::string &query);
+
+  /// Post a job to make the next of the batch's tiles to the pool's
+  /// background queue, returning false if the queue is full.
+  static bool post_batch_job(render_pool &pool, const std::shared_ptr<tile_batch> &batch);
+
+  /// Make the next of the batch's tiles, then post another job for the
+  /// rest, unless the client needs to catch up first. Called from a
+  /// render pool job, rather than while handling a request.
+  void make_batch_job(render_pool &pool, const std::shared_ptr<tile_batch> &batch);
+
+  /// Handle request to reload the configuration.
+  void handle_request_reload(const request &req, reply &rep);
+
+  /// Switch to the reloader's latest configuration, if this handler isn't
+  /// already using it. Must be called between enter and exit.
+  void update_config(unsigned int generation);
+
+  /// Handle request for a tile, given the parts of its path.
   void handle_request_tile(const request &req, reply &rep,
-                           const std::string &request_path);
+                           int z, int x, int y, const std::string &ext);
+
+  /// Handle request for a PNG tile.
+  void handle_request_raster(const request &req, reply &rep,
+                             int z, int x, int y);
+
+  /// If the request's If-None-Match header matches the tile's ETag,
+  /// fill in a 304 Not Modified reply and return true. If the body
+  /// depends on the request's Accept-Encoding, vary_encoding should
+  /// be true.
+  bool reply_not_modified(const request &req, reply &rep, const encoded_tile &tile,
+                          bool vary_encoding);
+
+  /// Get the inflated version of a gzipped vector tile, from the cache
+  /// if it's there.
+  tile_cache::value_type identity_tile(int z, int x, int y,
+                                       const tile_cache::value_type &gzipped);
+
+  /// Get an encoded tile in the given encoding, either "pbf" or "png",
+  /// from the cache, making it if it's not there. If metatile is true and
+  /// it's a PNG tile, the rest of the tile's metatile is made too.
+  tile_cache::value_type get_tile(int z, int x, int y, const std::string &encoding,
+                                  bool metatile);
+
+  /// Get an encoded tile from the cache, or call make to create it if
+  /// it's not there. If there's no cache, this always calls make.
+  tile_cache::value_type cached_tile(int z, int x, int y, const std::string &encoding,
+                                     const tile_cache::make_function &make);
+
+  /// If metatiling is on and the tile isn't cached, call make_block with
+  /// the top-left x, y and the size of the aligned block containing the
+  /// tile, which should put every tile in the block in the cache. Other
+  /// requests for tiles in the same block wait for it.
+  void cache_metatile(int z, int x, int y, const std::string &encoding,
+                      const std::function<void (int, int, int)> &make_block);
+
+  /// Make an encoded vector tile, reading it from the store if it's
+  /// there or rendering it otherwise.
+  tile_cache::value_type make_vector(int z, int x, int y);
+
+  /// Get the vector tile which PNG tiles are rendered from, or null if
+  /// the raster source doesn't have it.
+  std::unique_ptr<avecado::tile> source_tile(int z, int x, int y);
+
+  /// Get the vector tiles for a block of PNG tiles, in row-major order,
+  /// with nulls for those which the raster source doesn't have.
+  std::vector<std::unique_ptr<avecado::tile> > source_tiles(int z, int x0, int y0, int size);
+
+  /// Make an encoded PNG tile, or null if there's no source tile for it.
+  tile_cache::value_type make_raster(int z, int x, int y);
+
+  /// Render a block of PNG tiles in one pass and put them in the cache.
+  /// Nothing is made if there's no source for the requested tile x, y.
+  void make_raster_metatile(int z, int x, int y, int x0, int y0, int size);
+
+  /// Make a vector tile from the map, returning true if anything
+  /// was painted into it.
+  bool make_tile(avecado::tile &tile);
+
+  /// Record the time since start as spent in the given phase, if
+  /// metrics are being kept.
+  void record_phase(server_metrics::phase p, server_metrics::clock::time_point start);
 };
 
+/// Make a prefetcher for the server's tiles. The prefetch thread has a
+/// handler of its own, which doesn't log or record its requests, or add
+/// to the metrics.
+std::shared_ptr<prefetcher> make_prefetcher(const mapnik_server_options &options);
+
+/// Make the vector tiles and put them in the cache, on num_threads threads
+/// with handlers of their own, returning once they're all done. This is
+/// for warming up the server before it starts listening, and isn't logged
+/// or recorded in the metrics. Tiles which fail are reported and skipped,
+/// but if a thread's handler can't be made, the error is thrown once all
+/// the threads are done. Does nothing if there's no cache.
+void warm_cache(const mapnik_server_options &options, const std::vector<tile_id> &tiles,
+                std::size_t num_threads);
+
 } // namespace server3
 } // namespace http
 
@@ -4,6 +4,14 @@
 #include <boost/shared_ptr.hpp>
 #include <mapnik/image_scaling.hpp>
 #include "post_processor.hpp"
+#include "fetcher.hpp"
+#include "thread_pool.hpp"
+#include "http_server/tile_cache.hpp"
+#include "http_server/tile_store.hpp"
+#include "http_server/prefetcher.hpp"
+#include "http_server/server_metrics.hpp"
+#include "http_server/map_reloader.hpp"
+#include "http_server/shared_tilejson.hpp"
 #include "http_server/access_logger.hpp"
 #include "http_server/handler_factory.hpp"
 
@@ -26,6 +34,52 @@ struct mapnik_server_options {
   std::shared_ptr<http::server3::access_logger> logger;
   unsigned int max_age;
   int compression_level;
+  // if not empty, PNG tiles are also served at /z/x/y.png, rendered
+  // with the style in this Mapnik XML file.
+  std::string raster_map_file;
+  // where to get the vector tiles to render PNG tiles from. if this
+  // is null, then the server's own vector tiles are used.
+  std::shared_ptr<avecado::fetcher> raster_source;
+  // cache for encoded tiles of all formats, shared between all
+  // threads. if this is null, then nothing is cached and every
+  // request renders its own tile.
+  std::shared_ptr<tile_cache> cache;
+  // if not null, vector tiles are read from this store first, and
+  // only rendered if they're missing from it.
+  std::shared_ptr<tile_store> store;
+  // if not null, tiles rendered because they were missing from the
+  // store are written back to it on this pool's threads, so that the
+  // reply doesn't have to wait for the write.
+  std::shared_ptr<avecado::thread_pool> store_writer;
+  // if greater than one, a PNG tile missing from the cache causes the
+  // whole aligned block of metatile x metatile PNG tiles around it to be
+  // rendered in a single pass and cached, which requests for any of them
+  // wait on. vector tiles are always made one at a time, as each is a
+  // query of its own either way. must be a power of two, and needs a
+  // cache.
+  unsigned int metatile = 1;
+  // if not null, the neighbours and children of tiles which are asked
+  // for are made in the background, when the server is otherwise idle,
+  // and put in the cache. needs a cache.
+  std::shared_ptr<prefetcher> prefetch;
+  // if not null, requests and the time spent making tiles are
+  // recorded here, and served in the Prometheus format at /metrics.
+  std::shared_ptr<server_metrics> metrics;
+  // if not null, the maps and post-processor come from here rather
+  // than from map_file, raster_map_file and post_processor, and can be
+  // reloaded while the server is running.
+  std::shared_ptr<map_reloader> reloader;
+  // if true, and there's a reloader, then a POST to /reload reloads
+  // the configuration.
+  bool reload_endpoint = false;
+  // if greater than zero, up to this many vector tiles can be asked
+  // for in a single request to /batch.
+  std::size_t max_batch_tiles = 0;
+  // where the TileJSON is kept once it has been made, so that the
+  // handlers on all threads share it. if this is null, the handler
+  // factory makes one. not used if there's a reloader, as each of its
+  // configurations has its own.
+  std::shared_ptr<shared_tilejson> tilejson;
 };
 
 } } // namespace http::server3
@@ -6,8 +6,17 @@
 namespace http {
 namespace server3 {
 
+// parses a path of the form /z/x/y.pbf
 bool parse_path(const std::string &path, int &z, int &x, int &y);
 
+// parses a path of the form /z/x/y.ext, returning the extension.
+bool parse_path(const std::string &path, int &z, int &x, int &y, std::string &ext);
+
+// as above, for the path in [begin, end). the numbers must be plain
+// decimal, and the extension alphanumeric. this doesn't allocate,
+// other than for an extension too long to fit in ext's own storage.
+bool parse_path(const char *begin, const char *end, int &z, int &x, int &y, std::string &ext);
+
 } // namespace server3
 } // namespace http
 
@@ -0,0 +1,125 @@
+#ifndef PREFETCHER_HPP
+#define PREFETCHER_HPP
+
+#include <string>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <unordered_map>
+#include <boost/noncopyable.hpp>
+
+namespace http { namespace server3 {
+
+/* Makes the tiles which are likely to be asked for next, so that
+ * they're already in the cache when they are.
+ *
+ * Each tile served is recorded, and its 8 neighbours and 4 children
+ * become candidates for prefetching. A candidate's score goes up each
+ * time it's predicted, weighted by how often predictions of that kind
+ * - neighbour or child - have turned out to be asked for, so that the
+ * prefetcher adapts to whether clients are mostly panning or zooming.
+ *
+ * Candidates are made, highest score first, on a single thread of
+ * their own, with low OS priority, and only while no foreground
+ * requests are being handled. The candidate list is bounded, with the
+ * least recently predicted candidates dropped first.
+ */
+class prefetcher : public boost::noncopyable {
+public:
+  // makes a tile and puts it in the cache.
+  typedef std::function<void (int z, int x, int y, const std::string &encoding)> make_function;
+  // called on the prefetch thread to set up whatever it needs to make
+  // tiles, e.g: its own copy of the map.
+  typedef std::function<make_function ()> setup_function;
+
+  static const std::size_t DEFAULT_MAX_CANDIDATES = 1024;
+  static const int MAX_ZOOM = 30;
+
+  // keeps up to `max_candidates` tiles which haven't been asked for
+  // yet. starts the prefetch thread, which calls `setup` first.
+  prefetcher(setup_function setup, std::size_t max_candidates = DEFAULT_MAX_CANDIDATES);
+  ~prefetcher();
+
+  // record that a tile was served, predicting its neighbours and
+  // children.
+  void record(int z, int x, int y, const std::string &encoding);
+
+  // mark a foreground request as started or finished. nothing is
+  // prefetched while any foreground requests are in progress.
+  void begin_request();
+  void end_request();
+
+  // number of tiles which have been prefetched.
+  std::size_t num_prefetched() const;
+
+  // marks a foreground request for the lifetime of the object.
+  class foreground : public boost::noncopyable {
+  public:
+    explicit foreground(prefetcher &p) : m_prefetcher(p) { m_prefetcher.begin_request(); }
+    ~foreground() { m_prefetcher.end_request(); }
+  private:
+    prefetcher &m_prefetcher;
+  };
+
+private:
+  enum kind { NEIGHBOUR = 0, CHILD = 1, NUM_KINDS = 2 };
+
+  struct key {
+    int z, x, y;
+    std::string encoding;
+    bool operator==(const key &other) const;
+  };
+
+  struct key_hash {
+    std::size_t operator()(const key &k) const;
+  };
+
+  struct candidate {
+    key k;
+    double score;
+    // bitmask of the kinds of prediction which have been made for it.
+    unsigned int kinds;
+    // true once it's been prefetched. it's kept around so that a
+    // later request for it still counts as a hit.
+    bool done;
+  };
+
+  typedef std::list<candidate> candidate_list;
+
+  // these all expect the lock to be held.
+  double weight(kind k) const;
+  void predict(const key &k, kind kd, double w);
+  void trim();
+  candidate_list::iterator best();
+
+  void thread_func(setup_function setup);
+
+  const std::size_t max_candidates_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  bool shutdown_;
+
+  // most recently predicted at the front.
+  candidate_list candidates_;
+  std::unordered_map<key, candidate_list::iterator, key_hash> index_;
+  // number of candidates which haven't been prefetched yet.
+  std::size_t num_pending_;
+
+  // how many predictions of each kind have been made, and how many of
+  // those were asked for afterwards.
+  double predicted_[NUM_KINDS];
+  double hits_[NUM_KINDS];
+
+  std::atomic<int> num_foreground_;
+  std::atomic<std::size_t> num_prefetched_;
+
+  std::thread thread_;
+};
+
+} } // namespace http::server3
+
+#endif /* PREFETCHER_HPP */
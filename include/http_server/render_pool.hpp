@@ -0,0 +1,90 @@
+#ifndef HTTP_SERVER3_RENDER_POOL_HPP
+#define HTTP_SERVER3_RENDER_POOL_HPP
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <functional>
+#include <exception>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include "http_server/handler_factory.hpp"
+#include "http_server/request_handler.hpp"
+#include "http_server/server_metrics.hpp"
+
+namespace http {
+namespace server3 {
+
+/// Pool of threads which handle requests, so that slow requests, such as
+/// rendering a tile, don't hold up the threads doing network I/O.
+///
+/// Each thread has its own request handler, made by the factory, and jobs
+/// are taken from a bounded queue in the order they were posted.
+class render_pool
+  : private boost::noncopyable
+{
+public:
+  typedef std::function<void (request_handler &)> job;
+
+  /// Start num_threads workers, each with its own handler from the factory,
+  /// and wait for them to be set up. Throws the first error from setting
+  /// up a handler, if there was one. If metrics isn't null, the depth of
+  /// the queue is reported to it.
+  render_pool(std::size_t num_threads, std::size_t max_queued,
+              boost::shared_ptr<handler_factory> factory,
+              const std::string &port,
+              server_metrics *metrics = NULL);
+
+  /// Stop the workers. Jobs still in the queue are discarded.
+  ~render_pool();
+
+  /// Add a job to the end of the queue, returning false without queueing
+  /// it if the queue is full.
+  bool try_post(job j);
+
+  /// Add a job which nobody is waiting for to a queue of its own, which is
+  /// only run from while the main queue is empty. Returns false without
+  /// queueing it if that queue is full.
+  bool try_post_background(job j);
+
+  /// The number of worker threads.
+  std::size_t size() const;
+
+  /// The pool which the calling thread is a worker of, or null if it
+  /// isn't one of a pool's workers.
+  static render_pool *current();
+
+private:
+  /// Set up the thread's handler and then run jobs until stopped.
+  void thread_func(std::size_t i);
+
+  /// Stop and join all the workers.
+  void stop();
+
+  boost::shared_ptr<handler_factory> factory_;
+  std::string port_;
+  std::size_t max_queued_;
+  server_metrics *metrics_;
+
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  std::deque<job> jobs_, background_jobs_;
+  bool shutdown_;
+
+  /// Number of workers which have finished setting up, successfully or not,
+  /// and any errors they had doing so.
+  std::size_t num_ready_;
+  std::vector<std::exception_ptr> setup_errors_;
+
+  /// Each worker's handler.
+  boost::thread_specific_ptr<request_handler> handlers_;
+
+  std::vector<boost::shared_ptr<boost::thread> > threads_;
+};
+
+} // namespace server3
+} // namespace http
+
+#endif // HTTP_SERVER3_RENDER_POOL_HPP
@@ -13,8 +13,10 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 #include <boost/asio.hpp>
 #include "http_server/header.hpp"
+#include "http_server/body_stream.hpp"
 
 namespace http {
 namespace server3 {
@@ -37,6 +39,7 @@ struct reply
     unauthorized = 401,
     forbidden = 403,
     not_found = 404,
+    method_not_allowed = 405,
     internal_server_error = 500,
     not_implemented = 501,
     bad_gateway = 502,
@@ -46,15 +49,45 @@ struct reply
   /// The headers to be included in the reply.
   std::vector<header> headers;
 
+  /// Preformatted header lines, each ending in CRLF, which are sent after
+  /// `headers`. This is quicker for replies which are made often, as the
+  /// lines which never change can be formatted just once.
+  std::string header_block;
+
   /// The content to be sent in the reply.
   std::string content;
 
+  /// If not null, this is sent instead of `content`. This lets a body which
+  /// is kept elsewhere, such as in the tile cache, be sent without copying
+  /// it, and keeps it alive until the reply has been written.
+  std::shared_ptr<const std::string> shared_content;
+
+  /// If not null, the body is sent from this as it's written, after the
+  /// headers, and `content` and `shared_content` aren't used. The reply
+  /// shouldn't have a Content-Length.
+  std::shared_ptr<body_stream> stream;
+
   /// whether it's a hard error or not
   bool is_hard_error;
 
-  /// Convert the reply into a vector of buffers. The buffers do not own the
-  /// underlying memory blocks, therefore the reply object must remain valid and
-  /// not be changed until the write operation has completed.
+  /// The status line and headers, assembled by to_buffers.
+  std::string head;
+
+  /// Append a line to the header block.
+  void append_header(const char *name, const std::string &value);
+
+  /// Append a line with a decimal value, such as a Content-Length, to the
+  /// header block.
+  void append_header(const char *name, std::size_t value);
+
+  /// The content which will be sent.
+  const std::string &body() const;
+
+  /// Convert the reply into a vector of buffers. The status line and headers
+  /// are assembled into a single buffer, so that the reply can be sent with
+  /// a single gathering write. The buffers do not own the underlying memory
+  /// blocks, therefore the reply object must remain valid and not be changed
+  /// until the write operation has completed.
   std::vector<boost::asio::const_buffer> to_buffers();
 
   /// Get a stock reply.
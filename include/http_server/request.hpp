@@ -26,6 +26,18 @@ struct request
   int http_version_major;
   int http_version_minor;
   std::vector<header> headers;
+
+  /// Clear the request, ready for the next one on a connection, keeping the
+  /// memory which has already been allocated for the method, URI and the
+  /// list of headers.
+  void clear()
+  {
+    method.clear();
+    uri.clear();
+    http_version_major = 0;
+    http_version_minor = 0;
+    headers.clear();
+  }
 };
 
 } // namespace server3
@@ -47,7 +47,26 @@ public:
     return boost::make_tuple(result, begin);
   }
 
+  /// Parse some data from a buffer. This gives the same results as the
+  /// above, but if the buffer holds the whole of a request which hasn't been
+  /// started on yet, as it usually does, then it's parsed in a single pass
+  /// rather than a byte at a time.
+  boost::tuple<boost::tribool, char *> parse(request& req, char *begin, char *end);
+
 private:
+  /// Parse the whole of a request at the start of the data, returning the
+  /// end of it. Returns null, having possibly added some headers to the
+  /// request, if the data doesn't hold a whole request or if there's
+  /// anything unusual about it, such as a header split over several lines,
+  /// which is left for consume to deal with.
+  const char *parse_whole(request& req, const char *begin, const char *end);
+
+  /// Parse the digits of an HTTP version number.
+  static bool parse_version(const char *&p, int &version);
+
+  /// Check if a byte can be part of a token, such as a method or header name.
+  static bool is_token(int c);
+
   /// Handle the next character of input.
   boost::tribool consume(request& req, char input);
 
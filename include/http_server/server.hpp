@@ -17,10 +17,12 @@
 #include <exception>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/optional.hpp>
 #include <boost/thread/tss.hpp>
 #include "http_server/connection.hpp"
+#include "http_server/render_pool.hpp"
 #include "http_server/request_handler.hpp"
 #include "http_server/server_options.hpp"
 
@@ -43,7 +45,9 @@ public:
   /// it needs to know the concrete type, which we don't include here.
   ~server();
 
-  /// Run the server's io_service loop.
+  /// Set up each thread's handler, start listening and run the server's
+  /// io_service loop. If include_current_thread is true, this doesn't return
+  /// until the server is stopped. Throws if any handler can't be set up.
   void run(bool include_current_thread);
 
   /// Stop the server's io_service loop.
@@ -53,29 +57,62 @@ public:
   std::string port() const;
 
 private:
+  /// An io_service, along with the acceptor which it runs. Normally there's
+  /// a single listener, run by all the threads. With reuse_port, each thread
+  /// has a listener of its own, so that a connection is only ever handled
+  /// by the thread which accepted it.
+  struct listener
+    : private boost::noncopyable
+  {
+    listener();
+
+    /// The io_service used to perform asynchronous operations.
+    boost::asio::io_service io_service;
+
+    /// Acceptor used to listen for incoming connections.
+    boost::asio::ip::tcp::acceptor acceptor;
+
+    /// The next connection to be accepted.
+    connection_ptr new_connection;
+  };
+
+  /// Make the given number of listeners.
+  static std::vector<boost::shared_ptr<listener> > make_listeners(std::size_t count);
+
+  /// Open a listener's acceptor and bind it to the endpoint.
+  void open_acceptor(listener &l, const boost::asio::ip::tcp::endpoint &endpoint,
+                     bool reuse_port);
+
   /// Initiate an asynchronous accept operation.
-  void start_accept();
+  void start_accept(listener &l);
 
   /// Handle completion of an asynchronous accept operation.
-  void handle_accept(const boost::system::error_code& e);
+  void handle_accept(listener &l, const boost::system::error_code& e);
 
   /// Handle a request to stop the server.
   void handle_stop();
 
+  /// Handle a request to reload the configuration, and wait for the next.
+  void handle_reload(const boost::system::error_code& e);
+
   /// The number of threads that will call io_service::run().
   std::size_t thread_pool_size_;
 
-  /// The io_service used to perform asynchronous operations.
-  boost::asio::io_service io_service_;
+  /// Whether to pin each thread to a CPU.
+  bool pin_threads_;
+
+  /// The listeners, either one shared by all the threads, or one per thread.
+  /// The first one also handles the signals.
+  std::vector<boost::shared_ptr<listener> > listeners_;
 
   /// The signal_set is used to register for process termination notifications.
   boost::asio::signal_set signals_;
 
-  /// Acceptor used to listen for incoming connections.
-  boost::asio::ip::tcp::acceptor acceptor_;
+  /// The signal_set for SIGHUP, if there's anything to reload.
+  boost::asio::signal_set reload_signals_;
 
-  /// The next connection to be accepted.
-  connection_ptr new_connection_;
+  /// Called to reload the configuration.
+  std::function<void ()> reload_;
 
   /// the configuration for the request handler - also acts as a factory
   /// for creating per-thread instances of request handlers.
@@ -84,6 +121,17 @@ private:
   /// The port to run on
   std::string port_;
 
+  /// Seconds an idle persistent connection is kept open for.
+  unsigned int keepalive_timeout_;
+
+  /// Where to record telemetry, or null. This must outlive the render pool,
+  /// which reports to it.
+  std::shared_ptr<server_metrics> metrics_;
+
+  /// Threads to handle requests on, or null if they're handled on the
+  /// io_service threads.
+  boost::scoped_ptr<render_pool> render_pool_;
+
   /// thread local storage, so that we can construct objects and re-use
   /// them on threads without having to worry about locking them or having
   /// any sort of pool of objects.
@@ -0,0 +1,137 @@
+#ifndef SERVER_METRICS_HPP
+#define SERVER_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/tss.hpp>
+
+namespace http { namespace server3 {
+
+class tile_cache;
+
+/* Operational telemetry for the tile server, written out in the
+ * Prometheus text format.
+ *
+ * Recording is on the hot path of every request, so each thread
+ * records into counters of its own, which only it ever writes to.
+ * That way recording needs neither locks nor atomic read-modify-write
+ * operations, only relaxed loads and stores. Scraping adds up the
+ * counters of all the threads. The only lock is taken the first time
+ * a thread records anything, to register its counters.
+ */
+class server_metrics : public boost::noncopyable {
+public:
+  typedef std::chrono::steady_clock clock;
+
+  // the phases of making and sending a tile which are timed.
+  enum phase {
+    // querying the data and building the tile, or rendering a PNG.
+    RENDER,
+    // running the izers over the tile's layers.
+    POST_PROCESS,
+    // serialising and compressing the vector tile, or encoding a PNG.
+    SERIALISE,
+    // writing the reply to the client.
+    WRITE,
+    NUM_PHASES
+  };
+
+  static const int MAX_ZOOM = 30;
+
+  server_metrics();
+  ~server_metrics();
+
+  // count a reply by its status and the zoom of the tile requested,
+  // or a negative zoom if the request wasn't for a tile.
+  void record_request(int status, int zoom);
+
+  void record_phase(phase p, clock::duration d);
+
+  // size of the body of a tile served in the given encoding.
+  void record_tile_bytes(const std::string &encoding, std::size_t bytes);
+
+  // time this thread has spent handling requests.
+  void add_busy(clock::duration d);
+
+  // number of requests waiting for a render thread.
+  void set_queue_depth(std::size_t depth);
+
+  // write all the metrics out, including those of the cache, if
+  // there is one.
+  void write(std::ostream &out, const tile_cache *cache) const;
+
+private:
+  static const std::size_t NUM_STATUSES = 7;
+  static const std::size_t NUM_ENCODINGS = 2;
+  static const std::size_t NUM_LATENCY_BOUNDS = 13;
+  static const std::size_t NUM_BYTES_BOUNDS = 9;
+
+  // a histogram written to by a single thread.
+  template <std::size_t N>
+  struct histogram {
+    histogram();
+    void record(const std::uint64_t (&bounds)[N], std::uint64_t value);
+
+    std::array<std::atomic<std::uint64_t>, N + 1> buckets;
+    std::atomic<std::uint64_t> count, sum;
+  };
+
+  // each thread's counters.
+  struct counters {
+    counters();
+
+    // the extra zoom is for requests which aren't for tiles.
+    std::atomic<std::uint64_t> requests[NUM_STATUSES][MAX_ZOOM + 2];
+    // durations in microseconds.
+    histogram<NUM_LATENCY_BOUNDS> phases[NUM_PHASES];
+    histogram<NUM_BYTES_BOUNDS> tile_bytes[NUM_ENCODINGS];
+    std::atomic<std::uint64_t> busy_us;
+  };
+
+  static const int STATUSES[NUM_STATUSES];
+  static const char *const ENCODINGS[NUM_ENCODINGS];
+  static const char *const PHASE_NAMES[NUM_PHASES];
+  static const std::uint64_t LATENCY_BOUNDS_US[NUM_LATENCY_BOUNDS];
+  static const std::uint64_t BYTES_BOUNDS[NUM_BYTES_BOUNDS];
+
+  // the calling thread's counters, registering them if this is the
+  // first time it has recorded anything.
+  counters &local();
+
+  template <std::size_t N>
+  static void write_histogram(std::ostream &out, const std::string &name,
+                              const std::string &labels, double scale,
+                              const std::uint64_t (&bounds)[N],
+                              const std::vector<const histogram<N> *> &hs);
+
+  // a thread's pointer to its counters. the thread specific storage
+  // may outlive this object, and a later one could end up at the same
+  // address, so the pointer is only trusted if it's tagged with this
+  // object's id.
+  struct local_ref {
+    std::uint64_t owner;
+    counters *c;
+  };
+
+  const std::uint64_t id_;
+
+  // all the threads' counters. they're kept after a thread exits, so
+  // that its counts aren't lost.
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<counters> > threads_;
+  boost::thread_specific_ptr<local_ref> local_;
+
+  std::atomic<std::uint64_t> queue_depth_;
+};
+
+} } // namespace http::server3
+
+#endif /* SERVER_METRICS_HPP */
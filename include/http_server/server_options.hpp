@@ -1,16 +1,48 @@
 #ifndef SERVER_OPTIONS_HPP
 #define SERVER_OPTIONS_HPP
 
+#include <memory>
+#include <functional>
 #include <boost/shared_ptr.hpp>
 #include "http_server/handler_factory.hpp"
+#include "http_server/server_metrics.hpp"
 
 namespace http {
 namespace server3 {
 
 struct server_options {
+  server_options()
+    : thread_hint(1), keepalive_timeout(30),
+      render_threads(0), render_queue_size(128),
+      reuse_port(false), pin_threads(false) {}
+
   std::string port;
   unsigned short thread_hint;
   boost::shared_ptr<handler_factory> factory;
+  // seconds to keep an idle persistent connection open, waiting for
+  // the client's next request. zero disables keep-alive altogether.
+  unsigned int keepalive_timeout;
+  // number of threads to handle requests on, separate from the
+  // threads doing network I/O. if zero, requests are handled on the
+  // I/O threads.
+  unsigned int render_threads;
+  // maximum number of requests waiting for a render thread. any more
+  // are turned away with 503 Service Unavailable.
+  unsigned int render_queue_size;
+  // if not null, the time spent writing replies, requests turned
+  // away and the depth of the render queue are recorded here.
+  std::shared_ptr<server_metrics> metrics;
+  // if set, this is called when the server gets SIGHUP, so that it
+  // can reload its configuration. it should return quickly.
+  std::function<void ()> reload;
+  // if true, each thread has an io_service and an SO_REUSEPORT
+  // acceptor of its own, rather than all sharing one, and the kernel
+  // spreads the connections between them. a connection then stays on
+  // the thread which accepted it, along with that thread's handler.
+  // not available on all platforms.
+  bool reuse_port;
+  // if true, each thread is pinned to a CPU. only supported on Linux.
+  bool pin_threads;
 };
 
 } } // namespace http::server3
@@ -0,0 +1,41 @@
+#ifndef SHARED_TILEJSON_HPP
+#define SHARED_TILEJSON_HPP
+
+#include <string>
+#include <mutex>
+#include <functional>
+#include <boost/noncopyable.hpp>
+
+#include "http_server/tile_cache.hpp"
+
+namespace http { namespace server3 {
+
+/* The TileJSON for one load of the map, both as-is and gzipped, made by
+ * the first request handler which is asked for it and shared with all
+ * the others. Making it can mean asking each datasource to describe
+ * itself, so this keeps a server's worth of threads from all doing so
+ * after each load of the map.
+ */
+class shared_tilejson : public boost::noncopyable {
+public:
+  shared_tilejson();
+
+  // sets plain to the document, calling make to make it if this is the
+  // first time it's been asked for, and gzipped to it gzipped at the
+  // given level, or null if the level is zero. other callers wait while
+  // it's being made. if make throws, the next caller tries again.
+  void get(const std::function<std::string ()> &make, int compression_level,
+           tile_cache::value_type &plain, tile_cache::value_type &gzipped);
+
+  // number of times the document has been made.
+  std::size_t num_made() const;
+
+private:
+  mutable std::mutex mutex_;
+  tile_cache::value_type plain_, gzipped_;
+  std::size_t num_made_;
+};
+
+} } // namespace http::server3
+
+#endif /* SHARED_TILEJSON_HPP */
@@ -0,0 +1,81 @@
+#ifndef HTTP_SERVER3_TILE_BATCH_HPP
+#define HTTP_SERVER3_TILE_BATCH_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <boost/noncopyable.hpp>
+#include "http_server/body_stream.hpp"
+
+namespace http { namespace server3 {
+
+// a tile asked for in a batch request.
+struct tile_id {
+  int z, x, y;
+};
+
+// parses the query string of a batch request, which asks either for a
+// list of tiles:
+//
+//   tiles=z/x/y,z/x/y,...
+//
+// or for all the tiles covering a bounding box, in degrees of longitude
+// and latitude, over a range of zooms:
+//
+//   bbox=west,south,east,north&minzoom=z0&maxzoom=z1
+//
+// returns false if the query isn't valid, or if it asks for more than
+// max_tiles tiles. the tiles covering a bounding box are given zoom by
+// zoom, in rows.
+bool parse_batch_query(const std::string &query, std::size_t max_tiles,
+                       std::vector<tile_id> &tiles);
+
+// appends a tile's record to the body of a batch response. each record
+// is the tile's z, x, y, flags and the length of its body, as 32-bit
+// unsigned big-endian integers, followed by the body itself.
+void append_batch_record(std::string &out, const tile_id &tile, const std::string &body,
+                         bool gzipped);
+
+// size of a record's header.
+const std::size_t BATCH_RECORD_HEADER_SIZE = 20;
+
+// set in a record's flags if its body is gzipped.
+const uint32_t BATCH_RECORD_GZIPPED = 1;
+
+// a batch response which is being made on several threads at once.
+// each takes tiles in turn and writes their records to the stream,
+// which is closed once they've all been written, or aborted if the
+// batch is dropped before then. the records are written in the order
+// the tiles are made, rather than the order they were asked for.
+class tile_batch : private boost::noncopyable {
+public:
+  tile_batch(std::vector<tile_id> tiles, std::shared_ptr<body_stream> stream);
+  ~tile_batch();
+
+  // sets tile to the next one to make, returning false if there are
+  // none left, or if the client has gone away.
+  bool take(tile_id &tile);
+
+  // writes the record for a tile which was taken.
+  void write(const tile_id &tile, const std::string &body, bool gzipped);
+
+  // returns true if there's room in the stream for another record.
+  // otherwise resume is called once there is, as for the stream's
+  // wait_for_room.
+  bool wait_for_room(body_stream::callback resume);
+
+  // gives up on the batch after failing to make a tile.
+  void abort();
+
+private:
+  const std::vector<tile_id> tiles_;
+  std::shared_ptr<body_stream> stream_;
+  std::atomic<std::size_t> next_, written_;
+};
+
+} } // namespace http::server3
+
+#endif /* HTTP_SERVER3_TILE_BATCH_HPP */
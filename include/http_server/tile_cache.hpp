@@ -0,0 +1,145 @@
+#ifndef TILE_CACHE_HPP
+#define TILE_CACHE_HPP
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <vector>
+#include <chrono>
+#include <future>
+#include <functional>
+#include <unordered_map>
+#include <boost/noncopyable.hpp>
+
+namespace http { namespace server3 {
+
+/* An encoded tile, exactly as it's sent to the client, along with
+ * the strong ETag which identifies it. The ETag is computed once,
+ * when the tile is made, rather than on every request.
+ *
+ * Vector tiles are usually kept gzipped, and sent that way to clients
+ * which accept it. The body for the others is a separate tile, with
+ * an ETag of its own.
+ */
+struct encoded_tile {
+  explicit encoded_tile(std::string data);
+
+  std::string data;
+  std::string etag;
+  // true if the data is gzipped, and so must be sent with a gzip
+  // Content-Encoding.
+  bool gzipped;
+};
+
+/* Cache of encoded tile bodies, keyed by (z, x, y, encoding), which
+ * evicts the least recently used tiles once they take up more than
+ * its byte budget, and drops tiles once they're older than its TTL.
+ *
+ * A single cache is shared between all the request handler threads.
+ * To keep them from contending on a single lock, the keys are spread
+ * over a number of shards, each with its own lock, LRU list and share
+ * of the budget. The tiles are immutable once they've been put in the
+ * cache, so they can be handed out without copying.
+ *
+ * Concurrent misses for the same key are coalesced by `get_or_make`,
+ * so that a popular tile which isn't in the cache is only made once,
+ * with the other requests waiting for that result.
+ */
+class tile_cache : public boost::noncopyable {
+public:
+  typedef std::shared_ptr<const encoded_tile> value_type;
+  typedef std::function<value_type ()> make_function;
+  typedef std::chrono::steady_clock clock;
+
+  static const std::size_t DEFAULT_NUM_SHARDS = 16;
+
+  // holds up to roughly `max_bytes` of tiles, each for at most `ttl`.
+  // if either is zero, then nothing is kept, although concurrent
+  // misses are still coalesced.
+  tile_cache(std::size_t max_bytes, clock::duration ttl,
+             std::size_t num_shards = DEFAULT_NUM_SHARDS);
+  ~tile_cache();
+
+  // returns the tile, or null if it's not in the cache or has expired.
+  value_type get(int z, int x, int y, const std::string &encoding);
+
+  // adds or replaces a tile.
+  void put(int z, int x, int y, const std::string &encoding, value_type data);
+
+  // returns the tile if it's in the cache. otherwise, if another
+  // thread is already making it, waits for that thread's result. if
+  // not, calls `make` and puts the result in the cache. a null result
+  // is handed to the waiting threads but not cached, and an exception
+  // thrown by `make` is re-thrown to all the waiting threads.
+  value_type get_or_make(int z, int x, int y, const std::string &encoding,
+                         const make_function &make);
+
+  // drops every tile for which `pred` returns true, returning the
+  // number of tiles dropped. tiles being made at the time aren't
+  // affected.
+  std::size_t erase_if(const std::function<bool (int z, int x, int y, const std::string &encoding)> &pred);
+
+  // number of tiles, and total bytes charged for them, currently in
+  // the cache. this may include expired tiles which haven't been
+  // looked at since they expired.
+  std::size_t size() const;
+  std::size_t bytes() const;
+
+  // number of calls to `get_or_make` which found the tile in the
+  // cache, and which didn't, including those which waited for another
+  // thread to make it. and the number of tiles evicted to stay within
+  // the byte budget.
+  std::size_t hits() const;
+  std::size_t misses() const;
+  std::size_t evictions() const;
+
+private:
+  struct key {
+    int z, x, y;
+    std::string encoding;
+    bool operator==(const key &other) const;
+  };
+
+  struct key_hash {
+    std::size_t operator()(const key &k) const;
+  };
+
+  struct entry {
+    key k;
+    value_type data;
+    clock::time_point expires;
+    std::size_t charge;
+  };
+
+  typedef std::list<entry> lru_list;
+
+  struct shard {
+    mutable std::mutex mutex;
+    std::size_t bytes;
+    // most recently used at the front.
+    lru_list entries;
+    std::unordered_map<key, lru_list::iterator, key_hash> index;
+    // tiles being made by some thread right now.
+    std::unordered_map<key, std::shared_future<value_type>, key_hash> pending;
+    std::size_t hits, misses, evictions;
+  };
+
+  shard &shard_for(const key &k);
+
+  // sum of a counter over all the shards.
+  std::size_t total(std::size_t shard::*counter) const;
+
+  // these all expect the shard's lock to be held.
+  value_type lookup(shard &s, const key &k, clock::time_point now);
+  void insert(shard &s, const key &k, value_type data, clock::time_point now);
+  void erase(shard &s, lru_list::iterator itr);
+
+  std::size_t max_shard_bytes_;
+  clock::duration ttl_;
+  std::vector<std::unique_ptr<shard> > shards_;
+};
+
+} } // namespace http::server3
+
+#endif /* TILE_CACHE_HPP */
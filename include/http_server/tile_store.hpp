@@ -0,0 +1,44 @@
+#ifndef TILE_STORE_HPP
+#define TILE_STORE_HPP
+
+#include <string>
+#include <memory>
+#include <boost/noncopyable.hpp>
+
+namespace http { namespace server3 {
+
+/* Persistent storage for encoded vector tiles, such as a pyramid
+ * pre-generated by `avecado vector-bulk`.
+ *
+ * Tiles are stored as they're sent to clients which accept gzip. They
+ * may be gzipped or not, which the server works out from the data
+ * itself. Implementations must be safe to call from several threads
+ * at once.
+ */
+struct tile_store : public boost::noncopyable {
+  typedef std::shared_ptr<const std::string> value_type;
+
+  virtual ~tile_store();
+
+  // returns the stored tile, or null if it isn't in the store.
+  virtual value_type read(int z, int x, int y) = 0;
+
+  // adds or replaces a tile. throws on failure.
+  virtual void write(int z, int x, int y, const std::string &data) = 0;
+
+  // removes a tile, if it's in the store. throws on failure.
+  virtual void erase(int z, int x, int y) = 0;
+
+  // removes every tile at zoom z. throws on failure.
+  virtual void erase_zoom(int z) = 0;
+};
+
+// opens a store at `location`. if it ends in ".mbtiles" then it's
+// opened as an MBTiles file, which is created if it doesn't already
+// exist. otherwise it's a directory of $z/$x/$y.pbf files, as written
+// by `avecado vector-bulk`.
+std::shared_ptr<tile_store> make_tile_store(const std::string &location);
+
+} } // namespace http::server3
+
+#endif /* TILE_STORE_HPP */
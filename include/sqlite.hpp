@@ -0,0 +1,194 @@
+#ifndef AVECADO_SQLITE_HPP
+#define AVECADO_SQLITE_HPP
+
+#include <sqlite3.h>
+
+#include <string>
+#include <sstream>
+#include <memory>
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <boost/optional.hpp>
+#include <boost/format.hpp>
+
+namespace avecado {
+
+/* Thin wrappers around the SQLite3 C API, which take care of freeing
+ * handles and turn errors into exceptions. Only available when built
+ * with SQLite3 support, i.e: when HAVE_SQLITE3 is defined.
+ */
+namespace sqlite {
+struct sqlite_db_deleter {
+  void operator()(sqlite3 *ptr) const {
+    if (ptr != nullptr) {
+      int status = sqlite3_close(ptr);
+      if (status != SQLITE_OK) {
+        // TODO: use logger
+        std::cerr << "Unable to close SQLite3 database\n" << std::flush;
+      }
+    }
+  }
+};
+
+struct sqlite_statement_finalizer {
+  void operator()(sqlite3_stmt *ptr) const {
+    if (ptr != nullptr) {
+      int status = sqlite3_finalize(ptr);
+      if (status != SQLITE_OK) {
+        // TODO: use logger
+        std::cerr << "Unable to finalize SQLite3 statement\n" << std::flush;
+      }
+    }
+  }
+};
+
+struct statement {
+  boost::optional<std::time_t> column_time(int i) {
+    if (sqlite3_column_type(ptr.get(), i) == SQLITE_NULL) {
+      return boost::none;
+    } else {
+      sqlite3_int64 t = sqlite3_column_int64(ptr.get(), i);
+      return std::time_t(t);
+    }
+  }
+
+  boost::optional<std::string> column_text(int i) {
+    if (sqlite3_column_type(ptr.get(), i) == SQLITE_NULL) {
+      return boost::none;
+    } else {
+      const unsigned char *str = sqlite3_column_text(ptr.get(), i);
+      int sz = sqlite3_column_bytes(ptr.get(), i);
+      return std::string((const char *)str, sz);
+    }
+  }
+
+  void column_blob(int i, std::stringstream &stream) {
+    const char *bytes = static_cast<const char *>(sqlite3_column_blob(ptr.get(), i));
+    int sz = sqlite3_column_bytes(ptr.get(), i);
+    stream.write(bytes, sz);
+  }
+
+  std::string column_blob(int i) {
+    const char *bytes = static_cast<const char *>(sqlite3_column_blob(ptr.get(), i));
+    int sz = sqlite3_column_bytes(ptr.get(), i);
+    return std::string(bytes, sz);
+  }
+
+  bool step() {
+    int status = sqlite3_step(ptr.get());
+    if (status == SQLITE_DONE) { return false; }
+    if (status != SQLITE_ROW) {
+      throw std::runtime_error((boost::format("Unable to step row in query result: %1%") % sqlite3_errmsg(db_for_errors)).str());
+    }
+    return true;
+  }
+
+  void bind_text(int i, const std::string &str) {
+    int sz = str.size();
+    char *strp = static_cast<char *>(malloc(sz));
+    if (strp == nullptr) { throw std::runtime_error("Unable to allocate memory for string copy."); }
+    memcpy(strp, str.c_str(), sz);
+    int status = sqlite3_bind_text(ptr.get(), i, strp, sz, &free);
+    if (status != SQLITE_OK) {
+      free(strp);
+      throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
+    }
+  }
+
+  void bind_text(int i, const boost::optional<std::string> &str) {
+    if (str) {
+      bind_text(i, *str);
+
+    } else {
+      int status = sqlite3_bind_null(ptr.get(), i);
+      if (status != SQLITE_OK) {
+        throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
+      }
+    }
+  }
+
+  void bind_time(int i, std::time_t t) {
+    int status = sqlite3_bind_int64(ptr.get(), i, sqlite3_int64(t));
+    if (status != SQLITE_OK) {
+      throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
+    }
+  }
+
+  void bind_time(int i, boost::optional<std::time_t> t) {
+    if (t) {
+      bind_time(i, *t);
+
+    } else {
+      int status = sqlite3_bind_null(ptr.get(), i);
+      if (status != SQLITE_OK) {
+        throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
+      }
+    }
+  }
+
+  void bind_int(int i, int v) {
+    int status = sqlite3_bind_int(ptr.get(), i, v);
+    if (status != SQLITE_OK) {
+      throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
+    }
+  }
+
+  void bind_blob(int i, std::stringstream &stream) {
+    bind_blob(i, stream.str());
+  }
+
+  void bind_blob(int i, const std::string &str) {
+    int sz = str.size();
+    char *strp = static_cast<char *>(malloc(sz));
+    if (strp == nullptr) { throw std::runtime_error("Unable to allocate memory for blob copy."); }
+    memcpy(strp, str.c_str(), sz);
+    int status = sqlite3_bind_blob(ptr.get(), i, strp, sz, &free);
+    if (status != SQLITE_OK) {
+      free(strp);
+      throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
+    }
+  }
+
+private:
+  friend struct db;
+  statement(sqlite3 *db, const std::string &sql) 
+    : ptr(), db_for_errors(db) {
+    const char *tail = nullptr;
+    sqlite3_stmt *ptr_ = nullptr;
+    int status = sqlite3_prepare_v2(db, sql.c_str(), sql.size(), &ptr_, &tail);
+    if (status != SQLITE_OK) {
+      throw std::runtime_error((boost::format("Unable to prepare SQLite3 statement \"%1%\": %2%") % sql % sqlite3_errmsg(db_for_errors)).str());
+    }
+    ptr.reset(ptr_);
+  }
+
+  std::unique_ptr<sqlite3_stmt, sqlite_statement_finalizer> ptr;
+  sqlite3 *db_for_errors; // use for ERRORS only.
+};
+
+struct db {
+  db(const std::string &loc) {
+    sqlite3 *ptr_;
+    int status = sqlite3_open(loc.c_str(), &ptr_);
+    if (status != SQLITE_OK) {
+      throw std::runtime_error((boost::format("Unable to open SQLite3 database \"%1%\": %2%") % loc % sqlite3_errmsg(ptr_)).str());
+    }
+    ptr.reset(ptr_);
+  }
+
+  statement prepare(const std::string &sql) {
+    return statement(ptr.get(), sql);
+  }
+
+private:
+  std::unique_ptr<sqlite3, sqlite_db_deleter> ptr;
+};
+
+} // namespace sqlite
+
+} // namespace avecado
+
+#endif // AVECADO_SQLITE_HPP
@@ -0,0 +1,52 @@
+#ifndef AVECADO_THREAD_POOL_HPP
+#define AVECADO_THREAD_POOL_HPP
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace avecado {
+
+/* Fixed-size pool of worker threads which run jobs in the order that
+ * they were posted.
+ *
+ * This is used to get CPU-heavy work, such as decoding tiles, off
+ * threads which need to stay responsive, such as the one driving
+ * cURL. On destruction, any jobs still in the queue are run before
+ * the threads are joined, so that promises which those jobs were
+ * supposed to fulfil are not left hanging.
+ */
+class thread_pool : public boost::noncopyable {
+public:
+  typedef std::function<void ()> job;
+
+  // start a pool with `num_threads` workers. if `num_threads` is
+  // zero, then one worker is started anyway.
+  explicit thread_pool(std::size_t num_threads);
+  ~thread_pool();
+
+  // add a job to the end of the queue. jobs should handle their
+  // own errors - any exception escaping a job is reported on
+  // stderr and otherwise ignored.
+  void post(job j);
+
+  // number of worker threads in the pool.
+  std::size_t size() const;
+
+private:
+  void thread_func();
+
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::deque<job> m_jobs;
+  bool m_shutdown;
+  std::vector<std::thread> m_threads;
+};
+
+} // namespace avecado
+
+#endif // AVECADO_THREAD_POOL_HPP
@@ -4,6 +4,8 @@
 #include <mapnik/map.hpp>
 #include <mapnik/image_scaling.hpp>
 
+#include <vector>
+
 /* Forward declaration of vector tile type. This type is opaque
  * to users of Avecado, but we expose some methods in the
  * exported vector tile object below. */
@@ -34,11 +36,38 @@ public:
   vector_tile::Tile const &mapnik_tile() const;
   vector_tile::Tile &mapnik_tile();
 
+  // Move all the layers of `other` onto the end of this tile's
+  // layers. The layers aren't re-encoded, so if `other` has
+  // different coordinates, e.g: because it was overzoomed, then
+  // its coordinates are remembered for each of its layers.
+  void merge(tile &&other);
+
+  // As above, but copies the layers of `other`, leaving it intact.
+  void merge(const tile &other);
+
+  // coordinates of the data in the i'th layer. this is the same as
+  // the coordinates of the tile unless the layer was merged from a
+  // tile with different coordinates. note that this isn't kept
+  // when the tile is serialised.
+  struct origin {
+    unsigned int z, x, y;
+  };
+  origin layer_origin(int i) const;
+
   // coordinates of this tile
   const unsigned int z, x, y;
 
 private:
+  friend std::istream &operator>>(std::istream &, tile &);
+
+  // record origins for the layers of `other`, before they're
+  // appended to this tile.
+  void merge_origins(const tile &other);
+
   std::unique_ptr<vector_tile::Tile> m_mapnik_tile;
+  // per-layer origins, only filled in once a tile with different
+  // coordinates has been merged in.
+  std::vector<origin> m_layer_origins;
 };
 
 // read the tile from a zero-copy input stream
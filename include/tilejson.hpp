@@ -10,6 +10,8 @@ namespace mapnik { class Map; }
 
 namespace avecado {
 
+class fetch_metrics;
+
 /* Fetches a URI and parses it as TileJSON.
  */
 boost::property_tree::ptree tilejson(const std::string &uri);
@@ -23,6 +25,23 @@ boost::property_tree::ptree tilejson(const std::string &uri);
  */
 std::unique_ptr<fetcher> make_tilejson_fetcher(const boost::property_tree::ptree &conf);
 
+/* As above, but the constructed fetchers also report into `metrics`,
+ * if it is not null.
+ */
+std::unique_ptr<fetcher> make_tilejson_fetcher(const boost::property_tree::ptree &conf,
+                                               std::shared_ptr<fetch_metrics> metrics);
+
+/* Constructs a fetcher which merges the layers from several TileJSON
+ * sources into each tile.
+ *
+ * Each source gets its own nested fetchers, exactly as if it had
+ * been passed to `make_tilejson_fetcher`, so that differences in
+ * their max zoom and mask level are handled by each source's own
+ * overzoom. All the sources are fetched concurrently.
+ */
+std::unique_ptr<fetcher> make_tilejson_fetcher(const std::vector<boost::property_tree::ptree> &confs,
+                                               std::shared_ptr<fetch_metrics> metrics);
+
 /* Extracts data from a mapnik::Map to make TileJSON.
  */
 std::string make_tilejson(const mapnik::Map &map, const std::string &base_url);
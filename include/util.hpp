@@ -9,6 +9,10 @@ namespace avecado { namespace util {
 // conventional z/x/y tile.
 mapnik::box2d<double> box_for_tile(int z, int x, int y);
 
+// returns the bounding box in mercator coordinates for the block
+// of `size` x `size` tiles whose top-left tile is z/x/y.
+mapnik::box2d<double> box_for_metatile(int z, int x, int y, int size);
+
 } } // namespace avecado::util
 
 #endif // AVECADO_UTIL_HPP
@@ -13,6 +13,7 @@
 #include <stdexcept>
 #include <future>
 #include <atomic>
+#include <thread>
 #include <unordered_set>
 
 #include <mapnik/utils.hpp>
@@ -25,6 +26,7 @@
 #include "tilejson.hpp"
 #include "fetcher.hpp"
 #include "fetcher_io.hpp"
+#include "fetch_metrics.hpp"
 #include "util.hpp"
 #include "util_tile.hpp"
 #include "config.h"
@@ -654,7 +656,10 @@ int make_raster(int argc, char *argv[]) {
   double scale_factor = 1.0;
   unsigned int buffer_size = 0;
   unsigned int width = 256, height = 256;
+  bool dump_metrics = false;
+  unsigned int num_threads = std::thread::hardware_concurrency();
   std::string tilejson_uri, output_file, map_file;
+  std::vector<std::string> overlay_uris;
   std::string fonts_dir, input_plugins_dir;
 
   bpo::options_description options(
@@ -679,6 +684,18 @@ int make_raster(int argc, char *argv[]) {
      "Directory to tell Mapnik to look in for input plugins.")
     ("width", bpo::value<unsigned int>(&width), "Width of output raster.")
     ("height", bpo::value<unsigned int>(&height), "Height of output raster.")
+    ("metrics", bpo::bool_switch(&dump_metrics),
+     "Print statistics about fetching the vector tiles to stderr.")
+    ("overlay", bpo::value<std::vector<std::string> >(&overlay_uris),
+     "TileJSON config file URI of an extra source whose layers are merged with "
+     "those of the main source. May be given more than once.")
+    ("data-zoom", bpo::value<unsigned int>(),
+     "Render the tile's extent from all the vector tiles at this zoom level "
+     "which cover it, in parallel pieces, rather than from the single vector "
+     "tile at the tile's own zoom. Useful for large, high-resolution output.")
+    ("threads", bpo::value<unsigned int>(&num_threads),
+     "Number of threads to render with when --data-zoom is given. Defaults to "
+     "the number of cores.")
     // positional arguments
     ("tilejson", bpo::value<std::string>(&tilejson_uri),
      "TileJSON config file URI to specify where to get vector tiles from.")
@@ -741,12 +758,38 @@ int make_raster(int argc, char *argv[]) {
     map.resize(width, height);
     map.zoom_to_box(avecado::util::box_for_tile(z, x, y));
 
-    bpt::ptree conf = avecado::tilejson(tilejson_uri);
-    std::unique_ptr<avecado::fetcher> fetcher = avecado::make_tilejson_fetcher(conf);
+    std::shared_ptr<avecado::fetch_metrics> metrics;
+    if (dump_metrics) {
+      metrics = std::make_shared<avecado::fetch_metrics>();
+    }
+
+    std::vector<bpt::ptree> confs;
+    confs.push_back(avecado::tilejson(tilejson_uri));
+    for (auto const &uri : overlay_uris) {
+      confs.push_back(avecado::tilejson(uri));
+    }
+    std::unique_ptr<avecado::fetcher> fetcher = avecado::make_tilejson_fetcher(confs, metrics);
+
+    if (vm.count("data-zoom")) {
+      mapnik::image_rgba8 image(width, height);
+
+      avecado::render_vector_extent(image, *fetcher, map, vm["data-zoom"].as<unsigned int>(),
+                                    scale_factor, buffer_size, num_threads);
+      if (metrics) {
+        std::cerr << *metrics;
+      }
+      mapnik::save_to_file(image, output_file, "png");
+
+      return EXIT_SUCCESS;
+    }
 
     avecado::request req(z, x, y);
     avecado::fetch_response response = (*fetcher)(req).get();
 
+    if (metrics) {
+      std::cerr << *metrics;
+    }
+
     if (response.is_left()) {
       mapnik::image_rgba8 image(width, height);
 
@@ -2,8 +2,10 @@
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/json_parser.hpp>
-#include <boost/property_tree/exceptions.hpp>
+
+#include <thread>
+#include <algorithm>
+#include <limits>
 
 #include <mapnik/utils.hpp>
 #include <mapnik/load_map.hpp>
@@ -11,8 +13,10 @@
 #include <mapnik/datasource_cache.hpp>
 
 #include "avecado.hpp"
+#include "tilejson.hpp"
 #include "http_server/server.hpp"
 #include "http_server/mapnik_handler_factory.hpp"
+#include "http_server/mapnik_request_handler.hpp"
 #include "config.h"
 
 namespace bpo = boost::program_options;
@@ -26,6 +30,12 @@ int main(int argc, char *argv[]) {
   server_options srv_opts;
   mapnik_server_options map_opts;
   std::string fonts_dir, input_plugins_dir, config_file;
+  std::string raster_source_uri;
+  std::size_t cache_size = 0;
+  std::string store_location;
+  bool store_write_back = false;
+  bool prefetch = false;
+  std::string warm_up;
 
   bpo::options_description options(
     "Avecado " VERSION "\n"
@@ -37,6 +47,18 @@ int main(int argc, char *argv[]) {
     "tile with coordinates z=2, x=1, y=0 would be available at "
     "http://localhost:8080/2/1/0.pbf if the port parameter is given as 8080."
     "\n"
+    "\n"
+    "If a raster style is given with --raster-map, then PNG tiles are also served "
+    "on URLs like /$z/$x/$y.png, rendered from the server's own vector tiles or "
+    "from the vector tiles of the TileJSON source given with --raster-source."
+    "\n"
+    "\n"
+    "Metrics for monitoring are served in the Prometheus text format on /metrics."
+    "\n"
+    "\n"
+    "Sending the server SIGHUP reloads the map and config files, without dropping "
+    "connections. Only the cached tiles which the changes affect are dropped."
+    "\n"
     "\n");
 
   options.add_options()
@@ -70,6 +92,22 @@ int main(int argc, char *argv[]) {
     ("thread-hint", bpo::value<unsigned short>(&srv_opts.thread_hint)->default_value(1),
      "Hint at the number of asynchronous "
      "requests the server should be able to service.")
+    ("render-threads", bpo::value<unsigned int>(&srv_opts.render_threads)
+     ->default_value(std::max(1u, std::thread::hardware_concurrency())),
+     "Number of threads to render tiles on, separate from the threads "
+     "handling network I/O. 0 renders on the I/O threads.")
+    ("render-queue-size", bpo::value<unsigned int>(&srv_opts.render_queue_size)->default_value(128),
+     "Maximum number of requests waiting for a render thread. Any more are "
+     "turned away with 503 Service Unavailable.")
+    ("keepalive-timeout", bpo::value<unsigned int>(&srv_opts.keepalive_timeout)->default_value(30),
+     "Seconds to keep idle HTTP/1.1 connections open for. 0 closes the "
+     "connection after every response.")
+    ("reuse-port", bpo::bool_switch(&srv_opts.reuse_port),
+     "Give each of the --thread-hint threads its own SO_REUSEPORT listening "
+     "socket, so that connections stay on the thread which accepted them. "
+     "Best with --render-threads 0, so that tiles are made on that thread too.")
+    ("pin-threads", bpo::bool_switch(&srv_opts.pin_threads),
+     "Pin each of the --thread-hint threads to a CPU. Linux only.")
     ("config-file,c", bpo::value<std::string>(&config_file),
      "JSON config file to specify post-processing for data layers.")
     ("max-age", bpo::value<unsigned int>(&map_opts.max_age)->default_value(60),
@@ -77,7 +115,49 @@ int main(int argc, char *argv[]) {
     ("compression-level,z", bpo::value<int>(&map_opts.compression_level)
      ->default_value(-1),
      "Gzip compression level: 0 means no compression, 1 is fastest, "
-     "9 is best compression. Leave as -1 to use the default.")
+     "9 is best compression. Leave as -1 to use the default. Tiles are "
+     "compressed once, and inflated again for clients which don't accept "
+     "gzip.")
+    ("raster-map", bpo::value<std::string>(&map_opts.raster_map_file),
+     "Mapnik XML style file used to render PNG tiles. If not given, PNG "
+     "tiles are not served.")
+    ("raster-source", bpo::value<std::string>(&raster_source_uri),
+     "TileJSON config file URI to get vector tiles to render PNG tiles "
+     "from. If not given, the server's own vector tiles are used.")
+    ("cache-size", bpo::value<std::size_t>(&cache_size)->default_value(256),
+     "Megabytes of encoded tiles to keep in memory. Tiles are kept for "
+     "up to --max-age seconds. 0 disables caching.")
+    ("metatile", bpo::value<unsigned int>(&map_opts.metatile)->default_value(1),
+     "Render PNG tiles in aligned blocks of N x N in a single pass, caching "
+     "the neighbours of the requested tile as well. Only applies to PNG "
+     "tiles, so needs a --raster-map. Vector tiles are always made one "
+     "at a time. Must be a power of two, and needs the --cache-size to be "
+     "non-zero.")
+    ("store", bpo::value<std::string>(&store_location),
+     "Directory of pre-generated $z/$x/$y.pbf tiles, as made by vector-bulk, "
+     "or an MBTiles file, to serve tiles from. Tiles missing from it are "
+     "rendered. Stored tiles may be gzipped or not.")
+    ("store-write-back", bpo::bool_switch(&store_write_back),
+     "Write tiles which were rendered because they were missing back to "
+     "the --store, in the background.")
+    ("reload-endpoint", bpo::bool_switch(&map_opts.reload_endpoint),
+     "Reload the map and config files when a POST request is made to /reload, "
+     "as well as on SIGHUP.")
+    ("max-batch-tiles", bpo::value<std::size_t>(&map_opts.max_batch_tiles)->default_value(0),
+     "Serve up to this many vector tiles in one response from /batch, asked for "
+     "with ?tiles=z/x/y,... or ?bbox=west,south,east,north&minzoom=z0&maxzoom=z1. "
+     "The tiles are made on the --render-threads, which are needed for this, "
+     "in between other requests, and streamed back as they're made, each as "
+     "its z, x, y, flags and length, as 32-bit big-endian integers, followed by "
+     "the tile. Flags bit 0 is set if the tile is gzipped. 0 turns the endpoint off.")
+    ("prefetch", bpo::bool_switch(&prefetch),
+     "When the server is idle, make the neighbours and children of recently "
+     "requested tiles, so that they're already cached. Needs the --cache-size "
+     "to be non-zero.")
+    ("warm-up", bpo::value<std::string>(&warm_up),
+     "Tiles to make and cache before the server starts listening, given in the "
+     "same way as to /batch, e.g: \"bbox=-10,50,2,60&minzoom=0&maxzoom=8\". "
+     "Needs the --cache-size to be non-zero.")
     // positional arguments
     ("map-file", bpo::value<std::string>(&map_opts.map_file), "Mapnik XML input file.")
     ("port", bpo::value<std::string>(&srv_opts.port), "Port upon which the server will listen.")
@@ -119,6 +199,21 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if ((map_opts.metatile == 0) || ((map_opts.metatile & (map_opts.metatile - 1)) != 0)) {
+    std::cerr << "The --metatile size must be a power of two, but was " << map_opts.metatile << ".\n";
+    return EXIT_FAILURE;
+  }
+
+  if ((map_opts.metatile > 1) && map_opts.raster_map_file.empty()) {
+    std::cerr << "WARNING: Ignoring --metatile, as it only applies to PNG tiles and there's no --raster-map.\n";
+    map_opts.metatile = 1;
+  }
+
+  if ((map_opts.max_batch_tiles > 0) && (srv_opts.render_threads == 0)) {
+    std::cerr << "The --max-batch-tiles endpoint needs --render-threads to make its tiles on.\n";
+    return EXIT_FAILURE;
+  }
+
   if (vm.count("scaling-method")) {
     std::string method_str(vm["scaling-method"].as<std::string>());
 
@@ -138,34 +233,67 @@ int main(int argc, char *argv[]) {
     map_opts.scaling_method = mapnik::SCALING_NEAR;
   }
 
-  if (vm.count("config-file")) {
-    try {
-      // parse json config
-      pt::ptree config;
-      pt::read_json(config_file, config);
-
-      // init processor
-      map_opts.post_processor.reset(new avecado::post_processor);
-      map_opts.post_processor->load(config);
-
-    } catch (pt::ptree_error const& e) {
-      std::cerr << "Error while parsing config: " << config_file << std::endl;
-      std::cerr << e.what() << std::endl;
-      return EXIT_FAILURE;
-
-    } catch (std::exception const& e) {
-      std::cerr << "Error while loading config: " << config_file << std::endl;
-      std::cerr << e.what() << std::endl;
-      return EXIT_FAILURE;
-    }
-  }
-
   //start up the server
   try {
     // try to register fonts and input plugins
     mapnik::freetype_engine::register_fonts(fonts_dir);
     mapnik::datasource_cache::instance().register_datasources(input_plugins_dir);
 
+    if (!map_opts.raster_map_file.empty()) {
+      if (!raster_source_uri.empty()) {
+        pt::ptree conf = avecado::tilejson(raster_source_uri);
+        map_opts.raster_source.reset(avecado::make_tilejson_fetcher(conf).release());
+      }
+    }
+
+    if ((cache_size > 0) && (map_opts.max_age > 0)) {
+      map_opts.cache.reset(new http::server3::tile_cache(
+        cache_size * 1024 * 1024, std::chrono::seconds(map_opts.max_age)));
+    }
+
+    if (!store_location.empty()) {
+      map_opts.store = http::server3::make_tile_store(store_location);
+      if (store_write_back) {
+        // a single writer, so that writes don't contend with each
+        // other, only with the readers.
+        map_opts.store_writer = std::make_shared<avecado::thread_pool>(1);
+      }
+    }
+
+    // the maps are loaded once, here, and copied into each thread's
+    // handler. this is also what lets them be reloaded.
+    map_opts.reloader = std::make_shared<http::server3::map_reloader>(
+      map_opts.map_file, map_opts.raster_map_file, config_file, map_opts.cache,
+      !map_opts.raster_source, map_opts.store, map_opts.store_writer);
+    {
+      std::shared_ptr<http::server3::map_reloader> reloader = map_opts.reloader;
+      srv_opts.reload = [reloader]() { reloader->reload_async(); };
+    }
+
+    // metrics are cheap enough to always keep.
+    srv_opts.metrics = std::make_shared<http::server3::server_metrics>();
+    map_opts.metrics = srv_opts.metrics;
+
+    if (prefetch && map_opts.cache) {
+      map_opts.prefetch = http::server3::make_prefetcher(map_opts);
+    }
+
+    if (!warm_up.empty()) {
+      std::vector<http::server3::tile_id> tiles;
+      if (!http::server3::parse_batch_query(warm_up, std::numeric_limits<std::size_t>::max(), tiles)) {
+        std::cerr << "Unable to understand the --warm-up tiles \"" << warm_up << "\".\n";
+        return EXIT_FAILURE;
+      }
+      if (!map_opts.cache) {
+        std::cerr << "WARNING: Ignoring --warm-up, as there's no cache to warm.\n";
+      } else {
+        std::cout << "Warming up " << tiles.size() << " tiles..." << std::endl;
+        http::server3::warm_cache(map_opts, tiles,
+                                  std::max<std::size_t>(srv_opts.thread_hint, srv_opts.render_threads));
+        std::cout << "Warm-up done." << std::endl;
+      }
+    }
+
     // set up the factory object
     srv_opts.factory.reset(new http::server3::mapnik_handler_factory(map_opts));
     
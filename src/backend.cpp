@@ -6,11 +6,13 @@ namespace avecado {
 backend::backend(vector_tile::Tile & tile,
                  unsigned path_multiplier,
                  mapnik::Map const& map,
-                 boost::optional<const post_processor &> pp)
+                 boost::optional<const post_processor &> pp,
+                 std::chrono::steady_clock::duration *post_process_time)
   : m_pbf(tile, path_multiplier),
     m_map(map),
     m_tolerance(1),
-    m_post_processor(pp) {}
+    m_post_processor(pp),
+    m_post_process_time(post_process_time) {}
 
 void backend::start_tile_layer(std::string const& name) {
   m_current_layer_name = name;
@@ -19,9 +21,13 @@ void backend::start_tile_layer(std::string const& name) {
 
 void backend::stop_tile_layer() {
   if (m_post_processor) {
+    const auto start = std::chrono::steady_clock::now();
     m_post_processor->process_layer(m_current_layer_features,
                                     m_current_layer_name,
                                     m_map);
+    if (m_post_process_time) {
+      *m_post_process_time += std::chrono::steady_clock::now() - start;
+    }
   }
 
   m_pbf.start_tile_layer(m_current_layer_name);
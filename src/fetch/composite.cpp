@@ -0,0 +1,56 @@
+#include "fetch/composite.hpp"
+
+namespace avecado { namespace fetch {
+
+composite::composite(std::vector<std::unique_ptr<fetcher> > &&sources)
+  : m_sources(std::move(sources)) {
+  if (m_sources.empty()) {
+    throw std::runtime_error("Composite fetcher needs at least one source.");
+  }
+}
+
+composite::~composite() {
+}
+
+std::future<fetch_response> composite::operator()(const request &r) {
+  // start all the requests before waiting on any of them, so that
+  // they run concurrently and we only wait as long as the slowest.
+  std::vector<std::future<fetch_response> > upstream_futures;
+  upstream_futures.reserve(m_sources.size());
+  for (auto &source : m_sources) {
+    upstream_futures.emplace_back((*source)(r));
+  }
+
+  return std::async([r](std::vector<std::future<fetch_response> > &&futures) -> fetch_response {
+      std::unique_ptr<tile> merged;
+      boost::optional<fetch_result> error;
+
+      for (auto &fut : futures) {
+        fetch_response resp(fut.get());
+
+        if (resp.is_left()) {
+          if (!merged) {
+            merged.reset(new tile(r.z, r.x, r.y));
+          }
+          merged->merge(std::move(*resp.left()));
+
+        } else if ((resp.right().status != fetch_status::not_found) && !error) {
+          error = resp.right();
+        }
+      }
+
+      if (error) {
+        return fetch_response(*error);
+
+      } else if (merged) {
+        return fetch_response(std::move(merged));
+
+      } else {
+        fetch_result not_found;
+        not_found.status = fetch_status::not_found;
+        return fetch_response(not_found);
+      }
+    }, std::move(upstream_futures));
+}
+
+} } // namespace avecado::fetch
@@ -1,5 +1,8 @@
 #include "fetch/http.hpp"
 #include "fetch/http_date_parser.hpp"
+#include "fetch/host_queues.hpp"
+#include "fetch_metrics.hpp"
+#include "thread_pool.hpp"
 #include "vector_tile.pb.h"
 #include "config.h"
 
@@ -13,20 +16,26 @@
 
 #include <sstream>
 #include <list>
+#include <map>
 #include <queue>
+#include <mutex>
+#include <chrono>
 #include <google/protobuf/io/zero_copy_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 
 #include <curl/curl.h>
 
 #ifdef HAVE_SQLITE3
-#include <sqlite3.h>
+#include "sqlite.hpp"
 #endif
 
 // maximum number of idle HTTP handles/connections to keep alive in
 // the handle pool. TODO: make this configurable.
 #define MAX_POOL_SIZE (64)
 
+// default maximum number of transfers to run at once.
+#define DEFAULT_MAX_IN_FLIGHT (64)
+
 namespace avecado { namespace fetch {
 
 namespace {
@@ -49,6 +58,18 @@ size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
   return stream->good() ? total_bytes : 0;
 }
 
+// returns the "host[:port]" part of a URL, or an empty string for
+// URLs without one, such as file: URLs.
+std::string host_of(const std::string &url) {
+  std::string::size_type begin = url.find("://");
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  begin += 3;
+  std::string::size_type end = url.find('/', begin);
+  return url.substr(begin, (end == std::string::npos) ? end : end - begin);
+}
+
 std::vector<std::string> singleton(const std::string &base_url, const std::string &ext) {
   std::vector<std::string> vec;
   vec.push_back((boost::format("%1%/{z}/{x}/{y}.%2%") % base_url % ext).str());
@@ -79,7 +100,8 @@ struct formatter {
 
 struct request {
   request(std::promise<fetch_response> &&p_, const avecado::request &r_, std::string url_)
-    : promise(std::move(p_)), req(r_), z(r_.z), x(r_.x), y(r_.y), stream(new std::stringstream), url(url_) {}
+    : promise(std::move(p_)), req(r_), z(r_.z), x(r_.x), y(r_.y), stream(new std::stringstream), url(url_)
+    , host(host_of(url)), start(std::chrono::steady_clock::now()) {}
 
   request(request &&r)
     : promise(std::move(r.promise))
@@ -87,6 +109,8 @@ struct request {
     , z(r.z), x(r.x), y(r.y)
     , stream(std::move(r.stream))
     , url(std::move(r.url))
+    , host(std::move(r.host))
+    , start(r.start)
     , base_date(std::move(r.base_date))
     , expires(std::move(r.expires))
     , last_modified(std::move(r.last_modified))
@@ -107,6 +131,8 @@ struct request {
   unsigned int z, x, y;
   std::unique_ptr<std::stringstream> stream;
   std::string url;
+  std::string host;
+  std::chrono::steady_clock::time_point start;
   boost::optional<std::time_t> base_date;
   boost::optional<std::time_t> expires;
   boost::optional<std::time_t> last_modified;
@@ -205,158 +231,6 @@ size_t header_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
 }
 
 #ifdef HAVE_SQLITE3
-namespace sqlite {
-struct sqlite_db_deleter {
-  void operator()(sqlite3 *ptr) const {
-    if (ptr != nullptr) {
-      int status = sqlite3_close(ptr);
-      if (status != SQLITE_OK) {
-        // TODO: use logger
-        std::cerr << "Unable to close SQLite3 database\n" << std::flush;
-      }
-    }
-  }
-};
-
-struct sqlite_statement_finalizer {
-  void operator()(sqlite3_stmt *ptr) const {
-    if (ptr != nullptr) {
-      int status = sqlite3_finalize(ptr);
-      if (status != SQLITE_OK) {
-        // TODO: use logger
-        std::cerr << "Unable to finalize SQLite3 statement\n" << std::flush;
-      }
-    }
-  }
-};
-
-struct statement {
-  boost::optional<std::time_t> column_time(int i) {
-    if (sqlite3_column_type(ptr.get(), i) == SQLITE_NULL) {
-      return boost::none;
-    } else {
-      sqlite3_int64 t = sqlite3_column_int64(ptr.get(), i);
-      return std::time_t(t);
-    }
-  }
-
-  boost::optional<std::string> column_text(int i) {
-    if (sqlite3_column_type(ptr.get(), i) == SQLITE_NULL) {
-      return boost::none;
-    } else {
-      const unsigned char *str = sqlite3_column_text(ptr.get(), i);
-      int sz = sqlite3_column_bytes(ptr.get(), i);
-      return std::string((const char *)str, sz);
-    }
-  }
-
-  void column_blob(int i, std::stringstream &stream) {
-    const char *bytes = static_cast<const char *>(sqlite3_column_blob(ptr.get(), i));
-    int sz = sqlite3_column_bytes(ptr.get(), i);
-    stream.write(bytes, sz);
-  }
-
-  bool step() {
-    int status = sqlite3_step(ptr.get());
-    if (status == SQLITE_DONE) { return false; }
-    if (status != SQLITE_ROW) {
-      throw std::runtime_error((boost::format("Unable to step row in query result: %1%") % sqlite3_errmsg(db_for_errors)).str());
-    }
-    return true;
-  }
-
-  void bind_text(int i, const std::string &str) {
-    int sz = str.size();
-    char *strp = static_cast<char *>(malloc(sz));
-    if (strp == nullptr) { throw std::runtime_error("Unable to allocate memory for string copy."); }
-    memcpy(strp, str.c_str(), sz);
-    int status = sqlite3_bind_text(ptr.get(), i, strp, sz, &free);
-    if (status != SQLITE_OK) {
-      free(strp);
-      throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
-    }
-  }
-
-  void bind_text(int i, const boost::optional<std::string> &str) {
-    if (str) {
-      bind_text(i, *str);
-
-    } else {
-      int status = sqlite3_bind_null(ptr.get(), i);
-      if (status != SQLITE_OK) {
-        throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
-      }
-    }
-  }
-
-  void bind_time(int i, std::time_t t) {
-    int status = sqlite3_bind_int64(ptr.get(), i, sqlite3_int64(t));
-    if (status != SQLITE_OK) {
-      throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
-    }
-  }
-
-  void bind_time(int i, boost::optional<std::time_t> t) {
-    if (t) {
-      bind_time(i, *t);
-
-    } else {
-      int status = sqlite3_bind_null(ptr.get(), i);
-      if (status != SQLITE_OK) {
-        throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
-      }
-    }
-  }
-
-  void bind_blob(int i, std::stringstream &stream) {
-    std::string str = stream.str();
-    int sz = str.size();
-    char *strp = static_cast<char *>(malloc(sz));
-    if (strp == nullptr) { throw std::runtime_error("Unable to allocate memory for blob copy."); }
-    memcpy(strp, str.c_str(), sz);
-    int status = sqlite3_bind_blob(ptr.get(), i, strp, sz, &free);
-    if (status != SQLITE_OK) {
-      free(strp);
-      throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
-    }
-  }
-
-private:
-  friend struct db;
-  statement(sqlite3 *db, const std::string &sql) 
-    : ptr(), db_for_errors(db) {
-    const char *tail = nullptr;
-    sqlite3_stmt *ptr_ = nullptr;
-    int status = sqlite3_prepare_v2(db, sql.c_str(), sql.size(), &ptr_, &tail);
-    if (status != SQLITE_OK) {
-      throw std::runtime_error((boost::format("Unable to prepare SQLite3 statement \"%1%\": %2%") % sql % sqlite3_errmsg(db_for_errors)).str());
-    }
-    ptr.reset(ptr_);
-  }
-
-  std::unique_ptr<sqlite3_stmt, sqlite_statement_finalizer> ptr;
-  sqlite3 *db_for_errors; // use for ERRORS only.
-};
-
-struct db {
-  db(const std::string &loc) {
-    sqlite3 *ptr_;
-    int status = sqlite3_open(loc.c_str(), &ptr_);
-    if (status != SQLITE_OK) {
-      throw std::runtime_error((boost::format("Unable to open SQLite3 database \"%1%\": %2%") % loc % sqlite3_errmsg(ptr_)).str());
-    }
-    ptr.reset(ptr_);
-  }
-
-  statement prepare(const std::string &sql) {
-    return statement(ptr.get(), sql);
-  }
-
-private:
-  std::unique_ptr<sqlite3, sqlite_db_deleter> ptr;
-};
-
-} // namespace sqlite
 
 struct cache {
   cache(const std::string &loc) 
@@ -371,6 +245,7 @@ struct cache {
   }
 
   void lookup(std::unique_ptr<request> &req) {
+    std::unique_lock<std::mutex> lock(m_mutex);
     sqlite::statement s(m_db->prepare("select expires, last_modified, etag, body from cache where url=?"));
     s.bind_text(1, req->url);
 
@@ -383,6 +258,8 @@ struct cache {
   }
 
   void write(request *req) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
     // first, normalise the request by collapsing any Cache-control / Expires headers.
     if (req->max_age) {
       req->expires = time(nullptr) + *req->max_age;
@@ -404,6 +281,10 @@ struct cache {
   }
 
 private:
+  // the cache is written from the decode threads and read from
+  // whichever threads are making requests, so access to the
+  // database connection is serialised.
+  std::mutex m_mutex;
   std::unique_ptr<sqlite::db> m_db;
 };
 
@@ -428,9 +309,14 @@ struct http::impl {
 
   void enable_cache(const std::string &cache_location);
   void disable_cache();
+  void set_metrics(std::shared_ptr<fetch_metrics> metrics);
+  void limit_concurrency(std::size_t max_in_flight, std::size_t max_per_host);
 
 private:
   void thread_func();
+  void take_new_requests();
+  bool start_pending(CURLM *curl_multi);
+  bool has_pending() const;
   void run_curl_multi(CURLM *curl_multi, int *running_handles);
   void perform_multi(CURLM *curl_multi, int *running_handles);
   void handle_response(CURLcode res, CURL *curl);
@@ -438,29 +324,55 @@ private:
   CURL *new_handle();
   boost::optional<fetch_result> new_request(CURL *curl, request *r);
   std::string url_for(unsigned int z, unsigned int x, unsigned int y) const;
-  bool setup_response_tile(fetch_response &response, std::unique_ptr<std::stringstream> &stream, unsigned int z, unsigned int x, unsigned int y);
+  static bool setup_response_tile(fetch_response &response, std::unique_ptr<std::stringstream> &stream, unsigned int z, unsigned int x, unsigned int y);
+  static void decode_response(std::shared_ptr<request> req, std::shared_ptr<cache> c,
+                              std::shared_ptr<fetch_metrics> metrics);
 
   const std::vector<std::string> m_url_patterns;
   std::atomic<bool> m_shutdown;
+  // decoding a tile is CPU-bound and can take a while for large
+  // tiles, so it's done on this pool rather than on the cURL thread,
+  // which would otherwise stall all the other transfers. note that
+  // the cURL thread posts to it, so it must outlive that thread.
+  std::unique_ptr<thread_pool> m_decode_pool;
   std::thread m_thread;
   curl_slist *custom_headers;
   std::mutex m_mutex;
   std::list<std::unique_ptr<request> > m_new_requests;
+  std::atomic<std::size_t> m_max_in_flight, m_max_per_host;
+  // these are only touched by the cURL thread. there is one set of
+  // queues per priority, indexed by request_priority, and the
+  // interactive ones are always emptied first.
+  host_queues<std::unique_ptr<request> > m_pending[2];
+  std::size_t m_in_flight;
+  std::map<std::string, std::size_t> m_host_in_flight;
   std::queue<CURL*> m_handle_pool;
   // note: m_cache is *shared* between threads, so it *must* be thread-safe
   std::shared_ptr<cache> m_cache;
+  // optional, and also shared with the decode threads.
+  std::shared_ptr<fetch_metrics> m_metrics;
 };
 
 http::impl::impl(std::vector<std::string> &&patterns)
   : m_url_patterns(patterns)
   , m_shutdown(false)
-  , m_thread(&impl::thread_func, this)
-  , custom_headers(nullptr) {
+  , m_decode_pool(new thread_pool(std::thread::hardware_concurrency()))
+  , m_thread()
+  , custom_headers(nullptr)
+  , m_max_in_flight(DEFAULT_MAX_IN_FLIGHT)
+  , m_max_per_host(0)
+  , m_in_flight(0) {
+  // start the cURL thread only once all the members it uses have
+  // been constructed.
+  m_thread = std::thread(&impl::thread_func, this);
 }
 
 http::impl::~impl() {
   m_shutdown.store(true);
   m_thread.join();
+  // the cURL thread is the only one which posts to the decode pool,
+  // so once it has finished we can drain the pool.
+  m_decode_pool.reset();
   curl_slist_free_all(custom_headers);
 }
 
@@ -469,6 +381,7 @@ void http::impl::start_request(std::promise<fetch_response> &&promise, const ave
     fetch_result err;
     err.status = fetch_status::not_found;
     fetch_response response(err);
+    if (m_metrics) { m_metrics->record_response(response); }
     promise.set_value(std::move(response));
 
   } else {
@@ -479,6 +392,7 @@ void http::impl::start_request(std::promise<fetch_response> &&promise, const ave
     }
 
     if (req->expired()) {
+      if (m_metrics) { m_metrics->add_queued(1); }
       std::unique_lock<std::mutex> lock(m_mutex);
       m_new_requests.emplace_back(std::move(req));
 
@@ -489,6 +403,11 @@ void http::impl::start_request(std::promise<fetch_response> &&promise, const ave
 
       setup_response_tile(response, req->stream, r.z, r.x, r.y);
 
+      if (m_metrics) {
+        m_metrics->record_latency(fetch_metrics::latency_kind::cache_hit,
+                                  std::chrono::steady_clock::now() - req->start);
+        m_metrics->record_response(response);
+      }
       req->promise.set_value(std::move(response));
     }
   }
@@ -499,47 +418,106 @@ void http::impl::thread_func() {
   int running_handles = 0;
 
   while (m_shutdown.load() == false) {
-    std::list<std::unique_ptr<request> > requests;
-    {
-      std::unique_lock<std::mutex> lock(m_mutex);
-      requests.swap(m_new_requests);
+    take_new_requests();
+
+    if (start_pending(curl_multi)) {
+      perform_multi(curl_multi, &running_handles);
     }
 
-    bool added = false;
-    for (auto &ptr : requests) {
+    run_curl_multi(curl_multi, &running_handles);
+  }
+
+  // finish off everything which was queued before shutdown, so that
+  // nobody is left waiting on a future which will never be ready.
+  take_new_requests();
+  while ((running_handles > 0) || has_pending()) {
+    if (start_pending(curl_multi)) {
+      perform_multi(curl_multi, &running_handles);
+    }
+
+    run_curl_multi(curl_multi, &running_handles);
+  }
+
+  while (!m_handle_pool.empty()) {
+    CURL *curl = m_handle_pool.front();
+    m_handle_pool.pop();
+    curl_easy_cleanup(curl);
+  }
+
+  curl_multi_cleanup(curl_multi);
+}
+
+void http::impl::take_new_requests() {
+  std::list<std::unique_ptr<request> > requests;
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    requests.swap(m_new_requests);
+  }
+
+  for (auto &ptr : requests) {
+    const std::size_t priority = static_cast<std::size_t>(ptr->req.priority);
+    const std::string host = ptr->host;
+    m_pending[priority].push(host, std::move(ptr));
+  }
+}
+
+bool http::impl::start_pending(CURLM *curl_multi) {
+  const std::size_t max_in_flight = m_max_in_flight.load();
+  const std::size_t max_per_host = m_max_per_host.load();
+  bool added = false;
+
+  auto host_has_room = [&](const std::string &host) -> bool {
+    if (max_per_host == 0) { return true; }
+    auto itr = m_host_in_flight.find(host);
+    return (itr == m_host_in_flight.end()) || (itr->second < max_per_host);
+  };
+
+  // the queues take one request from each host in turn, so that a
+  // backlog for one host doesn't stop requests to other hosts from
+  // starting.
+  for (auto &queues : m_pending) {
+    std::unique_ptr<request> ptr;
+    while (((max_in_flight == 0) || (m_in_flight < max_in_flight)) &&
+           queues.pop(host_has_room, ptr)) {
       request *req = ptr.release();
+
+      if (m_metrics) { m_metrics->add_queued(-1); }
+
       CURL *curl = new_handle();
       boost::optional<fetch_result> err = new_request(curl, req);
 
       if (err) {
+        if (m_metrics) { m_metrics->record_status(err->status); }
         req->promise.set_value(fetch_response(*err));
         delete req;
         free_handle(curl);
 
       } else {
+        if (m_metrics) { m_metrics->add_in_flight(1); }
+        ++m_in_flight;
+        ++m_host_in_flight[req->host];
         curl_multi_add_handle(curl_multi, curl);
         added = true;
       }
     }
 
-    if (added) {
-      perform_multi(curl_multi, &running_handles);
+    // lower priority requests only get the slots which are left once
+    // the higher priority ones have started.
+    if ((max_in_flight > 0) && (m_in_flight >= max_in_flight)) {
+      break;
     }
-
-    run_curl_multi(curl_multi, &running_handles);
   }
 
-  while (running_handles > 0) {
-    run_curl_multi(curl_multi, &running_handles);
-  }
+  return added;
+}
 
-  while (!m_handle_pool.empty()) {
-    CURL *curl = m_handle_pool.front();
-    m_handle_pool.pop();
-    curl_easy_cleanup(curl);
+bool http::impl::has_pending() const {
+  for (const auto &queues : m_pending) {
+    if (!queues.empty()) {
+      return true;
+    }
   }
-
-  curl_multi_cleanup(curl_multi);
+  return false;
 }
 
 void http::impl::run_curl_multi(CURLM *curl_multi, int *running_handles) {
@@ -619,6 +597,22 @@ void http::impl::handle_response(CURLcode res, CURL *curl) {
   fres.status = fetch_status::server_error;
   fetch_response response(fres);
 
+  --m_in_flight;
+  {
+    auto itr = m_host_in_flight.find(req->host);
+    if ((itr != m_host_in_flight.end()) && (--(itr->second) == 0)) {
+      m_host_in_flight.erase(itr);
+    }
+  }
+
+  if (m_metrics) {
+    double bytes = 0.0;
+    if (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &bytes) == CURLE_OK) {
+      m_metrics->add_bytes(std::uint64_t(bytes));
+    }
+    m_metrics->add_in_flight(-1);
+  }
+
   if (res != CURLE_OK) {
     if (res == CURLE_REMOTE_FILE_NOT_FOUND) {
       fres.status = fetch_status::not_found;
@@ -630,15 +624,19 @@ void http::impl::handle_response(CURLcode res, CURL *curl) {
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code);
 
     if (status_code == 200) {
-      setup_response_tile(response, req->stream, req->z, req->x, req->y);
-      if (m_cache) {
-        m_cache->write(req);
-      }
+      // hand the body off to be decoded and cached on the decode
+      // pool, which also takes ownership of the request.
+      m_decode_pool->post(std::bind(&impl::decode_response,
+                                    std::shared_ptr<request>(req), m_cache, m_metrics));
+      return;
 
     } else if ((status_code == 0) && bal::starts_with(req->url, "file:")) {
-      setup_response_tile(response, req->stream, req->z, req->x, req->y);
       // don't cache if this was a local file - that would just be
       // a waste of disk space.
+      m_decode_pool->post(std::bind(&impl::decode_response,
+                                    std::shared_ptr<request>(req),
+                                    std::shared_ptr<cache>(), m_metrics));
+      return;
 
     } else {
       switch (status_code) {
@@ -653,10 +651,46 @@ void http::impl::handle_response(CURLcode res, CURL *curl) {
     }
   }
 
+  if (m_metrics) {
+    m_metrics->record_latency((fres.status == fetch_status::not_modified)
+                              ? fetch_metrics::latency_kind::revalidated
+                              : fetch_metrics::latency_kind::cache_miss,
+                              std::chrono::steady_clock::now() - req->start);
+    m_metrics->record_response(response);
+  }
+
   req->promise.set_value(std::move(response));
   delete req;
 }
 
+void http::impl::decode_response(std::shared_ptr<request> req, std::shared_ptr<cache> c,
+                                 std::shared_ptr<fetch_metrics> metrics) {
+  fetch_result fres;
+  fres.status = fetch_status::server_error;
+  fetch_response response(fres);
+
+  setup_response_tile(response, req->stream, req->z, req->x, req->y);
+
+  // the cache is only an optimisation, so failing to write to it
+  // doesn't fail the fetch. it's counted, so that it can be noticed.
+  if (c) {
+    try {
+      c->write(req.get());
+
+    } catch (const std::exception &) {
+      if (metrics) { metrics->record_cache_write_error(); }
+    }
+  }
+
+  if (metrics) {
+    metrics->record_latency(fetch_metrics::latency_kind::cache_miss,
+                            std::chrono::steady_clock::now() - req->start);
+    metrics->record_response(response);
+  }
+
+  req->promise.set_value(std::move(response));
+}
+
 bool http::impl::setup_response_tile(fetch_response &response, std::unique_ptr<std::stringstream> &stream, unsigned int z, unsigned int x, unsigned int y) {
   std::unique_ptr<tile> ptr(new tile(z, x, y));
   bool ok = true;
@@ -717,6 +751,14 @@ boost::optional<fetch_result> http::impl::new_request(CURL *curl, request *r) {
   res = curl_easy_setopt(curl, CURLOPT_HEADERDATA, r);
   if (res != CURLE_OK) { return err; }
 
+  // tiles are read through a gzip stream, so ask for them gzipped, but
+  // don't let cURL inflate them.
+  res = curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
+  if (res != CURLE_OK) { return err; }
+
+  res = curl_easy_setopt(curl, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+  if (res != CURLE_OK) { return err; }
+
   if (r->req.etag) {
     std::string header = (boost::format("If-None-Match: \"%1%\"") % (*r->req.etag)).str();
     custom_headers = curl_slist_append(custom_headers, header.c_str());
@@ -750,6 +792,15 @@ void http::impl::disable_cache() {
   m_cache.reset();
 }
 
+void http::impl::set_metrics(std::shared_ptr<fetch_metrics> metrics) {
+  m_metrics = metrics;
+}
+
+void http::impl::limit_concurrency(std::size_t max_in_flight, std::size_t max_per_host) {
+  m_max_in_flight.store(max_in_flight);
+  m_max_per_host.store(max_per_host);
+}
+
 http::http(const std::string &base_url, const std::string &ext)
   : m_impl(new impl(singleton(base_url, ext))) {
 }
@@ -776,4 +827,12 @@ void http::disable_cache() {
   m_impl->disable_cache();
 }
 
+void http::set_metrics(std::shared_ptr<fetch_metrics> metrics) {
+  m_impl->set_metrics(metrics);
+}
+
+void http::limit_concurrency(std::size_t max_in_flight, std::size_t max_per_host) {
+  m_impl->limit_concurrency(max_in_flight, max_per_host);
+}
+
 } } // namespace avecado::fetch
@@ -1,11 +1,122 @@
 #include "fetch/overzoom.hpp"
+#include "fetch_metrics.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// maximum number of missing tiles to remember at any one zoom.
+#define MAX_MISSING_PER_ZOOM (1 << 20)
 
 namespace avecado { namespace fetch {
 
+namespace {
+
+// the request for the tile at zoom `z` which contains the requested
+// tile, which must be at a zoom of at least `z`.
+request zoom_out(const request &r, int z) {
+  request parent(r);
+  parent.x >>= (parent.z - z);
+  parent.y >>= (parent.z - z);
+  parent.z = z;
+  return parent;
+}
+
+} // anonymous namespace
+
+/* Set of tiles which were recently not found, with an expiry time
+ * for each. This is shared between the threads making requests and
+ * the ones completing them, so access is serialised.
+ */
+struct overzoom::missing_tiles {
+  typedef std::chrono::steady_clock clock;
+
+  explicit missing_tiles(std::chrono::seconds ttl)
+    : m_ttl(ttl) {
+  }
+
+  void set_ttl(std::chrono::seconds ttl) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_ttl = ttl;
+    if (m_ttl.count() <= 0) {
+      m_zooms.clear();
+    }
+  }
+
+  void insert(int z, int x, int y) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_ttl.count() <= 0) { return; }
+
+    if (m_zooms.size() <= std::size_t(z)) {
+      m_zooms.resize(z + 1);
+    }
+
+    const clock::time_point now = clock::now();
+    zoom_set &tiles = m_zooms[z];
+    if (tiles.size() >= MAX_MISSING_PER_ZOOM) {
+      expire(tiles, now);
+      // if everything is still live, start again rather than letting
+      // the set grow without bound.
+      if (tiles.size() >= MAX_MISSING_PER_ZOOM) {
+        tiles.clear();
+      }
+    }
+
+    tiles[key(x, y)] = now + m_ttl;
+  }
+
+  // returns true if the tile, or any of its ancestors down to (but
+  // not including) `min_z`, is known to be missing.
+  bool contains(int z, int x, int y, int min_z) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const clock::time_point now = clock::now();
+
+    for (; z > min_z; --z, x >>= 1, y >>= 1) {
+      if (std::size_t(z) >= m_zooms.size()) { continue; }
+
+      zoom_set &tiles = m_zooms[z];
+      auto itr = tiles.find(key(x, y));
+      if (itr != tiles.end()) {
+        if (itr->second > now) {
+          return true;
+        }
+        tiles.erase(itr);
+      }
+    }
+
+    return false;
+  }
+
+private:
+  typedef std::unordered_map<std::uint64_t, clock::time_point> zoom_set;
+
+  static std::uint64_t key(int x, int y) {
+    return (std::uint64_t(std::uint32_t(x)) << 32) | std::uint64_t(std::uint32_t(y));
+  }
+
+  static void expire(zoom_set &tiles, clock::time_point now) {
+    auto itr = tiles.begin();
+    while (itr != tiles.end()) {
+      if (itr->second <= now) {
+        itr = tiles.erase(itr);
+      } else {
+        ++itr;
+      }
+    }
+  }
+
+  std::mutex m_mutex;
+  std::chrono::seconds m_ttl;
+  std::vector<zoom_set> m_zooms;
+};
+
 overzoom::overzoom(std::unique_ptr<fetcher> &&source, int max_zoom, boost::optional<int> mask_zoom)
   : m_source(std::move(source))
   , m_max_zoom(max_zoom)
-  , m_mask_zoom(mask_zoom) {
+  , m_mask_zoom(mask_zoom)
+  , m_missing(new missing_tiles(std::chrono::minutes(5))) {
 }
 
 overzoom::~overzoom() {
@@ -17,9 +128,18 @@ std::future<fetch_response> overzoom::operator()(const request &r) {
   if (req.z > m_max_zoom) {
     // zoom "out" to max zoom, as we're guaranteed not to find
     // any tiles a z > max zoom.
-    req.x >>= (req.z - m_max_zoom);
-    req.y >>= (req.z - m_max_zoom);
-    req.z = m_max_zoom;
+    req = zoom_out(req, m_max_zoom);
+
+    if (m_metrics) { m_metrics->record_overzoom(); }
+  }
+
+  // if this tile, or one of its parents, was recently not found then
+  // there's no point asking for it again - go straight to the mask
+  // zoom tile.
+  if (bool(m_mask_zoom) && (req.z > *m_mask_zoom) &&
+      m_missing->contains(req.z, req.x, req.y, *m_mask_zoom)) {
+    if (m_metrics) { m_metrics->record_mask_fallback(); }
+    return (*m_source)(zoom_out(req, *m_mask_zoom));
   }
 
   std::future<fetch_response> upstream_future((*m_source)(req));
@@ -33,17 +153,22 @@ std::future<fetch_response> overzoom::operator()(const request &r) {
           (req.z > *m_mask_zoom) &&
           resp.is_right() &&
           (resp.right().status == fetch_status::not_found)) {
-        const int mask_zoom = *m_mask_zoom;
-        request masked(req);
-        masked.x >>= masked.z - mask_zoom;
-        masked.y >>= masked.z - mask_zoom;
-        masked.z = mask_zoom;
+        m_missing->insert(req.z, req.x, req.y);
 
-        resp = ((*m_source)(masked)).get();
+        if (m_metrics) { m_metrics->record_mask_fallback(); }
+        resp = ((*m_source)(zoom_out(req, *m_mask_zoom))).get();
       }
 
       return resp;
     }, std::move(upstream_future));
 }
 
+void overzoom::set_metrics(std::shared_ptr<fetch_metrics> metrics) {
+  m_metrics = metrics;
+}
+
+void overzoom::set_missing_ttl(std::chrono::seconds ttl) {
+  m_missing->set_ttl(ttl);
+}
+
 } } // namespace avecado::fetch
@@ -0,0 +1,206 @@
+#include "fetch_metrics.hpp"
+
+namespace avecado {
+
+const unsigned int latency_histogram::bounds_ms[latency_histogram::num_bounds] = {
+  1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+latency_histogram::latency_histogram()
+  : m_count(0), m_sum_us(0) {
+  for (auto &b : m_buckets) {
+    b.store(0);
+  }
+}
+
+void latency_histogram::record(std::chrono::steady_clock::duration d) {
+  const std::uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+
+  std::size_t i = 0;
+  while ((i < num_bounds) && (us > std::uint64_t(bounds_ms[i]) * 1000)) {
+    ++i;
+  }
+
+  m_buckets[i].fetch_add(1, std::memory_order_relaxed);
+  m_count.fetch_add(1, std::memory_order_relaxed);
+  m_sum_us.fetch_add(us, std::memory_order_relaxed);
+}
+
+std::uint64_t latency_histogram::count() const {
+  return m_count.load(std::memory_order_relaxed);
+}
+
+double latency_histogram::sum_ms() const {
+  return double(m_sum_us.load(std::memory_order_relaxed)) / 1000.0;
+}
+
+std::uint64_t latency_histogram::bucket(std::size_t i) const {
+  return m_buckets[i].load(std::memory_order_relaxed);
+}
+
+fetch_metrics::fetch_metrics()
+  : m_ok(0)
+  , m_not_modified(0), m_bad_request(0), m_not_found(0)
+  , m_server_error(0), m_not_implemented(0)
+  , m_bytes(0)
+  , m_queued(0), m_in_flight(0)
+  , m_overzooms(0), m_mask_fallbacks(0), m_cache_write_errors(0) {
+}
+
+void fetch_metrics::record_response(const fetch_response &response) {
+  if (response.is_left()) {
+    record_ok();
+  } else {
+    record_status(response.right().status);
+  }
+}
+
+void fetch_metrics::record_status(fetch_status s) {
+  status_counter(s).fetch_add(1, std::memory_order_relaxed);
+}
+
+void fetch_metrics::record_ok() {
+  m_ok.fetch_add(1, std::memory_order_relaxed);
+}
+
+void fetch_metrics::record_latency(latency_kind kind, std::chrono::steady_clock::duration d) {
+  switch (kind) {
+  case latency_kind::cache_hit:   m_cache_hit.record(d);   break;
+  case latency_kind::cache_miss:  m_cache_miss.record(d);  break;
+  case latency_kind::revalidated: m_revalidated.record(d); break;
+  }
+}
+
+void fetch_metrics::add_bytes(std::uint64_t bytes) {
+  m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void fetch_metrics::add_queued(std::int64_t delta) {
+  m_queued.fetch_add(delta, std::memory_order_relaxed);
+}
+
+void fetch_metrics::add_in_flight(std::int64_t delta) {
+  m_in_flight.fetch_add(delta, std::memory_order_relaxed);
+}
+
+void fetch_metrics::record_overzoom() {
+  m_overzooms.fetch_add(1, std::memory_order_relaxed);
+}
+
+void fetch_metrics::record_mask_fallback() {
+  m_mask_fallbacks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void fetch_metrics::record_cache_write_error() {
+  m_cache_write_errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::uint64_t fetch_metrics::ok() const {
+  return m_ok.load(std::memory_order_relaxed);
+}
+
+std::uint64_t fetch_metrics::status(fetch_status s) const {
+  switch (s) {
+  case fetch_status::not_modified:    return m_not_modified.load(std::memory_order_relaxed);
+  case fetch_status::bad_request:     return m_bad_request.load(std::memory_order_relaxed);
+  case fetch_status::not_found:       return m_not_found.load(std::memory_order_relaxed);
+  case fetch_status::not_implemented: return m_not_implemented.load(std::memory_order_relaxed);
+  default:
+    return m_server_error.load(std::memory_order_relaxed);
+  }
+}
+
+const latency_histogram &fetch_metrics::latency(latency_kind kind) const {
+  switch (kind) {
+  case latency_kind::cache_hit:  return m_cache_hit;
+  case latency_kind::cache_miss: return m_cache_miss;
+  default:
+    return m_revalidated;
+  }
+}
+
+std::uint64_t fetch_metrics::bytes() const {
+  return m_bytes.load(std::memory_order_relaxed);
+}
+
+std::int64_t fetch_metrics::queued() const {
+  return m_queued.load(std::memory_order_relaxed);
+}
+
+std::int64_t fetch_metrics::in_flight() const {
+  return m_in_flight.load(std::memory_order_relaxed);
+}
+
+std::uint64_t fetch_metrics::overzooms() const {
+  return m_overzooms.load(std::memory_order_relaxed);
+}
+
+std::uint64_t fetch_metrics::mask_fallbacks() const {
+  return m_mask_fallbacks.load(std::memory_order_relaxed);
+}
+
+std::uint64_t fetch_metrics::cache_write_errors() const {
+  return m_cache_write_errors.load(std::memory_order_relaxed);
+}
+
+std::atomic<std::uint64_t> &fetch_metrics::status_counter(fetch_status s) {
+  switch (s) {
+  case fetch_status::not_modified:    return m_not_modified;
+  case fetch_status::bad_request:     return m_bad_request;
+  case fetch_status::not_found:       return m_not_found;
+  case fetch_status::not_implemented: return m_not_implemented;
+  default:
+    // anything unexpected is counted as a server error.
+    return m_server_error;
+  }
+}
+
+namespace {
+
+// as with Prometheus histograms, each "le" line counts the samples no
+// slower than its bound, so includes all those of the faster buckets.
+void write_histogram(std::ostream &out, const char *name, const latency_histogram &h) {
+  std::uint64_t cumulative = 0;
+  for (std::size_t i = 0; i < latency_histogram::num_bounds; ++i) {
+    cumulative += h.bucket(i);
+    out << "fetch_latency_" << name << "_le_" << latency_histogram::bounds_ms[i]
+        << "ms " << cumulative << "\n";
+  }
+  cumulative += h.bucket(latency_histogram::num_bounds);
+  out << "fetch_latency_" << name << "_le_inf " << cumulative << "\n";
+  out << "fetch_latency_" << name << "_count " << h.count() << "\n";
+  out << "fetch_latency_" << name << "_sum_ms " << h.sum_ms() << "\n";
+}
+
+} // anonymous namespace
+
+std::ostream &operator<<(std::ostream &out, const fetch_metrics &m) {
+  typedef fetch_metrics::latency_kind kind;
+
+  out << "fetch_status_ok " << m.ok() << "\n";
+  out << "fetch_status_not_modified " << m.status(fetch_status::not_modified) << "\n";
+  out << "fetch_status_bad_request " << m.status(fetch_status::bad_request) << "\n";
+  out << "fetch_status_not_found " << m.status(fetch_status::not_found) << "\n";
+  out << "fetch_status_server_error " << m.status(fetch_status::server_error) << "\n";
+  out << "fetch_status_not_implemented " << m.status(fetch_status::not_implemented) << "\n";
+
+  const std::uint64_t hits = m.latency(kind::cache_hit).count();
+  const std::uint64_t total = hits + m.latency(kind::cache_miss).count()
+    + m.latency(kind::revalidated).count();
+  out << "fetch_cache_hit_ratio " << ((total > 0) ? double(hits) / double(total) : 0.0) << "\n";
+
+  write_histogram(out, "cache_hit", m.latency(kind::cache_hit));
+  write_histogram(out, "cache_miss", m.latency(kind::cache_miss));
+  write_histogram(out, "revalidated", m.latency(kind::revalidated));
+
+  out << "fetch_bytes " << m.bytes() << "\n";
+  out << "fetch_queued " << m.queued() << "\n";
+  out << "fetch_in_flight " << m.in_flight() << "\n";
+  out << "fetch_overzooms " << m.overzooms() << "\n";
+  out << "fetch_mask_fallbacks " << m.mask_fallbacks() << "\n";
+  out << "fetch_cache_write_errors " << m.cache_write_errors() << "\n";
+
+  return out;
+}
+
+} // namespace avecado
@@ -4,7 +4,8 @@ namespace avecado {
 
 request::request(int z_, int x_, int y_)
   : z(z_), x(x_), y(y_),
-    etag(boost::none), if_modified_since(boost::none) {
+    etag(boost::none), if_modified_since(boost::none),
+    priority(request_priority::interactive) {
 }
 
 fetcher::~fetcher() {
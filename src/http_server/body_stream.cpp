@@ -0,0 +1,111 @@
+#include "http_server/body_stream.hpp"
+
+namespace http {
+namespace server3 {
+
+body_stream::body_stream(std::size_t high_water)
+  : high_water_(high_water),
+    state_(open),
+    cancelled_(false)
+{
+}
+
+void body_stream::write(const std::string &data)
+{
+  callback ready;
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    if ((state_ != open) || cancelled_ || data.empty())
+    {
+      return;
+    }
+    data_.append(data);
+    ready.swap(ready_);
+  }
+
+  // Called outside the lock, as it may read straight away.
+  if (ready) { ready(); }
+}
+
+void body_stream::close()
+{
+  finish(closed);
+}
+
+void body_stream::abort()
+{
+  finish(aborted);
+}
+
+bool body_stream::stopped() const
+{
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  return (state_ == aborted) || cancelled_;
+}
+
+bool body_stream::wait_for_room(callback resume)
+{
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  if ((high_water_ == 0) || (data_.size() < high_water_) ||
+      (state_ != open) || cancelled_)
+  {
+    return true;
+  }
+  waiting_.push_back(std::move(resume));
+  return false;
+}
+
+body_stream::state_type body_stream::read(std::string &data, callback ready)
+{
+  std::vector<callback> resume;
+  state_type state;
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    data.clear();
+    data.swap(data_);
+    if (data.empty() && (state_ == open))
+    {
+      ready_ = std::move(ready);
+    }
+    resume.swap(waiting_);
+    state = state_;
+  }
+
+  // Everything waiting has been taken, so the writers can carry on.
+  for (auto &r : resume) { r(); }
+  return state;
+}
+
+void body_stream::cancel()
+{
+  std::vector<callback> dropped;
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    cancelled_ = true;
+    data_.clear();
+    ready_ = callback();
+    dropped.swap(waiting_);
+  }
+}
+
+void body_stream::finish(state_type state)
+{
+  callback ready;
+  std::vector<callback> dropped;
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    if (state_ != open)
+    {
+      return;
+    }
+    state_ = state;
+    ready.swap(ready_);
+    // Nothing more can be written, so there's nothing to resume.
+    dropped.swap(waiting_);
+  }
+
+  if (ready) { ready(); }
+}
+
+} // namespace server3
+} // namespace http
@@ -0,0 +1,193 @@
+#include "http_server/config_diff.hpp"
+
+#include <map>
+#include <vector>
+#include <limits>
+#include <sstream>
+#include <algorithm>
+#include <boost/optional.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+
+namespace pt = boost::property_tree;
+
+namespace http { namespace server3 {
+
+namespace {
+
+// scale denominator of a 256 pixel tile at zoom 0, with Mapnik's
+// standard 0.28mm pixels.
+const double ZOOM_0_SCALE_DENOMINATOR = 559082264.028;
+
+zoom_set all_zooms() {
+  zoom_set zooms;
+  zooms.set();
+  return zooms;
+}
+
+// a layer's definition, along with those of the styles it uses, which
+// together determine what it puts in a tile.
+struct layer_info {
+  pt::ptree layer;
+  std::vector<pt::ptree> styles;
+};
+
+// the zooms at which a layer can be seen. the conversion from zoom to
+// scale denominator depends on the scale factor, so be generous and
+// include anything within a factor of two either side.
+zoom_set visible_zooms(const pt::ptree &layer) {
+  const double min_scale = layer.get<double>("<xmlattr>.minimum-scale-denominator", 0.0);
+  const double max_scale = layer.get<double>("<xmlattr>.maximum-scale-denominator",
+                                             std::numeric_limits<double>::max());
+
+  zoom_set zooms;
+  for (int z = 0; z <= CONFIG_MAX_ZOOM; ++z) {
+    const double scale = ZOOM_0_SCALE_DENOMINATOR / double(1 << z);
+    if ((scale * 2.0 >= min_scale) && (scale / 2.0 <= max_scale)) {
+      zooms.set(z);
+    }
+  }
+  return zooms;
+}
+
+// splits a parsed map into its layers, in order, and everything which
+// isn't a layer or a style. returns false if it isn't a map at all.
+bool split_map(const pt::ptree &doc, std::vector<std::pair<std::string, layer_info> > &layers,
+               pt::ptree &rest) {
+  boost::optional<const pt::ptree &> map = doc.get_child_optional("Map");
+  if (!map) {
+    return false;
+  }
+
+  std::map<std::string, pt::ptree> styles;
+  for (const auto &child : *map) {
+    if (child.first == "Style") {
+      styles[child.second.get<std::string>("<xmlattr>.name", "")] = child.second;
+    }
+  }
+
+  for (const auto &child : *map) {
+    if (child.first == "Layer") {
+      layer_info info;
+      info.layer = child.second;
+      for (const auto &layer_child : child.second) {
+        if (layer_child.first == "StyleName") {
+          auto itr = styles.find(layer_child.second.data());
+          info.styles.push_back((itr != styles.end()) ? itr->second : pt::ptree());
+        }
+      }
+      layers.push_back(std::make_pair(child.second.get<std::string>("<xmlattr>.name", ""), info));
+
+    } else if (child.first != "Style") {
+      rest.push_back(child);
+    }
+  }
+
+  return true;
+}
+
+bool operator==(const layer_info &a, const layer_info &b) {
+  return (a.layer == b.layer) && (a.styles == b.styles);
+}
+
+// add the zooms covered by each of the zoom ranges of a layer's
+// post-processor configuration.
+void add_izer_zooms(const pt::ptree &ranges, zoom_set &zooms) {
+  for (const auto &range : ranges) {
+    const int minzoom = std::max(range.second.get<int>("minzoom", 0), 0);
+    const int maxzoom = std::min(range.second.get<int>("maxzoom", CONFIG_MAX_ZOOM), CONFIG_MAX_ZOOM);
+    for (int z = minzoom; z <= maxzoom; ++z) {
+      zooms.set(z);
+    }
+  }
+}
+
+} // anonymous namespace
+
+zoom_set changed_zooms_for_map(const std::string &old_xml, const std::string &new_xml) {
+  if (old_xml == new_xml) {
+    return zoom_set();
+  }
+
+  std::vector<std::pair<std::string, layer_info> > old_layers, new_layers;
+  pt::ptree old_rest, new_rest;
+
+  try {
+    pt::ptree old_doc, new_doc;
+    std::istringstream old_in(old_xml), new_in(new_xml);
+    pt::read_xml(old_in, old_doc, pt::xml_parser::no_comments | pt::xml_parser::trim_whitespace);
+    pt::read_xml(new_in, new_doc, pt::xml_parser::no_comments | pt::xml_parser::trim_whitespace);
+
+    if (!split_map(old_doc, old_layers, old_rest) ||
+        !split_map(new_doc, new_layers, new_rest)) {
+      return all_zooms();
+    }
+
+  } catch (const pt::ptree_error &) {
+    // if it can't be understood, it can't be compared.
+    return all_zooms();
+  }
+
+  // anything outside of the layers and styles, such as the projection
+  // or fonts, could change every tile.
+  if (old_rest != new_rest) {
+    return all_zooms();
+  }
+
+  std::map<std::string, const layer_info *> old_by_name, new_by_name;
+  for (const auto &l : old_layers) { old_by_name[l.first] = &l.second; }
+  for (const auto &l : new_layers) { new_by_name[l.first] = &l.second; }
+
+  // layers which are in both maps must still be in the same order, or
+  // the order of features in every tile could change.
+  std::vector<std::string> old_order, new_order;
+  for (const auto &l : old_layers) {
+    if (new_by_name.count(l.first)) { old_order.push_back(l.first); }
+  }
+  for (const auto &l : new_layers) {
+    if (old_by_name.count(l.first)) { new_order.push_back(l.first); }
+  }
+  if (old_order != new_order) {
+    return all_zooms();
+  }
+
+  zoom_set zooms;
+  for (const auto &l : old_layers) {
+    auto itr = new_by_name.find(l.first);
+    if ((itr == new_by_name.end()) || !(l.second == *(itr->second))) {
+      zooms |= visible_zooms(l.second.layer);
+    }
+  }
+  for (const auto &l : new_layers) {
+    auto itr = old_by_name.find(l.first);
+    if ((itr == old_by_name.end()) || !(l.second == *(itr->second))) {
+      zooms |= visible_zooms(l.second.layer);
+    }
+  }
+  return zooms;
+}
+
+zoom_set changed_zooms_for_izers(const pt::ptree &old_config, const pt::ptree &new_config) {
+  zoom_set zooms;
+
+  try {
+    for (const auto &layer : old_config) {
+      boost::optional<const pt::ptree &> other = new_config.get_child_optional(pt::ptree::path_type(layer.first, '\0'));
+      if (!other || (*other != layer.second)) {
+        add_izer_zooms(layer.second, zooms);
+      }
+    }
+    for (const auto &layer : new_config) {
+      boost::optional<const pt::ptree &> other = old_config.get_child_optional(pt::ptree::path_type(layer.first, '\0'));
+      if (!other || (*other != layer.second)) {
+        add_izer_zooms(layer.second, zooms);
+      }
+    }
+
+  } catch (const pt::ptree_error &) {
+    return all_zooms();
+  }
+
+  return zooms;
+}
+
+} } // namespace http::server3
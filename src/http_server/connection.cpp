@@ -9,18 +9,112 @@
 //
 
 #include "http_server/connection.hpp"
+#include <algorithm>
 #include <vector>
+#include <sstream>
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/find.hpp>
 #include "http_server/request_handler.hpp"
 
 namespace http {
 namespace server3 {
 
+namespace {
+
+// how long clients which are turned away because the server is
+// overloaded are told to wait before trying again.
+const std::string RETRY_AFTER_SECONDS = "1";
+
+// the end of a chunk, and the chunk which ends a chunked body.
+const std::string CRLF = "\r\n";
+const std::string LAST_CHUNK = "0\r\n\r\n";
+
+bool is_http_1_1(const request &req)
+{
+  return (req.http_version_major > 1) ||
+    ((req.http_version_major == 1) && (req.http_version_minor >= 1));
+}
+
+// HTTP/1.1 connections are persistent unless the client asks for them to
+// be closed, HTTP/1.0 connections are only persistent if the client asks
+// for them to be.
+bool wants_keep_alive(const request &req)
+{
+  const bool http_1_1 = is_http_1_1(req);
+
+  for (const header &h : req.headers)
+  {
+    if (boost::iequals(h.name, "Connection"))
+    {
+      if (boost::ifind_first(h.value, "close"))
+      {
+        return false;
+      }
+      if (boost::ifind_first(h.value, "keep-alive"))
+      {
+        return true;
+      }
+    }
+  }
+
+  return http_1_1;
+}
+
+// request bodies longer than this aren't worth reading just to throw them
+// away, so the connection is closed instead.
+const std::size_t MAX_DISCARDED_BODY = 1 << 20;
+
+// sets length to the size of the request's body, if any. returns false
+// if the end of the body can't be found, e.g: because it is chunked, in
+// which case the rest of the stream can't be used for further requests.
+bool request_body_length(const request &req, std::size_t &length)
+{
+  length = 0;
+
+  for (const header &h : req.headers)
+  {
+    if (boost::iequals(h.name, "Transfer-Encoding"))
+    {
+      return false;
+    }
+    if (boost::iequals(h.name, "Content-Length"))
+    {
+      try
+      {
+        length = boost::lexical_cast<std::size_t>(h.value);
+      }
+      catch (const boost::bad_lexical_cast &)
+      {
+        return false;
+      }
+    }
+  }
+
+  return length <= MAX_DISCARDED_BODY;
+}
+
+} // anonymous namespace
+
 connection::connection(boost::asio::io_service& io_service,
-                       boost::thread_specific_ptr<request_handler>& handler_ptr)
+                       boost::thread_specific_ptr<request_handler>& handler_ptr,
+                       unsigned int keepalive_timeout,
+                       render_pool *pool,
+                       server_metrics *metrics)
   : strand_(io_service),
     socket_(io_service),
-    request_handler_ptr_(handler_ptr)
+    request_handler_ptr_(handler_ptr),
+    render_pool_(pool),
+    metrics_(metrics),
+    timer_(io_service),
+    keepalive_timeout_(keepalive_timeout),
+    buffer_begin_(0),
+    buffer_end_(0),
+    body_remaining_(0),
+    keep_alive_(false),
+    chunked_(false),
+    stream_done_(false)
 {
 }
 
@@ -31,6 +125,22 @@ boost::asio::ip::tcp::socket& connection::socket()
 
 void connection::start()
 {
+  start_read();
+}
+
+void connection::start_read()
+{
+  // Only idle connections, those waiting on the client, are timed out. The
+  // first request on a connection gets the same allowance as later ones.
+  if (keepalive_timeout_ > 0)
+  {
+    timer_.expires_from_now(boost::posix_time::seconds(keepalive_timeout_));
+    timer_.async_wait(
+        strand_.wrap(
+          boost::bind(&connection::handle_timeout, shared_from_this(),
+            boost::asio::placeholders::error)));
+  }
+
   socket_.async_read_some(boost::asio::buffer(buffer_),
       strand_.wrap(
         boost::bind(&connection::handle_read, shared_from_this(),
@@ -38,41 +148,184 @@ void connection::start()
           boost::asio::placeholders::bytes_transferred)));
 }
 
-void connection::handle_read(const boost::system::error_code& e,
-                             std::size_t bytes_transferred)
+void connection::process_buffer()
 {
-  if (!e)
+  // None of the handlers look at request bodies, but they have to be read
+  // past to find the start of the next request.
+  const std::size_t skip = std::min(body_remaining_, buffer_end_ - buffer_begin_);
+  buffer_begin_ += skip;
+  body_remaining_ -= skip;
+  if ((body_remaining_ > 0) || (buffer_begin_ == buffer_end_))
+  {
+    start_read();
+    return;
+  }
+
+  boost::tribool result;
+  char *consumed = NULL;
+  boost::tie(result, consumed) = request_parser_.parse(
+      request_, buffer_.data() + buffer_begin_, buffer_.data() + buffer_end_);
+  buffer_begin_ = consumed - buffer_.data();
+
+  if (result)
+  {
+    keep_alive_ = (keepalive_timeout_ > 0) && wants_keep_alive(request_) &&
+      request_body_length(request_, body_remaining_);
+    handle_request();
+  }
+  else if (!result)
+  {
+    // The rest of the stream can't be trusted once parsing has failed.
+    keep_alive_ = false;
+    reply_ = reply::stock_reply(reply::bad_request);
+    if (metrics_) { metrics_->record_request(reply_.status, -1); }
+    start_write();
+  }
+  else
   {
-    boost::tribool result;
-    boost::tie(result, boost::tuples::ignore) = request_parser_.parse(
-        request_, buffer_.data(), buffer_.data() + bytes_transferred);
+    start_read();
+  }
+}
+
+void connection::handle_request()
+{
+  reply_ = reply();
+
+  if (!render_pool_)
+  {
+    request_handler_ptr_->handle_request(request_, reply_);
+    start_write();
+    return;
+  }
+
+  // Not idle while the request is being handled, so park the timer.
+  timer_.expires_at(boost::posix_time::pos_infin);
 
-    if (result)
+  connection_ptr self = shared_from_this();
+  if (!render_pool_->try_post(
+        [self](request_handler &handler) { self->render(handler); }))
+  {
+    // Overloaded, so shed the request now rather than leaving the client
+    // waiting behind a queue which isn't getting any shorter.
+    reply_ = reply::stock_reply(reply::service_unavailable);
+    reply_.append_header("Retry-After", RETRY_AFTER_SECONDS);
+    if (metrics_) { metrics_->record_request(reply_.status, -1); }
+    start_write();
+  }
+}
+
+void connection::render(request_handler &handler)
+{
+  try
+  {
+    handler.handle_request(request_, reply_);
+  }
+  catch (...)
+  {
+    reply_ = reply::stock_reply(reply::internal_server_error);
+  }
+
+  // Back to the connection's strand for the network I/O.
+  strand_.post(boost::bind(&connection::start_write, shared_from_this()));
+}
+
+void connection::start_write()
+{
+  // Not idle while replying, so park the timer.
+  timer_.expires_at(boost::posix_time::pos_infin);
+
+  if (reply_.stream)
+  {
+    // Without chunks, the only way to mark the end of the body is to
+    // close the connection.
+    chunked_ = is_http_1_1(request_);
+    stream_done_ = false;
+    if (chunked_)
+    {
+      reply_.header_block.append("Transfer-Encoding: chunked\r\n");
+    }
+    else
+    {
+      keep_alive_ = false;
+    }
+  }
+
+  reply_.header_block.append(keep_alive_ ?
+                             "Connection: keep-alive\r\n" : "Connection: close\r\n");
+
+  write_start_ = server_metrics::clock::now();
+  boost::asio::async_write(socket_, reply_.to_buffers(),
+      strand_.wrap(
+        boost::bind(&connection::handle_write, shared_from_this(),
+          boost::asio::placeholders::error)));
+}
+
+void connection::write_stream()
+{
+  connection_ptr self = shared_from_this();
+  const body_stream::state_type state = reply_.stream->read(stream_data_,
+      [self]() { self->strand_.post(boost::bind(&connection::write_stream, self)); });
+
+  std::vector<boost::asio::const_buffer> buffers;
+  if (!stream_data_.empty())
+  {
+    if (chunked_)
     {
-      request_handler_ptr_->handle_request(request_, reply_);
-      boost::asio::async_write(socket_, reply_.to_buffers(),
-          strand_.wrap(
-            boost::bind(&connection::handle_write, shared_from_this(),
-              boost::asio::placeholders::error)));
+      std::ostringstream head;
+      head << std::hex << stream_data_.size() << "\r\n";
+      chunk_head_ = head.str();
+      buffers.push_back(boost::asio::buffer(chunk_head_));
+      buffers.push_back(boost::asio::buffer(stream_data_));
+      buffers.push_back(boost::asio::buffer(CRLF));
     }
-    else if (!result)
+    else
     {
-      reply_ = reply::stock_reply(reply::bad_request);
-      boost::asio::async_write(socket_, reply_.to_buffers(),
-          strand_.wrap(
-            boost::bind(&connection::handle_write, shared_from_this(),
-              boost::asio::placeholders::error)));
+      buffers.push_back(boost::asio::buffer(stream_data_));
+    }
+  }
+  else if (state == body_stream::open)
+  {
+    // Woken by the stream when there's more.
+    return;
+  }
+  else
+  {
+    stream_done_ = true;
+    if ((state == body_stream::closed) && chunked_)
+    {
+      buffers.push_back(boost::asio::buffer(LAST_CHUNK));
     }
     else
     {
-      socket_.async_read_some(boost::asio::buffer(buffer_),
-          strand_.wrap(
-            boost::bind(&connection::handle_read, shared_from_this(),
-              boost::asio::placeholders::error,
-              boost::asio::placeholders::bytes_transferred)));
+      // Otherwise the body ends with the connection. This is how an
+      // aborted chunked body is cut short, so that the client can tell.
+      keep_alive_ = false;
+      handle_write(boost::system::error_code());
+      return;
     }
   }
 
+  boost::asio::async_write(socket_, buffers,
+      strand_.wrap(
+        boost::bind(&connection::handle_write, self,
+          boost::asio::placeholders::error)));
+}
+
+void connection::handle_read(const boost::system::error_code& e,
+                             std::size_t bytes_transferred)
+{
+  if (!e)
+  {
+    buffer_begin_ = 0;
+    buffer_end_ = bytes_transferred;
+    process_buffer();
+  }
+  else
+  {
+    // Don't let the idle timer keep the connection object alive.
+    timer_.expires_at(boost::posix_time::pos_infin);
+  }
+
   // If an error occurs then no new asynchronous operations are started. This
   // means that all shared_ptr references to the connection object will
   // disappear and the object will be destroyed automatically after this
@@ -81,8 +334,37 @@ void connection::handle_read(const boost::system::error_code& e,
 
 void connection::handle_write(const boost::system::error_code& e)
 {
+  // A streamed body follows the headers, a piece at a time.
+  if (reply_.stream && !stream_done_)
+  {
+    if (!e)
+    {
+      write_stream();
+      return;
+    }
+    reply_.stream->cancel();
+  }
+
+  if (metrics_)
+  {
+    metrics_->record_phase(server_metrics::WRITE,
+                           server_metrics::clock::now() - write_start_);
+  }
+
   if (!e)
   {
+    if (keep_alive_)
+    {
+      request_.clear();
+      request_parser_.reset();
+
+      // Any data left over in the buffer is the previous request's body,
+      // or the start of a pipelined request which must be answered before
+      // reading any more.
+      process_buffer();
+      return;
+    }
+
     // Initiate graceful connection closure.
     boost::system::error_code ignored_ec;
     socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
@@ -94,5 +376,18 @@ void connection::handle_write(const boost::system::error_code& e)
   // destructor closes the socket.
 }
 
+void connection::handle_timeout(const boost::system::error_code& e)
+{
+  // The timer is pushed out whenever the connection stops being idle, so
+  // the deadline only really passed if it still lies in the past. Closing
+  // the socket aborts the outstanding read.
+  if ((e != boost::asio::error::operation_aborted) &&
+      (timer_.expires_at() <= boost::asio::deadline_timer::traits_type::now()))
+  {
+    boost::system::error_code ignored_ec;
+    socket_.close(ignored_ec);
+  }
+}
+
 } // namespace server3
 } // namespace http
@@ -0,0 +1,110 @@
+#include "http_server/content_encoding.hpp"
+
+#include <cstdlib>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+namespace bio = boost::iostreams;
+
+namespace http {
+namespace server3 {
+
+namespace {
+
+std::string trim(const std::string &s, std::string::size_type begin, std::string::size_type end)
+{
+  const std::string::size_type first = s.find_first_not_of(" \t", begin);
+  if ((first == std::string::npos) || (first >= end)) { return std::string(); }
+  const std::string::size_type last = s.find_last_not_of(" \t", end - 1);
+  return s.substr(first, last - first + 1);
+}
+
+// the q-value of a coding's parameters, e.g: ";q=0.5", which is one if
+// it isn't given.
+double q_value(const std::string &params)
+{
+  std::string::size_type pos = 0;
+  while (pos < params.size())
+  {
+    std::string::size_type end = params.find(';', pos);
+    if (end == std::string::npos) { end = params.size(); }
+
+    const std::string param = trim(params, pos, end);
+    if ((param.size() > 2) && ((param[0] == 'q') || (param[0] == 'Q')) && (param[1] == '='))
+    {
+      return std::strtod(param.c_str() + 2, NULL);
+    }
+
+    pos = end + 1;
+  }
+  return 1.0;
+}
+
+} // anonymous namespace
+
+bool accepts_gzip(const std::string &accept_encoding)
+{
+  // an explicit mention of gzip takes precedence over "*".
+  double gzip_q = -1.0, star_q = -1.0;
+
+  std::string::size_type pos = 0;
+  while (pos < accept_encoding.size())
+  {
+    std::string::size_type end = accept_encoding.find(',', pos);
+    if (end == std::string::npos) { end = accept_encoding.size(); }
+
+    std::string::size_type semicolon = accept_encoding.find(';', pos);
+    if ((semicolon == std::string::npos) || (semicolon > end)) { semicolon = end; }
+
+    const std::string coding = trim(accept_encoding, pos, semicolon);
+    const double q = q_value(accept_encoding.substr(semicolon, end - semicolon));
+    if (boost::iequals(coding, "gzip") || boost::iequals(coding, "x-gzip"))
+    {
+      gzip_q = q;
+    }
+    else if (coding == "*")
+    {
+      star_q = q;
+    }
+
+    pos = end + 1;
+  }
+
+  return (gzip_q >= 0.0) ? (gzip_q > 0.0) : (star_q > 0.0);
+}
+
+bool is_gzipped(const std::string &data)
+{
+  // see https://tools.ietf.org/html/rfc1952#page-6 for header magic values
+  return (data.size() >= 2) &&
+    (static_cast<unsigned char>(data[0]) == 0x1f) &&
+    (static_cast<unsigned char>(data[1]) == 0x8b);
+}
+
+std::string gzip_compress(const std::string &data, int compression_level)
+{
+  std::string compressed;
+  bio::filtering_ostream out;
+  out.push(bio::gzip_compressor(bio::gzip_params(compression_level)));
+  out.push(bio::back_inserter(compressed));
+  out.write(data.data(), data.size());
+  bio::close(out);
+  return compressed;
+}
+
+std::string gzip_decompress(const std::string &data)
+{
+  std::string inflated;
+  bio::filtering_istream in;
+  in.push(bio::gzip_decompressor());
+  in.push(bio::array_source(data.data(), data.size()));
+  bio::copy(in, bio::back_inserter(inflated));
+  return inflated;
+}
+
+} // namespace server3
+} // namespace http
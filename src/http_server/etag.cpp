@@ -0,0 +1,153 @@
+#include "http_server/etag.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+// the tail switch below falls through on purpose. the attribute is only
+// standard from C++17, so use the compilers' own spellings where there are
+// any.
+#if defined(__clang__)
+#define ETAG_FALLTHROUGH [[clang::fallthrough]]
+#elif defined(__GNUC__) && (__GNUC__ >= 7)
+#define ETAG_FALLTHROUGH __attribute__((fallthrough))
+#else
+#define ETAG_FALLTHROUGH do {} while (0)
+#endif
+
+namespace http {
+namespace server3 {
+
+namespace {
+
+inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+inline uint64_t load64(const unsigned char *p) {
+  // the bytes are assembled little-endian, so that the hash is the
+  // same on every platform.
+  uint64_t k = 0;
+  for (int i = 7; i >= 0; --i) {
+    k = (k << 8) | p[i];
+  }
+  return k;
+}
+
+// MurmurHash3 x64 128-bit, see https://github.com/aappleby/smhasher
+void murmur3_128(const std::string &data, uint64_t &out1, uint64_t &out2) {
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data.data());
+  const std::size_t len = data.size();
+  const std::size_t nblocks = len / 16;
+
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = 0, h2 = 0;
+
+  for (std::size_t i = 0; i < nblocks; ++i) {
+    uint64_t k1 = load64(bytes + i * 16);
+    uint64_t k2 = load64(bytes + i * 16 + 8);
+
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  const unsigned char *tail = bytes + nblocks * 16;
+  uint64_t k1 = 0, k2 = 0;
+
+  switch (len & 15) {
+  case 15: k2 ^= uint64_t(tail[14]) << 48; ETAG_FALLTHROUGH;
+  case 14: k2 ^= uint64_t(tail[13]) << 40; ETAG_FALLTHROUGH;
+  case 13: k2 ^= uint64_t(tail[12]) << 32; ETAG_FALLTHROUGH;
+  case 12: k2 ^= uint64_t(tail[11]) << 24; ETAG_FALLTHROUGH;
+  case 11: k2 ^= uint64_t(tail[10]) << 16; ETAG_FALLTHROUGH;
+  case 10: k2 ^= uint64_t(tail[ 9]) << 8; ETAG_FALLTHROUGH;
+  case  9: k2 ^= uint64_t(tail[ 8]);
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2; ETAG_FALLTHROUGH;
+
+  case  8: k1 ^= uint64_t(tail[ 7]) << 56; ETAG_FALLTHROUGH;
+  case  7: k1 ^= uint64_t(tail[ 6]) << 48; ETAG_FALLTHROUGH;
+  case  6: k1 ^= uint64_t(tail[ 5]) << 40; ETAG_FALLTHROUGH;
+  case  5: k1 ^= uint64_t(tail[ 4]) << 32; ETAG_FALLTHROUGH;
+  case  4: k1 ^= uint64_t(tail[ 3]) << 24; ETAG_FALLTHROUGH;
+  case  3: k1 ^= uint64_t(tail[ 2]) << 16; ETAG_FALLTHROUGH;
+  case  2: k1 ^= uint64_t(tail[ 1]) << 8; ETAG_FALLTHROUGH;
+  case  1: k1 ^= uint64_t(tail[ 0]);
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= uint64_t(len); h2 ^= uint64_t(len);
+  h1 += h2; h2 += h1;
+  h1 = fmix64(h1); h2 = fmix64(h2);
+  h1 += h2; h2 += h1;
+
+  out1 = h1;
+  out2 = h2;
+}
+
+void append_hex(std::string &out, uint64_t v) {
+  static const char digits[] = "0123456789abcdef";
+  for (int shift = 60; shift >= 0; shift -= 4) {
+    out.push_back(digits[(v >> shift) & 0xf]);
+  }
+}
+
+} // anonymous namespace
+
+std::string make_etag(const std::string &body)
+{
+  uint64_t h1 = 0, h2 = 0;
+  murmur3_128(body, h1, h2);
+
+  std::string etag;
+  etag.reserve(34);
+  etag.push_back('"');
+  append_hex(etag, h1);
+  append_hex(etag, h2);
+  etag.push_back('"');
+  return etag;
+}
+
+bool etag_matches(const std::string &if_none_match, const std::string &etag)
+{
+  // the header is either "*" or a comma-separated list of entity tags,
+  // each of which may be marked weak with a "W/" prefix.
+  std::string::size_type pos = 0;
+  while (pos < if_none_match.size())
+  {
+    std::string::size_type end = if_none_match.find(',', pos);
+    if (end == std::string::npos) { end = if_none_match.size(); }
+
+    std::string::size_type first = if_none_match.find_first_not_of(" \t", pos);
+    std::string::size_type last = if_none_match.find_last_not_of(" \t", end - 1);
+    if ((first != std::string::npos) && (first < end) && (last >= first))
+    {
+      if (if_none_match.compare(first, 2, "W/") == 0) { first += 2; }
+
+      const std::string::size_type len = last - first + 1;
+      if (((len == 1) && (if_none_match[first] == '*')) ||
+          ((len == etag.size()) && (if_none_match.compare(first, len, etag) == 0)))
+      {
+        return true;
+      }
+    }
+
+    pos = end + 1;
+  }
+
+  return false;
+}
+
+} // namespace server3
+} // namespace http
@@ -0,0 +1,82 @@
+#include "http_server/http_date.hpp"
+
+#include <boost/thread/tss.hpp>
+
+namespace http {
+namespace server3 {
+
+namespace {
+
+const char *const DAYS[7] = {
+  "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+
+const char *const MONTHS[12] = {
+  "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+void append_2digits(std::string &out, int v)
+{
+  out.push_back(char('0' + (v / 10) % 10));
+  out.push_back(char('0' + v % 10));
+}
+
+struct cached_date
+{
+  cached_date() : second(-1) {}
+
+  std::time_t second;
+  std::string formatted;
+};
+
+boost::thread_specific_ptr<cached_date> current_date;
+
+} // anonymous namespace
+
+std::string format_http_date(std::time_t t)
+{
+  struct tm tt;
+  gmtime_r(&t, &tt);
+
+  std::string out;
+  out.reserve(29);
+  out.append(DAYS[tt.tm_wday]);
+  out.append(", ");
+  append_2digits(out, tt.tm_mday);
+  out.push_back(' ');
+  out.append(MONTHS[tt.tm_mon]);
+  out.push_back(' ');
+  const int year = tt.tm_year + 1900;
+  append_2digits(out, year / 100);
+  append_2digits(out, year % 100);
+  out.push_back(' ');
+  append_2digits(out, tt.tm_hour);
+  out.push_back(':');
+  append_2digits(out, tt.tm_min);
+  out.push_back(':');
+  append_2digits(out, tt.tm_sec);
+  out.append(" GMT");
+  return out;
+}
+
+const std::string &http_date()
+{
+  cached_date *date = current_date.get();
+  if (date == NULL)
+  {
+    date = new cached_date;
+    current_date.reset(date);
+  }
+
+  const std::time_t now = std::time(NULL);
+  if (now != date->second)
+  {
+    date->formatted = format_http_date(now);
+    date->second = now;
+  }
+  return date->formatted;
+}
+
+} // namespace server3
+} // namespace http
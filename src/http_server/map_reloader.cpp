@@ -0,0 +1,296 @@
+#include "http_server/map_reloader.hpp"
+
+#include <chrono>
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <mapnik/load_map.hpp>
+
+namespace pt = boost::property_tree;
+
+namespace http { namespace server3 {
+
+namespace {
+
+// how often to check whether the readers have moved on to the new
+// configuration.
+const std::chrono::milliseconds READER_POLL_INTERVAL(5);
+
+// how many written back tiles are remembered at each zoom before
+// giving up and erasing the whole zoom from the store on a reload.
+// this is every tile up to zoom 6, and bounds the memory used at the
+// higher zooms.
+const std::size_t MAX_WRITTEN_BACK_PER_ZOOM = 4096;
+
+std::string read_file(const std::string &file) {
+  std::ifstream in(file.c_str(), std::ios::in | std::ios::binary);
+  if (!in) {
+    throw std::runtime_error((boost::format("Unable to open \"%1%\".") % file).str());
+  }
+  std::ostringstream out;
+  out << in.rdbuf();
+  return out.str();
+}
+
+// relative paths in a map, e.g: to shapefiles, are relative to the
+// directory which the map file is in.
+std::string base_path(const std::string &file) {
+  const std::string::size_type slash = file.rfind('/');
+  return (slash == std::string::npos) ? std::string() : file.substr(0, slash);
+}
+
+} // anonymous namespace
+
+map_reloader::reader::reader()
+  : active(0) {
+}
+
+map_reloader::map_reloader(const std::string &map_file, const std::string &raster_map_file,
+                           const std::string &config_file, std::shared_ptr<tile_cache> cache,
+                           bool raster_from_own_tiles,
+                           std::shared_ptr<tile_store> store,
+                           std::shared_ptr<avecado::thread_pool> store_writer)
+  : map_file_(map_file),
+    raster_map_file_(raster_map_file),
+    config_file_(config_file),
+    cache_(cache),
+    raster_from_own_tiles_(raster_from_own_tiles),
+    store_(store),
+    store_writer_(store_writer),
+    generation_(1),
+    reload_queued_(false),
+    background_(1) {
+  // zero means "between requests", so the generations start at one.
+  current_ = load(1);
+}
+
+map_reloader::~map_reloader() {
+}
+
+map_reloader::config_ptr map_reloader::current() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return current_;
+}
+
+bool map_reloader::reload() {
+  std::unique_lock<std::mutex> reload_lock(reload_mutex_);
+
+  config_ptr old_config = current();
+  config_ptr new_config;
+  try {
+    new_config = load(old_config->generation + 1);
+
+  } catch (const std::exception &e) {
+    std::cerr << "ERROR: Unable to reload the configuration, keeping the old one: " << e.what() << "\n";
+    return false;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    current_ = new_config;
+  }
+  generation_.store(new_config->generation);
+
+  // the handlers switch over between requests. until they all have,
+  // tiles made with the old configuration could still be put in the
+  // cache, so it's only cleaned out after that.
+  wait_for_readers(new_config->generation);
+  invalidate(*old_config, *new_config);
+
+  std::cout << "Configuration reloaded." << std::endl;
+  return true;
+}
+
+void map_reloader::reload_async() {
+  // a reload which hasn't started yet will pick up any changes made
+  // since it was asked for, so there's no need for another one.
+  if (reload_queued_.exchange(true)) {
+    return;
+  }
+
+  background_.post([this]() {
+      reload_queued_.store(false);
+      reload();
+    });
+}
+
+void map_reloader::written_back(int z, int x, int y) {
+  // the handlers don't make tiles at any other zoom.
+  if ((z < 0) || (z > CONFIG_MAX_ZOOM)) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(written_mutex_);
+  written_zoom &written = written_[z];
+  if (written.overflowed) {
+    return;
+  }
+  written.tiles.insert(std::make_pair(x, y));
+  if (written.tiles.size() > MAX_WRITTEN_BACK_PER_ZOOM) {
+    written.tiles.clear();
+    written.overflowed = true;
+  }
+}
+
+std::shared_ptr<map_reloader::reader> map_reloader::make_reader() {
+  std::shared_ptr<reader> r = std::make_shared<reader>();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  // forget about the readers of handlers which have gone away.
+  readers_.erase(std::remove_if(readers_.begin(), readers_.end(),
+                                [](const std::weak_ptr<reader> &w) { return w.expired(); }),
+                 readers_.end());
+  readers_.push_back(r);
+  return r;
+}
+
+unsigned int map_reloader::enter(reader &r) const {
+  // publish the generation before checking that it's still current. if
+  // a reload was published in between, go round again, otherwise the
+  // reloader is certain to see this reader as active.
+  unsigned int generation = generation_.load();
+  while (true) {
+    r.active.store(generation);
+    const unsigned int latest = generation_.load();
+    if (latest == generation) {
+      return generation;
+    }
+    generation = latest;
+  }
+}
+
+void map_reloader::exit(reader &r) const {
+  r.active.store(0);
+}
+
+map_reloader::config_ptr map_reloader::load(unsigned int generation) const {
+  std::shared_ptr<config> c = std::make_shared<config>();
+  c->generation = generation;
+
+  c->map_xml = read_file(map_file_);
+  mapnik::load_map_string(c->map, c->map_xml, false, base_path(map_file_));
+
+  if (!raster_map_file_.empty()) {
+    c->raster_map_xml = read_file(raster_map_file_);
+    c->raster_map.reset(new mapnik::Map);
+    mapnik::load_map_string(*c->raster_map, c->raster_map_xml, false, base_path(raster_map_file_));
+  }
+
+  if (!config_file_.empty()) {
+    pt::read_json(config_file_, c->izer_config);
+    c->post_processor = std::make_shared<avecado::post_processor>();
+    c->post_processor->load(c->izer_config);
+  }
+
+  c->tilejson = std::make_shared<shared_tilejson>();
+
+  return c;
+}
+
+void map_reloader::wait_for_readers(unsigned int generation) {
+  std::vector<std::shared_ptr<reader> > readers;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (const auto &w : readers_) {
+      std::shared_ptr<reader> r = w.lock();
+      if (r) { readers.push_back(r); }
+    }
+  }
+
+  for (const auto &r : readers) {
+    while (true) {
+      const unsigned int active = r->active.load();
+      if ((active == 0) || (active >= generation)) {
+        break;
+      }
+      std::this_thread::sleep_for(READER_POLL_INTERVAL);
+    }
+  }
+}
+
+void map_reloader::invalidate(const config &old_config, const config &new_config) {
+  const zoom_set vector_zooms =
+    changed_zooms_for_map(old_config.map_xml, new_config.map_xml) |
+    changed_zooms_for_izers(old_config.izer_config, new_config.izer_config);
+
+  // the store is cleaned out first, so that no tiles are read back from
+  // it into the cache once that's been cleaned out.
+  erase_written_back(vector_zooms);
+
+  if (!cache_) {
+    return;
+  }
+
+  zoom_set raster_zooms = changed_zooms_for_map(old_config.raster_map_xml, new_config.raster_map_xml);
+  if (raster_from_own_tiles_) {
+    // PNGs, even in metatiles, are rendered from the vector tiles at
+    // their own zoom.
+    raster_zooms |= vector_zooms;
+  }
+
+  const std::size_t dropped = cache_->erase_if(
+    [&](int z, int, int, const std::string &encoding) -> bool {
+      if ((z < 0) || (z > CONFIG_MAX_ZOOM)) { return true; }
+      return (encoding == "png") ? raster_zooms.test(z) : vector_zooms.test(z);
+    });
+
+  std::cout << "Dropped " << dropped << " tiles affected by the new configuration from the cache." << std::endl;
+}
+
+void map_reloader::erase_written_back(const zoom_set &zooms) {
+  if (!store_ || !store_writer_) {
+    return;
+  }
+
+  // the writer runs its jobs one at a time, in order, so this comes
+  // after the writes of any tiles made with the old configuration.
+  std::promise<std::size_t> erased;
+  std::future<std::size_t> result = erased.get_future();
+  store_writer_->post([&]() {
+      try {
+        std::size_t count = 0;
+        std::unique_lock<std::mutex> lock(written_mutex_);
+        for (int z = 0; z <= CONFIG_MAX_ZOOM; ++z) {
+          if (!zooms.test(z)) {
+            continue;
+          }
+
+          written_zoom &written = written_[z];
+          if (written.overflowed) {
+            std::cout << "Erasing all tiles at zoom " << z << " from the store, as too many were written back to track." << std::endl;
+            store_->erase_zoom(z);
+            written.overflowed = false;
+            continue;
+          }
+
+          // erased one at a time, so that a failure leaves the rest
+          // to be tried again on the next reload.
+          auto itr = written.tiles.begin();
+          while (itr != written.tiles.end()) {
+            store_->erase(z, itr->first, itr->second);
+            itr = written.tiles.erase(itr);
+            ++count;
+          }
+        }
+        erased.set_value(count);
+
+      } catch (...) {
+        erased.set_exception(std::current_exception());
+      }
+    });
+
+  try {
+    std::cout << "Erased " << result.get() << " tiles affected by the new configuration from the store." << std::endl;
+
+  } catch (const std::exception &e) {
+    std::cerr << "ERROR: Unable to erase tiles affected by the new configuration from the store: " << e.what() << "\n";
+  }
+}
+
+} } // namespace http::server3
@@ -11,6 +11,9 @@ namespace server3 {
 
 mapnik_handler_factory::mapnik_handler_factory(const mapnik_server_options &opts)
   : options_(opts) {
+  if (!options_.tilejson) {
+    options_.tilejson = std::make_shared<shared_tilejson>();
+  }
 }
 
 mapnik_handler_factory::~mapnik_handler_factory() {
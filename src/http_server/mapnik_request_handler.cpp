@@ -10,10 +10,16 @@
 
 #include <sstream>
 #include <string>
-#include <ctime>
 #include <chrono>
-#include <iomanip>
-#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <stdexcept>
+#include <exception>
+#include <functional>
+#include <future>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <iostream>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/format.hpp>
 
@@ -21,70 +27,172 @@
 #include "http_server/parse_path.hpp"
 #include "http_server/reply.hpp"
 #include "http_server/request.hpp"
+#include "http_server/etag.hpp"
+#include "http_server/content_encoding.hpp"
+#include "http_server/http_date.hpp"
+#include "http_server/tile_batch.hpp"
+#include "http_server/render_pool.hpp"
 
 #include <mapnik/load_map.hpp>
+#include <mapnik/image_util.hpp>
 
 // for vector tile creation
 #include "avecado.hpp"
 #include "tilejson.hpp"
 #include "util.hpp"
+#include "fetcher_io.hpp"
+
+namespace http {
+namespace server3 {
 
 namespace {
-std::string make_http_date() {
-  std::stringstream out;
-  std::time_t t = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-  struct tm tt;
-  gmtime_r(&t, &tt);
-  char *oldlocale = setlocale(LC_TIME, NULL);
-  setlocale(LC_TIME, "C");
-  char buf[30];
-  strftime(buf, 30, "%a, %d %b %Y %H:%M:%S GMT", &tt);
-  setlocale(LC_TIME, oldlocale);
-  return std::string(buf);
-}
-
-std::string strip_query_params(const std::string &str) {
-  return str.substr(0, str.find('?'));
+// how much of a batch response is held for a slow client before the
+// rest of its tiles wait for the client to catch up.
+const std::size_t BATCH_HIGH_WATER = 4 << 20;
+
+// marks a handler as using the reloader's configuration for as long as
+// it's in scope. does nothing if there's no reloader.
+struct config_guard {
+  config_guard(map_reloader *reloader, map_reloader::reader *reader)
+    : reloader_(reloader), reader_(reader),
+      generation(reloader ? reloader->enter(*reader) : 0) {
+  }
+
+  ~config_guard() {
+    if (reloader_) { reloader_->exit(*reader_); }
+  }
+
+  map_reloader *reloader_;
+  map_reloader::reader *reader_;
+  // generation which the handler must use at least.
+  const unsigned int generation;
+};
+
+// returns true if the client said it can take a gzipped body. clients
+// which don't say anything get an identity body, as they may not be
+// able to inflate it.
+bool client_accepts_gzip(const request &req) {
+  for (const header &h : req.headers) {
+    if (boost::iequals(h.name, "Accept-Encoding")) {
+      return accepts_gzip(h.value);
+    }
+  }
+  return false;
 }
-} // anonymous namespace
 
-namespace http {
-namespace server3 {
+// the tile from a response from the raster source, or null if it
+// doesn't have it.
+std::unique_ptr<avecado::tile> fetched_tile(int z, int x, int y, avecado::fetch_response response) {
+  if (response.is_right()) {
+    if (response.right().status == avecado::fetch_status::not_found) {
+      return std::unique_ptr<avecado::tile>();
+    }
+    throw std::runtime_error((boost::format("Unable to fetch source tile %1%/%2%/%3%: %4%")
+                              % z % x % y % response.right()).str());
+  }
+  return std::move(response.left());
+}
+} // anonymous namespace
 
 mapnik_request_handler::mapnik_request_handler(const mapnik_server_options &options, std::string port)
   : map_(),
     options_(options),
     port_(port),
-    max_age_value_((boost::format("max-age = %1%") % options_.max_age).str())
+    max_age_value_((boost::format("max-age = %1%") % options_.max_age).str()),
+    common_headers_("Access-Control-Allow-Origin: *\r\n"
+                    "Access-Control-Allow-Methods: GET\r\n"
+                    "Cache-control: " + max_age_value_ + "\r\n"),
+    pbf_headers_("Content-Type: application/octet-stream\r\n" + common_headers_ +
+                 "Vary: Accept-Encoding\r\n"),
+    png_headers_("Content-Type: image/png\r\n" + common_headers_),
+    tilejson_(options_.tilejson ? options_.tilejson : std::make_shared<shared_tilejson>()),
+    config_generation_(0),
+    request_zoom_(-1)
 {
+  if (options_.reloader) {
+    // the reloader has already loaded the maps, so this only needs
+    // its own copies of them.
+    reader_ = options_.reloader->make_reader();
+    update_config(options_.reloader->current()->generation);
+    return;
+  }
+
   std::cout << "Loading mapnik map..." << std::endl;
   mapnik::load_map(map_, options_.map_file);
   std::cout << "Mapnik map loaded." << std::endl;
+
+  if (!options_.raster_map_file.empty()) {
+    raster_map_.reset(new mapnik::Map);
+    mapnik::load_map(*raster_map_, options_.raster_map_file);
+  }
 }
 
 void mapnik_request_handler::handle_request(const request& req, reply& rep)
 {
-  handle_request_impl(req, rep);
+  // hold off prefetching while handling the request.
+  std::unique_ptr<prefetcher::foreground> foreground;
+  if (options_.prefetch) { foreground.reset(new prefetcher::foreground(*options_.prefetch)); }
+
+  const server_metrics::clock::time_point start = server_metrics::clock::now();
+  request_zoom_ = -1;
+
+  {
+    // configuration changes are picked up between requests.
+    config_guard guard(options_.reloader.get(), reader_.get());
+    if (options_.reloader) { update_config(guard.generation); }
+
+    handle_request_impl(req, rep);
+  }
   if (options_.logger) { options_.logger->log(req, rep); }
+
+  if (options_.metrics) {
+    options_.metrics->record_request(rep.status, request_zoom_);
+    options_.metrics->add_busy(server_metrics::clock::now() - start);
+  }
 }
 
 void mapnik_request_handler::handle_request_impl(const request &req, reply &rep)
 {
+  // most requests are for tiles, and have nothing in their path which
+  // needs decoding, so they're routed straight from the URI. anything
+  // else is decoded first.
+  const std::string::size_type query_pos = req.uri.find('?');
+  const char *path_begin = req.uri.data();
+  const char *path_end = path_begin + std::min(query_pos, req.uri.size());
+  int z, x, y;
+  std::string ext;
+  const bool is_tile = parse_path(path_begin, path_end, z, x, y, ext);
+
   // Decode url to path.
   std::string request_path;
-  if (!url_decode(strip_query_params(req.uri), request_path))
+  if (!is_tile && !url_decode(std::string(path_begin, path_end), request_path))
   {
     rep = reply::stock_reply(reply::bad_request);
     return;
   }
 
   try {
+    if (is_tile) {
+      handle_request_tile(req, rep, z, x, y, ext);
+
     // serve tilejson
-    if (request_path == "/tile.json") {
+    } else if (request_path == "/tile.json") {
       handle_request_json(req, rep);
 
+    } else if ((request_path == "/metrics") && options_.metrics) {
+      handle_request_metrics(req, rep);
+
+    } else if ((request_path == "/batch") && (options_.max_batch_tiles > 0)) {
+      handle_request_batch(req, rep, (query_pos == std::string::npos) ? std::string() : req.uri.substr(query_pos + 1));
+
+    } else if ((request_path == "/reload") && options_.reloader && options_.reload_endpoint) {
+      handle_request_reload(req, rep);
+
+    } else if (parse_path(request_path, z, x, y, ext)) {
+      handle_request_tile(req, rep, z, x, y, ext);
+
     } else {
-      handle_request_tile(req, rep, request_path);
+      rep = reply::stock_reply(reply::not_found);
     }
 
   } catch (...) {
@@ -93,33 +201,182 @@ void mapnik_request_handler::handle_request_impl(const request &req, reply &rep)
 }
 
 void mapnik_request_handler::handle_request_json(const request &req, reply &rep) {
-  std::string base_url = (boost::format("http://localhost:%1%") % port_).str();
-  std::string json = avecado::make_tilejson(map_, base_url);
+  // every client fetches this when it starts up, and making it can mean
+  // asking each datasource for its description, so it's only made once
+  // for each load of the map, by whichever thread is asked for it first.
+  tile_cache::value_type plain, gzipped;
+  tilejson_->get([this]() {
+      std::string base_url = (boost::format("http://localhost:%1%") % port_).str();
+      return avecado::make_tilejson(map_, base_url);
+    }, options_.compression_level, plain, gzipped);
+  const tile_cache::value_type &json =
+    (gzipped && client_accepts_gzip(req)) ? gzipped : plain;
+
+  if (reply_not_modified(req, rep, *json, true)) {
+    return;
+  }
+
+  rep.status = reply::ok;
+  rep.is_hard_error = false;
+  rep.shared_content = std::shared_ptr<const std::string>(json, &json->data);
+  rep.append_header("Content-Length", json->data.size());
+  rep.header_block.append("Content-Type: application/json\r\n");
+  rep.header_block.append(common_headers_);
+  rep.append_header("Date", http_date());
+  rep.append_header("ETag", json->etag);
+  rep.header_block.append("Vary: Accept-Encoding\r\n");
+  if (json->gzipped) {
+    rep.header_block.append("Content-Encoding: gzip\r\n");
+  }
+}
+
+void mapnik_request_handler::handle_request_metrics(const request &, reply &rep) {
+  std::ostringstream out;
+  options_.metrics->write(out, options_.cache.get());
+
+  rep.status = reply::ok;
+  rep.is_hard_error = false;
+  rep.content = out.str();
+  rep.append_header("Content-Length", rep.content.size());
+  rep.header_block.append("Content-Type: text/plain; version=0.0.4\r\n"
+                          "Cache-control: no-cache\r\n");
+}
+
+void mapnik_request_handler::handle_request_batch(const request &, reply &rep,
+                                                  const std::string &query) {
+  std::vector<tile_id> tiles;
+  if (!parse_batch_query(query, options_.max_batch_tiles, tiles)) {
+    rep = reply::stock_reply(reply::bad_request);
+    return;
+  }
+
+  // the records are streamed from the render threads, so without them
+  // there's nothing to stream from.
+  render_pool *pool = render_pool::current();
+  if (!pool) {
+    rep = reply::stock_reply(reply::not_implemented);
+    return;
+  }
 
+  // the tiles are shared out between the render threads, each using its
+  // own copy of the map, a tile at a time on the background queue, so
+  // that a big batch never holds up requests for single tiles.
+  std::shared_ptr<body_stream> stream = std::make_shared<body_stream>(BATCH_HIGH_WATER);
+  const std::size_t workers = std::min(pool->size(), tiles.size());
+  std::shared_ptr<tile_batch> batch = std::make_shared<tile_batch>(std::move(tiles), stream);
+  std::size_t posted = 0;
+  while ((posted < workers) && post_batch_job(*pool, batch)) {
+    ++posted;
+  }
+  if (posted == 0) {
+    rep = reply::stock_reply(reply::service_unavailable);
+    rep.append_header("Retry-After", "1");
+    return;
+  }
+
+  // the tiles are sent as they're kept, gzipped or not, each record
+  // saying which, so the body as a whole has no Content-Encoding and
+  // doesn't depend on the request's Accept-Encoding.
   rep.status = reply::ok;
   rep.is_hard_error = false;
-  rep.content = std::move(json);
-  rep.headers.resize(6);
-  rep.headers[0].name = "Content-Length";
-  rep.headers[0].value = boost::lexical_cast<std::string>(rep.content.size());
-  rep.headers[1].name = "Content-Type";
-  rep.headers[1].value = "application/json";
-  rep.headers[2].name = "Access-Control-Allow-Origin";
-  rep.headers[2].value = "*";
-  rep.headers[3].name= "Access-Control-Allow-Methods";
-  rep.headers[3].value = "GET";
-  rep.headers[4].name = "Cache-control";
-  rep.headers[4].value = max_age_value_;
-  rep.headers[5].name = "Date";
-  rep.headers[5].value = make_http_date();
+  rep.stream = stream;
+  rep.header_block.append("Content-Type: application/octet-stream\r\n");
+  rep.header_block.append(common_headers_);
+  rep.append_header("Date", http_date());
+}
+
+bool mapnik_request_handler::post_batch_job(render_pool &pool, const std::shared_ptr<tile_batch> &batch) {
+  render_pool *p = &pool;
+  return pool.try_post_background([p, batch](request_handler &handler) {
+      // every handler in the pool is made by the same factory.
+      mapnik_request_handler *h = dynamic_cast<mapnik_request_handler *>(&handler);
+      if (h) { h->make_batch_job(*p, batch); }
+    });
+}
+
+void mapnik_request_handler::make_batch_job(render_pool &pool, const std::shared_ptr<tile_batch> &batch) {
+  // the batch's jobs run outside of handle_request, so they have to
+  // pick up the configuration and hold off prefetching themselves.
+  std::unique_ptr<prefetcher::foreground> foreground;
+  if (options_.prefetch) { foreground.reset(new prefetcher::foreground(*options_.prefetch)); }
+  config_guard guard(options_.reloader.get(), reader_.get());
+  if (options_.reloader) { update_config(guard.generation); }
+
+  render_pool *p = &pool;
+  while (true) {
+    // if the client has fallen behind, the job is parked until it has
+    // caught up. the batch is given up on if the job can't be posted
+    // then, as there's no render thread to carry on with it.
+    const bool room = batch->wait_for_room([p, batch]() {
+        if (!post_batch_job(*p, batch)) { batch->abort(); }
+      });
+    tile_id t;
+    if (!room || !batch->take(t)) {
+      return;
+    }
+
+    try {
+      // the batch asks for the tiles it wants, so there's no need to
+      // make the rest of their metatiles too.
+      tile_cache::value_type tile = get_tile(t.z, t.x, t.y, "pbf", false);
+      if (options_.metrics) {
+        options_.metrics->record_tile_bytes("pbf", tile->data.size());
+      }
+      batch->write(t, tile->data, tile->gzipped);
+
+    } catch (const std::exception &e) {
+      std::cerr << "ERROR: Unable to make tile " << t.z << "/" << t.x << "/" << t.y
+                << " for a batch: " << e.what() << "\n";
+      batch->abort();
+      return;
+    }
+
+    // to the back of the queue for the next tile. if it's full, this
+    // thread carries on rather than dropping the batch.
+    if (post_batch_job(pool, batch)) {
+      return;
+    }
+  }
+}
+
+void mapnik_request_handler::handle_request_reload(const request &req, reply &rep) {
+  // GETs can be made by all sorts of things, such as link checkers.
+  if (req.method != "POST") {
+    rep = reply::stock_reply(reply::method_not_allowed);
+    rep.append_header("Allow", "POST");
+    return;
+  }
+
+  // the reload happens in the background, and the response doesn't
+  // wait for it.
+  options_.reloader->reload_async();
+  rep = reply::stock_reply(reply::accepted);
+}
+
+void mapnik_request_handler::update_config(unsigned int generation) {
+  if (generation == config_generation_) {
+    return;
+  }
+
+  map_reloader::config_ptr config = options_.reloader->current();
+  map_ = config->map;
+  if (config->raster_map) {
+    raster_map_.reset(new mapnik::Map(*config->raster_map));
+  } else {
+    raster_map_.reset();
+  }
+  options_.post_processor = config->post_processor;
+  config_generation_ = config->generation;
+
+  // the TileJSON describes the map, so the new one has its own.
+  tilejson_ = config->tilejson;
 }
 
 void mapnik_request_handler::handle_request_tile(const request &req, reply &rep,
-                                                 const std::string &request_path) {
+                                                 int z, int x, int y, const std::string &ext) {
   // simple hierarchy is just $z/$x/$y.pbf, in spherical mercator
   // and we don't take account of anything fancy.
-  int z, x, y;
-  if (!parse_path(request_path, z, x, y)) {
+  if ((ext != "pbf") && ((ext != "png") || !raster_map_)) {
     rep = reply::stock_reply(reply::not_found);
     return;
   }
@@ -139,50 +396,419 @@ void mapnik_request_handler::handle_request_tile(const request &req, reply &rep,
     return;
   }
 
+  request_zoom_ = z;
+
+  if (options_.prefetch) {
+    options_.prefetch->record(z, x, y, ext);
+  }
+
+  if (ext == "png") {
+    handle_request_raster(req, rep, z, x, y);
+    return;
+  }
+
+  tile_cache::value_type body = get_tile(z, x, y, ext, true);
+
+  // tiles are made and kept gzipped, and only inflated for clients
+  // which can't take them that way.
+  if (body->gzipped && !client_accepts_gzip(req)) {
+    body = identity_tile(z, x, y, body);
+  }
+
+  if (reply_not_modified(req, rep, *body, true)) {
+    return;
+  }
+
+  if (options_.metrics) {
+    options_.metrics->record_tile_bytes(ext, body->data.size());
+  }
+
+  // Fill out the reply to be sent to the client. the tile is sent
+  // straight from the cache, rather than being copied into the reply.
+  rep.status = reply::ok;
+  rep.is_hard_error = false;
+  rep.shared_content = std::shared_ptr<const std::string>(body, &body->data);
+  rep.header_block.reserve(pbf_headers_.size() + 128);
+  rep.header_block.append(pbf_headers_);
+  rep.append_header("Content-Length", body->data.size());
+  rep.append_header("Date", http_date());
+  rep.append_header("ETag", body->etag);
+  // make sure that the response header matches the body, so that the
+  // client doesn't have to inspect the file and try to figure out if
+  // it's supposed to be compressed or not.
+  if (body->gzipped) {
+    rep.header_block.append("Content-Encoding: gzip\r\n");
+  }
+}
+
+void mapnik_request_handler::handle_request_raster(const request &req, reply &rep,
+                                                   int z, int x, int y) {
+  // a null tile means that the source doesn't have it.
+  tile_cache::value_type png = get_tile(z, x, y, "png", true);
+
+  if (!png) {
+    rep = reply::stock_reply(reply::not_found);
+    return;
+  }
+
+  if (reply_not_modified(req, rep, *png, false)) {
+    return;
+  }
+
+  if (options_.metrics) {
+    options_.metrics->record_tile_bytes("png", png->data.size());
+  }
+
+  rep.status = reply::ok;
+  rep.is_hard_error = false;
+  rep.shared_content = std::shared_ptr<const std::string>(png, &png->data);
+  rep.header_block.reserve(png_headers_.size() + 128);
+  rep.header_block.append(png_headers_);
+  rep.append_header("Content-Length", png->data.size());
+  rep.append_header("Date", http_date());
+  rep.append_header("ETag", png->etag);
+}
+
+void mapnik_request_handler::prefetch(int z, int x, int y, const std::string &encoding) {
+  config_guard guard(options_.reloader.get(), reader_.get());
+  if (options_.reloader) { update_config(guard.generation); }
+
+  if (!options_.cache || ((encoding == "png") && !raster_map_)) {
+    return;
+  }
+  // prefetches are one tile at a time, so that a background job never
+  // starts a whole block which foreground requests then have to wait for.
+  get_tile(z, x, y, encoding, false);
+}
+
+tile_cache::value_type mapnik_request_handler::get_tile(int z, int x, int y,
+                                                        const std::string &encoding,
+                                                        bool metatile) {
+  using namespace std::placeholders;
+  if (encoding == "png") {
+    if (metatile) {
+      cache_metatile(z, x, y, encoding, std::bind(&mapnik_request_handler::make_raster_metatile, this, z, x, y, _1, _2, _3));
+    }
+    return cached_tile(z, x, y, encoding, std::bind(&mapnik_request_handler::make_raster, this, z, x, y));
+  }
+
+  // vector tiles are queried one at a time whether they're in a block or
+  // not, so they're never metatiled.
+  return cached_tile(z, x, y, encoding, std::bind(&mapnik_request_handler::make_vector, this, z, x, y));
+}
+
+bool mapnik_request_handler::reply_not_modified(const request &req, reply &rep,
+                                                const encoded_tile &tile, bool vary_encoding) {
+  bool matched = false;
+  for (const header &h : req.headers) {
+    if (boost::iequals(h.name, "If-None-Match") && etag_matches(h.value, tile.etag)) {
+      matched = true;
+      break;
+    }
+  }
+  if (!matched) { return false; }
+
+  // a 304 has no body, but carries the same validator and caching
+  // headers as the 200 would have done, so that the client can
+  // refresh its copy.
+  rep.status = reply::not_modified;
+  rep.is_hard_error = false;
+  rep.content.clear();
+  rep.shared_content.reset();
+  rep.header_block.reserve(common_headers_.size() + 128);
+  rep.append_header("ETag", tile.etag);
+  rep.header_block.append(common_headers_);
+  rep.append_header("Date", http_date());
+  if (vary_encoding) {
+    rep.header_block.append("Vary: Accept-Encoding\r\n");
+  }
+  return true;
+}
+
+tile_cache::value_type mapnik_request_handler::identity_tile(int z, int x, int y,
+                                                             const tile_cache::value_type &gzipped) {
+  // the inflated tile is cached alongside the gzipped one, so that it's
+  // dropped along with it on reload.
+  return cached_tile(z, x, y, "pbf;identity", [&]() -> tile_cache::value_type {
+      return std::make_shared<const encoded_tile>(gzip_decompress(gzipped->data));
+    });
+}
+
+tile_cache::value_type mapnik_request_handler::cached_tile(
+  int z, int x, int y, const std::string &encoding,
+  const tile_cache::make_function &make) {
+
+  if (options_.cache) {
+    return options_.cache->get_or_make(z, x, y, encoding, make);
+  } else {
+    return make();
+  }
+}
+
+void mapnik_request_handler::cache_metatile(
+  int z, int x, int y, const std::string &encoding,
+  const std::function<void (int, int, int)> &make_block) {
+
+  // the block can't be bigger than the whole world, and there's no
+  // point making one if there's nowhere to keep the other tiles.
+  const int size = std::min(int(options_.metatile), 1 << z);
+  if (!options_.cache || (size <= 1) || options_.cache->get(z, x, y, encoding)) {
+    return;
+  }
+
+  // the block is coalesced under the key of its top-left tile, with
+  // an encoding which never gets stored. any request for a tile in
+  // the block while it's being made waits for it to finish.
+  const int x0 = x - (x % size), y0 = y - (y % size);
+  options_.cache->get_or_make(z, x0, y0, encoding + ";metatile", [&]() -> tile_cache::value_type {
+      make_block(x0, y0, size);
+      return tile_cache::value_type();
+    });
+}
+
+tile_cache::value_type mapnik_request_handler::make_vector(int z, int x, int y) {
+  if (options_.store) {
+    tile_store::value_type stored = options_.store->read(z, x, y);
+    if (stored) { return std::make_shared<const encoded_tile>(*stored); }
+  }
+
+  avecado::tile tile(z, x, y);
+  bool painted = make_tile(tile);
+
+  const server_metrics::clock::time_point start = server_metrics::clock::now();
+  tile_cache::value_type data = std::make_shared<const encoded_tile>(
+    painted ? tile.get_data(options_.compression_level) : "");
+  record_phase(server_metrics::SERIALISE, start);
+
+  if (options_.store && options_.store_writer) {
+    std::shared_ptr<tile_store> store = options_.store;
+    std::shared_ptr<map_reloader> reloader = options_.reloader;
+    options_.store_writer->post([store, reloader, z, x, y, data]() {
+        store->write(z, x, y, data->data);
+        // so that it's erased again if a reload changes it.
+        if (reloader) { reloader->written_back(z, x, y); }
+      });
+  }
+
+  return data;
+}
+
+std::unique_ptr<avecado::tile> mapnik_request_handler::source_tile(int z, int x, int y) {
+  if (options_.raster_source) {
+    return fetched_tile(z, x, y, (*options_.raster_source)(avecado::request(z, x, y)).get());
+  }
+
+  std::unique_ptr<avecado::tile> tile(new avecado::tile(z, x, y));
+  make_tile(*tile);
+  return tile;
+}
+
+std::vector<std::unique_ptr<avecado::tile> > mapnik_request_handler::source_tiles(
+  int z, int x0, int y0, int size) {
+
+  std::vector<std::unique_ptr<avecado::tile> > tiles;
+  tiles.reserve(size * size);
+
+  if (options_.raster_source) {
+    // start all the fetches before waiting on any of them, so that the
+    // fetcher can get on with them concurrently.
+    std::vector<std::future<avecado::fetch_response> > responses;
+    for (int j = 0; j < size; ++j) {
+      for (int i = 0; i < size; ++i) {
+        responses.push_back((*options_.raster_source)(avecado::request(z, x0 + i, y0 + j)));
+      }
+    }
+    for (int k = 0; k < size * size; ++k) {
+      tiles.push_back(fetched_tile(z, x0 + (k % size), y0 + (k / size), responses[k].get()));
+    }
+
+  } else {
+    for (int j = 0; j < size; ++j) {
+      for (int i = 0; i < size; ++i) {
+        tiles.push_back(source_tile(z, x0 + i, y0 + j));
+      }
+    }
+  }
+
+  return tiles;
+}
+
+tile_cache::value_type mapnik_request_handler::make_raster(int z, int x, int y) {
+  std::unique_ptr<avecado::tile> tile = source_tile(z, x, y);
+  if (!tile) {
+    return tile_cache::value_type();
+  }
+
+  raster_map_->resize(256, 256);
+  raster_map_->zoom_to_box(avecado::util::box_for_tile(z, x, y));
+
+  server_metrics::clock::time_point start = server_metrics::clock::now();
+  mapnik::image_rgba8 image(256, 256);
+  avecado::render_vector_tile(image, *tile, *raster_map_, options_.scale_factor,
+                              std::max(options_.buffer_size, 0));
+  record_phase(server_metrics::RENDER, start);
+
+  start = server_metrics::clock::now();
+  tile_cache::value_type png = std::make_shared<const encoded_tile>(mapnik::save_to_string(image, "png"));
+  record_phase(server_metrics::SERIALISE, start);
+  return png;
+}
+
+void mapnik_request_handler::make_raster_metatile(int z, int x, int y,
+                                                  int x0, int y0, int size) {
+  // the block is rendered in one pass and sliced up, from the same
+  // vector tiles that each of its tiles would be rendered from on its
+  // own, merged together. so the PNGs have the same data whether
+  // metatiling is on or not, and labels aren't cut between them.
+  std::vector<std::unique_ptr<avecado::tile> > sources = source_tiles(z, x0, y0, size);
+
+  // without a source for the requested tile there's nothing to serve,
+  // and as nothing would be cached for it, making the rest of the block
+  // would be repeated on each request for it.
+  if (!sources[(y - y0) * size + (x - x0)]) {
+    return;
+  }
+
+  std::vector<bool> found(sources.size());
+  avecado::tile block(z, x0, y0);
+  for (std::size_t k = 0; k < sources.size(); ++k) {
+    if (sources[k]) {
+      found[k] = true;
+      block.merge(std::move(*sources[k]));
+    }
+  }
+
+  raster_map_->resize(256 * size, 256 * size);
+  raster_map_->zoom_to_box(avecado::util::box_for_metatile(z, x0, y0, size));
+
+  server_metrics::clock::time_point start = server_metrics::clock::now();
+  std::vector<mapnik::image_rgba8> images;
+  avecado::render_vector_metatile(images, block, *raster_map_, size, options_.scale_factor,
+                                  std::max(options_.buffer_size, 0));
+  record_phase(server_metrics::RENDER, start);
+
+  for (int j = 0; j < size; ++j) {
+    for (int i = 0; i < size; ++i) {
+      // tiles without a source are left out, as they would be if they
+      // were asked for on their own.
+      if (!found[j * size + i]) {
+        continue;
+      }
+      start = server_metrics::clock::now();
+      tile_cache::value_type png = std::make_shared<const encoded_tile>(
+        mapnik::save_to_string(images[j * size + i], "png"));
+      record_phase(server_metrics::SERIALISE, start);
+      options_.cache->put(z, x0 + i, y0 + j, "png", png);
+    }
+  }
+}
+
+bool mapnik_request_handler::make_tile(avecado::tile &tile) {
   // setup map parameters
   map_.resize(256, 256);
-  map_.zoom_to_box(avecado::util::box_for_tile(z, x, y));
+  map_.zoom_to_box(avecado::util::box_for_tile(tile.z, tile.x, tile.y));
 
   boost::optional<const avecado::post_processor &> pp = boost::none;
   if (options_.post_processor) {
     pp = *options_.post_processor;
   }
 
-  avecado::tile tile(z, x, y);
-
-  // actually making the vector tile
+  // actually making the vector tile. the time spent in the post
+  // processor is counted separately from the rest of the rendering.
+  const server_metrics::clock::time_point start = server_metrics::clock::now();
+  server_metrics::clock::duration post_process_time = server_metrics::clock::duration::zero();
   bool painted = avecado::make_vector_tile(
     tile, options_.path_multiplier, map_, options_.buffer_size,
     options_.scale_factor, options_.offset_x, options_.offset_y,
     options_.tolerance, options_.image_format, options_.scaling_method,
-    options_.scale_denominator, pp);
+    options_.scale_denominator, pp, &post_process_time);
 
-  // Fill out the reply to be sent to the client.
-  rep.status = reply::ok;
-  rep.is_hard_error = false;
-  rep.content = painted ? tile.get_data(options_.compression_level) : "";
-  rep.headers.resize(7);
-  rep.headers[0].name = "Content-Length";
-  rep.headers[0].value = boost::lexical_cast<std::string>(rep.content.size());
-  rep.headers[1].name = "Content-Type";
-  rep.headers[1].value = "application/octet-stream";
-  rep.headers[2].name = "Access-Control-Allow-Origin";
-  rep.headers[2].value = "*";
-  rep.headers[3].name= "Access-Control-Allow-Methods";
-  rep.headers[3].value = "GET";
-  rep.headers[4].name = "Cache-control";
-  rep.headers[4].value = max_age_value_;
-  rep.headers[5].name = "Date";
-  rep.headers[5].value = make_http_date();
-  // make sure that the response header is set appropriately for the level
-  // of compression that we are applying, so that the client doesn't have
-  // to inspect the file and try to figure out if it's supposed to be
-  // compressed or not.
-  rep.headers[6].name = "Content-Encoding";
-  if (options_.compression_level == 0) {
-    rep.headers[6].value = "identity";
-  } else {
-    rep.headers[6].value = "gzip";
+  if (options_.metrics) {
+    options_.metrics->record_phase(server_metrics::RENDER,
+                                   (server_metrics::clock::now() - start) - post_process_time);
+    if (pp) {
+      options_.metrics->record_phase(server_metrics::POST_PROCESS, post_process_time);
+    }
+  }
+
+  return painted;
+}
+
+void mapnik_request_handler::record_phase(server_metrics::phase p,
+                                          server_metrics::clock::time_point start) {
+  if (options_.metrics) {
+    options_.metrics->record_phase(p, server_metrics::clock::now() - start);
+  }
+}
+
+std::shared_ptr<prefetcher> make_prefetcher(const mapnik_server_options &options) {
+  // the prefetch thread's handler mustn't record its own tiles, or it
+  // would go on to prefetch the whole world. nor should its requests
+  // show up in the access log, or its renders in the metrics, which
+  // are for the time clients spend waiting.
+  mapnik_server_options prefetch_options(options);
+  prefetch_options.prefetch.reset();
+  prefetch_options.logger.reset();
+  prefetch_options.metrics.reset();
+
+  return std::make_shared<prefetcher>([prefetch_options]() -> prefetcher::make_function {
+      std::shared_ptr<mapnik_request_handler> handler =
+        std::make_shared<mapnik_request_handler>(prefetch_options, "");
+      return [handler](int z, int x, int y, const std::string &encoding) {
+        handler->prefetch(z, x, y, encoding);
+      };
+    });
+}
+
+void warm_cache(const mapnik_server_options &options, const std::vector<tile_id> &tiles,
+                std::size_t num_threads) {
+  if (!options.cache) {
+    return;
+  }
+
+  // as for the prefetcher, the warm-up isn't recorded or logged.
+  mapnik_server_options warm_options(options);
+  warm_options.prefetch.reset();
+  warm_options.logger.reset();
+  warm_options.metrics.reset();
+
+  // the threads take the next tile as they finish each one, so that a
+  // slow area doesn't hold up the rest.
+  const std::size_t count = std::max<std::size_t>(num_threads, 1);
+  std::atomic<std::size_t> next(0);
+  std::vector<std::exception_ptr> errors(count);
+  std::vector<std::thread> threads;
+  for (std::size_t i = 0; i < count; ++i) {
+    threads.emplace_back([&, i]() {
+        try {
+          mapnik_request_handler handler(warm_options, "");
+          for (std::size_t j = next++; j < tiles.size(); j = next++) {
+            const tile_id &t = tiles[j];
+            try {
+              handler.prefetch(t.z, t.x, t.y, "pbf");
+
+            } catch (const std::exception &e) {
+              std::cerr << "WARNING: Unable to warm up tile " << t.z << "/" << t.x << "/" << t.y
+                        << ": " << e.what() << "\n";
+            }
+          }
+
+        } catch (...) {
+          // e.g: the map couldn't be loaded, which the server would
+          // fail on anyway.
+          errors[i] = std::current_exception();
+        }
+      });
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  for (auto &ptr : errors) {
+    if (ptr) {
+      std::rethrow_exception(ptr);
+    }
   }
 }
 
@@ -1,41 +1,78 @@
 #include "http_server/parse_path.hpp"
 
-#include <boost/lexical_cast.hpp>
-#include <boost/algorithm/string/split.hpp>
-#include <boost/algorithm/string/classification.hpp>
-
 namespace http {
 namespace server3 {
 
+namespace {
+
+// parses an unsigned decimal number at p, moving p past it. numbers with
+// more digits than could fit in an int are refused.
+bool parse_int(const char *&p, const char *end, int &value)
+{
+  const char *start = p;
+  int v = 0;
+  while ((p != end) && (*p >= '0') && (*p <= '9')) {
+    if (p - start >= 9) {
+      return false;
+    }
+    v = v * 10 + (*p - '0');
+    ++p;
+  }
+
+  if (p == start) {
+    return false;
+  }
+  value = v;
+  return true;
+}
+
+inline bool is_alnum(char c)
+{
+  return ((c >= '0') && (c <= '9')) || ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z'));
+}
+
+} // anonymous namespace
+
 bool parse_path(const std::string &path, int &z, int &x, int &y)
 {
-  std::vector<std::string> splits;
-  boost::algorithm::split(splits, path, boost::algorithm::is_any_of("/."));
-  
+  std::string ext;
+  return parse_path(path, z, x, y, ext) && (ext == "pbf");
+}
+
+bool parse_path(const std::string &path, int &z, int &x, int &y, std::string &ext)
+{
+  return parse_path(path.data(), path.data() + path.size(), z, x, y, ext);
+}
+
+bool parse_path(const char *begin, const char *end, int &z, int &x, int &y, std::string &ext)
+{
   // we're expecting a leading /, then 3 numbers separated by /,
-  // then ".pbf" at the end.
-  if (splits.size() != 5) {
+  // then an extension such as ".pbf" at the end.
+  const char *p = begin;
+  if ((p == end) || (*p++ != '/')) {
     return false;
   }
-
-  if (splits[0] != "") {
+  if (!parse_int(p, end, z) || (p == end) || (*p++ != '/')) {
     return false;
   }
-
-  if (splits[4] != "pbf") {
+  if (!parse_int(p, end, x) || (p == end) || (*p++ != '/')) {
+    return false;
+  }
+  if (!parse_int(p, end, y) || (p == end) || (*p++ != '.')) {
     return false;
   }
 
-  try {
-    z = boost::lexical_cast<int>(splits[1]);
-    x = boost::lexical_cast<int>(splits[2]);
-    y = boost::lexical_cast<int>(splits[3]);
-
-    return true;
-
-  } catch (...) {
+  if (p == end) {
     return false;
   }
+  for (const char *c = p; c != end; ++c) {
+    if (!is_alnum(*c)) {
+      return false;
+    }
+  }
+
+  ext.assign(p, end);
+  return true;
 }
 
 } }
@@ -0,0 +1,220 @@
+#include "http_server/prefetcher.hpp"
+
+#include <iostream>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+namespace http { namespace server3 {
+
+namespace {
+
+// once this many predictions have been made, the counts are halved,
+// so that the weights follow what clients have been doing lately.
+const double DECAY_THRESHOLD = 4096;
+
+// niceness of the prefetch thread, so that the OS schedules it after
+// the threads handling foreground requests.
+const int PREFETCH_NICENESS = 19;
+
+} // anonymous namespace
+
+bool prefetcher::key::operator==(const key &other) const {
+  return (z == other.z) && (x == other.x) && (y == other.y) &&
+    (encoding == other.encoding);
+}
+
+std::size_t prefetcher::key_hash::operator()(const key &k) const {
+  std::size_t h = std::hash<int>()(k.z);
+  h = h * 31 + std::hash<int>()(k.x);
+  h = h * 31 + std::hash<int>()(k.y);
+  h = h * 31 + std::hash<std::string>()(k.encoding);
+  return h;
+}
+
+prefetcher::prefetcher(setup_function setup, std::size_t max_candidates)
+  : max_candidates_(max_candidates),
+    shutdown_(false),
+    num_pending_(0),
+    num_foreground_(0),
+    num_prefetched_(0) {
+  for (int i = 0; i < NUM_KINDS; ++i) {
+    predicted_[i] = 0;
+    hits_[i] = 0;
+  }
+
+  thread_ = std::thread(&prefetcher::thread_func, this, std::move(setup));
+}
+
+prefetcher::~prefetcher() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
+void prefetcher::record(int z, int x, int y, const std::string &encoding) {
+  const key k = {z, x, y, encoding};
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    // if the tile was predicted, then that prediction was a hit, and
+    // there's no need to prefetch it any more.
+    auto itr = index_.find(k);
+    if (itr != index_.end()) {
+      const candidate &c = *(itr->second);
+      for (int i = 0; i < NUM_KINDS; ++i) {
+        if (c.kinds & (1u << i)) { hits_[i] += 1; }
+      }
+      if (!c.done) { --num_pending_; }
+      candidates_.erase(itr->second);
+      index_.erase(itr);
+    }
+
+    // all the predictions from this tile get the same weight, rather
+    // than each one lowering it for the next.
+    const double neighbour_weight = weight(NEIGHBOUR);
+    const double child_weight = weight(CHILD);
+    const int max_coord = 1 << z;
+
+    for (int dy = -1; dy <= 1; ++dy) {
+      for (int dx = -1; dx <= 1; ++dx) {
+        const int nx = x + dx, ny = y + dy;
+        if (((dx != 0) || (dy != 0)) &&
+            (nx >= 0) && (nx < max_coord) && (ny >= 0) && (ny < max_coord)) {
+          predict(key{z, nx, ny, encoding}, NEIGHBOUR, neighbour_weight);
+        }
+      }
+    }
+
+    if (z < MAX_ZOOM) {
+      for (int dy = 0; dy <= 1; ++dy) {
+        for (int dx = 0; dx <= 1; ++dx) {
+          predict(key{z + 1, 2 * x + dx, 2 * y + dy, encoding}, CHILD, child_weight);
+        }
+      }
+    }
+
+    if ((predicted_[NEIGHBOUR] + predicted_[CHILD]) > DECAY_THRESHOLD) {
+      for (int i = 0; i < NUM_KINDS; ++i) {
+        predicted_[i] /= 2;
+        hits_[i] /= 2;
+      }
+    }
+
+    trim();
+  }
+
+  cond_.notify_one();
+}
+
+void prefetcher::begin_request() {
+  ++num_foreground_;
+}
+
+void prefetcher::end_request() {
+  if (--num_foreground_ == 0) {
+    // take the lock so that the notification can't slip in between
+    // the prefetch thread checking the count and starting to wait.
+    { std::unique_lock<std::mutex> lock(mutex_); }
+    cond_.notify_one();
+  }
+}
+
+std::size_t prefetcher::num_prefetched() const {
+  return num_prefetched_;
+}
+
+double prefetcher::weight(kind k) const {
+  // the fraction of predictions which were hits, starting from an
+  // even chance when nothing has been seen yet.
+  return (hits_[k] + 1) / (predicted_[k] + 2);
+}
+
+void prefetcher::predict(const key &k, kind kd, double w) {
+  predicted_[kd] += 1;
+
+  auto itr = index_.find(k);
+  if (itr != index_.end()) {
+    candidate &c = *(itr->second);
+    c.score += w;
+    c.kinds |= (1u << kd);
+    candidates_.splice(candidates_.begin(), candidates_, itr->second);
+
+  } else {
+    candidates_.push_front(candidate{k, w, 1u << kd, false});
+    index_[k] = candidates_.begin();
+    ++num_pending_;
+  }
+}
+
+void prefetcher::trim() {
+  while (candidates_.size() > max_candidates_) {
+    const candidate &c = candidates_.back();
+    if (!c.done) { --num_pending_; }
+    index_.erase(c.k);
+    candidates_.pop_back();
+  }
+}
+
+prefetcher::candidate_list::iterator prefetcher::best() {
+  auto best = candidates_.end();
+  for (auto itr = candidates_.begin(); itr != candidates_.end(); ++itr) {
+    if (!itr->done && ((best == candidates_.end()) || (itr->score > best->score))) {
+      best = itr;
+    }
+  }
+  return best;
+}
+
+void prefetcher::thread_func(setup_function setup) {
+#ifdef __linux__
+  // on Linux, the niceness of a thread can be set on its own.
+  setpriority(PRIO_PROCESS, pid_t(syscall(SYS_gettid)), PREFETCH_NICENESS);
+#endif
+
+  make_function make;
+  try {
+    make = setup();
+
+  } catch (const std::exception &e) {
+    std::cerr << "ERROR: Unable to set up prefetching, so it is disabled: " << e.what() << "\n";
+    return;
+  }
+
+  while (true) {
+    key k;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (!shutdown_ && ((num_pending_ == 0) || (num_foreground_ > 0))) {
+        cond_.wait(lock);
+      }
+      if (shutdown_) {
+        break;
+      }
+
+      auto itr = best();
+      itr->done = true;
+      --num_pending_;
+      k = itr->k;
+    }
+
+    try {
+      make(k.z, k.x, k.y, k.encoding);
+      ++num_prefetched_;
+
+    } catch (const std::exception &e) {
+      std::cerr << "ERROR: Unable to prefetch tile " << k.z << "/" << k.x << "/" << k.y
+                << "." << k.encoding << ": " << e.what() << "\n";
+    }
+  }
+}
+
+} } // namespace http::server3
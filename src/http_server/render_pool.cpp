@@ -0,0 +1,184 @@
+#include "http_server/render_pool.hpp"
+#include <iostream>
+#include <boost/bind.hpp>
+
+namespace http {
+namespace server3 {
+
+namespace {
+
+// the pool which this thread is a worker of, if any.
+thread_local render_pool *current_pool = NULL;
+
+} // anonymous namespace
+
+render_pool::render_pool(std::size_t num_threads, std::size_t max_queued,
+                         boost::shared_ptr<handler_factory> factory,
+                         const std::string &port,
+                         server_metrics *metrics)
+  : factory_(factory),
+    port_(port),
+    max_queued_(max_queued),
+    metrics_(metrics),
+    shutdown_(false),
+    num_ready_(0),
+    setup_errors_(num_threads)
+{
+  for (std::size_t i = 0; i < num_threads; ++i)
+  {
+    threads_.push_back(boost::shared_ptr<boost::thread>(
+        new boost::thread(boost::bind(&render_pool::thread_func, this, i))));
+  }
+
+  // Wait for all the handlers to be set up, so that a bad configuration
+  // is reported now, rather than when the first request comes in.
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    while (num_ready_ < num_threads)
+    {
+      cond_.wait(lock);
+    }
+  }
+
+  for (auto &ptr : setup_errors_)
+  {
+    if (ptr)
+    {
+      stop();
+      std::rethrow_exception(ptr);
+    }
+  }
+}
+
+render_pool::~render_pool()
+{
+  stop();
+}
+
+bool render_pool::try_post(job j)
+{
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    if (jobs_.size() >= max_queued_)
+    {
+      return false;
+    }
+    jobs_.push_back(std::move(j));
+    if (metrics_) { metrics_->set_queue_depth(jobs_.size()); }
+  }
+  cond_.notify_one();
+  return true;
+}
+
+bool render_pool::try_post_background(job j)
+{
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    if (background_jobs_.size() >= max_queued_)
+    {
+      return false;
+    }
+    background_jobs_.push_back(std::move(j));
+  }
+  cond_.notify_one();
+  return true;
+}
+
+std::size_t render_pool::size() const
+{
+  return threads_.size();
+}
+
+render_pool *render_pool::current()
+{
+  return current_pool;
+}
+
+void render_pool::thread_func(std::size_t i)
+{
+  bool ok = true;
+  try
+  {
+    factory_->thread_setup(handlers_, port_);
+  }
+  catch (...)
+  {
+    setup_errors_[i] = std::current_exception();
+    ok = false;
+  }
+
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    ++num_ready_;
+  }
+  cond_.notify_all();
+
+  if (!ok) { return; }
+  current_pool = this;
+
+  while (true)
+  {
+    job j;
+
+    {
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      while (jobs_.empty() && background_jobs_.empty() && !shutdown_)
+      {
+        cond_.wait(lock);
+      }
+      if (shutdown_)
+      {
+        break;
+      }
+
+      // Background jobs only get a look in once every waiting request
+      // has been started.
+      if (!jobs_.empty())
+      {
+        j = std::move(jobs_.front());
+        jobs_.pop_front();
+        if (metrics_) { metrics_->set_queue_depth(jobs_.size()); }
+      }
+      else
+      {
+        j = std::move(background_jobs_.front());
+        background_jobs_.pop_front();
+      }
+    }
+
+    try
+    {
+      j(*handlers_);
+    }
+    catch (const std::exception &e)
+    {
+      std::cerr << "ERROR: Render job failed: " << e.what() << "\n";
+    }
+    catch (...)
+    {
+      std::cerr << "ERROR: Render job failed with UNKNOWN ERROR\n";
+    }
+  }
+}
+
+void render_pool::stop()
+{
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    shutdown_ = true;
+    // Queued jobs hold on to their connections, so let them go now.
+    jobs_.clear();
+    background_jobs_.clear();
+    if (metrics_) { metrics_->set_queue_depth(0); }
+  }
+  cond_.notify_all();
+
+  for (auto &thread : threads_)
+  {
+    thread->join();
+  }
+  threads_.clear();
+}
+
+} // namespace server3
+} // namespace http
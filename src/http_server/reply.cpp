@@ -18,76 +18,80 @@ namespace server3 {
 namespace status_strings {
 
 const std::string ok =
-  "HTTP/1.0 200 OK\r\n";
+  "HTTP/1.1 200 OK\r\n";
 const std::string created =
-  "HTTP/1.0 201 Created\r\n";
+  "HTTP/1.1 201 Created\r\n";
 const std::string accepted =
-  "HTTP/1.0 202 Accepted\r\n";
+  "HTTP/1.1 202 Accepted\r\n";
 const std::string no_content =
-  "HTTP/1.0 204 No Content\r\n";
+  "HTTP/1.1 204 No Content\r\n";
 const std::string multiple_choices =
-  "HTTP/1.0 300 Multiple Choices\r\n";
+  "HTTP/1.1 300 Multiple Choices\r\n";
 const std::string moved_permanently =
-  "HTTP/1.0 301 Moved Permanently\r\n";
+  "HTTP/1.1 301 Moved Permanently\r\n";
 const std::string moved_temporarily =
-  "HTTP/1.0 302 Moved Temporarily\r\n";
+  "HTTP/1.1 302 Moved Temporarily\r\n";
 const std::string not_modified =
-  "HTTP/1.0 304 Not Modified\r\n";
+  "HTTP/1.1 304 Not Modified\r\n";
 const std::string bad_request =
-  "HTTP/1.0 400 Bad Request\r\n";
+  "HTTP/1.1 400 Bad Request\r\n";
 const std::string unauthorized =
-  "HTTP/1.0 401 Unauthorized\r\n";
+  "HTTP/1.1 401 Unauthorized\r\n";
 const std::string forbidden =
-  "HTTP/1.0 403 Forbidden\r\n";
+  "HTTP/1.1 403 Forbidden\r\n";
 const std::string not_found =
-  "HTTP/1.0 404 Not Found\r\n";
+  "HTTP/1.1 404 Not Found\r\n";
+const std::string method_not_allowed =
+  "HTTP/1.1 405 Method Not Allowed\r\n";
 const std::string internal_server_error =
-  "HTTP/1.0 500 Internal Server Error\r\n";
+  "HTTP/1.1 500 Internal Server Error\r\n";
 const std::string not_implemented =
-  "HTTP/1.0 501 Not Implemented\r\n";
+  "HTTP/1.1 501 Not Implemented\r\n";
 const std::string bad_gateway =
-  "HTTP/1.0 502 Bad Gateway\r\n";
+  "HTTP/1.1 502 Bad Gateway\r\n";
 const std::string service_unavailable =
-  "HTTP/1.0 503 Service Unavailable\r\n";
+  "HTTP/1.1 503 Service Unavailable\r\n";
 
-boost::asio::const_buffer to_buffer(reply::status_type status)
+const std::string &to_string(reply::status_type status)
 {
   switch (status)
   {
   case reply::ok:
-    return boost::asio::buffer(ok);
+    return ok;
   case reply::created:
-    return boost::asio::buffer(created);
+    return created;
   case reply::accepted:
-    return boost::asio::buffer(accepted);
+    return accepted;
   case reply::no_content:
-    return boost::asio::buffer(no_content);
+    return no_content;
   case reply::multiple_choices:
-    return boost::asio::buffer(multiple_choices);
+    return multiple_choices;
   case reply::moved_permanently:
-    return boost::asio::buffer(moved_permanently);
+    return moved_permanently;
   case reply::moved_temporarily:
-    return boost::asio::buffer(moved_temporarily);
+    return moved_temporarily;
   case reply::not_modified:
-    return boost::asio::buffer(not_modified);
+    return not_modified;
   case reply::bad_request:
-    return boost::asio::buffer(bad_request);
+    return bad_request;
   case reply::unauthorized:
-    return boost::asio::buffer(unauthorized);
+    return unauthorized;
   case reply::forbidden:
-    return boost::asio::buffer(forbidden);
+    return forbidden;
   case reply::not_found:
-    return boost::asio::buffer(not_found);
+    return not_found;
+  case reply::method_not_allowed:
+    return method_not_allowed;
   case reply::internal_server_error:
-    return boost::asio::buffer(internal_server_error);
+    return internal_server_error;
   case reply::not_implemented:
-    return boost::asio::buffer(not_implemented);
+    return not_implemented;
   case reply::bad_gateway:
-    return boost::asio::buffer(bad_gateway);
+    return bad_gateway;
   case reply::service_unavailable:
-    return boost::asio::buffer(service_unavailable);
+    return service_unavailable;
   default:
-    return boost::asio::buffer(internal_server_error);
+    return internal_server_error;
   }
 }
 
@@ -100,21 +104,56 @@ const char crlf[] = { '\r', '\n' };
 
 } // namespace misc_strings
 
+void reply::append_header(const char *name, const std::string &value)
+{
+  header_block.append(name);
+  header_block.append(misc_strings::name_value_separator, sizeof(misc_strings::name_value_separator));
+  header_block.append(value);
+  header_block.append(misc_strings::crlf, sizeof(misc_strings::crlf));
+}
+
+void reply::append_header(const char *name, std::size_t value)
+{
+  char digits[24];
+  char *end = digits + sizeof(digits);
+  char *begin = end;
+  do
+  {
+    *--begin = char('0' + value % 10);
+    value /= 10;
+  }
+  while (value > 0);
+
+  header_block.append(name);
+  header_block.append(misc_strings::name_value_separator, sizeof(misc_strings::name_value_separator));
+  header_block.append(begin, end);
+  header_block.append(misc_strings::crlf, sizeof(misc_strings::crlf));
+}
+
+const std::string &reply::body() const
+{
+  return shared_content ? *shared_content : content;
+}
+
 std::vector<boost::asio::const_buffer> reply::to_buffers()
 {
   std::vector<boost::asio::const_buffer> buffers;
   if (!is_hard_error) {
-     buffers.push_back(status_strings::to_buffer(status));
+     head.clear();
+     head.append(status_strings::to_string(status));
      for (std::size_t i = 0; i < headers.size(); ++i)
      {
         header& h = headers[i];
-        buffers.push_back(boost::asio::buffer(h.name));
-        buffers.push_back(boost::asio::buffer(misc_strings::name_value_separator));
-        buffers.push_back(boost::asio::buffer(h.value));
-        buffers.push_back(boost::asio::buffer(misc_strings::crlf));
+        head.append(h.name);
+        head.append(misc_strings::name_value_separator, sizeof(misc_strings::name_value_separator));
+        head.append(h.value);
+        head.append(misc_strings::crlf, sizeof(misc_strings::crlf));
      }
-     buffers.push_back(boost::asio::buffer(misc_strings::crlf));
-     buffers.push_back(boost::asio::buffer(content));
+     head.append(header_block);
+     head.append(misc_strings::crlf, sizeof(misc_strings::crlf));
+
+     buffers.push_back(boost::asio::buffer(head));
+     buffers.push_back(boost::asio::buffer(body()));
   }
   return buffers;
 }
@@ -177,6 +216,11 @@ const char not_found[] =
   "<head><title>Not Found</title></head>"
   "<body><h1>404 Not Found</h1></body>"
   "</html>";
+const char method_not_allowed[] =
+  "<html>"
+  "<head><title>Method Not Allowed</title></head>"
+  "<body><h1>405 Method Not Allowed</h1></body>"
+  "</html>";
 const char internal_server_error[] =
   "<html>"
   "<head><title>Internal Server Error</title></head>"
@@ -226,6 +270,8 @@ std::string to_string(reply::status_type status)
     return forbidden;
   case reply::not_found:
     return not_found;
+  case reply::method_not_allowed:
+    return method_not_allowed;
   case reply::internal_server_error:
     return internal_server_error;
   case reply::not_implemented:
@@ -10,6 +10,8 @@
 
 #include "http_server/request_parser.hpp"
 #include "http_server/request.hpp"
+#include <algorithm>
+#include <cstring>
 
 namespace http {
 namespace server3 {
@@ -24,6 +26,116 @@ void request_parser::reset()
   state_ = method_start;
 }
 
+boost::tuple<boost::tribool, char *> request_parser::parse(request& req,
+    char *begin, char *end)
+{
+  if (state_ == method_start)
+  {
+    const char *done = parse_whole(req, begin, end);
+    if (done)
+    {
+      boost::tribool result = true;
+      return boost::make_tuple(result, begin + (done - begin));
+    }
+
+    // Start again, a byte at a time.
+    req.headers.clear();
+  }
+
+  return parse<char *>(req, begin, end);
+}
+
+const char *request_parser::parse_whole(request& req,
+    const char *begin, const char *end)
+{
+  // The request ends with a blank line. Every line ends in a CRLF, which
+  // stops each of the loops below, so they can't run past the end.
+  static const char blank_line[] = "\r\n\r\n";
+  const char *request_end = std::search(begin, end, blank_line, blank_line + 4);
+  if (request_end == end)
+  {
+    return NULL;
+  }
+  request_end += 4;
+
+  const char *p = begin;
+
+  const char *method_begin = p;
+  while (is_token(*p)) { ++p; }
+  if ((p == method_begin) || (*p != ' '))
+  {
+    return NULL;
+  }
+  const char *method_end = p++;
+
+  const char *uri_begin = p;
+  while ((*p != ' ') && !is_ctl(*p)) { ++p; }
+  if (*p != ' ')
+  {
+    return NULL;
+  }
+  const char *uri_end = p++;
+
+  int major = 0, minor = 0;
+  if ((request_end - p < 5) || (std::memcmp(p, "HTTP/", 5) != 0))
+  {
+    return NULL;
+  }
+  p += 5;
+  if (!parse_version(p, major) || (*p++ != '.') || !parse_version(p, minor) ||
+      (p[0] != '\r') || (p[1] != '\n'))
+  {
+    return NULL;
+  }
+  p += 2;
+
+  while (*p != '\r')
+  {
+    const char *name_begin = p;
+    while (is_token(*p)) { ++p; }
+    if ((p == name_begin) || (p[0] != ':') || (p[1] != ' '))
+    {
+      return NULL;
+    }
+    const char *name_end = p;
+    p += 2;
+
+    const char *value_begin = p;
+    while (!is_ctl(*p)) { ++p; }
+    if ((p[0] != '\r') || (p[1] != '\n'))
+    {
+      return NULL;
+    }
+
+    req.headers.push_back(header());
+    req.headers.back().name.assign(name_begin, name_end);
+    req.headers.back().value.assign(value_begin, p);
+    p += 2;
+  }
+  if ((p[1] != '\n') || (p + 2 != request_end))
+  {
+    return NULL;
+  }
+
+  req.method.assign(method_begin, method_end);
+  req.uri.assign(uri_begin, uri_end);
+  req.http_version_major = major;
+  req.http_version_minor = minor;
+  return request_end;
+}
+
+bool request_parser::parse_version(const char *&p, int &version)
+{
+  // Versions are only ever a digit or so, anything longer is unusual.
+  const char *begin = p;
+  version = 0;
+  while (is_digit(*p) && (p - begin < 3))
+  {
+    version = version * 10 + *p++ - '0';
+  }
+  return (p != begin) && !is_digit(*p);
+}
+
 boost::tribool request_parser::consume(request& req, char input)
 {
   switch (state_)
@@ -306,6 +418,11 @@ bool request_parser::is_tspecial(int c)
   }
 }
 
+bool request_parser::is_token(int c)
+{
+  return is_char(c) && !is_ctl(c) && !is_tspecial(c);
+}
+
 bool request_parser::is_digit(int c)
 {
   return c >= '0' && c <= '9';
@@ -10,10 +10,18 @@
 
 #include "http_server/server.hpp"
 #include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/format.hpp>
 #include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 // for the Map object destructor
 #include <mapnik/map.hpp>
@@ -21,15 +29,71 @@
 #include <mapnik/load_map.hpp>
 
 namespace {
+#if defined(SO_REUSEPORT)
+// the SO_REUSEPORT socket option, which asio doesn't provide. this
+// meets asio's SettableSocketOption requirements.
+class reuse_port_option {
+public:
+  explicit reuse_port_option(bool enabled) : value_(enabled ? 1 : 0) {}
+
+  template <typename Protocol>
+  int level(const Protocol &) const { return SOL_SOCKET; }
+
+  template <typename Protocol>
+  int name(const Protocol &) const { return SO_REUSEPORT; }
+
+  template <typename Protocol>
+  const int *data(const Protocol &) const { return &value_; }
+
+  template <typename Protocol>
+  std::size_t size(const Protocol &) const { return sizeof(value_); }
+
+private:
+  int value_;
+};
+#endif // defined(SO_REUSEPORT)
+
+// pin the calling thread to a CPU.
+void pin_to_cpu(unsigned int cpu) {
+#ifdef __linux__
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+    std::cerr << "WARNING: Unable to pin thread to CPU " << cpu << ".\n";
+  }
+#endif
+}
+
 // function to set up the mapnik::Map object on the thread
 // immediately after it has been created.
-void setup_thread(const boost::shared_ptr<http::server3::handler_factory> &factory,
-                  std::string port,
-                  boost::thread_specific_ptr<http::server3::request_handler> &ptr,
-                  boost::asio::io_service *service,
-                  std::exception_ptr &error) {
+// if the requests are handled on a separate render pool, then the
+// I/O threads don't need a handler of their own. if cpu is negative,
+// the thread isn't pinned.
+void setup_handler(const boost::shared_ptr<http::server3::handler_factory> &factory,
+                   const std::string &port,
+                   boost::thread_specific_ptr<http::server3::request_handler> &ptr,
+                   bool needs_handler,
+                   int cpu,
+                   std::exception_ptr &error) {
+  try {
+    // pinned first, so that the handler's memory is allocated close
+    // to the CPU which will use it.
+    if (cpu >= 0) {
+      pin_to_cpu(cpu);
+    }
+    if (needs_handler) {
+      factory->thread_setup(ptr, port);
+    }
+
+  } catch (...) {
+    error = std::current_exception();
+  }
+}
+
+// run the io_service until the server is stopped.
+void run_service(boost::asio::io_service *service, std::exception_ptr &error) {
   try {
-    factory->thread_setup(ptr, port);
     service->run();
 
   } catch (const std::exception &e) {
@@ -41,21 +105,59 @@ void setup_thread(const boost::shared_ptr<http::server3::handler_factory> &facto
     error = std::current_exception();
   }
 }
+
+// the body of each of the server's threads. once the handler is set
+// up, the thread waits at the barrier for the others, and then again
+// while the server starts listening.
+void setup_thread(const boost::shared_ptr<http::server3::handler_factory> &factory,
+                  std::string port,
+                  boost::thread_specific_ptr<http::server3::request_handler> &ptr,
+                  boost::asio::io_service *service,
+                  bool needs_handler,
+                  int cpu,
+                  boost::shared_ptr<boost::barrier> ready,
+                  std::exception_ptr &error) {
+  setup_handler(factory, port, ptr, needs_handler, cpu, error);
+  ready->wait();
+  ready->wait();
+
+  if (!error) {
+    run_service(service, error);
+  }
+}
 }
 
 namespace http {
 namespace server3 {
 
+server::listener::listener()
+  : io_service(),
+    acceptor(io_service),
+    new_connection()
+{
+}
+
 server::server(const std::string& address, const server_options &options)
   : thread_pool_size_(options.thread_hint),
-    signals_(io_service_),
-    acceptor_(io_service_),
-    new_connection_(),
+    pin_threads_(options.pin_threads),
+    listeners_(make_listeners(options.reuse_port ? std::max<std::size_t>(options.thread_hint, 1) : 1)),
+    signals_(listeners_[0]->io_service),
+    reload_signals_(listeners_[0]->io_service),
+    reload_(options.reload),
     factory_(options.factory),
-    port_(options.port)
+    port_(options.port),
+    keepalive_timeout_(options.keepalive_timeout),
+    metrics_(options.metrics)
 {
   using boost::asio::ip::tcp;
 
+#ifndef __linux__
+  if (pin_threads_)
+  {
+    throw std::runtime_error("Pinning threads to CPUs is only supported on Linux.");
+  }
+#endif
+
   // Register to handle the signals that indicate when the server should exit.
   // It is safe to register for the same signal multiple times in a program,
   // provided all registration for the specified signal is made through Asio.
@@ -66,23 +168,37 @@ server::server(const std::string& address, const server_options &options)
 #endif // defined(SIGQUIT)
   signals_.async_wait(boost::bind(&server::handle_stop, this));
 
-  tcp::resolver resolver(io_service_);
+#if defined(SIGHUP)
+  if (reload_) {
+    reload_signals_.add(SIGHUP);
+    reload_signals_.async_wait(boost::bind(&server::handle_reload, this,
+                                           boost::asio::placeholders::error));
+  }
+#endif // defined(SIGHUP)
+
+  tcp::resolver resolver(listeners_[0]->io_service);
   tcp::resolver::query query(address, port_);
   tcp::endpoint endpoint = *resolver.resolve(query);
 
-  // Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
-  acceptor_.open(endpoint.protocol());
-  acceptor_.set_option(tcp::acceptor::reuse_address(true));
-  acceptor_.bind(endpoint);
-
-  // get the actual port bound
-  endpoint = acceptor_.local_endpoint();
+  // get the actual port bound from the first acceptor, so that if it
+  // was left for the OS to choose, the others bind to the same one.
+  open_acceptor(*listeners_[0], endpoint, options.reuse_port);
+  endpoint = listeners_[0]->acceptor.local_endpoint();
   port_ = (boost::format("%1%") % endpoint.port()).str();
 
-  // listen on the socket
-  acceptor_.listen();
+  for (std::size_t i = 1; i < listeners_.size(); ++i) {
+    open_acceptor(*listeners_[i], endpoint, options.reuse_port);
+  }
+
+  // start the render threads before accepting any connections which
+  // might need them.
+  if (options.render_threads > 0) {
+    render_pool_.reset(new render_pool(options.render_threads, options.render_queue_size,
+                                       factory_, port_, metrics_.get()));
+  }
 
-  start_accept();
+  // the sockets aren't listened on until the threads' handlers are all
+  // set up, in run(), so that connections aren't left waiting for them.
 }
 
 server::~server()
@@ -95,9 +211,18 @@ void server::run(bool include_current_thread)
   // back their errors to the main thread.
   thread_errors_.resize(thread_pool_size_);
 
+  // with a listener per thread, each thread runs its own io_service.
+  // otherwise they all run the one.
+  const unsigned int num_cpus = std::max(1u, boost::thread::hardware_concurrency());
+
+  // the new threads and this one meet here once the handlers are set
+  // up, and again once the server is listening.
+  const std::size_t first_thread = (include_current_thread ? 1 : 0);
+  boost::shared_ptr<boost::barrier> ready(
+    new boost::barrier(thread_pool_size_ - std::min(first_thread, thread_pool_size_) + 1));
+
   // Create a pool of threads to run all of the io_services.
-  for (std::size_t i = (include_current_thread ? 1 : 0);
-       i < thread_pool_size_; ++i)
+  for (std::size_t i = first_thread; i < thread_pool_size_; ++i)
   {
     boost::shared_ptr<boost::thread> thread(
         new boost::thread(
@@ -106,19 +231,46 @@ void server::run(bool include_current_thread)
                 factory_,
                 port_,
                 boost::ref(thread_specific_ptr_),
-                &io_service_,
+                &listeners_[i % listeners_.size()]->io_service,
+                !render_pool_,
+                pin_threads_ ? int(i % num_cpus) : -1,
+                ready,
                 boost::ref(thread_errors_[i]))));
     threads_.push_back(thread);
   }
 
   if (include_current_thread) {
-    setup_thread(factory_, port_, boost::ref(thread_specific_ptr_),
-                 &io_service_, boost::ref(thread_errors_[0]));
+    setup_handler(factory_, port_, thread_specific_ptr_, !render_pool_,
+                  pin_threads_ ? 0 : -1, thread_errors_[0]);
+  }
+  ready->wait();
+
+  // a bad configuration is reported now, rather than when the first
+  // request comes in.
+  const bool setup_failed = std::any_of(thread_errors_.begin(), thread_errors_.end(),
+                                        [](const std::exception_ptr &e) { return bool(e); });
+  if (setup_failed) {
+    handle_stop();
+  } else {
+    for (auto &l : listeners_) {
+      l->acceptor.listen();
+      start_accept(*l);
+    }
+  }
+  ready->wait();
+
+  if (setup_failed) {
+    stop();
+    return;
   }
 
   std::cout << "Server starting on port " << port_
             << ". Tiles should be available on URLs like "
             << "http://localhost:" << port_ << "/0/0/0.pbf" << std::endl;
+
+  if (include_current_thread) {
+    run_service(&listeners_[0]->io_service, thread_errors_[0]);
+  }
 }
 
 void server::stop()
@@ -141,6 +293,9 @@ void server::stop()
      }
    }
 
+   // nothing is going to collect the replies any more.
+   render_pool_.reset();
+
    // if any thread had an error, re-throw it now.
    for (auto &ptr : thread_errors_) {
      if (ptr) {
@@ -152,27 +307,77 @@ void server::stop()
    }
 }
 
-void server::start_accept()
+std::vector<boost::shared_ptr<server::listener> > server::make_listeners(std::size_t count)
+{
+  std::vector<boost::shared_ptr<listener> > listeners;
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    listeners.push_back(boost::shared_ptr<listener>(new listener));
+  }
+  return listeners;
+}
+
+void server::open_acceptor(listener &l, const boost::asio::ip::tcp::endpoint &endpoint,
+                           bool reuse_port)
 {
-  new_connection_.reset(new connection(io_service_, thread_specific_ptr_));
-  acceptor_.async_accept(new_connection_->socket(),
-      boost::bind(&server::handle_accept, this,
+  using boost::asio::ip::tcp;
+
+  // Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
+  l.acceptor.open(endpoint.protocol());
+  l.acceptor.set_option(tcp::acceptor::reuse_address(true));
+
+  // With SO_REUSEPORT, several acceptors can be bound to the same port, and
+  // the kernel shares the incoming connections between them.
+  if (reuse_port)
+  {
+#if defined(SO_REUSEPORT)
+    l.acceptor.set_option(reuse_port_option(true));
+#else
+    throw std::runtime_error("SO_REUSEPORT is not supported on this platform.");
+#endif // defined(SO_REUSEPORT)
+  }
+
+  l.acceptor.bind(endpoint);
+}
+
+void server::start_accept(listener &l)
+{
+  l.new_connection.reset(new connection(l.io_service, thread_specific_ptr_,
+                                        keepalive_timeout_, render_pool_.get(),
+                                        metrics_.get()));
+  l.acceptor.async_accept(l.new_connection->socket(),
+      boost::bind(&server::handle_accept, this, boost::ref(l),
         boost::asio::placeholders::error));
 }
 
-void server::handle_accept(const boost::system::error_code& e)
+void server::handle_accept(listener &l, const boost::system::error_code& e)
 {
   if (!e)
   {
-    new_connection_->start();
+    l.new_connection->start();
   }
 
-  start_accept();
+  start_accept(l);
 }
 
 void server::handle_stop()
 {
-  io_service_.stop();
+  for (auto &l : listeners_)
+  {
+    l->io_service.stop();
+  }
+}
+
+void server::handle_reload(const boost::system::error_code& e)
+{
+  if (e)
+  {
+    return;
+  }
+
+  reload_();
+  reload_signals_.async_wait(boost::bind(&server::handle_reload, this,
+                                         boost::asio::placeholders::error));
 }
 
 std::string server::port() const {
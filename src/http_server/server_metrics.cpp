@@ -0,0 +1,232 @@
+#include "http_server/server_metrics.hpp"
+#include "http_server/tile_cache.hpp"
+
+#include <boost/format.hpp>
+
+namespace http { namespace server3 {
+
+namespace {
+
+// ids to tell metrics objects apart, see local_ref.
+std::atomic<std::uint64_t> next_id(1);
+
+// only the owning thread writes to the counters, so a plain load and
+// store is enough, and avoids the cost of a locked add.
+inline void bump(std::atomic<std::uint64_t> &counter, std::uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline std::uint64_t get(const std::atomic<std::uint64_t> &counter) {
+  return counter.load(std::memory_order_relaxed);
+}
+
+inline std::uint64_t to_us(server_metrics::clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+} // anonymous namespace
+
+// the last entry catches every other status.
+const int server_metrics::STATUSES[server_metrics::NUM_STATUSES] = {
+  200, 304, 400, 404, 500, 503, 0
+};
+
+const char *const server_metrics::ENCODINGS[server_metrics::NUM_ENCODINGS] = {
+  "pbf", "png"
+};
+
+const char *const server_metrics::PHASE_NAMES[server_metrics::NUM_PHASES] = {
+  "render", "post_process", "serialise", "write"
+};
+
+const std::uint64_t server_metrics::LATENCY_BOUNDS_US[server_metrics::NUM_LATENCY_BOUNDS] = {
+  1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+  1000000, 2500000, 5000000, 10000000
+};
+
+const std::uint64_t server_metrics::BYTES_BOUNDS[server_metrics::NUM_BYTES_BOUNDS] = {
+  128, 512, 2048, 8192, 32768, 131072, 524288, 2097152, 8388608
+};
+
+template <std::size_t N>
+server_metrics::histogram<N>::histogram()
+  : count(0), sum(0) {
+  for (auto &b : buckets) {
+    b.store(0);
+  }
+}
+
+template <std::size_t N>
+void server_metrics::histogram<N>::record(const std::uint64_t (&bounds)[N], std::uint64_t value) {
+  std::size_t i = 0;
+  while ((i < N) && (value > bounds[i])) {
+    ++i;
+  }
+
+  bump(buckets[i], 1);
+  bump(count, 1);
+  bump(sum, value);
+}
+
+server_metrics::counters::counters()
+  : busy_us(0) {
+  for (auto &by_zoom : requests) {
+    for (auto &c : by_zoom) {
+      c.store(0);
+    }
+  }
+}
+
+server_metrics::server_metrics()
+  : id_(next_id++), queue_depth_(0) {
+}
+
+server_metrics::~server_metrics() {
+}
+
+void server_metrics::record_request(int status, int zoom) {
+  std::size_t s = 0;
+  while ((s < NUM_STATUSES - 1) && (STATUSES[s] != status)) {
+    ++s;
+  }
+
+  const std::size_t z = ((zoom >= 0) && (zoom <= MAX_ZOOM)) ? zoom : (MAX_ZOOM + 1);
+  bump(local().requests[s][z], 1);
+}
+
+void server_metrics::record_phase(phase p, clock::duration d) {
+  local().phases[p].record(LATENCY_BOUNDS_US, to_us(d));
+}
+
+void server_metrics::record_tile_bytes(const std::string &encoding, std::size_t bytes) {
+  const std::size_t e = (encoding == ENCODINGS[1]) ? 1 : 0;
+  local().tile_bytes[e].record(BYTES_BOUNDS, bytes);
+}
+
+void server_metrics::add_busy(clock::duration d) {
+  bump(local().busy_us, to_us(d));
+}
+
+void server_metrics::set_queue_depth(std::size_t depth) {
+  queue_depth_.store(depth, std::memory_order_relaxed);
+}
+
+server_metrics::counters &server_metrics::local() {
+  local_ref *ref = local_.get();
+  if ((ref != nullptr) && (ref->owner == id_)) {
+    return *(ref->c);
+  }
+
+  std::unique_ptr<counters> c(new counters);
+  counters *ptr = c.get();
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    threads_.emplace_back(std::move(c));
+  }
+  local_.reset(new local_ref{id_, ptr});
+  return *ptr;
+}
+
+template <std::size_t N>
+void server_metrics::write_histogram(std::ostream &out, const std::string &name,
+                                     const std::string &labels, double scale,
+                                     const std::uint64_t (&bounds)[N],
+                                     const std::vector<const histogram<N> *> &hs) {
+  std::uint64_t cumulative = 0, count = 0, sum = 0;
+  for (std::size_t i = 0; i <= N; ++i) {
+    for (const auto *h : hs) {
+      cumulative += get(h->buckets[i]);
+    }
+    const std::string le = (i < N) ? (boost::format("%1%") % (double(bounds[i]) * scale)).str() : "+Inf";
+    out << name << "_bucket{" << labels << ",le=\"" << le << "\"} " << cumulative << "\n";
+  }
+  for (const auto *h : hs) {
+    count += get(h->count);
+    sum += get(h->sum);
+  }
+  out << name << "_sum{" << labels << "} " << (double(sum) * scale) << "\n";
+  out << name << "_count{" << labels << "} " << count << "\n";
+}
+
+void server_metrics::write(std::ostream &out, const tile_cache *cache) const {
+  std::vector<const counters *> all;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (const auto &c : threads_) {
+      all.push_back(c.get());
+    }
+  }
+
+  out << "# HELP avecado_requests_total Requests answered, by status and the zoom of the tile requested.\n";
+  out << "# TYPE avecado_requests_total counter\n";
+  for (std::size_t s = 0; s < NUM_STATUSES; ++s) {
+    for (int z = 0; z <= MAX_ZOOM + 1; ++z) {
+      std::uint64_t total = 0;
+      for (const auto *c : all) {
+        total += get(c->requests[s][z]);
+      }
+      // most combinations never happen, so leave them out.
+      if (total == 0) { continue; }
+
+      out << "avecado_requests_total{status=\""
+          << ((STATUSES[s] != 0) ? std::to_string(STATUSES[s]) : std::string("other"))
+          << "\",zoom=\"" << ((z <= MAX_ZOOM) ? std::to_string(z) : std::string("none"))
+          << "\"} " << total << "\n";
+    }
+  }
+
+  out << "# HELP avecado_phase_duration_seconds Time spent in each phase of making and sending tiles.\n";
+  out << "# TYPE avecado_phase_duration_seconds histogram\n";
+  for (std::size_t p = 0; p < NUM_PHASES; ++p) {
+    std::vector<const histogram<NUM_LATENCY_BOUNDS> *> hs;
+    for (const auto *c : all) {
+      hs.push_back(&c->phases[p]);
+    }
+    write_histogram(out, "avecado_phase_duration_seconds",
+                    (boost::format("phase=\"%1%\"") % PHASE_NAMES[p]).str(),
+                    1.0e-6, LATENCY_BOUNDS_US, hs);
+  }
+
+  out << "# HELP avecado_tile_bytes Size of the tiles served.\n";
+  out << "# TYPE avecado_tile_bytes histogram\n";
+  for (std::size_t e = 0; e < NUM_ENCODINGS; ++e) {
+    std::vector<const histogram<NUM_BYTES_BOUNDS> *> hs;
+    for (const auto *c : all) {
+      hs.push_back(&c->tile_bytes[e]);
+    }
+    write_histogram(out, "avecado_tile_bytes",
+                    (boost::format("encoding=\"%1%\"") % ENCODINGS[e]).str(),
+                    1.0, BYTES_BOUNDS, hs);
+  }
+
+  out << "# HELP avecado_thread_busy_seconds_total Time each thread has spent handling requests.\n";
+  out << "# TYPE avecado_thread_busy_seconds_total counter\n";
+  for (std::size_t i = 0; i < all.size(); ++i) {
+    out << "avecado_thread_busy_seconds_total{thread=\"" << i << "\"} "
+        << (double(get(all[i]->busy_us)) * 1.0e-6) << "\n";
+  }
+
+  out << "# HELP avecado_render_queue_depth Requests waiting for a render thread.\n";
+  out << "# TYPE avecado_render_queue_depth gauge\n";
+  out << "avecado_render_queue_depth " << queue_depth_.load(std::memory_order_relaxed) << "\n";
+
+  if (cache != nullptr) {
+    out << "# HELP avecado_cache_hits_total Tiles found in the cache.\n";
+    out << "# TYPE avecado_cache_hits_total counter\n";
+    out << "avecado_cache_hits_total " << cache->hits() << "\n";
+    out << "# HELP avecado_cache_misses_total Tiles not found in the cache.\n";
+    out << "# TYPE avecado_cache_misses_total counter\n";
+    out << "avecado_cache_misses_total " << cache->misses() << "\n";
+    out << "# HELP avecado_cache_evictions_total Tiles evicted from the cache to stay within its size.\n";
+    out << "# TYPE avecado_cache_evictions_total counter\n";
+    out << "avecado_cache_evictions_total " << cache->evictions() << "\n";
+    out << "# HELP avecado_cache_tiles Tiles in the cache.\n";
+    out << "# TYPE avecado_cache_tiles gauge\n";
+    out << "avecado_cache_tiles " << cache->size() << "\n";
+    out << "# HELP avecado_cache_bytes Bytes of tiles in the cache.\n";
+    out << "# TYPE avecado_cache_bytes gauge\n";
+    out << "avecado_cache_bytes " << cache->bytes() << "\n";
+  }
+}
+
+} } // namespace http::server3
@@ -0,0 +1,30 @@
+#include "http_server/shared_tilejson.hpp"
+#include "http_server/content_encoding.hpp"
+
+namespace http { namespace server3 {
+
+shared_tilejson::shared_tilejson() : num_made_(0) {
+}
+
+void shared_tilejson::get(const std::function<std::string ()> &make, int compression_level,
+                          tile_cache::value_type &plain, tile_cache::value_type &gzipped) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!plain_) {
+    tile_cache::value_type p = std::make_shared<const encoded_tile>(make()), g;
+    if (compression_level != 0) {
+      g = std::make_shared<const encoded_tile>(gzip_compress(p->data, compression_level));
+    }
+    plain_ = p;
+    gzipped_ = g;
+    ++num_made_;
+  }
+  plain = plain_;
+  gzipped = gzipped_;
+}
+
+std::size_t shared_tilejson::num_made() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return num_made_;
+}
+
+} } // namespace http::server3
@@ -0,0 +1,230 @@
+#include "http_server/tile_batch.hpp"
+#include "http_server/request_handler.hpp"
+#include "http_server/config_diff.hpp"
+
+#include <cmath>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+
+namespace http { namespace server3 {
+
+namespace {
+
+// the furthest north or south which spherical mercator tiles reach.
+const double MAX_LATITUDE = 85.0511287798;
+
+// parses the whole of a string as a decimal integer.
+bool parse_number(const std::string &s, int &value) {
+  if (s.empty() || (s[0] < '0') || (s[0] > '9')) {
+    return false;
+  }
+  char *end = NULL;
+  errno = 0;
+  const long v = std::strtol(s.c_str(), &end, 10);
+  if ((*end != '\0') || (errno != 0) || (v > std::numeric_limits<int>::max())) {
+    return false;
+  }
+  value = int(v);
+  return true;
+}
+
+// parses the whole of a string as a floating point number.
+bool parse_number(const std::string &s, double &value) {
+  if (s.empty()) {
+    return false;
+  }
+  char *end = NULL;
+  value = std::strtod(s.c_str(), &end);
+  return (*end == '\0') && std::isfinite(value);
+}
+
+bool valid_tile(const tile_id &t) {
+  if ((t.z < 0) || (t.z > CONFIG_MAX_ZOOM)) {
+    return false;
+  }
+  const int max_coord = 1 << t.z;
+  return (t.x >= 0) && (t.x < max_coord) && (t.y >= 0) && (t.y < max_coord);
+}
+
+// tile column and row containing a point at the given zoom.
+int lon_to_x(double lon, int z) {
+  const int n = 1 << z;
+  const int x = int(std::floor((lon + 180.0) / 360.0 * n));
+  return std::min(std::max(x, 0), n - 1);
+}
+
+int lat_to_y(double lat, int z) {
+  const int n = 1 << z;
+  const double r = std::min(std::max(lat, -MAX_LATITUDE), MAX_LATITUDE) * M_PI / 180.0;
+  const int y = int(std::floor((1.0 - std::log(std::tan(r) + 1.0 / std::cos(r)) / M_PI) / 2.0 * n));
+  return std::min(std::max(y, 0), n - 1);
+}
+
+bool parse_tile_list(const std::string &list, std::size_t max_tiles, std::vector<tile_id> &tiles) {
+  std::vector<std::string> items;
+  boost::algorithm::split(items, list, boost::algorithm::is_any_of(","));
+  if (items.size() > max_tiles) {
+    return false;
+  }
+
+  for (const std::string &item : items) {
+    std::vector<std::string> parts;
+    boost::algorithm::split(parts, item, boost::algorithm::is_any_of("/"));
+    tile_id t;
+    if ((parts.size() != 3) ||
+        !parse_number(parts[0], t.z) || !parse_number(parts[1], t.x) || !parse_number(parts[2], t.y) ||
+        !valid_tile(t)) {
+      return false;
+    }
+    tiles.push_back(t);
+  }
+  return true;
+}
+
+bool parse_tile_range(const std::string &bbox, const std::string &minzoom, const std::string &maxzoom,
+                      std::size_t max_tiles, std::vector<tile_id> &tiles) {
+  std::vector<std::string> parts;
+  boost::algorithm::split(parts, bbox, boost::algorithm::is_any_of(","));
+  double west, south, east, north;
+  int z0, z1;
+  if ((parts.size() != 4) ||
+      !parse_number(parts[0], west) || !parse_number(parts[1], south) ||
+      !parse_number(parts[2], east) || !parse_number(parts[3], north) ||
+      !parse_number(minzoom, z0) || !parse_number(maxzoom, z1)) {
+    return false;
+  }
+  if ((west > east) || (south > north) || (z0 > z1) || (z1 > CONFIG_MAX_ZOOM)) {
+    return false;
+  }
+
+  // count them first, so that a huge range is refused before anything
+  // is allocated for it.
+  std::uint64_t count = 0;
+  for (int z = z0; z <= z1; ++z) {
+    count += std::uint64_t(lon_to_x(east, z) - lon_to_x(west, z) + 1) *
+             std::uint64_t(lat_to_y(south, z) - lat_to_y(north, z) + 1);
+    if (count > max_tiles) {
+      return false;
+    }
+  }
+
+  tiles.reserve(count);
+  for (int z = z0; z <= z1; ++z) {
+    const int x0 = lon_to_x(west, z), x1 = lon_to_x(east, z);
+    const int y0 = lat_to_y(north, z), y1 = lat_to_y(south, z);
+    for (int y = y0; y <= y1; ++y) {
+      for (int x = x0; x <= x1; ++x) {
+        tiles.push_back(tile_id{z, x, y});
+      }
+    }
+  }
+  return true;
+}
+
+void append_uint32(std::string &out, std::uint32_t v) {
+  const char bytes[4] = { char(v >> 24), char(v >> 16), char(v >> 8), char(v) };
+  out.append(bytes, 4);
+}
+
+} // anonymous namespace
+
+bool parse_batch_query(const std::string &query, std::size_t max_tiles,
+                       std::vector<tile_id> &tiles) {
+  std::string list, bbox, minzoom, maxzoom;
+  bool has_list = false, has_bbox = false;
+
+  std::vector<std::string> params;
+  boost::algorithm::split(params, query, boost::algorithm::is_any_of("&"));
+  for (const std::string &param : params) {
+    const std::string::size_type eq = param.find('=');
+    if (eq == std::string::npos) {
+      continue;
+    }
+    std::string value;
+    if (!request_handler::url_decode(param.substr(eq + 1), value)) {
+      return false;
+    }
+
+    const std::string name = param.substr(0, eq);
+    if (name == "tiles") {
+      list = value;
+      has_list = true;
+    } else if (name == "bbox") {
+      bbox = value;
+      has_bbox = true;
+    } else if (name == "minzoom") {
+      minzoom = value;
+    } else if (name == "maxzoom") {
+      maxzoom = value;
+    }
+  }
+
+  tiles.clear();
+  if (has_list == has_bbox) {
+    return false;
+  } else if (has_list) {
+    return parse_tile_list(list, max_tiles, tiles);
+  } else {
+    return parse_tile_range(bbox, minzoom, maxzoom, max_tiles, tiles);
+  }
+}
+
+void append_batch_record(std::string &out, const tile_id &tile, const std::string &body,
+                         bool gzipped) {
+  append_uint32(out, tile.z);
+  append_uint32(out, tile.x);
+  append_uint32(out, tile.y);
+  append_uint32(out, gzipped ? BATCH_RECORD_GZIPPED : 0);
+  append_uint32(out, body.size());
+  out.append(body);
+}
+
+tile_batch::tile_batch(std::vector<tile_id> tiles, std::shared_ptr<body_stream> stream)
+  : tiles_(std::move(tiles)), stream_(stream), next_(0), written_(0) {
+  if (tiles_.empty()) {
+    stream_->close();
+  }
+}
+
+tile_batch::~tile_batch() {
+  // does nothing if every record was written. otherwise some jobs were
+  // dropped without making their tiles, e.g: when the server stopped.
+  stream_->abort();
+}
+
+bool tile_batch::take(tile_id &tile) {
+  if (stream_->stopped()) {
+    return false;
+  }
+  const std::size_t i = next_++;
+  if (i >= tiles_.size()) {
+    return false;
+  }
+  tile = tiles_[i];
+  return true;
+}
+
+void tile_batch::write(const tile_id &tile, const std::string &body, bool gzipped) {
+  std::string record;
+  record.reserve(BATCH_RECORD_HEADER_SIZE + body.size());
+  append_batch_record(record, tile, body, gzipped);
+  stream_->write(record);
+  if (++written_ == tiles_.size()) {
+    stream_->close();
+  }
+}
+
+bool tile_batch::wait_for_room(body_stream::callback resume) {
+  return stream_->wait_for_room(std::move(resume));
+}
+
+void tile_batch::abort() {
+  stream_->abort();
+}
+
+} } // namespace http::server3
@@ -0,0 +1,223 @@
+#include "http_server/tile_cache.hpp"
+#include "http_server/etag.hpp"
+#include "http_server/content_encoding.hpp"
+
+#include <iterator>
+
+namespace http { namespace server3 {
+
+encoded_tile::encoded_tile(std::string d)
+  : data(std::move(d)), etag(make_etag(data)), gzipped(is_gzipped(data)) {
+}
+
+bool tile_cache::key::operator==(const key &other) const {
+  return (z == other.z) && (x == other.x) && (y == other.y) &&
+    (encoding == other.encoding);
+}
+
+std::size_t tile_cache::key_hash::operator()(const key &k) const {
+  std::size_t h = std::hash<int>()(k.z);
+  h = h * 31 + std::hash<int>()(k.x);
+  h = h * 31 + std::hash<int>()(k.y);
+  h = h * 31 + std::hash<std::string>()(k.encoding);
+  return h;
+}
+
+tile_cache::tile_cache(std::size_t max_bytes, clock::duration ttl,
+                       std::size_t num_shards)
+  : max_shard_bytes_(0), ttl_(ttl) {
+  if (num_shards == 0) {
+    num_shards = 1;
+  }
+  max_shard_bytes_ = max_bytes / num_shards;
+
+  shards_.reserve(num_shards);
+  for (std::size_t i = 0; i < num_shards; ++i) {
+    shards_.emplace_back(new shard);
+    shards_.back()->bytes = 0;
+    shards_.back()->hits = 0;
+    shards_.back()->misses = 0;
+    shards_.back()->evictions = 0;
+  }
+}
+
+tile_cache::~tile_cache() {
+}
+
+tile_cache::value_type tile_cache::get(int z, int x, int y, const std::string &encoding) {
+  const key k = {z, x, y, encoding};
+  shard &s = shard_for(k);
+
+  std::unique_lock<std::mutex> lock(s.mutex);
+  return lookup(s, k, clock::now());
+}
+
+void tile_cache::put(int z, int x, int y, const std::string &encoding, value_type data) {
+  const key k = {z, x, y, encoding};
+  shard &s = shard_for(k);
+
+  std::unique_lock<std::mutex> lock(s.mutex);
+  insert(s, k, data, clock::now());
+}
+
+tile_cache::value_type tile_cache::get_or_make(int z, int x, int y, const std::string &encoding,
+                                               const make_function &make) {
+  const key k = {z, x, y, encoding};
+  shard &s = shard_for(k);
+  std::promise<value_type> promise;
+
+  {
+    std::unique_lock<std::mutex> lock(s.mutex);
+
+    value_type data = lookup(s, k, clock::now());
+    if (data) {
+      ++s.hits;
+      return data;
+    }
+    ++s.misses;
+
+    auto itr = s.pending.find(k);
+    if (itr != s.pending.end()) {
+      std::shared_future<value_type> result = itr->second;
+      // don't hold the lock while waiting, or the thread making the
+      // tile won't be able to put it in the cache.
+      lock.unlock();
+      return result.get();
+    }
+
+    s.pending.emplace(k, promise.get_future().share());
+  }
+
+  // this thread is responsible for making the tile and letting
+  // everyone waiting on it know the outcome, whatever happens.
+  value_type data;
+  try {
+    data = make();
+
+  } catch (...) {
+    {
+      std::unique_lock<std::mutex> lock(s.mutex);
+      s.pending.erase(k);
+    }
+    promise.set_exception(std::current_exception());
+    throw;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(s.mutex);
+    if (data) {
+      insert(s, k, data, clock::now());
+    }
+    s.pending.erase(k);
+  }
+  promise.set_value(data);
+
+  return data;
+}
+
+std::size_t tile_cache::erase_if(const std::function<bool (int z, int x, int y, const std::string &encoding)> &pred) {
+  std::size_t dropped = 0;
+  for (auto &s : shards_) {
+    std::unique_lock<std::mutex> lock(s->mutex);
+    for (auto itr = s->entries.begin(); itr != s->entries.end(); ) {
+      auto next = std::next(itr);
+      if (pred(itr->k.z, itr->k.x, itr->k.y, itr->k.encoding)) {
+        erase(*s, itr);
+        ++dropped;
+      }
+      itr = next;
+    }
+  }
+  return dropped;
+}
+
+std::size_t tile_cache::size() const {
+  std::size_t total = 0;
+  for (const auto &s : shards_) {
+    std::unique_lock<std::mutex> lock(s->mutex);
+    total += s->entries.size();
+  }
+  return total;
+}
+
+std::size_t tile_cache::bytes() const {
+  std::size_t total = 0;
+  for (const auto &s : shards_) {
+    std::unique_lock<std::mutex> lock(s->mutex);
+    total += s->bytes;
+  }
+  return total;
+}
+
+std::size_t tile_cache::hits() const {
+  return total(&shard::hits);
+}
+
+std::size_t tile_cache::misses() const {
+  return total(&shard::misses);
+}
+
+std::size_t tile_cache::evictions() const {
+  return total(&shard::evictions);
+}
+
+std::size_t tile_cache::total(std::size_t shard::*counter) const {
+  std::size_t sum = 0;
+  for (const auto &s : shards_) {
+    std::unique_lock<std::mutex> lock(s->mutex);
+    sum += (*s).*counter;
+  }
+  return sum;
+}
+
+tile_cache::shard &tile_cache::shard_for(const key &k) {
+  return *shards_[key_hash()(k) % shards_.size()];
+}
+
+tile_cache::value_type tile_cache::lookup(shard &s, const key &k, clock::time_point now) {
+  auto itr = s.index.find(k);
+  if (itr == s.index.end()) {
+    return value_type();
+  }
+
+  if (itr->second->expires <= now) {
+    erase(s, itr->second);
+    return value_type();
+  }
+
+  // move to the front, as it's now the most recently used.
+  s.entries.splice(s.entries.begin(), s.entries, itr->second);
+  return itr->second->data;
+}
+
+void tile_cache::insert(shard &s, const key &k, value_type data, clock::time_point now) {
+  auto itr = s.index.find(k);
+  if (itr != s.index.end()) {
+    erase(s, itr->second);
+  }
+
+  // the bookkeeping for each entry isn't free, so charge something
+  // for it, otherwise lots of empty tiles would look free to keep.
+  const std::size_t charge = data->data.size() + data->etag.size() + k.encoding.size() + sizeof(entry);
+  if ((ttl_ <= clock::duration::zero()) || (charge > max_shard_bytes_)) {
+    return;
+  }
+
+  entry e = {k, data, now + ttl_, charge};
+  s.entries.emplace_front(std::move(e));
+  s.index.emplace(k, s.entries.begin());
+  s.bytes += charge;
+
+  while (s.bytes > max_shard_bytes_) {
+    erase(s, std::prev(s.entries.end()));
+    ++s.evictions;
+  }
+}
+
+void tile_cache::erase(shard &s, lru_list::iterator itr) {
+  s.bytes -= itr->charge;
+  s.index.erase(itr->k);
+  s.entries.erase(itr);
+}
+
+} } // namespace http::server3
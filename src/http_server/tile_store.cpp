@@ -0,0 +1,200 @@
+#include "http_server/tile_store.hpp"
+#include "config.h"
+
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <thread>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <boost/format.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+
+#ifdef HAVE_SQLITE3
+#include "sqlite.hpp"
+#endif
+
+namespace http { namespace server3 {
+
+namespace {
+
+// create `dir` and any of its parents which don't already exist.
+void make_directories(const std::string &dir) {
+  std::string::size_type pos = 0;
+  while (pos != std::string::npos) {
+    pos = dir.find('/', pos + 1);
+    const std::string prefix = dir.substr(0, pos);
+
+    if ((mkdir(prefix.c_str(), 0777) != 0) && (errno != EEXIST)) {
+      throw std::runtime_error((boost::format("Unable to create directory \"%1%\": %2%")
+                                % prefix % std::strerror(errno)).str());
+    }
+  }
+}
+
+int remove_entry(const char *path, const struct stat *, int, struct FTW *) {
+  return std::remove(path);
+}
+
+// remove `dir` and everything in it, if it exists.
+void remove_directory(const std::string &dir) {
+  if ((nftw(dir.c_str(), &remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0) && (errno != ENOENT)) {
+    throw std::runtime_error((boost::format("Unable to remove directory \"%1%\": %2%")
+                              % dir % std::strerror(errno)).str());
+  }
+}
+
+struct directory_store : public tile_store {
+  explicit directory_store(const std::string &root) : m_root(root) {}
+  virtual ~directory_store() {}
+
+  value_type read(int z, int x, int y) {
+    std::ifstream in(tile_path(z, x, y).c_str(), std::ios::in | std::ios::binary);
+    if (!in) {
+      return value_type();
+    }
+
+    std::ostringstream data;
+    data << in.rdbuf();
+    return std::make_shared<const std::string>(data.str());
+  }
+
+  void write(int z, int x, int y, const std::string &data) {
+    make_directories((boost::format("%1%/%2%/%3%") % m_root % z % x).str());
+
+    // write to a temporary file and move it into place, so that
+    // readers never see a partly written tile.
+    const std::string path = tile_path(z, x, y);
+    const std::string tmp_path = (boost::format("%1%.%2%.tmp")
+                                  % path % std::hash<std::thread::id>()(std::this_thread::get_id())).str();
+    {
+      std::ofstream out(tmp_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+      out.write(data.data(), data.size());
+      if (!out) {
+        throw std::runtime_error((boost::format("Unable to write tile to \"%1%\"") % tmp_path).str());
+      }
+    }
+
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+      std::remove(tmp_path.c_str());
+      throw std::runtime_error((boost::format("Unable to move tile to \"%1%\": %2%")
+                                % path % std::strerror(errno)).str());
+    }
+  }
+
+  void erase(int z, int x, int y) {
+    const std::string path = tile_path(z, x, y);
+    if ((std::remove(path.c_str()) != 0) && (errno != ENOENT)) {
+      throw std::runtime_error((boost::format("Unable to remove tile \"%1%\": %2%")
+                                % path % std::strerror(errno)).str());
+    }
+  }
+
+  void erase_zoom(int z) {
+    remove_directory((boost::format("%1%/%2%") % m_root % z).str());
+  }
+
+private:
+  std::string tile_path(int z, int x, int y) const {
+    return (boost::format("%1%/%2%/%3%/%4%.pbf") % m_root % z % x % y).str();
+  }
+
+  std::string m_root;
+};
+
+#ifdef HAVE_SQLITE3
+// see https://github.com/mapbox/mbtiles-spec - note that rows are
+// numbered from the bottom (TMS), rather than from the top.
+struct mbtiles_store : public tile_store {
+  explicit mbtiles_store(const std::string &file)
+    : m_db(new avecado::sqlite::db(file)) {
+
+    // a new file needs the tables setting up. existing files are used
+    // as they are, as `tiles` is often a view in files made by other
+    // tools.
+    avecado::sqlite::statement s(m_db->prepare("SELECT name FROM sqlite_master WHERE name='tiles'"));
+    if (!s.step()) {
+      m_db->prepare("CREATE TABLE tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB)").step();
+      m_db->prepare("CREATE UNIQUE INDEX tile_index ON tiles (zoom_level, tile_column, tile_row)").step();
+      m_db->prepare("CREATE TABLE IF NOT EXISTS metadata (name TEXT, value TEXT)").step();
+      m_db->prepare("INSERT INTO metadata (name, value) VALUES ('format', 'pbf')").step();
+    }
+  }
+
+  virtual ~mbtiles_store() {}
+
+  value_type read(int z, int x, int y) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    avecado::sqlite::statement s(m_db->prepare("SELECT tile_data FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?"));
+    s.bind_int(1, z);
+    s.bind_int(2, x);
+    s.bind_int(3, (1 << z) - 1 - y);
+
+    if (!s.step()) {
+      return value_type();
+    }
+    return std::make_shared<const std::string>(s.column_blob(0));
+  }
+
+  void write(int z, int x, int y, const std::string &data) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    avecado::sqlite::statement s(m_db->prepare("INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?)"));
+    s.bind_int(1, z);
+    s.bind_int(2, x);
+    s.bind_int(3, (1 << z) - 1 - y);
+    s.bind_blob(4, data);
+    s.step();
+  }
+
+  void erase(int z, int x, int y) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    avecado::sqlite::statement s(m_db->prepare("DELETE FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?"));
+    s.bind_int(1, z);
+    s.bind_int(2, x);
+    s.bind_int(3, (1 << z) - 1 - y);
+    s.step();
+  }
+
+  void erase_zoom(int z) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    avecado::sqlite::statement s(m_db->prepare("DELETE FROM tiles WHERE zoom_level=?"));
+    s.bind_int(1, z);
+    s.step();
+  }
+
+private:
+  // reads come from all the request handler threads, and writes from
+  // the write-back thread, so access to the database connection is
+  // serialised.
+  std::mutex m_mutex;
+  std::unique_ptr<avecado::sqlite::db> m_db;
+};
+#endif /* HAVE_SQLITE3 */
+
+} // anonymous namespace
+
+tile_store::~tile_store() {
+}
+
+std::shared_ptr<tile_store> make_tile_store(const std::string &location) {
+  if (boost::algorithm::ends_with(location, ".mbtiles")) {
+#ifdef HAVE_SQLITE3
+    return std::make_shared<mbtiles_store>(location);
+#else
+    throw std::runtime_error("MBTiles storage is not implemented because avecado was built without SQLite3 support.");
+#endif
+  }
+
+  return std::make_shared<directory_store>(location);
+}
+
+} } // namespace http::server3
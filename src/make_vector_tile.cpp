@@ -20,12 +20,13 @@ bool make_vector_tile(tile &tile,
                       const std::string &image_format,
                       mapnik::scaling_method_e scaling_method,
                       double scale_denominator,
-                      boost::optional<const post_processor &> pp) {
+                      boost::optional<const post_processor &> pp,
+                      std::chrono::steady_clock::duration *post_process_time) {
   
   typedef backend backend_type;
   typedef mapnik::vector_tile_impl::processor<backend_type> renderer_type;
   
-  backend_type backend(tile.mapnik_tile(), path_multiplier, map, pp);
+  backend_type backend(tile.mapnik_tile(), path_multiplier, map, pp, post_process_time);
   
   mapnik::request request(map.width(),
                           map.height(),
@@ -0,0 +1,201 @@
+#include "avecado.hpp"
+#include "fetcher.hpp"
+#include "thread_pool.hpp"
+#include "util.hpp"
+
+#include <mapnik/map.hpp>
+#include <mapnik/image.hpp>
+
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <map>
+#include <mutex>
+
+// size, in pixels, of the pieces which the output is split into.
+#define PIECE_SIZE (1024)
+
+// least number of pixels, at a scale factor of 1, which each piece is
+// padded by, whatever the buffer size. this is enough for the labels
+// and symbols near a piece's edge to be placed the same way in both of
+// the pieces they overlap.
+#define MIN_PIECE_BUFFER (128)
+
+namespace avecado {
+
+namespace {
+
+struct tile_range {
+  int x0, y0, x1, y1;
+};
+
+// range of tiles at zoom `z` which cover `box`, in mercator
+// coordinates. the range is inclusive at both ends and clamped to
+// the world.
+tile_range tiles_covering(unsigned int z, mapnik::box2d<double> const &box) {
+  const mapnik::box2d<double> world = util::box_for_tile(0, 0, 0);
+  const int n = 1 << z;
+
+  auto clamp = [n](double v) -> int {
+    return std::min(std::max(int(std::floor(v)), 0), n - 1);
+  };
+
+  tile_range r;
+  r.x0 = clamp((box.minx() - world.minx()) / world.width() * n);
+  r.x1 = clamp((box.maxx() - world.minx()) / world.width() * n);
+  r.y0 = clamp((world.maxy() - box.maxy()) / world.height() * n);
+  r.y1 = clamp((world.maxy() - box.miny()) / world.height() * n);
+  return r;
+}
+
+typedef std::map<std::pair<int, int>, std::unique_ptr<tile> > tile_set;
+
+/* number of pixels each piece is padded by, at least the buffer size.
+ */
+unsigned int piece_buffer(double scale_factor, unsigned int buffer_size) {
+  return std::max(buffer_size, (unsigned int)(std::ceil(MIN_PIECE_BUFFER * scale_factor)));
+}
+
+/* render one rectangular piece of the output image, padded by the
+ * piece buffer on each side, using the subset of tiles which cover
+ * it, and copy the middle of it into place.
+ */
+void render_piece(mapnik::image_rgba8 &image,
+                  tile_set const &tiles,
+                  mapnik::Map const &map,
+                  unsigned int z,
+                  unsigned int px0, unsigned int py0,
+                  unsigned int px1, unsigned int py1,
+                  double scale_factor,
+                  unsigned int buffer_size) {
+  const mapnik::box2d<double> extent = map.get_current_extent();
+  const double dx = extent.width() / map.width();
+  const double dy = extent.height() / map.height();
+
+  const mapnik::box2d<double> piece_box(
+    extent.minx() + px0 * dx, extent.maxy() - py1 * dy,
+    extent.minx() + px1 * dx, extent.maxy() - py0 * dy);
+
+  // labels and symbols which cross the edges of the piece are rendered
+  // in the padding as well, so that they're placed the same way as in
+  // the neighbouring pieces, and the padding is then cropped off.
+  const unsigned int pad = piece_buffer(scale_factor, buffer_size);
+  mapnik::box2d<double> padded_box(
+    piece_box.minx() - pad * dx, piece_box.miny() - pad * dy,
+    piece_box.maxx() + pad * dx, piece_box.maxy() + pad * dy);
+
+  mapnik::box2d<double> buffered_box(padded_box);
+  buffered_box.pad(pad * std::max(dx, dy));
+  const tile_range range = tiles_covering(z, buffered_box);
+
+  // gather up copies of the layers of all the tiles under this piece.
+  tile data(z, range.x0, range.y0);
+  for (int y = range.y0; y <= range.y1; ++y) {
+    for (int x = range.x0; x <= range.x1; ++x) {
+      auto itr = tiles.find(std::make_pair(x, y));
+      if ((itr != tiles.end()) && itr->second) {
+        data.merge(*itr->second);
+      }
+    }
+  }
+
+  // each piece gets its own copy of the map, so that pieces can be
+  // rendered concurrently without sharing any mutable state.
+  mapnik::Map piece_map(map);
+  piece_map.resize(px1 - px0 + 2 * pad, py1 - py0 + 2 * pad);
+  piece_map.zoom_to_box(padded_box);
+
+  mapnik::image_rgba8 piece(piece_map.width(), piece_map.height());
+  render_vector_tile(piece, data, piece_map, scale_factor, pad);
+
+  // the cropped pieces don't overlap, so it's safe to copy into the
+  // output from several threads at once.
+  for (unsigned int y = py0; y < py1; ++y) {
+    const mapnik::image_rgba8::pixel_type *row = &piece(pad, pad + y - py0);
+    std::copy(row, row + (px1 - px0), &image(px0, y));
+  }
+}
+
+} // anonymous namespace
+
+bool render_vector_extent(mapnik::image_rgba8 &image,
+                          fetcher &source,
+                          mapnik::Map const &map,
+                          unsigned int z,
+                          double scale_factor,
+                          unsigned int buffer_size,
+                          unsigned int num_threads) {
+  if ((image.width() != map.width()) || (image.height() != map.height())) {
+    throw std::runtime_error((boost::format("Image size %1%x%2% does not match map size %3%x%4%.")
+                              % image.width() % image.height() % map.width() % map.height()).str());
+  }
+
+  const mapnik::box2d<double> extent = map.get_current_extent();
+  const double dx = extent.width() / map.width();
+  const double dy = extent.height() / map.height();
+
+  // enough to cover the padding and buffer of the pieces at the edges.
+  mapnik::box2d<double> buffered_extent(extent);
+  buffered_extent.pad(2 * piece_buffer(scale_factor, buffer_size) * std::max(dx, dy));
+  const tile_range range = tiles_covering(z, buffered_extent);
+
+  // fetch all the tiles at once, so that the fetcher can get on
+  // with them concurrently, and each is only fetched once even if it
+  // is used by several pieces.
+  std::map<std::pair<int, int>, std::future<fetch_response> > futures;
+  for (int y = range.y0; y <= range.y1; ++y) {
+    for (int x = range.x0; x <= range.x1; ++x) {
+      futures.emplace(std::make_pair(x, y), source(request(z, x, y)));
+    }
+  }
+
+  tile_set tiles;
+  for (auto &entry : futures) {
+    fetch_response response = entry.second.get();
+    if (response.is_left()) {
+      tiles.emplace(entry.first, std::move(response.left()));
+
+    } else if (response.right().status != fetch_status::not_found) {
+      throw std::runtime_error((boost::format("Unable to fetch tile %1%/%2%/%3%: status %4%.")
+                                % z % entry.first.first % entry.first.second
+                                % int(response.right().status)).str());
+    }
+  }
+
+  std::mutex error_mutex;
+  std::exception_ptr error;
+
+  {
+    thread_pool pool(num_threads);
+
+    for (unsigned int py = 0; py < map.height(); py += PIECE_SIZE) {
+      for (unsigned int px = 0; px < map.width(); px += PIECE_SIZE) {
+        const unsigned int px1 = std::min(px + PIECE_SIZE, map.width());
+        const unsigned int py1 = std::min(py + PIECE_SIZE, map.height());
+
+        pool.post([&, px, py, px1, py1]() {
+            try {
+              render_piece(image, tiles, map, z, px, py, px1, py1, scale_factor, buffer_size);
+
+            } catch (...) {
+              std::unique_lock<std::mutex> lock(error_mutex);
+              if (!error) { error = std::current_exception(); }
+            }
+          });
+      }
+    }
+
+    // the pool finishes all the jobs posted to it before it is
+    // destroyed at the end of this block.
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  return true;
+}
+
+} // namespace avecado
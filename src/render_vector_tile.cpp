@@ -9,6 +9,11 @@
 #include <mapnik/layer.hpp>
 #include <mapnik/projection.hpp>
 #include <mapnik/scale_denominator.hpp>
+#include <mapnik/memory_datasource.hpp>
+#include <mapnik/query.hpp>
+
+#include <unordered_map>
+#include <boost/format.hpp>
 
 #include "vector_tile_datasource.hpp"
 
@@ -16,43 +21,116 @@ namespace avecado {
 
 namespace {
 
+// index of tile layer positions by name. there can be more than one
+// layer with the same name, e.g: if the tile was merged from several
+// sources, in which case they're rendered in tile order.
+typedef std::unordered_map<std::string, std::vector<int> > layer_index;
+
+layer_index make_layer_index(vector_tile::Tile const &tile) {
+  layer_index index;
+  for (int i = 0; i < tile.layers_size(); ++i) {
+    index[tile.layers(i).name()].push_back(i);
+  }
+  return index;
+}
+
+/* decode all the features in a tile datasource into a memory datasource,
+ * so that the work of decoding can be shared between all the style layers
+ * which render the same tile layer.
+ */
+mapnik::datasource_ptr decode_layer(mapnik::datasource_ptr const &tile_ds) {
+  mapnik::parameters params;
+  params["type"] = "memory";
+  auto mem_ds = std::make_shared<mapnik::memory_datasource>(params);
+
+  // features can extend into the buffer beyond the tile's extent, so
+  // query a generously padded box to be sure of getting all of them.
+  mapnik::box2d<double> extent = tile_ds->envelope();
+  extent.pad(std::max(extent.width(), extent.height()));
+
+  mapnik::query q(extent);
+  for (auto const &attr : tile_ds->get_descriptor().get_descriptors()) {
+    q.add_property_name(attr.get_name());
+  }
+
+  mapnik::featureset_ptr features = tile_ds->features(q);
+  if (features) {
+    mapnik::feature_ptr feature;
+    while ((feature = features->next())) {
+      mem_ds->push(feature);
+    }
+  }
+
+  return mem_ds;
+}
+
 /* render the layers in order, taking the data from each from the vector tile
  * rather than the datasource which was loaded as part of the "map" object.
  *
- * NOTE: z, x, & y are the coordinates of the tile's data, not of the request.
- * the two can be different due to overzooming.
+ * NOTE: the coordinates of each layer's data are taken from the tile, and
+ * are not necessarily those of the request. the two can be different due to
+ * overzooming, and can differ between layers if the tile was merged from
+ * several sources.
  */
 void process_layers(std::vector<mapnik::layer> const &layers,
-                    vector_tile::Tile const &tile,
+                    tile const &avecado_tile,
                     mapnik::request &request,
-                    unsigned int z, unsigned int x, unsigned int y,
                     mapnik::projection const &projection,
                     double scale_denom,
                     mapnik::attributes const &variables,
                     mapnik::agg_renderer<mapnik::image_rgba8> &renderer) {
+  vector_tile::Tile const &tile = avecado_tile.mapnik_tile();
+  const layer_index index = make_layer_index(tile);
+
+  // count how many visible style layers use each tile layer. those
+  // used more than once are decoded once, up-front, rather than once
+  // for each style layer.
+  std::vector<int> uses(tile.layers_size(), 0);
+  for (auto const &layer : layers) {
+    if (layer.visible(scale_denom)) {
+      auto itr = index.find(layer.name());
+      if (itr != index.end()) {
+        for (int i : itr->second) { ++uses[i]; }
+      }
+    }
+  }
+  std::vector<mapnik::datasource_ptr> decoded(tile.layers_size());
+
   for (auto const &layer : layers) {
 
     if (layer.visible(scale_denom)) {
 
-      for (auto const &layer_data : tile.layers()) {
+      auto itr = index.find(layer.name());
+      if (itr == index.end()) {
+        continue;
+      }
 
-        if (layer.name() == layer_data.name()) {
-          // we don't want to modify the layer, and it's const anyway, so
-          // we take a copy. thankfully, mapnik::layer is pretty lightweight
-          // and this is a relatively cheap operation.
-          mapnik::layer layer_copy(layer);
+      for (int i : itr->second) {
+        mapnik::datasource_ptr ds = decoded[i];
 
-          layer_copy.set_datasource(
-            std::make_shared<mapnik::vector_tile_impl::tile_datasource>(
-              layer_data, x, y, z, request.width()));
+        if (!ds) {
+          const tile::origin o = avecado_tile.layer_origin(i);
+          ds = std::make_shared<mapnik::vector_tile_impl::tile_datasource>(
+            tile.layers(i), o.x, o.y, o.z, request.width());
 
-          std::set<std::string> names;
-          renderer.apply_to_layer(layer_copy, renderer, projection,
-                                  request.scale(), scale_denom,
-                                  request.width(), request.height(),
-                                  request.extent(), request.buffer_size(),
-                                  names);
+          if (uses[i] > 1) {
+            ds = decode_layer(ds);
+            decoded[i] = ds;
+          }
         }
+
+        // we don't want to modify the layer, and it's const anyway, so
+        // we take a copy. thankfully, mapnik::layer is pretty lightweight
+        // and this is a relatively cheap operation.
+        mapnik::layer layer_copy(layer);
+        layer_copy.set_datasource(ds);
+
+        std::set<std::string> names;
+        renderer.apply_to_layer(layer_copy, renderer, projection,
+                                request.scale(), scale_denom,
+                                request.width(), request.height(),
+                                request.extent(), request.buffer_size(),
+                                names);
       }
     }
   }
@@ -72,8 +150,6 @@ bool render_vector_tile(mapnik::image_rgba8 &image,
   // them from.
   mapnik::attributes variables;
 
-  vector_tile::Tile const &tile = avecado_tile.mapnik_tile();
-
   mapnik::request request(map.width(),
                           map.height(),
                           map.get_current_extent());
@@ -88,12 +164,49 @@ bool render_vector_tile(mapnik::image_rgba8 &image,
   // can replace the datasource with one based on the vector tile.
   // TODO: can we avoid this with an up-front replacement of the datasources?
   renderer.start_map_processing(map);
-  process_layers(map.layers(), tile, request,
-                 avecado_tile.z, avecado_tile.x, avecado_tile.y,
+  process_layers(map.layers(), avecado_tile, request,
                  projection, scale_denom, variables, renderer);
   renderer.end_map_processing(map);
 
   return true;
 }
 
+bool render_vector_metatile(std::vector<mapnik::image_rgba8> &images,
+                            tile &avecado_tile,
+                            mapnik::Map const &map,
+                            unsigned int metatile,
+                            double scale_factor,
+                            unsigned int buffer_size) {
+  if ((metatile == 0) ||
+      (map.width() % metatile != 0) ||
+      (map.height() % metatile != 0)) {
+    throw std::runtime_error((boost::format("Map size %1%x%2% cannot be divided into a %3%x%3% metatile.")
+                              % map.width() % map.height() % metatile).str());
+  }
+
+  mapnik::image_rgba8 block(map.width(), map.height());
+  bool status = render_vector_tile(block, avecado_tile, map, scale_factor, buffer_size);
+
+  const unsigned int width = map.width() / metatile;
+  const unsigned int height = map.height() / metatile;
+
+  images.clear();
+  images.reserve(metatile * metatile);
+
+  // copy each row of each image out of the block.
+  for (unsigned int j = 0; j < metatile; ++j) {
+    for (unsigned int i = 0; i < metatile; ++i) {
+      images.emplace_back(width, height);
+      mapnik::image_rgba8 &image = images.back();
+
+      for (unsigned int y = 0; y < height; ++y) {
+        const mapnik::image_rgba8::pixel_type *row = &block(i * width, j * height + y);
+        std::copy(row, row + width, &image(0, y));
+      }
+    }
+  }
+
+  return status;
+}
+
 } // namespace avecado
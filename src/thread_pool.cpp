@@ -0,0 +1,76 @@
+#include "thread_pool.hpp"
+
+#include <iostream>
+#include <exception>
+
+namespace avecado {
+
+thread_pool::thread_pool(std::size_t num_threads)
+  : m_shutdown(false) {
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+
+  m_threads.reserve(num_threads);
+  for (std::size_t i = 0; i < num_threads; ++i) {
+    m_threads.emplace_back(&thread_pool::thread_func, this);
+  }
+}
+
+thread_pool::~thread_pool() {
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_shutdown = true;
+  }
+  m_cond.notify_all();
+
+  for (auto &thread : m_threads) {
+    thread.join();
+  }
+}
+
+void thread_pool::post(job j) {
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_jobs.emplace_back(std::move(j));
+  }
+  m_cond.notify_one();
+}
+
+std::size_t thread_pool::size() const {
+  return m_threads.size();
+}
+
+void thread_pool::thread_func() {
+  while (true) {
+    job j;
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (m_jobs.empty() && !m_shutdown) {
+        m_cond.wait(lock);
+      }
+
+      // only exit once the queue has been drained, even if we've
+      // been asked to shut down.
+      if (m_jobs.empty()) {
+        break;
+      }
+
+      j = std::move(m_jobs.front());
+      m_jobs.pop_front();
+    }
+
+    try {
+      j();
+
+    } catch (const std::exception &e) {
+      std::cerr << "ERROR: Job in thread pool failed: " << e.what() << "\n";
+
+    } catch (...) {
+      std::cerr << "ERROR: Job in thread pool failed with UNKNOWN ERROR\n";
+    }
+  }
+}
+
+} // namespace avecado
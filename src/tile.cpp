@@ -24,6 +24,7 @@ void tile::from_string(const std::string &str) {
   std::istringstream buffer(str);
   buffer >> t;
   m_mapnik_tile.swap(t.m_mapnik_tile);
+  m_layer_origins.clear();
 }
 
 vector_tile::Tile const &tile::mapnik_tile() const {
@@ -34,10 +35,55 @@ vector_tile::Tile &tile::mapnik_tile() {
   return *m_mapnik_tile;
 }
 
+void tile::merge_origins(const tile &other) {
+  const bool same_origin = (other.z == z) && (other.x == x) && (other.y == y);
+  if (!(same_origin && m_layer_origins.empty() && other.m_layer_origins.empty())) {
+    // fill in the origins of the layers we already have, if they
+    // haven't been already.
+    const origin self = {z, x, y};
+    m_layer_origins.resize(m_mapnik_tile->layers_size(), self);
+    for (int i = 0; i < other.m_mapnik_tile->layers_size(); ++i) {
+      m_layer_origins.push_back(other.layer_origin(i));
+    }
+  }
+}
+
+void tile::merge(tile &&other) {
+  typedef google::protobuf::RepeatedPtrField<vector_tile::Tile_Layer> layer_list;
+
+  layer_list *layers = m_mapnik_tile->mutable_layers();
+  layer_list *other_layers = other.m_mapnik_tile->mutable_layers();
+  const int num_other_layers = other_layers->size();
+
+  merge_origins(other);
+
+  // steal the layers, rather than copying them.
+  std::vector<vector_tile::Tile_Layer *> stolen(num_other_layers, nullptr);
+  other_layers->ExtractSubrange(0, num_other_layers, stolen.data());
+  for (vector_tile::Tile_Layer *layer : stolen) {
+    layers->AddAllocated(layer);
+  }
+  other.m_layer_origins.clear();
+}
+
+void tile::merge(const tile &other) {
+  merge_origins(other);
+  m_mapnik_tile->mutable_layers()->MergeFrom(other.m_mapnik_tile->layers());
+}
+
+tile::origin tile::layer_origin(int i) const {
+  if ((i >= 0) && (std::size_t(i) < m_layer_origins.size())) {
+    return m_layer_origins[i];
+  }
+  const origin self = {z, x, y};
+  return self;
+}
+
 std::istream &operator>>(std::istream &in, tile &t) {
   google::protobuf::io::IstreamInputStream stream(&in);
   google::protobuf::io::GzipInputStream gz_stream(&stream);
   bool read_ok = t.mapnik_tile().ParseFromZeroCopyStream(&gz_stream);
+  t.m_layer_origins.clear();
 
   if (!read_ok) {
     throw std::runtime_error("Unable to read tile from input stream.");
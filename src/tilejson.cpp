@@ -1,6 +1,8 @@
 #include "tilejson.hpp"
 #include "fetch/overzoom.hpp"
 #include "fetch/http.hpp"
+#include "fetch/composite.hpp"
+#include "fetch_metrics.hpp"
 
 #include <boost/format.hpp>
 #include <boost/algorithm/string/predicate.hpp>
@@ -130,6 +132,11 @@ bpt::ptree tilejson(const std::string &uri) {
 }
 
 std::unique_ptr<fetcher> make_tilejson_fetcher(const bpt::ptree &conf) {
+  return make_tilejson_fetcher(conf, std::shared_ptr<fetch_metrics>());
+}
+
+std::unique_ptr<fetcher> make_tilejson_fetcher(const bpt::ptree &conf,
+                                               std::shared_ptr<fetch_metrics> metrics) {
   // parameters relating to the overzoom functionality
   int max_zoom = conf.get<int>("maxzoom", 22);
   boost::optional<int> mask_zoom = conf.get_optional<int>("maskLevel");
@@ -142,10 +149,27 @@ std::unique_ptr<fetcher> make_tilejson_fetcher(const bpt::ptree &conf) {
   }
 
   // construct fetchers
-  std::unique_ptr<fetcher> http(new fetch::http(std::move(patterns)));
-  std::unique_ptr<fetcher> overzoom(new fetch::overzoom(std::move(http), max_zoom, mask_zoom));
+  std::unique_ptr<fetch::http> http(new fetch::http(std::move(patterns)));
+  http->set_metrics(metrics);
+  std::unique_ptr<fetch::overzoom> overzoom(new fetch::overzoom(std::move(http), max_zoom, mask_zoom));
+  overzoom->set_metrics(metrics);
+
+  return std::unique_ptr<fetcher>(std::move(overzoom));
+}
+
+std::unique_ptr<fetcher> make_tilejson_fetcher(const std::vector<bpt::ptree> &confs,
+                                               std::shared_ptr<fetch_metrics> metrics) {
+  // no point in the extra layer if there's only one source.
+  if (confs.size() == 1) {
+    return make_tilejson_fetcher(confs[0], metrics);
+  }
+
+  std::vector<std::unique_ptr<fetcher> > sources;
+  for (auto const &conf : confs) {
+    sources.emplace_back(make_tilejson_fetcher(conf, metrics));
+  }
 
-  return overzoom;
+  return std::unique_ptr<fetcher>(new fetch::composite(std::move(sources)));
 }
 
 namespace {
@@ -16,5 +16,16 @@ mapnik::box2d<double> box_for_tile(int z, int x, int y) {
     half_world - y * scale);
 }
 
+mapnik::box2d<double> box_for_metatile(int z, int x, int y, int size) {
+  const double scale = WORLD_SIZE / double(1 << z);
+  const double half_world = 0.5 * WORLD_SIZE;
+
+  return mapnik::box2d<double>(
+    x * scale - half_world,
+    half_world - (y+size) * scale,
+    (x+size) * scale - half_world,
+    half_world - y * scale);
+}
+
 } } // namespace avecado::util
 
@@ -0,0 +1,121 @@
+#include "config.h"
+#include "common.hpp"
+#include "fetch/composite.hpp"
+#include "fetcher_io.hpp"
+#include "logging/logger.hpp"
+#include "vector_tile.pb.h"
+
+#include <iostream>
+
+namespace {
+
+// returns a tile with a single, empty, layer called `m_layer` for
+// zooms up to one above `m_max_zoom` and `m_status` for anything
+// higher. requests for the zoom above `m_max_zoom` get the parent
+// tile, as if they had been overzoomed.
+struct test_fetcher : public avecado::fetcher {
+  std::string m_layer;
+  int m_max_zoom;
+  avecado::fetch_status m_status;
+
+  test_fetcher(const std::string &layer, int max_zoom, avecado::fetch_status status)
+    : m_layer(layer), m_max_zoom(max_zoom), m_status(status) {}
+  virtual ~test_fetcher() {}
+
+  std::future<avecado::fetch_response> operator()(const avecado::request &r) {
+    std::promise<avecado::fetch_response> response;
+
+    if (r.z <= m_max_zoom + 1) {
+      const int z = std::min(r.z, m_max_zoom);
+      std::unique_ptr<avecado::tile> tile(new avecado::tile(z, r.x >> (r.z - z), r.y >> (r.z - z)));
+      vector_tile::Tile_Layer *layer = tile->mapnik_tile().add_layers();
+      layer->set_name(m_layer);
+      layer->set_version(1);
+      response.set_value(avecado::fetch_response(std::move(tile)));
+
+    } else {
+      avecado::fetch_result err;
+      err.status = m_status;
+      response.set_value(avecado::fetch_response(err));
+    }
+
+    return response.get_future();
+  }
+};
+
+std::unique_ptr<avecado::fetch::composite> make_composite(avecado::fetch_status status) {
+  std::vector<std::unique_ptr<avecado::fetcher> > sources;
+  sources.emplace_back(new test_fetcher("base", 14, avecado::fetch_status::not_found));
+  sources.emplace_back(new test_fetcher("overlay", 12, status));
+  return std::unique_ptr<avecado::fetch::composite>(new avecado::fetch::composite(std::move(sources)));
+}
+
+void test_merge_layers() {
+  auto c = make_composite(avecado::fetch_status::not_found);
+
+  avecado::fetch_response response((*c)(avecado::request(12, 1, 2)).get());
+  test::assert_equal<bool>(response.is_left(), true, "should merge tile");
+
+  const avecado::tile &t = *response.left();
+  test::assert_equal<int>(t.mapnik_tile().layers_size(), 2, "number of layers");
+  test::assert_equal<std::string>(t.mapnik_tile().layers(0).name(), "base", "first layer");
+  test::assert_equal<std::string>(t.mapnik_tile().layers(1).name(), "overlay", "second layer");
+  test::assert_equal<unsigned int>(t.z, 12, "tile zoom");
+}
+
+void test_merge_overzoomed() {
+  auto c = make_composite(avecado::fetch_status::not_found);
+
+  // the overlay only goes to z12, so its layer comes from the z12
+  // parent of the requested tile.
+  avecado::fetch_response response((*c)(avecado::request(13, 3, 5)).get());
+  test::assert_equal<bool>(response.is_left(), true, "should merge tile");
+
+  const avecado::tile &t = *response.left();
+  test::assert_equal<int>(t.mapnik_tile().layers_size(), 2, "number of layers");
+  test::assert_equal<unsigned int>(t.layer_origin(0).z, 13, "base layer zoom");
+  test::assert_equal<unsigned int>(t.layer_origin(0).x, 3, "base layer x");
+  test::assert_equal<unsigned int>(t.layer_origin(1).z, 12, "overlay layer zoom");
+  test::assert_equal<unsigned int>(t.layer_origin(1).x, 1, "overlay layer x");
+  test::assert_equal<unsigned int>(t.layer_origin(1).y, 2, "overlay layer y");
+}
+
+void test_missing_source() {
+  auto c = make_composite(avecado::fetch_status::not_found);
+
+  // only the base has z14, so the overlay contributes nothing.
+  avecado::fetch_response response((*c)(avecado::request(14, 0, 0)).get());
+  test::assert_equal<bool>(response.is_left(), true, "should still return base tile");
+  test::assert_equal<int>(response.left()->mapnik_tile().layers_size(), 1, "number of layers");
+
+  // neither has z16.
+  avecado::fetch_response missing((*c)(avecado::request(16, 0, 0)).get());
+  test::assert_equal<bool>(missing.is_right(), true, "should not find tile");
+  test::assert_equal<avecado::fetch_status>(missing.right().status, avecado::fetch_status::not_found, "status");
+}
+
+void test_error_source() {
+  auto c = make_composite(avecado::fetch_status::server_error);
+
+  avecado::fetch_response response((*c)(avecado::request(14, 0, 0)).get());
+  test::assert_equal<bool>(response.is_right(), true, "error should be returned");
+  test::assert_equal<avecado::fetch_status>(response.right().status, avecado::fetch_status::server_error, "status");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing composite fetcher ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_merge_layers);
+  RUN_TEST(test_merge_overzoomed);
+  RUN_TEST(test_missing_source);
+  RUN_TEST(test_error_source);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,118 @@
+#include "config.h"
+#include "common.hpp"
+#include "http_server/config_diff.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <boost/property_tree/json_parser.hpp>
+
+using http::server3::zoom_set;
+using http::server3::changed_zooms_for_map;
+using http::server3::changed_zooms_for_izers;
+
+namespace pt = boost::property_tree;
+
+namespace {
+
+// a map with a layer which can be seen at all zooms, and one which can
+// only be seen from about zoom 10 upwards.
+const std::string base_map =
+  "<Map srs=\"+init=epsg:3857\">\n"
+  "  <Style name=\"roads\"><Rule><LineSymbolizer stroke=\"black\"/></Rule></Style>\n"
+  "  <Style name=\"houses\"><Rule><PolygonSymbolizer fill=\"red\"/></Rule></Style>\n"
+  "  <Layer name=\"roads\"><StyleName>roads</StyleName>\n"
+  "    <Datasource><Parameter name=\"type\">csv</Parameter></Datasource></Layer>\n"
+  "  <Layer name=\"houses\" maximum-scale-denominator=\"600000\"><StyleName>houses</StyleName>\n"
+  "    <Datasource><Parameter name=\"type\">csv</Parameter></Datasource></Layer>\n"
+  "</Map>\n";
+
+std::string replace(const std::string &s, const std::string &from, const std::string &to) {
+  std::string result = s;
+  result.replace(result.find(from), from.size(), to);
+  return result;
+}
+
+pt::ptree parse_json(const std::string &json) {
+  pt::ptree config;
+  std::istringstream in(json);
+  pt::read_json(in, config);
+  return config;
+}
+
+void test_map_unchanged() {
+  test::assert_equal<bool>(changed_zooms_for_map(base_map, base_map).none(), true, "same map");
+
+  // whitespace and comments don't matter.
+  std::string reformatted = replace(base_map, "\n  <Layer name=\"roads\">",
+                                    "<!-- comment -->\n\n    <Layer name=\"roads\">");
+  test::assert_equal<bool>(changed_zooms_for_map(base_map, reformatted).none(), true, "reformatted map");
+}
+
+void test_map_layer_style_changed() {
+  // the houses are only visible at high zooms, so changing their style
+  // shouldn't affect low zoom tiles.
+  zoom_set zooms = changed_zooms_for_map(base_map, replace(base_map, "fill=\"red\"", "fill=\"blue\""));
+  test::assert_equal<bool>(zooms.test(0), false, "zoom 0 unaffected");
+  test::assert_equal<bool>(zooms.test(5), false, "zoom 5 unaffected");
+  test::assert_equal<bool>(zooms.test(12), true, "zoom 12 affected");
+  test::assert_equal<bool>(zooms.test(30), true, "zoom 30 affected");
+}
+
+void test_map_global_change() {
+  zoom_set zooms = changed_zooms_for_map(base_map, replace(base_map, "epsg:3857", "epsg:4326"));
+  test::assert_equal<bool>(zooms.all(), true, "projection change affects every zoom");
+
+  // swapping the order of the layers changes every tile.
+  std::string swapped =
+    "<Map srs=\"+init=epsg:3857\">\n"
+    "  <Style name=\"roads\"><Rule><LineSymbolizer stroke=\"black\"/></Rule></Style>\n"
+    "  <Style name=\"houses\"><Rule><PolygonSymbolizer fill=\"red\"/></Rule></Style>\n"
+    "  <Layer name=\"houses\" maximum-scale-denominator=\"600000\"><StyleName>houses</StyleName>\n"
+    "    <Datasource><Parameter name=\"type\">csv</Parameter></Datasource></Layer>\n"
+    "  <Layer name=\"roads\"><StyleName>roads</StyleName>\n"
+    "    <Datasource><Parameter name=\"type\">csv</Parameter></Datasource></Layer>\n"
+    "</Map>\n";
+  test::assert_equal<bool>(changed_zooms_for_map(base_map, swapped).all(), true, "reordering affects every zoom");
+
+  test::assert_equal<bool>(changed_zooms_for_map(base_map, "<Map").all(), true, "unparseable map affects every zoom");
+}
+
+void test_izers_changed() {
+  const std::string base =
+    "{\"roads\": [{\"minzoom\": 3, \"maxzoom\": 5, \"process\": [{\"type\": \"generalizer\", \"tolerance\": 1}]},"
+    "             {\"minzoom\": 6, \"maxzoom\": 8, \"process\": [{\"type\": \"generalizer\", \"tolerance\": 2}]}],"
+    " \"houses\": [{\"minzoom\": 12, \"maxzoom\": 14, \"process\": [{\"type\": \"unionizer\"}]}]}";
+
+  test::assert_equal<bool>(changed_zooms_for_izers(parse_json(base), parse_json(base)).none(), true, "same config");
+
+  zoom_set zooms = changed_zooms_for_izers(parse_json(base),
+                                           parse_json(replace(base, "\"tolerance\": 1", "\"tolerance\": 4")));
+  for (int z = 0; z <= http::server3::CONFIG_MAX_ZOOM; ++z) {
+    test::assert_equal<bool>(zooms.test(z), (z >= 3) && (z <= 8), "changed layer's zooms affected");
+  }
+
+  // removing a layer's izers affects the zooms they applied to.
+  zooms = changed_zooms_for_izers(parse_json(base), parse_json(
+    "{\"roads\": [{\"minzoom\": 3, \"maxzoom\": 5, \"process\": [{\"type\": \"generalizer\", \"tolerance\": 1}]},"
+    "             {\"minzoom\": 6, \"maxzoom\": 8, \"process\": [{\"type\": \"generalizer\", \"tolerance\": 2}]}]}"));
+  test::assert_equal<size_t>(zooms.count(), 3, "removed layer's zooms affected");
+  test::assert_equal<bool>(zooms.test(13), true, "zoom 13 affected");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing config diff ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_map_unchanged);
+  RUN_TEST(test_map_layer_style_changed);
+  RUN_TEST(test_map_global_change);
+  RUN_TEST(test_izers_changed);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
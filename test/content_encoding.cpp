@@ -0,0 +1,75 @@
+#include "config.h"
+#include "common.hpp"
+#include "http_server/content_encoding.hpp"
+
+#include <iostream>
+
+using http::server3::accepts_gzip;
+using http::server3::is_gzipped;
+using http::server3::gzip_compress;
+using http::server3::gzip_decompress;
+
+namespace {
+
+void test_accepts_gzip() {
+  test::assert_equal<bool>(accepts_gzip(""), false, "no codings");
+  test::assert_equal<bool>(accepts_gzip("identity"), false, "only identity");
+  test::assert_equal<bool>(accepts_gzip("gzip"), true, "gzip");
+  test::assert_equal<bool>(accepts_gzip("GZip"), true, "codings are case insensitive");
+  test::assert_equal<bool>(accepts_gzip("deflate, gzip, br"), true, "gzip in a list");
+  test::assert_equal<bool>(accepts_gzip("x-gzip"), true, "x-gzip");
+  test::assert_equal<bool>(accepts_gzip("gzip;q=0.5"), true, "gzip with a q-value");
+  test::assert_equal<bool>(accepts_gzip("gzip ; q=0"), false, "gzip refused");
+  test::assert_equal<bool>(accepts_gzip("gzip;q=0.0, identity"), false, "gzip refused in a list");
+  test::assert_equal<bool>(accepts_gzip("*"), true, "anything");
+  test::assert_equal<bool>(accepts_gzip("*;q=0, identity"), false, "anything refused");
+  test::assert_equal<bool>(accepts_gzip("gzip;q=0, *"), false, "gzip refused, anything else accepted");
+  test::assert_equal<bool>(accepts_gzip("*;q=0, gzip"), true, "gzip accepted, anything else refused");
+  test::assert_equal<bool>(accepts_gzip("gzipped"), false, "not quite gzip");
+}
+
+void test_round_trip() {
+  std::string data;
+  for (int i = 0; i < 1000; ++i) { data += "a fairly compressible string. "; }
+
+  for (int level = -1; level <= 9; ++level) {
+    const std::string compressed = gzip_compress(data, level);
+    test::assert_equal<bool>(is_gzipped(compressed), true, "compressed data has gzip magic");
+    test::assert_equal<std::string>(gzip_decompress(compressed), data, "round trip");
+  }
+
+  test::assert_equal<bool>(gzip_compress(data, 9).size() < data.size(), true, "data was compressed");
+  test::assert_equal<bool>(is_gzipped(data), false, "plain data has no gzip magic");
+  test::assert_equal<bool>(is_gzipped(""), false, "empty data has no gzip magic");
+  test::assert_equal<std::string>(gzip_decompress(gzip_compress("", -1)), "", "empty round trip");
+}
+
+void test_corrupt() {
+  std::string compressed = gzip_compress("some data which will be corrupted", -1);
+  compressed.resize(compressed.size() / 2);
+
+  bool threw = false;
+  try {
+    gzip_decompress(compressed);
+  } catch (...) {
+    threw = true;
+  }
+  test::assert_equal<bool>(threw, true, "truncated data throws");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing content encoding ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_accepts_gzip);
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_corrupt);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+#include "config.h"
+#include "common.hpp"
+#include "fetch/host_queues.hpp"
+
+#include <iostream>
+#include <set>
+
+using avecado::fetch::host_queues;
+
+namespace {
+
+bool any_host(const std::string &) { return true; }
+
+// pops everything, returning the items in the order they came out.
+std::string pop_all(host_queues<std::string> &queues) {
+  std::string order, item;
+  while (queues.pop(any_host, item)) {
+    order += item;
+  }
+  return order;
+}
+
+void test_round_robin() {
+  host_queues<std::string> queues;
+  for (const char *item : {"a1", "a2", "a3"}) { queues.push("a.example.com", item); }
+  for (const char *item : {"b1", "b2"}) { queues.push("b.example.com", item); }
+  queues.push("c.example.com", "c1");
+
+  test::assert_equal<std::string>(pop_all(queues), "a1b1c1a2b2a3", "hosts taken in turn");
+  test::assert_equal<bool>(queues.empty(), true, "all popped");
+}
+
+void test_one_at_a_time() {
+  // when only one item can be started at a time, as when the global
+  // limit is reached, the next one should still come from the next
+  // host rather than from the first again.
+  host_queues<std::string> queues;
+  for (const char *item : {"a1", "a2", "a3"}) { queues.push("a.example.com", item); }
+  for (const char *item : {"b1", "b2", "b3"}) { queues.push("b.example.com", item); }
+
+  std::string item;
+  test::assert_equal<bool>(queues.pop(any_host, item), true, "first pop");
+  test::assert_equal<std::string>(item, "a1", "first item");
+
+  // a host which turns up later joins in at its place in the turn.
+  queues.push("aa.example.com", "aa1");
+  test::assert_equal<std::string>(pop_all(queues), "b1a2aa1b2a3b3", "hosts still taken in turn");
+}
+
+void test_host_full() {
+  host_queues<std::string> queues;
+  for (const char *item : {"a1", "a2"}) { queues.push("a.example.com", item); }
+  for (const char *item : {"b1", "b2"}) { queues.push("b.example.com", item); }
+
+  std::set<std::string> full = {"a.example.com"};
+  auto has_room = [&](const std::string &host) { return full.count(host) == 0; };
+
+  std::string item;
+  test::assert_equal<bool>(queues.pop(has_room, item), true, "pop from b");
+  test::assert_equal<std::string>(item, "b1", "full host skipped");
+  test::assert_equal<bool>(queues.pop(has_room, item), true, "pop from b again");
+  test::assert_equal<std::string>(item, "b2", "full host skipped again");
+  test::assert_equal<bool>(queues.pop(has_room, item), false, "nothing which can start");
+  test::assert_equal<bool>(queues.empty(), false, "full host still queued");
+
+  full.clear();
+  test::assert_equal<std::string>(pop_all(queues), "a1a2", "host started once it has room");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing host queues ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_round_robin);
+  RUN_TEST(test_one_at_a_time);
+  RUN_TEST(test_host_full);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -3,9 +3,12 @@
 #include "fetcher_io.hpp"
 #include "tilejson.hpp"
 #include "fetch/http.hpp"
+#include "fetch_metrics.hpp"
 #include "logging/logger.hpp"
 #include "http_server/server.hpp"
 #include "http_server/mapnik_handler_factory.hpp"
+#include "http_server/mapnik_request_handler.hpp"
+#include "http_server/tile_batch.hpp"
 #include "vector_tile.pb.h"
 
 #include <google/protobuf/io/zero_copy_stream_impl.h>
@@ -18,6 +21,15 @@
 #include <mapnik/datasource_cache.hpp>
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <tuple>
 
 #include <curl/curl.h>
 
@@ -245,6 +257,9 @@ void test_tile_is_compressed() {
   CURL_SETOPT(curl, CURLOPT_URL, uri.c_str());
   CURL_SETOPT(curl, CURLOPT_WRITEFUNCTION, write_callback);
   CURL_SETOPT(curl, CURLOPT_WRITEDATA, &stream);
+  // ask for gzip, but don't let cURL inflate it.
+  CURL_SETOPT(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
+  CURL_SETOPT(curl, CURLOPT_HTTP_CONTENT_DECODING, 0L);
 
   CURLcode res = curl_easy_perform(curl);
   if (res != CURLE_OK) {
@@ -289,6 +304,382 @@ void test_tile_is_not_compressed() {
   test::assert_equal<bool>(read_ok, true, "tile was plain PBF");
 }
 
+void test_tile_is_inflated() {
+  // a client which doesn't say that it accepts gzip gets the raw PBF,
+  // even though the server keeps the tile compressed.
+  server_guard guard("test/single_line.xml", 9);
+  std::string uri = (boost::format("%1%/0/0/0.pbf") % guard.base_url()).str();
+  std::stringstream stream;
+
+  CURL *curl = curl_easy_init();
+  CURL_SETOPT(curl, CURLOPT_URL, uri.c_str());
+  CURL_SETOPT(curl, CURLOPT_WRITEFUNCTION, write_callback);
+  CURL_SETOPT(curl, CURLOPT_WRITEDATA, &stream);
+
+  CURLcode res = curl_easy_perform(curl);
+  if (res != CURLE_OK) {
+    throw std::runtime_error("cURL operation failed");
+  }
+
+  curl_easy_cleanup(curl);
+
+  google::protobuf::io::IstreamInputStream gstream(&stream);
+  vector_tile::Tile tile;
+  bool read_ok = tile.ParseFromZeroCopyStream(&gstream);
+  test::assert_equal<bool>(read_ok, true, "tile was plain PBF");
+  test::assert_equal<int>(tile.layers_size(), 1, "tile has its layer");
+}
+
+void test_tilejson_is_compressed() {
+  server_guard guard("test/single_line.xml", 9);
+  std::string uri = (boost::format("%1%/tile.json") % guard.base_url()).str();
+  std::stringstream stream;
+
+  CURL *curl = curl_easy_init();
+  CURL_SETOPT(curl, CURLOPT_URL, uri.c_str());
+  CURL_SETOPT(curl, CURLOPT_WRITEFUNCTION, write_callback);
+  CURL_SETOPT(curl, CURLOPT_WRITEDATA, &stream);
+  CURL_SETOPT(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
+  CURL_SETOPT(curl, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+
+  CURLcode res = curl_easy_perform(curl);
+  if (res != CURLE_OK) {
+    throw std::runtime_error("cURL operation failed");
+  }
+
+  curl_easy_cleanup(curl);
+
+  std::string data = stream.str();
+  test::assert_greater_or_equal<size_t>(data.size(), 2, "tile.json size");
+  test::assert_equal<uint32_t>(uint8_t(data[0]), 0x1f, "gzip header magic ID1");
+  test::assert_equal<uint32_t>(uint8_t(data[1]), 0x8b, "gzip header magic ID2");
+}
+
+// fetches a URL, returning the body as it was sent. like most clients,
+// this accepts gzip, so that tiles are served straight from the cache
+// rather than also being inflated and cached that way.
+std::string curl_get(const std::string &uri) {
+  std::stringstream stream;
+
+  CURL *curl = curl_easy_init();
+  CURL_SETOPT(curl, CURLOPT_URL, uri.c_str());
+  CURL_SETOPT(curl, CURLOPT_WRITEFUNCTION, write_callback);
+  CURL_SETOPT(curl, CURLOPT_WRITEDATA, &stream);
+  CURL_SETOPT(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
+  CURL_SETOPT(curl, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+
+  CURLcode res = curl_easy_perform(curl);
+  if (res != CURLE_OK) {
+    throw std::runtime_error("cURL operation failed");
+  }
+
+  long status_code = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code);
+  curl_easy_cleanup(curl);
+  test::assert_equal<long>(status_code, 200, "status code");
+
+  return stream.str();
+}
+
+void test_metatile() {
+  mapnik_server_options map_opt(default_mapnik_options("test/single_line.xml", -1));
+  map_opt.raster_map_file = "test/single_line.xml";
+  map_opt.cache = std::make_shared<http::server3::tile_cache>(1 << 20, std::chrono::seconds(60));
+  map_opt.metatile = 2;
+  server_options srv_opt(default_options(map_opt));
+  srv_opt.render_threads = 2;
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+
+  // vector tiles are made one at a time, even with idle render threads
+  // which could make the rest of the block.
+  curl_get((boost::format("http://localhost:%1%/1/1/0.pbf") % server.port()).str());
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  test::assert_equal<size_t>(map_opt.cache->size(), 1, "only the vector tile asked for is made");
+
+  // asking for one PNG at z1 renders all four in one pass, from the
+  // vector tiles at the same zoom, so the other three of those are made
+  // too.
+  std::string png = curl_get((boost::format("http://localhost:%1%/1/0/1.png") % server.port()).str());
+  test::assert_equal<std::string>(png.substr(0, 4), "\x89PNG", "PNG signature");
+  test::assert_equal<size_t>(map_opt.cache->size(), 8, "vector and raster tiles in cache");
+  for (int x = 0; x < 2; ++x) {
+    for (int y = 0; y < 2; ++y) {
+      test::assert_equal<bool>(bool(map_opt.cache->get(1, x, y, "png")), true, "PNG in block cached");
+    }
+  }
+
+  // the block can't be bigger than the world.
+  curl_get((boost::format("http://localhost:%1%/0/0/0.pbf") % server.port()).str());
+  test::assert_equal<size_t>(map_opt.cache->size(), 9, "z0 tile in cache");
+
+  server.stop();
+}
+
+// returns an empty tile for any request, remembering which were asked for.
+struct recording_fetcher : public avecado::fetcher {
+  std::mutex m_mutex;
+  std::set<std::tuple<int, int, int> > m_requests;
+
+  virtual ~recording_fetcher() {}
+
+  std::future<avecado::fetch_response> operator()(const avecado::request &r) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_requests.insert(std::make_tuple(r.z, r.x, r.y));
+    }
+
+    std::promise<avecado::fetch_response> response;
+    response.set_value(avecado::fetch_response(std::unique_ptr<avecado::tile>(new avecado::tile(r.z, r.x, r.y))));
+    return response.get_future();
+  }
+};
+
+// a block of PNG tiles is rendered from the same vector tiles as each
+// would be on its own, rather than from a lower zoom.
+void test_metatile_raster_source() {
+  auto source = std::make_shared<recording_fetcher>();
+  mapnik_server_options map_opt(default_mapnik_options("test/single_line.xml", -1));
+  map_opt.raster_map_file = "test/single_line.xml";
+  map_opt.raster_source = source;
+  map_opt.cache = std::make_shared<http::server3::tile_cache>(1 << 20, std::chrono::seconds(60));
+  map_opt.metatile = 2;
+  server_options srv_opt(default_options(map_opt));
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+
+  curl_get((boost::format("http://localhost:%1%/2/1/2.png") % server.port()).str());
+
+  std::set<std::tuple<int, int, int> > expected;
+  for (int y = 2; y <= 3; ++y) {
+    for (int x = 0; x <= 1; ++x) {
+      expected.insert(std::make_tuple(2, x, y));
+    }
+  }
+  test::assert_equal<bool>(source->m_requests == expected, true, "block's own tiles fetched");
+  test::assert_equal<size_t>(map_opt.cache->size(), 4, "raster tiles in cache");
+
+  server.stop();
+}
+
+void test_prefetch() {
+  mapnik_server_options map_opt(default_mapnik_options("test/single_line.xml", -1));
+  map_opt.cache = std::make_shared<http::server3::tile_cache>(1 << 20, std::chrono::seconds(60));
+  map_opt.metrics = std::make_shared<http::server3::server_metrics>();
+  map_opt.prefetch = http::server3::make_prefetcher(map_opt);
+  server_options srv_opt(default_options(map_opt));
+  srv_opt.metrics = map_opt.metrics;
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+
+  curl_get((boost::format("http://localhost:%1%/1/0/0.pbf") % server.port()).str());
+
+  // the 3 neighbours and 4 children get made in the background.
+  for (int i = 0; (i < 100) && (map_opt.prefetch->num_prefetched() < 7); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  test::assert_equal<size_t>(map_opt.prefetch->num_prefetched(), 7, "tiles prefetched");
+  test::assert_equal<size_t>(map_opt.cache->size(), 8, "requested and prefetched tiles in cache");
+
+  // only the requested tile's render counts towards the metrics.
+  std::string text = curl_get((boost::format("http://localhost:%1%/metrics") % server.port()).str());
+  test::assert_equal<bool>(text.find("avecado_phase_duration_seconds_count{phase=\"render\"} 1\n") != std::string::npos,
+                           true, "prefetches not timed");
+
+  server.stop();
+}
+
+void test_metrics() {
+  mapnik_server_options map_opt(default_mapnik_options("test/single_line.xml", -1));
+  map_opt.metrics = std::make_shared<http::server3::server_metrics>();
+  server_options srv_opt(default_options(map_opt));
+  srv_opt.metrics = map_opt.metrics;
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+
+  curl_get((boost::format("http://localhost:%1%/0/0/0.pbf") % server.port()).str());
+  std::string text = curl_get((boost::format("http://localhost:%1%/metrics") % server.port()).str());
+
+  test::assert_equal<bool>(text.find("avecado_requests_total{status=\"200\",zoom=\"0\"} 1\n") != std::string::npos,
+                           true, "tile request counted");
+  test::assert_equal<bool>(text.find("avecado_phase_duration_seconds_count{phase=\"render\"} 1\n") != std::string::npos,
+                           true, "render timed");
+  test::assert_equal<bool>(text.find("avecado_tile_bytes_count{encoding=\"pbf\"} 1\n") != std::string::npos,
+                           true, "tile size recorded");
+
+  server.stop();
+}
+
+void write_file(const std::string &file, const std::string &content) {
+  std::ofstream out(file.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  out << content;
+}
+
+void test_reload() {
+  test::temp_dir tmp;
+  const std::string map_file = (tmp.path() / "map.xml").string();
+
+  std::string map_xml;
+  {
+    std::ifstream in("test/single_line.xml");
+    map_xml.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  write_file(map_file, map_xml);
+
+  mapnik_server_options map_opt(default_mapnik_options(map_file, -1));
+  map_opt.cache = std::make_shared<http::server3::tile_cache>(1 << 20, std::chrono::seconds(60));
+  map_opt.store = http::server3::make_tile_store((tmp.path() / "tiles").string());
+  map_opt.store_writer = std::make_shared<avecado::thread_pool>(1);
+  map_opt.reloader = std::make_shared<http::server3::map_reloader>(
+    map_file, "", "", map_opt.cache, true, map_opt.store, map_opt.store_writer);
+  server_options srv_opt(default_options(map_opt));
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+
+  const std::string url = (boost::format("http://localhost:%1%/0/0/0.pbf") % server.port()).str();
+  const std::string before = curl_get(url);
+  test::assert_equal<size_t>(map_opt.cache->size(), 1, "tile cached");
+
+  // reloading the same map changes nothing, so nothing is dropped. the
+  // reload waits for the tile to be written back to the store.
+  test::assert_equal<bool>(map_opt.reloader->reload(), true, "reload unchanged map");
+  test::assert_equal<size_t>(map_opt.cache->size(), 1, "tile still cached");
+  test::assert_equal<bool>(bool(map_opt.store->read(0, 0, 0)), true, "tile still in store");
+
+  // a broken map is refused, and the old one kept.
+  write_file(map_file, "<Map");
+  test::assert_equal<bool>(map_opt.reloader->reload(), false, "broken map refused");
+  test::assert_equal<std::string>(curl_get(url), before, "old map still used");
+
+  // moving the line changes the tile.
+  std::string moved = map_xml;
+  moved.replace(moved.find("-2000000 0"), 10, "-3000000 0");
+  write_file(map_file, moved);
+  test::assert_equal<bool>(map_opt.reloader->reload(), true, "reload changed map");
+  test::assert_equal<size_t>(map_opt.cache->size(), 0, "affected tile dropped");
+  test::assert_equal<bool>(bool(map_opt.store->read(0, 0, 0)), false, "affected tile erased from store");
+  test::assert_equal<bool>(curl_get(url) != before, true, "tile made with new map");
+
+  // the new map has its own TileJSON, made on the first request for it.
+  test::assert_equal<size_t>(map_opt.reloader->current()->tilejson->num_made(), 0, "new TileJSON not made yet");
+  curl_get((boost::format("http://localhost:%1%/tile.json") % server.port()).str());
+  test::assert_equal<size_t>(map_opt.reloader->current()->tilejson->num_made(), 1, "new TileJSON made");
+
+  server.stop();
+}
+
+void test_reload_many_written_back() {
+  test::temp_dir tmp;
+  const std::string map_file = (tmp.path() / "map.xml").string();
+
+  std::string map_xml;
+  {
+    std::ifstream in("test/single_line.xml");
+    map_xml.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  write_file(map_file, map_xml);
+
+  std::shared_ptr<http::server3::tile_store> store = http::server3::make_tile_store((tmp.path() / "tiles").string());
+  auto store_writer = std::make_shared<avecado::thread_pool>(1);
+  http::server3::map_reloader reloader(map_file, "", "", std::shared_ptr<http::server3::tile_cache>(),
+                                       true, store, store_writer);
+
+  // a tile which was already in the store is kept, as long as the
+  // written back tiles at its zoom can be kept track of.
+  store->write(1, 0, 0, "seeded");
+  store->write(1, 1, 1, "written back");
+  reloader.written_back(1, 1, 1);
+
+  // too many to keep track of, so the whole zoom goes.
+  store->write(7, 127, 127, "seeded");
+  for (int x = 0; x < 64; ++x) {
+    for (int y = 0; y < 65; ++y) {
+      store->write(7, x, y, "written back");
+      reloader.written_back(7, x, y);
+    }
+  }
+
+  std::string moved = map_xml;
+  moved.replace(moved.find("-2000000 0"), 10, "-3000000 0");
+  write_file(map_file, moved);
+  test::assert_equal<bool>(reloader.reload(), true, "reload changed map");
+
+  test::assert_equal<bool>(bool(store->read(1, 0, 0)), true, "seeded tile kept");
+  test::assert_equal<bool>(bool(store->read(1, 1, 1)), false, "written back tile erased");
+  test::assert_equal<bool>(bool(store->read(7, 127, 127)), false, "seeded tile at overflowed zoom erased");
+  test::assert_equal<bool>(bool(store->read(7, 63, 64)), false, "written back tile at overflowed zoom erased");
+}
+
+void test_tile_store() {
+  test::temp_dir tmp;
+
+  mapnik_server_options map_opt(default_mapnik_options("test/single_line.xml", -1));
+  map_opt.store = http::server3::make_tile_store(tmp.path().string());
+  map_opt.store_writer = std::make_shared<avecado::thread_pool>(1);
+  // the server doesn't check what's in the store, so anything will do.
+  map_opt.store->write(0, 0, 0, "stored tile");
+
+  {
+    server_options srv_opt(default_options(map_opt));
+    http::server3::server server("localhost", srv_opt);
+    server.run(false);
+
+    test::assert_equal<std::string>(curl_get((boost::format("http://localhost:%1%/0/0/0.pbf") % server.port()).str()),
+                                    "stored tile", "tile served from store");
+
+    // this tile isn't in the store, so it gets rendered.
+    std::string rendered = curl_get((boost::format("http://localhost:%1%/1/0/0.pbf") % server.port()).str());
+    test::assert_greater_or_equal<size_t>(rendered.size(), 2, "rendered tile size");
+
+    server.stop();
+  }
+
+  // wait for the write-back to finish.
+  map_opt.store_writer.reset();
+
+  http::server3::tile_store::value_type stored = map_opt.store->read(1, 0, 0);
+  test::assert_equal<bool>(bool(stored), true, "rendered tile written back to store");
+}
+
+void test_raster_tile() {
+  mapnik_server_options map_opt(default_mapnik_options("test/single_line.xml", -1));
+  map_opt.raster_map_file = "test/single_line.xml";
+  map_opt.cache = std::make_shared<http::server3::tile_cache>(1 << 20, std::chrono::seconds(60));
+  server_options srv_opt(default_options(map_opt));
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+
+  std::string uri = (boost::format("http://localhost:%1%/0/0/0.png") % server.port()).str();
+
+  for (int i = 0; i < 2; ++i) {
+    std::stringstream stream;
+
+    CURL *curl = curl_easy_init();
+    CURL_SETOPT(curl, CURLOPT_URL, uri.c_str());
+    CURL_SETOPT(curl, CURLOPT_WRITEFUNCTION, write_callback);
+    CURL_SETOPT(curl, CURLOPT_WRITEDATA, &stream);
+
+    CURLcode res = curl_easy_perform(curl);
+    long status_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code);
+    curl_easy_cleanup(curl);
+
+    if (res != CURLE_OK) {
+      throw std::runtime_error("cURL operation failed");
+    }
+
+    test::assert_equal<long>(status_code, 200, "status code");
+
+    std::string data = stream.str();
+    test::assert_greater_or_equal<size_t>(data.size(), 8, "PNG size");
+    test::assert_equal<std::string>(data.substr(0, 4), "\x89PNG", "PNG signature");
+  }
+
+  test::assert_equal<size_t>(map_opt.cache->size(), 1, "rendered tiles in cache");
+
+  server.stop();
+}
+
 struct cache_header_checker_handler : public request_handler {
   virtual ~cache_header_checker_handler() {}
 
@@ -353,6 +744,704 @@ void test_http_if_modified_since() {
   }
 }
 
+// sends two pipelined requests down a single connection, and checks
+// that both are answered, in order, and that the connection is only
+// closed once the client asks for it.
+void test_keep_alive_pipelining() {
+  using boost::asio::ip::tcp;
+
+  auto factory = boost::make_shared<cache_header_checker_factory>();
+  server_guard2 server(factory);
+
+  boost::asio::io_service io_service;
+  tcp::resolver resolver(io_service);
+  tcp::socket socket(io_service);
+  boost::asio::connect(socket, resolver.resolve(tcp::resolver::query("localhost", server.port)));
+
+  const std::string requests =
+    "GET /0/0/0.png HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "If-None-Match: \"foo\"\r\n"
+    "\r\n"
+    "GET /0/0/0.png HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+  boost::asio::write(socket, boost::asio::buffer(requests));
+
+  // the server closing the connection ends the read.
+  boost::asio::streambuf buffer;
+  boost::system::error_code ec;
+  boost::asio::read(socket, buffer, ec);
+  if (ec != boost::asio::error::eof) {
+    throw std::runtime_error((boost::format("Expected server to close connection, but got: %1%") % ec.message()).str());
+  }
+
+  std::string responses((std::istreambuf_iterator<char>(&buffer)), std::istreambuf_iterator<char>());
+
+  size_t first = responses.find("HTTP/1.1 304 Not Modified\r\n");
+  size_t second = responses.find("HTTP/1.1 500 Internal Server Error\r\n");
+  test::assert_equal<bool>(first != std::string::npos, true, "first response is 304");
+  test::assert_equal<bool>(second != std::string::npos, true, "second response is 500");
+  test::assert_equal<bool>(first < second, true, "responses in request order");
+
+  size_t keep_alive = responses.find("Connection: keep-alive\r\n");
+  size_t close = responses.find("Connection: close\r\n");
+  test::assert_equal<bool>((keep_alive > first) && (keep_alive < second), true, "first response keeps connection alive");
+  test::assert_equal<bool>((close > second) && (close != std::string::npos), true, "second response closes connection");
+}
+
+// sends a request with a body, which itself looks like a request, ahead
+// of a pipelined request, and checks that the body is skipped rather than
+// answered.
+void test_keep_alive_request_body() {
+  using boost::asio::ip::tcp;
+
+  auto factory = boost::make_shared<cache_header_checker_factory>();
+  server_guard2 server(factory);
+
+  boost::asio::io_service io_service;
+  tcp::resolver resolver(io_service);
+  tcp::socket socket(io_service);
+  boost::asio::connect(socket, resolver.resolve(tcp::resolver::query("localhost", server.port)));
+
+  const std::string body =
+    "GET /0/0/0.png HTTP/1.1\r\n"
+    "If-None-Match: \"foo\"\r\n"
+    "\r\n";
+  const std::string requests =
+    "POST /0/0/0.png HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Content-Length: " + std::to_string(body.size()) + "\r\n"
+    "\r\n" + body +
+    "GET /0/0/0.png HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "If-None-Match: \"foo\"\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+  boost::asio::write(socket, boost::asio::buffer(requests));
+
+  boost::asio::streambuf buffer;
+  boost::system::error_code ec;
+  boost::asio::read(socket, buffer, ec);
+  if (ec != boost::asio::error::eof) {
+    throw std::runtime_error((boost::format("Expected server to close connection, but got: %1%") % ec.message()).str());
+  }
+
+  std::string responses((std::istreambuf_iterator<char>(&buffer)), std::istreambuf_iterator<char>());
+
+  size_t first = responses.find("HTTP/1.1 500 Internal Server Error\r\n");
+  size_t second = responses.find("HTTP/1.1 304 Not Modified\r\n");
+  test::assert_equal<bool>(first != std::string::npos, true, "request with body is answered");
+  test::assert_equal<bool>(second != std::string::npos, true, "pipelined request is answered");
+  test::assert_equal<bool>(first < second, true, "responses in request order");
+  test::assert_equal<bool>(responses.find("HTTP/1.1 ", second + 1) == std::string::npos, true, "body isn't answered as a request");
+}
+
+// makes a single GET request on a fresh connection, returning the whole
+// response, headers and all.
+std::string raw_get(const std::string &port, const std::string &path,
+                    const std::string &extra_headers = "") {
+  using boost::asio::ip::tcp;
+
+  boost::asio::io_service io_service;
+  tcp::resolver resolver(io_service);
+  tcp::socket socket(io_service);
+  boost::asio::connect(socket, resolver.resolve(tcp::resolver::query("localhost", port)));
+
+  const std::string request = "GET " + path + " HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Connection: close\r\n" + extra_headers + "\r\n";
+  boost::asio::write(socket, boost::asio::buffer(request));
+
+  boost::asio::streambuf buffer;
+  boost::system::error_code ec;
+  boost::asio::read(socket, buffer, ec);
+  if (ec != boost::asio::error::eof) {
+    throw std::runtime_error((boost::format("Error reading response: %1%") % ec.message()).str());
+  }
+
+  return std::string((std::istreambuf_iterator<char>(&buffer)), std::istreambuf_iterator<char>());
+}
+
+// joins the chunks of a chunked body back together, setting complete to
+// whether the body had its last chunk.
+std::string dechunk(const std::string &chunked, bool &complete) {
+  std::string body;
+  std::size_t pos = 0;
+  complete = false;
+  while (pos < chunked.size()) {
+    const std::size_t eol = chunked.find("\r\n", pos);
+    if (eol == std::string::npos) {
+      break;
+    }
+    const std::size_t size = std::stoul(chunked.substr(pos, eol - pos), nullptr, 16);
+    if (size == 0) {
+      complete = (chunked.compare(eol, std::string::npos, "\r\n\r\n") == 0);
+      break;
+    }
+    body.append(chunked, eol + 2, size);
+    pos = eol + 2 + size + 2;
+  }
+  return body;
+}
+
+// the reload endpoint only does anything for POSTs, which may have a
+// body, and says so to anything else.
+void test_reload_endpoint() {
+  mapnik_server_options map_opt(default_mapnik_options("test/single_line.xml", -1));
+  map_opt.reloader = std::make_shared<http::server3::map_reloader>(
+    "test/single_line.xml", "", "", map_opt.cache, true);
+  map_opt.reload_endpoint = true;
+  server_options srv_opt(default_options(map_opt));
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+
+  std::string response = raw_get(server.port(), "/reload");
+  test::assert_equal<bool>(boost::starts_with(response, "HTTP/1.1 405 Method Not Allowed\r\n"), true, "GET gives 405");
+  test::assert_equal<bool>(response.find("Allow: POST\r\n") != std::string::npos, true, "405 says POST is allowed");
+
+  using boost::asio::ip::tcp;
+  boost::asio::io_service io_service;
+  tcp::resolver resolver(io_service);
+  tcp::socket socket(io_service);
+  boost::asio::connect(socket, resolver.resolve(tcp::resolver::query("localhost", server.port())));
+
+  const std::string requests =
+    "POST /reload HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Content-Length: 2\r\n"
+    "\r\n"
+    "{}"
+    "GET /0/0/0.pbf HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+  boost::asio::write(socket, boost::asio::buffer(requests));
+
+  boost::asio::streambuf buffer;
+  boost::system::error_code ec;
+  boost::asio::read(socket, buffer, ec);
+  if (ec != boost::asio::error::eof) {
+    throw std::runtime_error((boost::format("Expected server to close connection, but got: %1%") % ec.message()).str());
+  }
+  std::string responses((std::istreambuf_iterator<char>(&buffer)), std::istreambuf_iterator<char>());
+
+  size_t first = responses.find("HTTP/1.1 202 Accepted\r\n");
+  size_t second = responses.find("HTTP/1.1 200 OK\r\n");
+  test::assert_equal<bool>(first != std::string::npos, true, "POST with a body is accepted");
+  test::assert_equal<bool>((second != std::string::npos) && (first < second), true, "following request is answered");
+
+  server.stop();
+}
+
+void test_tile_etag() {
+  server_guard guard("test/single_line.xml");
+
+  std::string response = raw_get(guard.port, "/0/0/0.pbf");
+  test::assert_equal<bool>(boost::starts_with(response, "HTTP/1.1 200 OK\r\n"), true, "first response is 200");
+
+  size_t begin = response.find("ETag: \"");
+  test::assert_equal<bool>(begin != std::string::npos, true, "response has ETag");
+  begin += 6;
+  const std::string etag = response.substr(begin, response.find("\r\n", begin) - begin);
+  // 128 bits of hex, plus quotes.
+  test::assert_equal<size_t>(etag.size(), 34, "ETag length");
+
+  response = raw_get(guard.port, "/0/0/0.pbf", "If-None-Match: W/\"nope\", " + etag + "\r\n");
+  test::assert_equal<bool>(boost::starts_with(response, "HTTP/1.1 304 Not Modified\r\n"), true, "matching ETag gives 304");
+  test::assert_equal<bool>(response.find("ETag: " + etag + "\r\n") != std::string::npos, true, "304 carries ETag");
+  test::assert_equal<bool>(boost::ends_with(response, "\r\n\r\n"), true, "304 has no body");
+
+  response = raw_get(guard.port, "/0/0/0.pbf", "If-None-Match: \"nope\"\r\n");
+  test::assert_equal<bool>(boost::starts_with(response, "HTTP/1.1 200 OK\r\n"), true, "other ETag gives 200");
+}
+
+void test_tilejson_etag() {
+  mapnik_server_options map_opt(default_mapnik_options("test/single_line.xml", -1));
+  auto tilejson = std::make_shared<http::server3::shared_tilejson>();
+  map_opt.tilejson = tilejson;
+  server_options srv_opt(default_options(map_opt));
+  // each thread has its own handler, but they share the TileJSON.
+  srv_opt.thread_hint = 4;
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+  const std::string port = server.port();
+
+  std::string response = raw_get(port, "/tile.json");
+  test::assert_equal<bool>(boost::starts_with(response, "HTTP/1.1 200 OK\r\n"), true, "first response is 200");
+
+  size_t begin = response.find("ETag: \"");
+  test::assert_equal<bool>(begin != std::string::npos, true, "response has ETag");
+  begin += 6;
+  const std::string etag = response.substr(begin, response.find("\r\n", begin) - begin);
+
+  // the document is made once, so it's the same the second time round.
+  const std::string body = response.substr(response.find("\r\n\r\n") + 4);
+  for (int i = 0; i < 8; ++i) {
+    response = raw_get(port, "/tile.json");
+    test::assert_equal<std::string>(response.substr(response.find("\r\n\r\n") + 4), body, "same TileJSON");
+  }
+  test::assert_equal<size_t>(tilejson->num_made(), 1, "TileJSON made once for all threads");
+
+  response = raw_get(port, "/tile.json", "If-None-Match: " + etag + "\r\n");
+  test::assert_equal<bool>(boost::starts_with(response, "HTTP/1.1 304 Not Modified\r\n"), true, "matching ETag gives 304");
+  test::assert_equal<bool>(boost::ends_with(response, "\r\n\r\n"), true, "304 has no body");
+
+  server.stop();
+}
+
+void test_batch() {
+  mapnik_server_options map_opt(default_mapnik_options("test/single_line.xml", -1));
+  map_opt.max_batch_tiles = 5;
+  server_options srv_opt(default_options(map_opt));
+  // the tiles are shared out between the render threads.
+  srv_opt.render_threads = 2;
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+
+  std::string response = raw_get(server.port(), "/batch?tiles=0/0/0,1/1/0");
+  test::assert_equal<bool>(boost::starts_with(response, "HTTP/1.1 200 OK\r\n"), true, "batch response is 200");
+  test::assert_equal<bool>(response.find("Transfer-Encoding: chunked\r\n") != std::string::npos, true,
+                           "batch response is streamed");
+  bool complete = false;
+  const std::string body = dechunk(response.substr(response.find("\r\n\r\n") + 4), complete);
+  test::assert_equal<bool>(complete, true, "batch response is complete");
+
+  // each record is z, x, y, flags and the length of the tile, then the
+  // tile, in whichever order they were made.
+  std::set<std::tuple<uint32_t, uint32_t, uint32_t> > coords;
+  std::size_t pos = 0;
+  while (pos + http::server3::BATCH_RECORD_HEADER_SIZE <= body.size()) {
+    uint32_t fields[5];
+    for (int i = 0; i < 5; ++i, pos += 4) {
+      fields[i] = (uint32_t(uint8_t(body[pos])) << 24) | (uint32_t(uint8_t(body[pos + 1])) << 16) |
+                  (uint32_t(uint8_t(body[pos + 2])) << 8) | uint32_t(uint8_t(body[pos + 3]));
+    }
+    coords.insert(std::make_tuple(fields[0], fields[1], fields[2]));
+    test::assert_greater_or_equal<size_t>(fields[4], 2, "tile size");
+    // tiles are sent gzipped, without needing an Accept-Encoding, and
+    // say so.
+    test::assert_equal<uint32_t>(fields[3], http::server3::BATCH_RECORD_GZIPPED, "gzipped flag");
+    test::assert_equal<uint32_t>(uint8_t(body[pos]), 0x1f, "tile is gzipped");
+    pos += fields[4];
+  }
+  test::assert_equal<size_t>(pos, body.size(), "body is whole records");
+  const std::set<std::tuple<uint32_t, uint32_t, uint32_t> > expected = {
+    std::make_tuple(0u, 0u, 0u), std::make_tuple(1u, 1u, 0u) };
+  test::assert_equal<bool>(coords == expected, true, "tiles asked for");
+
+  response = raw_get(server.port(), "/batch?bbox=-180,-90,180,90&minzoom=0&maxzoom=1");
+  test::assert_equal<bool>(boost::starts_with(response, "HTTP/1.1 200 OK\r\n"), true, "bbox response is 200");
+  response = raw_get(server.port(), "/batch?bbox=-180,-90,180,90&minzoom=0&maxzoom=2");
+  test::assert_equal<bool>(boost::starts_with(response, "HTTP/1.1 400 Bad Request\r\n"), true, "too many tiles");
+
+  server.stop();
+}
+
+void test_warm_cache() {
+  mapnik_server_options map_opt(default_mapnik_options("test/single_line.xml", -1));
+  map_opt.cache = std::make_shared<http::server3::tile_cache>(1 << 20, std::chrono::seconds(60));
+
+  std::vector<http::server3::tile_id> tiles;
+  http::server3::parse_batch_query("bbox=-180,-90,180,90&minzoom=0&maxzoom=1", 100, tiles);
+  map_opt.metrics = std::make_shared<http::server3::server_metrics>();
+  http::server3::warm_cache(map_opt, tiles, 2);
+  test::assert_equal<size_t>(map_opt.cache->size(), 5, "warmed tiles cached");
+
+  // the warm-up doesn't count as serving tiles.
+  std::ostringstream metrics;
+  map_opt.metrics->write(metrics, map_opt.cache.get());
+  test::assert_equal<bool>(metrics.str().find("avecado_phase_duration_seconds_count{phase=\"render\"} 0\n") != std::string::npos,
+                           true, "warm-up renders not timed");
+
+  // a map which can't be loaded is an error, rather than a warm-up
+  // which quietly does nothing.
+  mapnik_server_options bad_opt(default_mapnik_options("test/does_not_exist.xml", -1));
+  bad_opt.cache = std::make_shared<http::server3::tile_cache>(1 << 20, std::chrono::seconds(60));
+  bool thrown = false;
+  try {
+    http::server3::warm_cache(bad_opt, tiles, 2);
+  } catch (const std::exception &) {
+    thrown = true;
+  }
+  test::assert_equal<bool>(thrown, true, "bad map throws");
+
+  // and they're served from the cache once the server starts.
+  server_options srv_opt(default_options(map_opt));
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+  curl_get((boost::format("http://localhost:%1%/1/0/1.pbf") % server.port()).str());
+  test::assert_equal<size_t>(map_opt.cache->size(), 5, "no more tiles made");
+  server.stop();
+}
+
+// handler which says which handler it is in a header, so that the
+// test can tell which thread answered.
+struct handler_id_handler : public request_handler {
+  std::string m_id;
+
+  handler_id_handler(int id) : m_id((boost::format("%1%") % id).str()) {}
+  virtual ~handler_id_handler() {}
+
+  virtual void handle_request(const request &, reply &rep) {
+    rep = reply::stock_reply(reply::ok);
+    rep.append_header("X-Handler", m_id);
+  }
+};
+
+struct handler_id_factory : public handler_factory {
+  std::atomic<int> m_next_id;
+
+  handler_id_factory() : m_next_id(0) {}
+  virtual ~handler_id_factory() {}
+  virtual void thread_setup(boost::thread_specific_ptr<request_handler> &tss, const std::string &) {
+    tss.reset(new handler_id_handler(m_next_id++));
+  }
+};
+
+// with a listener per thread, every request on a connection should be
+// answered by the same thread's handler, and the kernel should share
+// the connections out between the listeners.
+void test_reuse_port() {
+  using boost::asio::ip::tcp;
+
+  auto factory = boost::make_shared<handler_id_factory>();
+  server_options srv_opt;
+  srv_opt.port = "";
+  srv_opt.factory = factory;
+  srv_opt.thread_hint = 4;
+  srv_opt.reuse_port = true;
+#ifdef __linux__
+  srv_opt.pin_threads = true;
+#endif
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+
+  const std::string requests =
+    "GET /0/0/0.pbf HTTP/1.1\r\nHost: localhost\r\n\r\n"
+    "GET /0/0/0.pbf HTTP/1.1\r\nHost: localhost\r\n\r\n"
+    "GET /0/0/0.pbf HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+
+  boost::asio::io_service io_service;
+  tcp::resolver resolver(io_service);
+  std::set<std::string> handlers;
+  for (int i = 0; i < 16; ++i) {
+    tcp::socket socket(io_service);
+    boost::asio::connect(socket, resolver.resolve(tcp::resolver::query("localhost", server.port())));
+    boost::asio::write(socket, boost::asio::buffer(requests));
+
+    boost::asio::streambuf buffer;
+    boost::system::error_code ec;
+    boost::asio::read(socket, buffer, ec);
+    std::string responses((std::istreambuf_iterator<char>(&buffer)), std::istreambuf_iterator<char>());
+
+    std::vector<std::string> ids;
+    std::string::size_type pos = 0;
+    while ((pos = responses.find("X-Handler: ", pos)) != std::string::npos) {
+      pos += 11;
+      ids.push_back(responses.substr(pos, responses.find("\r\n", pos) - pos));
+    }
+    test::assert_equal<size_t>(ids.size(), 3, "all requests answered");
+    test::assert_equal<std::string>(ids[1], ids[0], "second request on same handler");
+    test::assert_equal<std::string>(ids[2], ids[0], "third request on same handler");
+    handlers.insert(ids[0]);
+  }
+
+  // connections are hashed on their source port, so the chance of all
+  // 16 landing on the same one of 4 listeners is negligible.
+  test::assert_greater_or_equal<size_t>(handlers.size(), 2, "connections answered by more than one listener");
+
+  server.stop();
+}
+
+// handler which blocks until it's told to carry on, to simulate a
+// slow tile.
+struct blocking_handler : public request_handler {
+  std::atomic<int> &m_started;
+  std::shared_future<void> m_gate;
+
+  blocking_handler(std::atomic<int> &started, std::shared_future<void> gate)
+    : m_started(started), m_gate(gate) {}
+  virtual ~blocking_handler() {}
+
+  virtual void handle_request(const request &, reply &rep) {
+    ++m_started;
+    m_gate.wait();
+    rep = reply::stock_reply(reply::ok);
+  }
+};
+
+struct blocking_factory : public handler_factory {
+  std::atomic<int> m_started;
+  std::shared_future<void> m_gate;
+
+  blocking_factory(std::shared_future<void> gate) : m_started(0), m_gate(gate) {}
+  virtual ~blocking_factory() {}
+  virtual void thread_setup(boost::thread_specific_ptr<request_handler> &tss, const std::string &) {
+    tss.reset(new blocking_handler(m_started, m_gate));
+  }
+};
+
+// with one render thread and room for one request in the queue, a
+// third concurrent request should be turned away straight away.
+void test_render_queue_overload() {
+  using boost::asio::ip::tcp;
+
+  std::promise<void> gate;
+  auto factory = boost::make_shared<blocking_factory>(gate.get_future().share());
+
+  server_options srv_opt;
+  srv_opt.port = "";
+  srv_opt.factory = factory;
+  srv_opt.render_threads = 1;
+  srv_opt.render_queue_size = 1;
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+
+  boost::asio::io_service io_service;
+  tcp::resolver resolver(io_service);
+  const std::string request = "GET /0/0/0.pbf HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+
+  auto send_request = [&]() -> std::shared_ptr<tcp::socket> {
+    std::shared_ptr<tcp::socket> socket = std::make_shared<tcp::socket>(io_service);
+    boost::asio::connect(*socket, resolver.resolve(tcp::resolver::query("localhost", server.port())));
+    boost::asio::write(*socket, boost::asio::buffer(request));
+    return socket;
+  };
+
+  auto read_response = [](tcp::socket &socket) -> std::string {
+    boost::asio::streambuf buffer;
+    boost::system::error_code ec;
+    boost::asio::read(socket, buffer, ec);
+    return std::string((std::istreambuf_iterator<char>(&buffer)), std::istreambuf_iterator<char>());
+  };
+
+  // occupy the render thread...
+  auto first = send_request();
+  while (factory->m_started == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  // ...fill up the queue...
+  auto second = send_request();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  // ...and this one has nowhere to go.
+  auto third = send_request();
+
+  std::string response = read_response(*third);
+  test::assert_equal<bool>(boost::starts_with(response, "HTTP/1.1 503 Service Unavailable\r\n"), true, "overload gives 503");
+  test::assert_equal<bool>(response.find("Retry-After: ") != std::string::npos, true, "503 has Retry-After");
+
+  gate.set_value();
+  test::assert_equal<bool>(boost::starts_with(read_response(*first), "HTTP/1.1 200 OK\r\n"), true, "first request served");
+  test::assert_equal<bool>(boost::starts_with(read_response(*second), "HTTP/1.1 200 OK\r\n"), true, "queued request served");
+  test::assert_equal<int>(factory->m_started, 2, "requests handled");
+
+  server.stop();
+}
+
+// handler which streams its body from another thread, aborting it part
+// way for /abort.
+struct streaming_handler : public request_handler {
+  virtual ~streaming_handler() {}
+
+  virtual void handle_request(const request &req, reply &rep) {
+    rep.status = reply::ok;
+    rep.is_hard_error = false;
+    rep.stream = std::make_shared<http::server3::body_stream>();
+    const bool abort = (req.uri == "/abort");
+    std::shared_ptr<http::server3::body_stream> stream = rep.stream;
+    std::thread([stream, abort]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        stream->write("hello ");
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        if (abort) {
+          stream->abort();
+          return;
+        }
+        stream->write("world");
+        stream->close();
+      }).detach();
+  }
+};
+
+struct streaming_factory : public handler_factory {
+  virtual ~streaming_factory() {}
+  virtual void thread_setup(boost::thread_specific_ptr<request_handler> &tss, const std::string &) {
+    tss.reset(new streaming_handler);
+  }
+};
+
+// a streamed body is sent in chunks to HTTP/1.1 clients, which can
+// then carry on using the connection, and as-is up to the end of the
+// connection to HTTP/1.0 clients.
+void test_streamed_reply() {
+  using boost::asio::ip::tcp;
+
+  auto factory = boost::make_shared<streaming_factory>();
+  server_guard2 server(factory);
+
+  auto exchange = [&](const std::string &requests) -> std::string {
+    boost::asio::io_service io_service;
+    tcp::resolver resolver(io_service);
+    tcp::socket socket(io_service);
+    boost::asio::connect(socket, resolver.resolve(tcp::resolver::query("localhost", server.port)));
+    boost::asio::write(socket, boost::asio::buffer(requests));
+
+    boost::asio::streambuf buffer;
+    boost::system::error_code ec;
+    boost::asio::read(socket, buffer, ec);
+    return std::string((std::istreambuf_iterator<char>(&buffer)), std::istreambuf_iterator<char>());
+  };
+
+  std::string responses = exchange(
+    "GET /stream HTTP/1.1\r\nHost: localhost\r\n\r\n"
+    "GET /stream HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+  const std::size_t second = responses.find("HTTP/1.1 200 OK\r\n", 1);
+  test::assert_equal<bool>(second != std::string::npos, true, "both requests answered");
+  const std::string first = responses.substr(0, second);
+  test::assert_equal<bool>(first.find("Transfer-Encoding: chunked\r\n") != std::string::npos, true, "chunked");
+  test::assert_equal<bool>(first.find("Connection: keep-alive\r\n") != std::string::npos, true, "kept alive");
+  bool complete = false;
+  test::assert_equal<std::string>(dechunk(first.substr(first.find("\r\n\r\n") + 4), complete),
+                                  "hello world", "chunked body");
+  test::assert_equal<bool>(complete, true, "chunked body is complete");
+
+  responses = exchange("GET /stream HTTP/1.0\r\nConnection: keep-alive\r\n\r\n");
+  test::assert_equal<bool>(responses.find("Transfer-Encoding") == std::string::npos, true, "HTTP/1.0 not chunked");
+  test::assert_equal<bool>(responses.find("Connection: close\r\n") != std::string::npos, true, "HTTP/1.0 closed");
+  test::assert_equal<bool>(boost::ends_with(responses, "\r\n\r\nhello world"), true, "HTTP/1.0 body");
+
+  // the connection is closed part way through an aborted body, even
+  // though another request is waiting.
+  responses = exchange(
+    "GET /abort HTTP/1.1\r\nHost: localhost\r\n\r\n"
+    "GET /stream HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+  test::assert_equal<bool>(responses.find("HTTP/1.1 200 OK\r\n", 1) == std::string::npos, true,
+                           "nothing after the aborted body");
+  test::assert_equal<std::string>(dechunk(responses.substr(responses.find("\r\n\r\n") + 4), complete),
+                                  "hello ", "aborted body");
+  test::assert_equal<bool>(complete, false, "aborted body is incomplete");
+}
+
+void test_fetch_metrics() {
+  using avecado::fetch_status;
+  typedef avecado::fetch_metrics::latency_kind kind;
+
+  server_guard guard("test/single_line.xml");
+
+  auto metrics = std::make_shared<avecado::fetch_metrics>();
+  avecado::fetch::http fetch(guard.base_url(), "pbf");
+  fetch.set_metrics(metrics);
+
+  avecado::fetch_response response(fetch(avecado::request(0, 0, 0)).get());
+  test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+  // invalid coordinates are rejected without going to the server
+  assert_is_error(fetch, 0, 0, 1, fetch_status::not_found);
+
+  test::assert_equal<uint64_t>(metrics->ok(), 1, "number of tiles fetched");
+  test::assert_equal<uint64_t>(metrics->status(fetch_status::not_found), 1, "number of tiles not found");
+  test::assert_equal<uint64_t>(metrics->latency(kind::cache_miss).count(), 1, "number of origin fetches");
+  test::assert_equal<uint64_t>(metrics->latency(kind::cache_hit).count(), 0, "number of cache hits");
+  test::assert_greater_or_equal<uint64_t>(metrics->bytes(), 1, "bytes transferred");
+  test::assert_equal<int64_t>(metrics->in_flight(), 0, "nothing should be in flight");
+  test::assert_equal<int64_t>(metrics->queued(), 0, "nothing should be queued");
+}
+
+// handler which keeps track of the most requests it has seen at once,
+// across all the threads, holding each one for a little while.
+struct concurrency_counter {
+  std::mutex mutex;
+  int current = 0, most = 0;
+};
+
+struct counting_handler : public request_handler {
+  std::shared_ptr<concurrency_counter> m_counter;
+
+  counting_handler(std::shared_ptr<concurrency_counter> c) : m_counter(c) {}
+  virtual ~counting_handler() {}
+
+  virtual void handle_request(const request &, reply &rep) {
+    {
+      std::unique_lock<std::mutex> lock(m_counter->mutex);
+      m_counter->most = std::max(m_counter->most, ++m_counter->current);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    {
+      std::unique_lock<std::mutex> lock(m_counter->mutex);
+      --m_counter->current;
+    }
+    rep = reply::stock_reply(reply::not_found);
+  }
+};
+
+struct counting_factory : public handler_factory {
+  std::shared_ptr<concurrency_counter> m_counter;
+
+  counting_factory(std::shared_ptr<concurrency_counter> c) : m_counter(c) {}
+  virtual ~counting_factory() {}
+  virtual void thread_setup(boost::thread_specific_ptr<request_handler> &tss, const std::string &) {
+    tss.reset(new counting_handler(m_counter));
+  }
+};
+
+// the most requests which the fetcher had running at once, when
+// fetching more tiles than its limits allow.
+int most_in_flight(std::size_t max_in_flight, std::size_t max_per_host) {
+  auto counter = std::make_shared<concurrency_counter>();
+  server_options srv_opt;
+  srv_opt.port = "";
+  srv_opt.factory = boost::make_shared<counting_factory>(counter);
+  srv_opt.thread_hint = 8;
+  http::server3::server server("localhost", srv_opt);
+  server.run(false);
+
+  {
+    avecado::fetch::http fetch((boost::format("http://localhost:%1%") % server.port()).str(), "pbf");
+    fetch.limit_concurrency(max_in_flight, max_per_host);
+
+    std::vector<std::future<avecado::fetch_response> > futures;
+    for (int i = 0; i < 16; ++i) {
+      futures.emplace_back(fetch(avecado::request(2, i % 4, i / 4)));
+    }
+    for (auto &f : futures) {
+      f.get();
+    }
+  }
+
+  server.stop();
+  return counter->most;
+}
+
+void test_fetch_limited_concurrency() {
+  // the server could handle all of them at once, so the limits are
+  // the only thing holding the fetcher back.
+  test::assert_equal<bool>(most_in_flight(0, 0) > 2, true, "unlimited fetches overlap");
+  test::assert_equal<bool>(most_in_flight(2, 0) <= 2, true, "global limit respected");
+  test::assert_equal<int>(most_in_flight(4, 1), 1, "per-host limit respected");
+
+  server_guard guard("test/single_line.xml");
+
+  avecado::fetch::http fetch(guard.base_url(), "pbf");
+  fetch.limit_concurrency(2, 1);
+
+  // more requests than can run at once, of mixed priority, should
+  // all still be queued and completed.
+  std::vector<std::future<avecado::fetch_response> > futures;
+  for (int i = 0; i < 16; ++i) {
+    avecado::request r(2, i % 4, i / 4);
+    if (i % 2 == 0) {
+      r.priority = avecado::request_priority::background;
+    }
+    futures.emplace_back(fetch(r));
+  }
+
+  for (auto &f : futures) {
+    avecado::fetch_response response(f.get());
+    test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+  }
+}
+
 } // anonymous namespace
 
 int main() {
@@ -376,8 +1465,30 @@ int main() {
   RUN_TEST(test_fetch_tilejson);
   RUN_TEST(test_tile_is_compressed);
   RUN_TEST(test_tile_is_not_compressed);
+  RUN_TEST(test_tile_is_inflated);
+  RUN_TEST(test_tilejson_is_compressed);
+  RUN_TEST(test_raster_tile);
+  RUN_TEST(test_tile_store);
+  RUN_TEST(test_metatile);
+  RUN_TEST(test_metatile_raster_source);
+  RUN_TEST(test_prefetch);
+  RUN_TEST(test_metrics);
+  RUN_TEST(test_reload);
+  RUN_TEST(test_reload_many_written_back);
+  RUN_TEST(test_reload_endpoint);
   RUN_TEST(test_http_etag);
   RUN_TEST(test_http_if_modified_since);
+  RUN_TEST(test_keep_alive_pipelining);
+  RUN_TEST(test_keep_alive_request_body);
+  RUN_TEST(test_reuse_port);
+  RUN_TEST(test_tile_etag);
+  RUN_TEST(test_tilejson_etag);
+  RUN_TEST(test_batch);
+  RUN_TEST(test_warm_cache);
+  RUN_TEST(test_render_queue_overload);
+  RUN_TEST(test_streamed_reply);
+  RUN_TEST(test_fetch_metrics);
+  RUN_TEST(test_fetch_limited_concurrency);
 
   std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
 
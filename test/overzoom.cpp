@@ -1,21 +1,27 @@
 #include "config.h"
 #include "common.hpp"
 #include "fetch/overzoom.hpp"
+#include "fetch_metrics.hpp"
 #include "logging/logger.hpp"
 
 #include <iostream>
+#include <sstream>
+#include <atomic>
+#include <cstdint>
 
 namespace {
 
 struct test_fetcher : public avecado::fetcher {
   int m_min_zoom, m_max_zoom;
   avecado::fetch_status m_status;
+  std::atomic<int> m_requests;
 
-  test_fetcher(int min_zoom, int max_zoom, avecado::fetch_status status) : m_min_zoom(min_zoom), m_max_zoom(max_zoom), m_status(status) {}
+  test_fetcher(int min_zoom, int max_zoom, avecado::fetch_status status) : m_min_zoom(min_zoom), m_max_zoom(max_zoom), m_status(status), m_requests(0) {}
   virtual ~test_fetcher() {}
 
   std::future<avecado::fetch_response> operator()(const avecado::request &r) {
     std::promise<avecado::fetch_response> response;
+    ++m_requests;
 
     if ((r.z >= m_min_zoom) && (r.z <= m_max_zoom)) {
       std::unique_ptr<avecado::tile> tile(new avecado::tile(r.z, r.x, r.y));
@@ -100,6 +106,74 @@ void test_fetch_no_mask2() {
   check_tile(o, 16, 0, 0, true, "z16");
 }
 
+void test_fetch_metrics() {
+  std::unique_ptr<avecado::fetcher> f(new test_fetcher(11, 16, avecado::fetch_status::not_found));
+  avecado::fetch::overzoom o(std::move(f), 18, 12);
+  auto metrics = std::make_shared<avecado::fetch_metrics>();
+  o.set_metrics(metrics);
+
+  // z19 is overzoomed to z18, which is then masked to z12.
+  check_tile(o, 19, 0, 0, true, "z19");
+  // z17 is masked to z12.
+  check_tile(o, 17, 0, 0, true, "z17");
+  // z16 is present.
+  check_tile(o, 16, 0, 0, true, "z16");
+
+  test::assert_equal<uint64_t>(metrics->overzooms(), 1, "number of overzoomed requests");
+  test::assert_equal<uint64_t>(metrics->mask_fallbacks(), 2, "number of mask zoom fallbacks");
+}
+
+// each bucket of the dumped histograms includes the faster ones.
+void test_fetch_metrics_dump() {
+  typedef avecado::fetch_metrics::latency_kind kind;
+  avecado::fetch_metrics metrics;
+  metrics.record_latency(kind::cache_miss, std::chrono::microseconds(500));
+  metrics.record_latency(kind::cache_miss, std::chrono::milliseconds(20));
+  metrics.record_latency(kind::cache_miss, std::chrono::seconds(20));
+
+  std::ostringstream out;
+  out << metrics;
+  const std::string dump = out.str();
+  test::assert_equal<bool>(dump.find("fetch_latency_cache_miss_le_1ms 1\n") != std::string::npos, true, "le_1ms");
+  test::assert_equal<bool>(dump.find("fetch_latency_cache_miss_le_10ms 1\n") != std::string::npos, true, "le_10ms");
+  test::assert_equal<bool>(dump.find("fetch_latency_cache_miss_le_25ms 2\n") != std::string::npos, true, "le_25ms");
+  test::assert_equal<bool>(dump.find("fetch_latency_cache_miss_le_10000ms 2\n") != std::string::npos, true, "le_10000ms");
+  test::assert_equal<bool>(dump.find("fetch_latency_cache_miss_le_inf 3\n") != std::string::npos, true, "le_inf");
+  test::assert_equal<bool>(dump.find("fetch_latency_cache_miss_count 3\n") != std::string::npos, true, "count");
+}
+
+// once a tile has been found to be missing, requests for it and its
+// children should go straight to the mask zoom.
+void test_fetch_missing_remembered() {
+  test_fetcher *source = new test_fetcher(11, 16, avecado::fetch_status::not_found);
+  std::unique_ptr<avecado::fetcher> f(source);
+  avecado::fetch::overzoom o(std::move(f), 18, 12);
+
+  check_tile(o, 17, 0, 0, true, "z17");
+  test::assert_equal<int>(source->m_requests.load(), 2, "missing tile should be requested, then masked");
+
+  check_tile(o, 17, 0, 0, true, "z17 again");
+  test::assert_equal<int>(source->m_requests.load(), 3, "known missing tile should only request the mask tile");
+
+  check_tile(o, 18, 1, 1, true, "z18 child");
+  test::assert_equal<int>(source->m_requests.load(), 4, "child of a known missing tile should only request the mask tile");
+
+  // a different z17 tile hasn't been seen yet.
+  check_tile(o, 17, 1, 0, true, "z17 sibling");
+  test::assert_equal<int>(source->m_requests.load(), 6, "unknown tile should be requested, then masked");
+}
+
+void test_fetch_missing_not_remembered() {
+  test_fetcher *source = new test_fetcher(11, 16, avecado::fetch_status::not_found);
+  std::unique_ptr<avecado::fetcher> f(source);
+  avecado::fetch::overzoom o(std::move(f), 18, 12);
+  o.set_missing_ttl(std::chrono::seconds(0));
+
+  check_tile(o, 17, 0, 0, true, "z17");
+  check_tile(o, 17, 0, 0, true, "z17 again");
+  test::assert_equal<int>(source->m_requests.load(), 4, "both requests should try z17 first");
+}
+
 } // anonymous namespace
 
 int main() {
@@ -112,6 +186,10 @@ int main() {
   RUN_TEST(test_fetch_result);
   RUN_TEST(test_fetch_no_mask);
   RUN_TEST(test_fetch_no_mask2);
+  RUN_TEST(test_fetch_metrics);
+  RUN_TEST(test_fetch_metrics_dump);
+  RUN_TEST(test_fetch_missing_remembered);
+  RUN_TEST(test_fetch_missing_not_remembered);
   
   std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
 
@@ -0,0 +1,132 @@
+#include "config.h"
+#include "common.hpp"
+#include "http_server/prefetcher.hpp"
+
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <set>
+#include <tuple>
+#include <boost/format.hpp>
+
+using http::server3::prefetcher;
+
+namespace {
+
+// records the tiles which the prefetcher makes, in order.
+struct tile_log {
+  std::mutex mutex;
+  std::vector<std::string> tiles;
+
+  prefetcher::setup_function setup() {
+    return [this]() -> prefetcher::make_function {
+      return [this](int z, int x, int y, const std::string &encoding) {
+        std::unique_lock<std::mutex> lock(mutex);
+        tiles.push_back((boost::format("%1%/%2%/%3%.%4%") % z % x % y % encoding).str());
+      };
+    };
+  }
+
+  std::vector<std::string> get() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return tiles;
+  }
+};
+
+void wait_for(prefetcher &p, std::size_t n) {
+  for (int i = 0; (i < 100) && (p.num_prefetched() < n); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+void test_neighbours_and_children() {
+  tile_log log;
+  prefetcher p(log.setup());
+
+  // at z1, the top-left tile has 3 neighbours and 4 children.
+  p.record(1, 0, 0, "pbf");
+  wait_for(p, 7);
+
+  std::vector<std::string> made = log.get();
+  std::set<std::string> tiles(made.begin(), made.end());
+  std::set<std::string> expected = {
+    "1/1/0.pbf", "1/0/1.pbf", "1/1/1.pbf",
+    "2/0/0.pbf", "2/1/0.pbf", "2/0/1.pbf", "2/1/1.pbf"
+  };
+  test::assert_equal<size_t>(made.size(), 7, "number of tiles prefetched");
+  test::assert_equal<bool>(tiles == expected, true, "neighbours and children prefetched");
+}
+
+void test_waits_for_foreground() {
+  tile_log log;
+  prefetcher p(log.setup());
+
+  {
+    prefetcher::foreground fg(p);
+    p.record(0, 0, 0, "pbf");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    test::assert_equal<size_t>(log.get().size(), 0, "nothing prefetched during a request");
+  }
+
+  wait_for(p, 4);
+  test::assert_equal<size_t>(log.get().size(), 4, "children prefetched after the request");
+}
+
+void test_score_order() {
+  tile_log log;
+  prefetcher p(log.setup());
+
+  {
+    // hold off prefetching until both tiles have been recorded.
+    prefetcher::foreground fg(p);
+    p.record(2, 1, 1, "pbf");
+    p.record(2, 2, 1, "pbf");
+  }
+  wait_for(p, 4);
+
+  // the tiles which neighbour both requests should come first.
+  std::vector<std::string> made = log.get();
+  test::assert_greater_or_equal<size_t>(made.size(), 4, "number of tiles prefetched");
+  std::set<std::string> first(made.begin(), made.begin() + 4);
+  std::set<std::string> expected = { "2/1/0.pbf", "2/2/0.pbf", "2/1/2.pbf", "2/2/2.pbf" };
+  test::assert_equal<bool>(first == expected, true, "shared neighbours prefetched first");
+}
+
+void test_bounded_candidates() {
+  tile_log log;
+  prefetcher p(log.setup(), 4);
+
+  {
+    prefetcher::foreground fg(p);
+    p.record(0, 0, 0, "pbf");
+    p.record(0, 0, 0, "png");
+  }
+  wait_for(p, 4);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  // only the most recent predictions are kept.
+  std::vector<std::string> made = log.get();
+  test::assert_equal<size_t>(made.size(), 4, "number of tiles prefetched");
+  for (const auto &tile : made) {
+    test::assert_equal<std::string>(tile.substr(tile.size() - 4), ".png", "recent candidate kept");
+  }
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing prefetcher ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_neighbours_and_children);
+  RUN_TEST(test_waits_for_foreground);
+  RUN_TEST(test_score_order);
+  RUN_TEST(test_bounded_candidates);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
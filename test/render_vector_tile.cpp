@@ -1,6 +1,8 @@
 #include "config.h"
 #include "common.hpp"
 #include "avecado.hpp"
+#include "fetcher.hpp"
+#include "util.hpp"
 #include "logging/logger.hpp"
 
 #include <boost/property_tree/ptree.hpp>
@@ -17,6 +19,7 @@
 #include "vector_tile.pb.h"
 
 #include <iostream>
+#include <atomic>
 
 namespace {
 
@@ -93,6 +96,277 @@ void test_full() {
   }
 }
 
+// two style layers using the same tile layer should both be rendered,
+// in order, from the same data.
+void test_shared_layer() {
+  mapnik::color background_colour(0x8c, 0xc6, 0x3f);
+  mapnik::color first_colour(0x51, 0x21, 0x4d);
+  mapnik::color second_colour(0x2e, 0x4d, 0x9b);
+  mapnik::image_rgba8 image(256, 256);
+
+  mapnik::Map map(256, 256);
+  {
+    map.set_background(background_colour);
+    map.zoom_to_box(mapnik::box2d<double>(-180, -90, 180, 90));
+
+    for (auto const &colour : {first_colour, second_colour}) {
+      const std::string style_name = "style-" + colour.to_string();
+
+      mapnik::polygon_symbolizer symbolizer;
+      mapnik::set_property(symbolizer, mapnik::keys::fill, colour.to_string());
+
+      mapnik::rule rule;
+      rule.append(std::move(symbolizer));
+
+      mapnik::feature_type_style style;
+      style.add_rule(std::move(rule));
+      map.insert_style(style_name, std::move(style));
+
+      mapnik::layer layer("layer");
+      layer.set_srs(map.srs());
+      layer.add_style(style_name);
+      map.add_layer(std::move(layer));
+    }
+  }
+
+  avecado::tile tile(0, 0, 0);
+  {
+    vector_tile::Tile_Layer *layer = tile.mapnik_tile().add_layers();
+    layer->set_version(1);
+    layer->set_name("layer");
+    vector_tile::Tile_Feature *feature = layer->add_features();
+    feature->set_id(1);
+    feature->set_type(vector_tile::Tile::POLYGON);
+    for (uint32_t g : {9, 0, 128, 26, 512, 0, 0, 256, 511, 0, 7}) {
+      feature->add_geometry(g);
+    }
+    layer->set_extent(256);
+  }
+
+  bool status = avecado::render_vector_tile(image, tile, map, 1.0, 0);
+
+  test::assert_equal<bool>(status, true, "should have rendered an image");
+
+  const mapnik::rgba8_t::type rgba = second_colour.rgba();
+  for (unsigned int y = 0; y < image.height(); ++y) {
+    for (unsigned int x = 0; x < image.width(); ++x) {
+      test::assert_equal<mapnik::rgba8_t::type>(image(x, y), rgba, "should have set fill colour of last layer");
+    }
+  }
+}
+
+void test_metatile() {
+  mapnik::color background_colour(0x8c, 0xc6, 0x3f);
+  mapnik::color fill_colour(0x51, 0x21, 0x4d);
+
+  mapnik::Map map(512, 512);
+  {
+    map.set_background(background_colour);
+    map.zoom_to_box(mapnik::box2d<double>(-180, -90, 180, 90));
+
+    mapnik::polygon_symbolizer symbolizer;
+    mapnik::set_property(symbolizer, mapnik::keys::fill, fill_colour.to_string());
+
+    mapnik::rule rule;
+    rule.append(std::move(symbolizer));
+
+    mapnik::feature_type_style style;
+    style.add_rule(std::move(rule));
+    map.insert_style("style", std::move(style));
+
+    mapnik::layer layer("layer");
+    layer.set_srs(map.srs());
+    layer.add_style("style");
+    map.add_layer(std::move(layer));
+  }
+
+  // a polygon covering only the left half of the tile.
+  avecado::tile tile(0, 0, 0);
+  {
+    vector_tile::Tile_Layer *layer = tile.mapnik_tile().add_layers();
+    layer->set_version(1);
+    layer->set_name("layer");
+    vector_tile::Tile_Feature *feature = layer->add_features();
+    feature->set_id(1);
+    feature->set_type(vector_tile::Tile::POLYGON);
+    for (uint32_t g : {9, 0, 128, 26, 256, 0, 0, 256, 255, 0, 7}) {
+      feature->add_geometry(g);
+    }
+    layer->set_extent(256);
+  }
+
+  std::vector<mapnik::image_rgba8> images;
+  bool status = avecado::render_vector_metatile(images, tile, map, 2, 1.0, 0);
+
+  test::assert_equal<bool>(status, true, "should have rendered an image");
+  test::assert_equal<size_t>(images.size(), 4, "number of images");
+
+  for (size_t i = 0; i < images.size(); ++i) {
+    const mapnik::image_rgba8 &image = images[i];
+    test::assert_equal<unsigned int>(image.width(), 256, "image width");
+    test::assert_equal<unsigned int>(image.height(), 256, "image height");
+
+    // images in the left column should be filled, those on the right
+    // should be background.
+    const mapnik::rgba8_t::type rgba = ((i % 2) == 0) ? fill_colour.rgba() : background_colour.rgba();
+    for (unsigned int y = 0; y < image.height(); ++y) {
+      for (unsigned int x = 0; x < image.width(); ++x) {
+        test::assert_equal<mapnik::rgba8_t::type>(image(x, y), rgba, "pixel colour");
+      }
+    }
+  }
+}
+
+// returns a tile completely covered by a single polygon for any
+// request.
+struct full_tile_fetcher : public avecado::fetcher {
+  std::atomic<int> m_requests;
+
+  full_tile_fetcher() : m_requests(0) {}
+  virtual ~full_tile_fetcher() {}
+
+  std::future<avecado::fetch_response> operator()(const avecado::request &r) {
+    ++m_requests;
+
+    std::unique_ptr<avecado::tile> tile(new avecado::tile(r.z, r.x, r.y));
+    vector_tile::Tile_Layer *layer = tile->mapnik_tile().add_layers();
+    layer->set_version(1);
+    layer->set_name("layer");
+    vector_tile::Tile_Feature *feature = layer->add_features();
+    feature->set_id(1);
+    feature->set_type(vector_tile::Tile::POLYGON);
+    for (uint32_t g : {9, 0, 0, 26, 512, 0, 0, 512, 511, 0, 7}) {
+      feature->add_geometry(g);
+    }
+    layer->set_extent(256);
+
+    std::promise<avecado::fetch_response> response;
+    response.set_value(avecado::fetch_response(std::move(tile)));
+    return response.get_future();
+  }
+};
+
+void test_extent() {
+  const std::string merc = "+proj=merc +a=6378137 +b=6378137 +lat_ts=0.0 +lon_0=0.0 +x_0=0.0 +y_0=0.0 +k=1.0 +units=m +nadgrids=@null +wktext +no_defs +over";
+  mapnik::color background_colour(0x8c, 0xc6, 0x3f);
+  mapnik::color fill_colour(0x51, 0x21, 0x4d);
+
+  // big enough to be split into several pieces.
+  mapnik::Map map(1536, 1536, merc);
+  {
+    map.set_background(background_colour);
+    map.zoom_to_box(avecado::util::box_for_tile(0, 0, 0));
+
+    mapnik::polygon_symbolizer symbolizer;
+    mapnik::set_property(symbolizer, mapnik::keys::fill, fill_colour.to_string());
+
+    mapnik::rule rule;
+    rule.append(std::move(symbolizer));
+
+    mapnik::feature_type_style style;
+    style.add_rule(std::move(rule));
+    map.insert_style("style", std::move(style));
+
+    mapnik::layer layer("layer");
+    layer.set_srs(merc);
+    layer.add_style("style");
+    map.add_layer(std::move(layer));
+  }
+
+  full_tile_fetcher fetcher;
+  mapnik::image_rgba8 image(1536, 1536);
+  bool status = avecado::render_vector_extent(image, fetcher, map, 1, 1.0, 8, 4);
+
+  test::assert_equal<bool>(status, true, "should have rendered an image");
+  test::assert_equal<int>(fetcher.m_requests.load(), 4, "each tile should be fetched once");
+
+  const mapnik::rgba8_t::type rgba = fill_colour.rgba();
+  for (unsigned int y = 0; y < image.height(); ++y) {
+    for (unsigned int x = 0; x < image.width(); ++x) {
+      test::assert_equal<mapnik::rgba8_t::type>(image(x, y), rgba, "should have set fill colour");
+    }
+  }
+}
+
+// returns a tile with a single point, 10 pixels of a 2048 pixel world
+// image below and to the right of its centre, in tile 1/1/1, and empty
+// tiles otherwise.
+struct seam_point_fetcher : public avecado::fetcher {
+  virtual ~seam_point_fetcher() {}
+
+  std::future<avecado::fetch_response> operator()(const avecado::request &r) {
+    std::unique_ptr<avecado::tile> tile(new avecado::tile(r.z, r.x, r.y));
+    if ((r.z == 1) && (r.x == 1) && (r.y == 1)) {
+      vector_tile::Tile_Layer *layer = tile->mapnik_tile().add_layers();
+      layer->set_version(1);
+      layer->set_name("layer");
+      vector_tile::Tile_Feature *feature = layer->add_features();
+      feature->set_id(1);
+      feature->set_type(vector_tile::Tile::POINT);
+      // a move to (40, 40) of 4096, which is 10 pixels of 1024.
+      for (uint32_t g : {9, 80, 80}) {
+        feature->add_geometry(g);
+      }
+      layer->set_extent(4096);
+    }
+
+    std::promise<avecado::fetch_response> response;
+    response.set_value(avecado::fetch_response(std::move(tile)));
+    return response.get_future();
+  }
+};
+
+// a marker just off the corner where four pieces meet should be drawn
+// whole, even without a buffer, rather than only in the piece which
+// holds its point.
+void test_extent_seam() {
+  const std::string merc = "+proj=merc +a=6378137 +b=6378137 +lat_ts=0.0 +lon_0=0.0 +x_0=0.0 +y_0=0.0 +k=1.0 +units=m +nadgrids=@null +wktext +no_defs +over";
+  mapnik::color background_colour(0x8c, 0xc6, 0x3f);
+  mapnik::color marker_colour(0x51, 0x21, 0x4d);
+
+  mapnik::Map map(2048, 2048, merc);
+  {
+    map.set_background(background_colour);
+    map.zoom_to_box(avecado::util::box_for_tile(0, 0, 0));
+
+    mapnik::markers_symbolizer symbolizer;
+    mapnik::set_property(symbolizer, mapnik::keys::width, "40");
+    mapnik::set_property(symbolizer, mapnik::keys::height, "40");
+    mapnik::set_property(symbolizer, mapnik::keys::fill, marker_colour.to_string());
+    mapnik::set_property(symbolizer, mapnik::keys::stroke_width, "0");
+    mapnik::set_property(symbolizer, mapnik::keys::allow_overlap, "true");
+
+    mapnik::rule rule;
+    rule.append(std::move(symbolizer));
+
+    mapnik::feature_type_style style;
+    style.add_rule(std::move(rule));
+    map.insert_style("style", std::move(style));
+
+    mapnik::layer layer("layer");
+    layer.set_srs(merc);
+    layer.add_style("style");
+    map.add_layer(std::move(layer));
+  }
+
+  seam_point_fetcher fetcher;
+  mapnik::image_rgba8 image(2048, 2048);
+  bool status = avecado::render_vector_extent(image, fetcher, map, 1, 1.0, 0, 4);
+  test::assert_equal<bool>(status, true, "should have rendered an image");
+
+  // the marker is centred on (1034, 1034), and reaches over the seams
+  // at 1024 into the three pieces above and to the left.
+  const mapnik::rgba8_t::type rgba = marker_colour.rgba();
+  for (int y = -15; y <= 15; ++y) {
+    for (int x = -15; x <= 15; ++x) {
+      if ((x * x + y * y) <= (15 * 15)) {
+        test::assert_equal<mapnik::rgba8_t::type>(image(1034 + x, 1034 + y), rgba, "marker colour");
+      }
+    }
+  }
+  test::assert_equal<mapnik::rgba8_t::type>(image(1000, 1000), background_colour.rgba(), "background");
+}
+
 } // anonymous namespace
 
 int main() {
@@ -107,6 +381,10 @@ int main() {
 #define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
   RUN_TEST(test_empty);
   RUN_TEST(test_full);
+  RUN_TEST(test_shared_layer);
+  RUN_TEST(test_metatile);
+  RUN_TEST(test_extent);
+  RUN_TEST(test_extent_seam);
   
   std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
 
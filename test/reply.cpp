@@ -0,0 +1,97 @@
+#include "config.h"
+#include "common.hpp"
+#include "http_server/reply.hpp"
+#include "http_server/http_date.hpp"
+
+#include <iostream>
+
+using http::server3::reply;
+using http::server3::header;
+
+namespace {
+
+std::string flatten(const std::vector<boost::asio::const_buffer> &buffers) {
+  std::string out;
+  for (const auto &b : buffers) {
+    out.append(boost::asio::buffer_cast<const char *>(b), boost::asio::buffer_size(b));
+  }
+  return out;
+}
+
+void test_format_http_date() {
+  // the example from RFC 7231.
+  test::assert_equal<std::string>(http::server3::format_http_date(784111777),
+                                  "Sun, 06 Nov 1994 08:49:37 GMT", "RFC 7231 example");
+  test::assert_equal<std::string>(http::server3::format_http_date(0),
+                                  "Thu, 01 Jan 1970 00:00:00 GMT", "epoch");
+  test::assert_equal<std::string>(http::server3::format_http_date(1451606399),
+                                  "Thu, 31 Dec 2015 23:59:59 GMT", "end of a year");
+}
+
+void test_http_date() {
+  const std::string &date = http::server3::http_date();
+  test::assert_equal<size_t>(date.size(), 29, "date length");
+  test::assert_equal<std::string>(date.substr(date.size() - 4), " GMT", "date is in GMT");
+}
+
+void test_to_buffers() {
+  reply rep;
+  rep.status = reply::ok;
+  rep.is_hard_error = false;
+  header h;
+  h.name = "Content-Type";
+  h.value = "text/plain";
+  rep.headers.push_back(h);
+  rep.append_header("Content-Length", std::size_t(5));
+  rep.append_header("ETag", "\"abc\"");
+  rep.content = "hello";
+
+  std::vector<boost::asio::const_buffer> buffers = rep.to_buffers();
+  test::assert_equal<size_t>(buffers.size(), 2, "header and body buffers");
+  test::assert_equal<std::string>(flatten(buffers),
+                                  "HTTP/1.1 200 OK\r\n"
+                                  "Content-Type: text/plain\r\n"
+                                  "Content-Length: 5\r\n"
+                                  "ETag: \"abc\"\r\n"
+                                  "\r\n"
+                                  "hello", "reply bytes");
+}
+
+void test_shared_content() {
+  std::shared_ptr<const std::string> body = std::make_shared<const std::string>("shared body");
+
+  reply rep;
+  rep.status = reply::ok;
+  rep.is_hard_error = false;
+  rep.shared_content = body;
+  rep.append_header("Content-Length", body->size());
+  rep.append_header("X-Zero", std::size_t(0));
+
+  std::vector<boost::asio::const_buffer> buffers = rep.to_buffers();
+  test::assert_equal<bool>(boost::asio::buffer_cast<const char *>(buffers[1]) == body->data(), true,
+                           "shared body isn't copied");
+  test::assert_equal<std::string>(flatten(buffers),
+                                  "HTTP/1.1 200 OK\r\n"
+                                  "Content-Length: 11\r\n"
+                                  "X-Zero: 0\r\n"
+                                  "\r\n"
+                                  "shared body", "reply bytes");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing reply ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_format_http_date);
+  RUN_TEST(test_http_date);
+  RUN_TEST(test_to_buffers);
+  RUN_TEST(test_shared_content);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,153 @@
+#include "config.h"
+#include "common.hpp"
+#include "http_server/request.hpp"
+#include "http_server/request_parser.hpp"
+#include "http_server/parse_path.hpp"
+
+#include <iostream>
+#include <vector>
+#include <boost/format.hpp>
+
+using http::server3::request;
+using http::server3::request_parser;
+using http::server3::parse_path;
+
+namespace {
+
+std::string describe(const request &req) {
+  std::string out = (boost::format("%1% %2% HTTP/%3%.%4%\n") % req.method % req.uri
+                     % req.http_version_major % req.http_version_minor).str();
+  for (const auto &h : req.headers) {
+    out += h.name + "=" + h.value + "\n";
+  }
+  return out;
+}
+
+// parses the data with the single pass parser and a byte at a time,
+// checking that both give the same result, and returns it.
+boost::tribool parse_both(const std::string &data, std::string &parsed, std::size_t &consumed) {
+  std::vector<char> buffer(data.begin(), data.end());
+
+  request fast_req;
+  request_parser fast_parser;
+  boost::tribool fast_result;
+  char *fast_end = NULL;
+  boost::tie(fast_result, fast_end) = fast_parser.parse(fast_req, buffer.data(), buffer.data() + buffer.size());
+
+  request slow_req;
+  request_parser slow_parser;
+  boost::tribool slow_result;
+  std::string::const_iterator slow_end;
+  boost::tie(slow_result, slow_end) = slow_parser.parse(slow_req, data.begin(), data.end());
+
+  const std::string what = "parsing \"" + data + "\"";
+  test::assert_equal<int>(int(bool(fast_result)) + 2 * int(bool(!fast_result)),
+                          int(bool(slow_result)) + 2 * int(bool(!slow_result)), what + ": result");
+  test::assert_equal<std::size_t>(fast_end - buffer.data(), slow_end - data.begin(), what + ": consumed");
+  if (fast_result) {
+    test::assert_equal<std::string>(describe(fast_req), describe(slow_req), what + ": request");
+  }
+
+  parsed = describe(fast_req);
+  consumed = fast_end - buffer.data();
+  return fast_result;
+}
+
+void test_simple_request() {
+  std::string parsed;
+  std::size_t consumed = 0;
+  const std::string data =
+    "GET /1/2/3.pbf?foo=bar HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "If-None-Match: \"abc\"\r\n"
+    "\r\n";
+  test::assert_equal<bool>(bool(parse_both(data, parsed, consumed)), true, "parsed");
+  test::assert_equal<std::string>(parsed,
+                                  "GET /1/2/3.pbf?foo=bar HTTP/1.1\n"
+                                  "Host=localhost\n"
+                                  "Accept-Encoding=gzip, deflate\n"
+                                  "If-None-Match=\"abc\"\n", "request");
+  test::assert_equal<std::size_t>(consumed, data.size(), "whole request consumed");
+}
+
+void test_pipelined() {
+  std::string parsed;
+  std::size_t consumed = 0;
+  const std::string first = "GET /0/0/0.pbf HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  const std::string second = "GET /tile.json HTTP/1.0\r\n\r\n";
+  test::assert_equal<bool>(bool(parse_both(first + second, parsed, consumed)), true, "parsed");
+  test::assert_equal<std::size_t>(consumed, first.size(), "only the first request consumed");
+  test::assert_equal<bool>(bool(parse_both(second, parsed, consumed)), true, "parsed second");
+  test::assert_equal<std::string>(parsed, "GET /tile.json HTTP/1.0\n", "request without headers");
+}
+
+void test_unusual() {
+  std::string parsed;
+  std::size_t consumed = 0;
+
+  // these are all left to the byte at a time parser, which must give
+  // the same results.
+  const std::vector<std::string> requests = {
+    // incomplete.
+    "GET /0/0/0.pbf HTTP/1.1\r\nHost: local",
+    // header continued over two lines.
+    "GET / HTTP/1.1\r\nX-Long: one\r\n  two\r\n\r\n",
+    // empty header value.
+    "GET / HTTP/1.1\r\nX-Empty: \r\n\r\n",
+    // long version numbers.
+    "GET / HTTP/1000.1\r\n\r\n",
+    // invalid: no space after the colon, bad method, bad version, bare LF.
+    "GET / HTTP/1.1\r\nHost:localhost\r\n\r\n",
+    "G(T / HTTP/1.1\r\n\r\n",
+    "GET / HTTP/x.1\r\n\r\n",
+    "GET / HTTP/1.1\nHost: localhost\r\n\r\n",
+    "GET / FTP/1.1\r\n\r\n",
+    "GET /\r\n\r\n",
+  };
+  for (const std::string &r : requests) {
+    parse_both(r, parsed, consumed);
+  }
+}
+
+void test_parse_path() {
+  int z = -1, x = -1, y = -1;
+  std::string ext;
+  test::assert_equal<bool>(parse_path("/12/345/678.pbf", z, x, y, ext), true, "tile path");
+  test::assert_equal<int>(z, 12, "z");
+  test::assert_equal<int>(x, 345, "x");
+  test::assert_equal<int>(y, 678, "y");
+  test::assert_equal<std::string>(ext, "pbf", "ext");
+
+  test::assert_equal<bool>(parse_path("/0/0/0.png", z, x, y, ext), true, "png path");
+  test::assert_equal<std::string>(ext, "png", "png ext");
+  test::assert_equal<bool>(parse_path("/0/0/0.png", z, x, y), false, "only pbf without ext");
+  test::assert_equal<bool>(parse_path("/0/0/0.pbf", z, x, y), true, "pbf without ext");
+
+  const std::vector<std::string> bad = {
+    "", "/", "/0/0/0", "/0/0/0.", "0/0/0.pbf", "/0/0.pbf", "/0/0/0/0.pbf", "/a/0/0.pbf",
+    "/-1/0/0.pbf", "/0//0.pbf", "/0/0/0.pbf/", "/0/0/0.p.bf", "/0/0/0.pbf?", "/1234567890/0/0.pbf",
+    "/tile.json"
+  };
+  for (const std::string &p : bad) {
+    test::assert_equal<bool>(parse_path(p, z, x, y, ext), false, "bad path \"" + p + "\"");
+  }
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing request parser ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_simple_request);
+  RUN_TEST(test_pipelined);
+  RUN_TEST(test_unusual);
+  RUN_TEST(test_parse_path);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
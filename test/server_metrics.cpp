@@ -0,0 +1,107 @@
+#include "config.h"
+#include "common.hpp"
+#include "http_server/server_metrics.hpp"
+#include "http_server/tile_cache.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <stdexcept>
+
+using http::server3::server_metrics;
+
+namespace {
+
+std::string scrape(const server_metrics &metrics, const http::server3::tile_cache *cache) {
+  std::ostringstream out;
+  metrics.write(out, cache);
+  return out.str();
+}
+
+void assert_has_line(const std::string &text, const std::string &line) {
+  if (text.find("\n" + line + "\n") == std::string::npos) {
+    throw std::runtime_error("Expected line \"" + line + "\" in metrics:\n" + text);
+  }
+}
+
+void test_requests_merged_over_threads() {
+  server_metrics metrics;
+
+  metrics.record_request(200, 3);
+  metrics.record_request(200, 3);
+  std::thread other([&]() {
+      metrics.record_request(200, 3);
+      metrics.record_request(404, -1);
+      metrics.record_request(418, 2);
+    });
+  other.join();
+
+  // the other thread's counts are kept after it exits.
+  std::string text = scrape(metrics, nullptr);
+  assert_has_line(text, "avecado_requests_total{status=\"200\",zoom=\"3\"} 3");
+  assert_has_line(text, "avecado_requests_total{status=\"404\",zoom=\"none\"} 1");
+  assert_has_line(text, "avecado_requests_total{status=\"other\",zoom=\"2\"} 1");
+  test::assert_equal<bool>(text.find("status=\"500\"") == std::string::npos, true,
+                           "statuses which never happened are left out");
+}
+
+void test_histograms() {
+  server_metrics metrics;
+
+  metrics.record_phase(server_metrics::RENDER, std::chrono::milliseconds(3));
+  metrics.record_phase(server_metrics::RENDER, std::chrono::seconds(20));
+  metrics.record_tile_bytes("pbf", 1000);
+
+  std::string text = scrape(metrics, nullptr);
+  assert_has_line(text, "avecado_phase_duration_seconds_bucket{phase=\"render\",le=\"0.001\"} 0");
+  assert_has_line(text, "avecado_phase_duration_seconds_bucket{phase=\"render\",le=\"0.005\"} 1");
+  assert_has_line(text, "avecado_phase_duration_seconds_bucket{phase=\"render\",le=\"10\"} 1");
+  assert_has_line(text, "avecado_phase_duration_seconds_bucket{phase=\"render\",le=\"+Inf\"} 2");
+  assert_has_line(text, "avecado_phase_duration_seconds_count{phase=\"render\"} 2");
+  assert_has_line(text, "avecado_phase_duration_seconds_count{phase=\"write\"} 0");
+  assert_has_line(text, "avecado_tile_bytes_bucket{encoding=\"pbf\",le=\"512\"} 0");
+  assert_has_line(text, "avecado_tile_bytes_bucket{encoding=\"pbf\",le=\"2048\"} 1");
+  assert_has_line(text, "avecado_tile_bytes_sum{encoding=\"pbf\"} 1000");
+  assert_has_line(text, "avecado_tile_bytes_count{encoding=\"png\"} 0");
+}
+
+void test_gauges_and_cache() {
+  server_metrics metrics;
+  http::server3::tile_cache cache(1 << 20, std::chrono::seconds(60));
+
+  metrics.set_queue_depth(5);
+  metrics.add_busy(std::chrono::milliseconds(1500));
+  cache.get_or_make(0, 0, 0, "pbf", []() {
+      return std::make_shared<const http::server3::encoded_tile>("foo");
+    });
+  cache.get_or_make(0, 0, 0, "pbf", []() -> http::server3::tile_cache::value_type {
+      throw std::runtime_error("should have been cached");
+    });
+
+  std::string text = scrape(metrics, &cache);
+  assert_has_line(text, "avecado_render_queue_depth 5");
+  assert_has_line(text, "avecado_thread_busy_seconds_total{thread=\"0\"} 1.5");
+  assert_has_line(text, "avecado_cache_hits_total 1");
+  assert_has_line(text, "avecado_cache_misses_total 1");
+  assert_has_line(text, "avecado_cache_tiles 1");
+
+  test::assert_equal<bool>(scrape(metrics, nullptr).find("avecado_cache") == std::string::npos, true,
+                           "no cache metrics without a cache");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing server metrics ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_requests_merged_over_threads);
+  RUN_TEST(test_histograms);
+  RUN_TEST(test_gauges_and_cache);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
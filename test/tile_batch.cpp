@@ -0,0 +1,165 @@
+#include "config.h"
+#include "common.hpp"
+#include "http_server/tile_batch.hpp"
+
+#include <iostream>
+#include <memory>
+
+using http::server3::tile_id;
+using http::server3::parse_batch_query;
+using http::server3::append_batch_record;
+using http::server3::tile_batch;
+using http::server3::body_stream;
+using http::server3::BATCH_RECORD_HEADER_SIZE;
+
+namespace {
+
+void test_tile_list() {
+  std::vector<tile_id> tiles;
+  test::assert_equal<bool>(parse_batch_query("tiles=0/0/0,3/1/2", 10, tiles), true, "list parsed");
+  test::assert_equal<size_t>(tiles.size(), 2, "number of tiles");
+  test::assert_equal<int>(tiles[1].z, 3, "z");
+  test::assert_equal<int>(tiles[1].x, 1, "x");
+  test::assert_equal<int>(tiles[1].y, 2, "y");
+
+  // the separators may be URL-encoded, and other parameters are ignored.
+  test::assert_equal<bool>(parse_batch_query("foo=bar&tiles=1%2F1%2F1%2C2/3/3", 10, tiles), true, "encoded list");
+  test::assert_equal<size_t>(tiles.size(), 2, "number of encoded tiles");
+  test::assert_equal<int>(tiles[1].x, 3, "encoded x");
+
+  test::assert_equal<bool>(parse_batch_query("tiles=0/0/0,0/0/0,0/0/0", 2, tiles), false, "too many tiles");
+  test::assert_equal<bool>(parse_batch_query("tiles=1/2/0", 10, tiles), false, "x out of range");
+  test::assert_equal<bool>(parse_batch_query("tiles=31/0/0", 10, tiles), false, "zoom out of range");
+  test::assert_equal<bool>(parse_batch_query("tiles=0/0", 10, tiles), false, "missing y");
+  test::assert_equal<bool>(parse_batch_query("tiles=0/0/-0", 10, tiles), false, "sign");
+  test::assert_equal<bool>(parse_batch_query("tiles=0/0/0,", 10, tiles), false, "trailing comma");
+  test::assert_equal<bool>(parse_batch_query("", 10, tiles), false, "nothing asked for");
+}
+
+void test_bbox() {
+  std::vector<tile_id> tiles;
+  // a box around central London.
+  test::assert_equal<bool>(parse_batch_query("bbox=-0.2,51.45,0.0,51.55&minzoom=0&maxzoom=10", 100, tiles),
+                           true, "bbox parsed");
+  test::assert_equal<int>(tiles.front().z, 0, "starts at minzoom");
+  test::assert_equal<int>(tiles.back().z, 10, "ends at maxzoom");
+  for (const tile_id &t : tiles) {
+    if (t.z == 10) {
+      test::assert_equal<bool>((t.x >= 511) && (t.x <= 512), true, "x at z10");
+      test::assert_equal<bool>((t.y >= 340) && (t.y <= 341), true, "y at z10");
+    }
+  }
+
+  // the whole world at z2 is 16 tiles, even with latitudes beyond
+  // those which the tiles cover.
+  test::assert_equal<bool>(parse_batch_query("bbox=-180,-90,180,90&minzoom=2&maxzoom=2", 16, tiles),
+                           true, "world parsed");
+  test::assert_equal<size_t>(tiles.size(), 16, "world tiles");
+  test::assert_equal<bool>(parse_batch_query("bbox=-180,-90,180,90&minzoom=2&maxzoom=3", 16, tiles),
+                           false, "too many world tiles");
+
+  test::assert_equal<bool>(parse_batch_query("bbox=1,0,0,1&minzoom=0&maxzoom=0", 10, tiles), false, "west of east");
+  test::assert_equal<bool>(parse_batch_query("bbox=0,0,1,1&minzoom=2&maxzoom=1", 10, tiles), false, "zooms reversed");
+  test::assert_equal<bool>(parse_batch_query("bbox=0,0,1,1&minzoom=0", 10, tiles), false, "missing maxzoom");
+  test::assert_equal<bool>(parse_batch_query("bbox=0,0,1,1&tiles=0/0/0&minzoom=0&maxzoom=0", 10, tiles),
+                           false, "both bbox and tiles");
+}
+
+void test_record() {
+  std::string out = "x";
+  append_batch_record(out, tile_id{1, 2, 3}, "body", false);
+  const std::string expected("x"
+                             "\x00\x00\x00\x01" "\x00\x00\x00\x02" "\x00\x00\x00\x03"
+                             "\x00\x00\x00\x00" "\x00\x00\x00\x04"
+                             "body", 25);
+  test::assert_equal<std::string>(out, expected, "record");
+
+  out.clear();
+  append_batch_record(out, tile_id{1, 2, 3}, "gz", true);
+  test::assert_equal<std::string>(out.substr(12, 4), std::string("\x00\x00\x00\x01", 4), "gzipped flag");
+}
+
+// the stream is closed once every tile taken from the batch has been
+// written, and aborted if the batch goes away before then.
+void test_batch_stream() {
+  std::string data;
+  auto stream = std::make_shared<body_stream>();
+  {
+    tile_batch batch({tile_id{0, 0, 0}, tile_id{1, 1, 0}}, stream);
+    tile_id a, b, c;
+    test::assert_equal<bool>(batch.take(a), true, "first tile");
+    test::assert_equal<bool>(batch.take(b), true, "second tile");
+    test::assert_equal<bool>(batch.take(c), false, "no more tiles");
+    test::assert_equal<int>(b.z, 1, "tiles taken in order");
+
+    batch.write(b, "b", false);
+    test::assert_equal<int>(stream->read(data, body_stream::callback()), body_stream::open, "open after one");
+    test::assert_equal<size_t>(data.size(), BATCH_RECORD_HEADER_SIZE + 1, "one record read");
+
+    bool woken = false;
+    test::assert_equal<int>(stream->read(data, [&]() { woken = true; }), body_stream::open, "still open");
+    test::assert_equal<bool>(data.empty(), true, "nothing more to read");
+    batch.write(a, "a", false);
+    test::assert_equal<bool>(woken, true, "reader woken by write");
+    test::assert_equal<int>(stream->read(data, body_stream::callback()), body_stream::closed, "closed after all");
+    test::assert_equal<size_t>(data.size(), BATCH_RECORD_HEADER_SIZE + 1, "last record read");
+  }
+  test::assert_equal<int>(stream->read(data, body_stream::callback()), body_stream::closed,
+                          "finished batch isn't aborted");
+
+  stream = std::make_shared<body_stream>();
+  {
+    tile_batch batch({tile_id{0, 0, 0}}, stream);
+  }
+  test::assert_equal<int>(stream->read(data, body_stream::callback()), body_stream::aborted,
+                          "dropped batch is aborted");
+
+  // once the client has gone, there's nothing more to make.
+  stream = std::make_shared<body_stream>();
+  tile_batch batch({tile_id{0, 0, 0}}, stream);
+  stream->cancel();
+  tile_id t;
+  test::assert_equal<bool>(batch.take(t), false, "nothing taken once cancelled");
+}
+
+// writers are held back once too much is waiting, until it's read.
+void test_stream_high_water() {
+  std::string data;
+  body_stream stream(4);
+  test::assert_equal<bool>(stream.wait_for_room(body_stream::callback()), true, "room when empty");
+  stream.write("abcd");
+
+  int resumed = 0;
+  test::assert_equal<bool>(stream.wait_for_room([&]() { ++resumed; }), false, "no room when full");
+  test::assert_equal<int>(resumed, 0, "not resumed yet");
+  stream.read(data, body_stream::callback());
+  test::assert_equal<int>(resumed, 1, "resumed once read");
+  test::assert_equal<bool>(stream.wait_for_room(body_stream::callback()), true, "room once read");
+
+  // a writer waiting when the client goes away isn't resumed.
+  stream.write("efgh");
+  test::assert_equal<bool>(stream.wait_for_room([&]() { ++resumed; }), false, "full again");
+  stream.cancel();
+  stream.read(data, body_stream::callback());
+  test::assert_equal<int>(resumed, 1, "not resumed once cancelled");
+  test::assert_equal<bool>(stream.wait_for_room(body_stream::callback()), true, "nothing to wait for once cancelled");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing tile batch ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_tile_list);
+  RUN_TEST(test_bbox);
+  RUN_TEST(test_record);
+  RUN_TEST(test_batch_stream);
+  RUN_TEST(test_stream_high_water);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,155 @@
+#include "config.h"
+#include "common.hpp"
+#include "http_server/tile_cache.hpp"
+
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+
+using http::server3::tile_cache;
+
+namespace {
+
+tile_cache::value_type make_body(const std::string &s) {
+  return std::make_shared<const http::server3::encoded_tile>(s);
+}
+
+void test_get_put() {
+  tile_cache cache(1 << 20, std::chrono::seconds(60));
+
+  cache.put(1, 0, 1, "pbf", make_body("foo"));
+
+  tile_cache::value_type body = cache.get(1, 0, 1, "pbf");
+  test::assert_equal<bool>(bool(body), true, "tile should be in cache");
+  test::assert_equal<std::string>(body->data, "foo", "tile body");
+
+  // same coordinates, different encoding is a different tile.
+  test::assert_equal<bool>(bool(cache.get(1, 0, 1, "png")), false, "other encoding should miss");
+  test::assert_equal<bool>(bool(cache.get(1, 1, 1, "pbf")), false, "other tile should miss");
+  test::assert_equal<size_t>(cache.size(), 1, "tiles in cache");
+}
+
+void test_byte_budget() {
+  const std::string body(1000, 'x');
+
+  // a single shard with just about room for two tiles.
+  tile_cache cache(2500, std::chrono::seconds(60), 1);
+
+  cache.put(0, 0, 0, "pbf", make_body(body));
+  cache.put(1, 0, 0, "pbf", make_body(body));
+  // touch the first tile, so that the second is least recently used.
+  test::assert_equal<bool>(bool(cache.get(0, 0, 0, "pbf")), true, "first tile in cache");
+  cache.put(1, 1, 0, "pbf", make_body(body));
+
+  test::assert_equal<size_t>(cache.size(), 2, "tiles in cache");
+  test::assert_equal<bool>(bool(cache.get(0, 0, 0, "pbf")), true, "recently used tile kept");
+  test::assert_equal<bool>(bool(cache.get(1, 0, 0, "pbf")), false, "least recently used tile evicted");
+  test::assert_equal<bool>(bool(cache.get(1, 1, 0, "pbf")), true, "new tile kept");
+  test::assert_greater_or_equal<size_t>(2500, cache.bytes(), "bytes within budget");
+  test::assert_equal<size_t>(cache.evictions(), 1, "tiles evicted");
+
+  // anything bigger than the budget isn't kept at all.
+  cache.put(2, 0, 0, "pbf", make_body(std::string(3000, 'x')));
+  test::assert_equal<bool>(bool(cache.get(2, 0, 0, "pbf")), false, "oversized tile not kept");
+}
+
+void test_ttl() {
+  tile_cache cache(1 << 20, std::chrono::milliseconds(50));
+
+  cache.put(0, 0, 0, "pbf", make_body("foo"));
+  test::assert_equal<bool>(bool(cache.get(0, 0, 0, "pbf")), true, "fresh tile in cache");
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  test::assert_equal<bool>(bool(cache.get(0, 0, 0, "pbf")), false, "expired tile should miss");
+  test::assert_equal<size_t>(cache.size(), 0, "expired tile dropped");
+}
+
+void test_coalesce_misses() {
+  const size_t num_threads = 8;
+  tile_cache cache(1 << 20, std::chrono::seconds(60));
+  std::atomic<int> num_made(0);
+
+  auto make = [&]() -> tile_cache::value_type {
+    ++num_made;
+    // give the other threads time to pile up behind this one.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    return make_body("foo");
+  };
+
+  std::vector<tile_cache::value_type> bodies(num_threads);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&, i]() { bodies[i] = cache.get_or_make(3, 2, 1, "pbf", make); });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  test::assert_equal<int>(num_made, 1, "tile should only be made once");
+  for (const auto &body : bodies) {
+    test::assert_equal<bool>(bool(body), true, "every thread gets the tile");
+    test::assert_equal<std::string>(body->data, "foo", "tile body");
+  }
+
+  // and now it should be a plain cache hit.
+  cache.get_or_make(3, 2, 1, "pbf", make);
+  test::assert_equal<int>(num_made, 1, "cached tile should not be made again");
+  test::assert_equal<size_t>(cache.hits(), 1, "cache hits");
+  test::assert_equal<size_t>(cache.misses(), num_threads, "cache misses");
+}
+
+void test_make_error() {
+  tile_cache cache(1 << 20, std::chrono::seconds(60));
+
+  bool threw = false;
+  try {
+    cache.get_or_make(0, 0, 0, "pbf", []() -> tile_cache::value_type {
+        throw std::runtime_error("failed");
+      });
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  test::assert_equal<bool>(threw, true, "error should be passed on");
+  test::assert_equal<size_t>(cache.size(), 0, "nothing cached after error");
+
+  // the failure isn't remembered, so the next request tries again.
+  tile_cache::value_type body = cache.get_or_make(0, 0, 0, "pbf", []() { return make_body("foo"); });
+  test::assert_equal<std::string>(body->data, "foo", "tile made on retry");
+}
+
+void test_erase_if() {
+  tile_cache cache(1 << 20, std::chrono::seconds(60));
+
+  cache.put(1, 0, 0, "pbf", make_body("foo"));
+  cache.put(1, 0, 0, "png", make_body("foo"));
+  cache.put(2, 0, 0, "pbf", make_body("foo"));
+
+  size_t dropped = cache.erase_if([](int z, int, int, const std::string &encoding) {
+      return (z == 1) && (encoding == "pbf");
+    });
+  test::assert_equal<size_t>(dropped, 1, "tiles dropped");
+  test::assert_equal<bool>(bool(cache.get(1, 0, 0, "pbf")), false, "matching tile dropped");
+  test::assert_equal<bool>(bool(cache.get(1, 0, 0, "png")), true, "other encoding kept");
+  test::assert_equal<bool>(bool(cache.get(2, 0, 0, "pbf")), true, "other zoom kept");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing tile cache ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_get_put);
+  RUN_TEST(test_byte_budget);
+  RUN_TEST(test_ttl);
+  RUN_TEST(test_coalesce_misses);
+  RUN_TEST(test_make_error);
+  RUN_TEST(test_erase_if);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,89 @@
+#include "config.h"
+#include "common.hpp"
+#include "http_server/tile_store.hpp"
+
+#include <iostream>
+#include <unistd.h>
+
+using http::server3::tile_store;
+using http::server3::make_tile_store;
+
+namespace {
+
+void check_read_write(tile_store &store) {
+  test::assert_equal<bool>(bool(store.read(2, 1, 0)), false, "tile missing from empty store");
+
+  store.write(2, 1, 0, "foo");
+  store.write(2, 1, 3, "bar");
+
+  tile_store::value_type data = store.read(2, 1, 0);
+  test::assert_equal<bool>(bool(data), true, "written tile should be in store");
+  test::assert_equal<std::string>(*data, "foo", "tile data");
+
+  data = store.read(2, 1, 3);
+  test::assert_equal<bool>(bool(data), true, "written tile should be in store");
+  test::assert_equal<std::string>(*data, "bar", "tile data");
+
+  test::assert_equal<bool>(bool(store.read(2, 0, 0)), false, "other tile missing from store");
+
+  store.write(2, 1, 0, "baz");
+  test::assert_equal<std::string>(*store.read(2, 1, 0), "baz", "replaced tile data");
+
+  store.erase(2, 1, 3);
+  test::assert_equal<bool>(bool(store.read(2, 1, 3)), false, "erased tile missing from store");
+  test::assert_equal<std::string>(*store.read(2, 1, 0), "baz", "other tile kept");
+
+  // erasing a tile which isn't there does nothing.
+  store.erase(2, 1, 3);
+
+  store.write(3, 2, 1, "qux");
+  store.write(3, 5, 6, "quux");
+  store.erase_zoom(3);
+  test::assert_equal<bool>(bool(store.read(3, 2, 1)), false, "tile at erased zoom missing from store");
+  test::assert_equal<bool>(bool(store.read(3, 5, 6)), false, "tile at erased zoom missing from store");
+  test::assert_equal<std::string>(*store.read(2, 1, 0), "baz", "tile at other zoom kept");
+
+  // as is erasing a zoom with nothing at it.
+  store.erase_zoom(4);
+}
+
+void test_directory_store() {
+  test::temp_dir tmp;
+  const std::string dir = tmp.path().string();
+  std::shared_ptr<tile_store> store = make_tile_store(dir + "/tiles");
+  check_read_write(*store);
+
+  // should be laid out like vector-bulk output.
+  test::assert_equal<int>(access((dir + "/tiles/2/1/0.pbf").c_str(), R_OK), 0, "tile file exists");
+}
+
+#ifdef HAVE_SQLITE3
+void test_mbtiles_store() {
+  test::temp_dir tmp;
+  const std::string file = (tmp.path() / "tiles.mbtiles").string();
+  std::shared_ptr<tile_store> store = make_tile_store(file);
+  check_read_write(*store);
+
+  // re-opening an existing file should find the same tiles.
+  store = make_tile_store(file);
+  test::assert_equal<std::string>(*store->read(2, 1, 0), "baz", "tile data after re-opening");
+}
+#endif /* HAVE_SQLITE3 */
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing tile store ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_directory_store);
+#ifdef HAVE_SQLITE3
+  RUN_TEST(test_mbtiles_store);
+#endif /* HAVE_SQLITE3 */
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}